@@ -158,6 +158,12 @@ int main(int argc, char *argv[])
 #endif
         // TODO: use fontconfig instead
         //fontDirs.add( cs16("/root/fonts/truetype") );
+        if ( LVDirectoryExists( homecr3 ) ) {
+            SetFontCatalogFile( homecr3 + "fontcatalog.dat" );
+            lString16 fontMetricsDir = homecr3 + "fontmetrics";
+            if ( LVCreateDirectory( fontMetricsDir ) )
+                SetFontMetricsCacheDir( fontMetricsDir );
+        }
         if ( !InitCREngine( argv[0], fontDirs ) ) {
             printf("Cannot init CREngine - exiting\n");
             return 2;
@@ -32,6 +32,20 @@ public:
 
 extern CRConcurrencyProvider * concurrencyProvider;
 
+/// concurrency provider based on std::thread, for engine tests and frontends which don't have own one
+/**
+    GUI tasks are executed immediately in the calling thread; delayed GUI tasks are executed after sleeping delayMillis.
+*/
+class CRStdConcurrencyProvider : public CRConcurrencyProvider {
+public:
+    virtual CRMutex * createMutex();
+    virtual CRMonitor * createMonitor();
+    virtual CRThread * createThread(CRRunnable * threadTask);
+    virtual void executeGui(CRRunnable * task);
+    virtual void executeGui(CRRunnable * task, int delayMillis);
+    virtual void sleepMs(int durationMs);
+};
+
 
 class CRThreadExecutor : public CRRunnable, public CRExecutor {
     volatile bool _stopped;
@@ -56,6 +56,7 @@ extern CRMutex * _fontMutex;
 extern CRMutex * _fontManMutex;
 extern CRMutex * _fontGlyphCacheMutex;
 extern CRMutex * _fontLocalGlyphCacheMutex;
+extern CRMutex * _fontMetricsCacheMutex;
 extern CRMutex * _crengineMutex;
 
 // use REF_GUARD to acquire LVProtectedRef mutex
@@ -68,6 +69,8 @@ extern CRMutex * _crengineMutex;
 #define FONT_GLYPH_CACHE_GUARD CRGuard _fontGlyphCacheGuard(_fontGlyphCacheMutex); CR_UNUSED(_fontGlyphCacheGuard);
 // use FONT_LOCAL_GLYPH_CACHE_GUARD to acquire font global glyph cache operations mutex
 #define FONT_LOCAL_GLYPH_CACHE_GUARD CRGuard _fontLocalGlyphCacheGuard(_fontLocalGlyphCacheMutex); CR_UNUSED(_fontLocalGlyphCacheGuard);
+// use FONT_METRICS_CACHE_GUARD to acquire font metrics cache list mutex
+#define FONT_METRICS_CACHE_GUARD CRGuard _fontMetricsCacheGuard(_fontMetricsCacheMutex); CR_UNUSED(_fontMetricsCacheGuard);
 // use CRENGINE_GUARD to acquire crengine drawing lock
 #define CRENGINE_GUARD CRGuard _crengineGuard(_crengineMutex); CR_UNUSED(_crengineMutex);
 
@@ -14,6 +14,45 @@
 
 LVStreamRef LVCreateCompareTestStream( LVStreamRef stream1, LVStreamRef stream2 );
 
+/// runs engine unit tests; threaded code is tested with CRStdConcurrencyProvider if no other provider is set
+/// (document cache is reinitialized in test directory and closed after tests)
 void runCRUnitTests();
 
+/// measures time of stylesheet matching: applies stylesheet from cssFile (document's own if empty) to each element of document
+/// \return average time of one pass over all elements, ms
+int runStyleSheetBenchmark( lString16 cssFile, lString16 docFile, int passes );
+
+/// measures glyph cache speed: draws synthetic page of glyphCount glyphs in several font sizes passes times
+/// \return average time of drawing one page, microseconds
+int runGlyphCacheBenchmark( lString8 fontFace, int glyphCount, int passes );
+
+/// font locking stress test: measures and draws synthetic page of glyphCount glyphs by threadCount threads concurrently
+/// \return total time in ms, -1 if some thread got results differing from single threaded ones
+int runFontConcurrencyTest( lString8 fontFace, int threadCount, int glyphCount, int passes );
+
+/// font metrics cache test: measures text by first registered font file with font manager which writes metrics cache files to dir,
+/// then measures it again by new manager which maps the files
+/// \return total time in ms, -1 if files are broken, or widths after reload differ
+int runFontMetricsCacheTest( lString16 dir );
+
+/// font catalog test: registers first registered font file with font manager which writes font catalog to dir (cold start),
+/// registers it again with faces taken from catalog (warm start), then damages catalog file and checks that it's ignored
+/// \return total time in ms, -1 if font file is opened on warm start, or damaged catalog is used
+int runFontCatalogTest( lString16 dir );
+
+/// threaded document test: styles elements, writes cache file and restores storage chunks in other threads, using document written to dir
+/// \return total time in ms, -1 if pages differ from single threaded ones or document is not reopened from cache
+int runThreadedDocumentTest( lString16 dir, int paragraphs );
+
+/// corrupted cache test: damages text chunk of cache file of document written to dir, then opens document again
+/// \return total time in ms, -1 if document is not reloaded from source or its pages differ from ones before damage
+int runCorruptedCacheTest( lString16 dir, int paragraphs );
+
+/// large document test: builds document with idCount id attributes and about nodeCount nodes, styles it by class and id rules
+/// (in several threads if concurrency provider is set), checks id lookups and styles, saves document to cache in dir,
+/// then opens it from cache and checks it again; runCRUnitTests() calls it with sizes just above 16 bit limits,
+/// larger sizes are for manual runs
+/// \return total time in ms, -1 if some of checks failed
+int runLargeDocumentTest( lString16 dir, int idCount, int nodeCount );
+
 #endif // CRTEST_H
@@ -575,6 +575,8 @@ public:
     void requestRender();
     /// invalidate document data, request reload
     void requestReload();
+    /// reloads document from source, when some of blocks of its cache file are found to be corrupted while reading
+    void reloadCorruptedDocument();
     /// invalidate image cache, request redraw
     void clearImageCache();
 #if CR_ENABLE_PAGE_IMAGE_CACHE==1
@@ -168,8 +168,8 @@ public:
     virtual void InvertRect(int x0, int y0, int x1, int y1) = 0;
     /// sets new size
     virtual void Resize( int dx, int dy ) = 0;
-    /// draws bitmap (1 byte per pixel) using specified palette
-    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette ) = 0;
+    /// draws bitmap (1 byte per pixel) using specified palette, rows of bitmap are bitmapPitch bytes apart (width if 0)
+    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette, int bitmapPitch = 0 ) = 0;
     /// draws image
     virtual void Draw( LVImageSourceRef img, int x, int y, int width, int height, bool dither=true ) = 0;
     /// draws part of source image, possible rescaled
@@ -362,7 +362,7 @@ public:
     /// draws image
     virtual void Draw( LVImageSourceRef img, int x, int y, int width, int height, bool dither );
     /// draws bitmap (1 byte per pixel) using specified palette
-    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette );
+    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette, int bitmapPitch = 0 );
     /// constructor
     LVGrayDrawBuf(int dx, int dy, int bpp=2, void * auxdata = NULL );
     /// destructor
@@ -428,7 +428,7 @@ public:
     /// draws image
     virtual void Draw( LVImageSourceRef img, int x, int y, int width, int height, bool dither );
     /// draws bitmap (1 byte per pixel) using specified palette
-    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette );
+    virtual void Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette, int bitmapPitch = 0 );
     /// returns scanline pointer
     virtual lUInt8 * GetScanLine( int y );
 
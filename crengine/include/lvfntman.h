@@ -34,41 +34,57 @@ extern "C" {
 class LVDrawBuf;
 
 struct LVFontGlyphCacheItem;
+struct LVFontGlyphAtlasPage;
+class LVFontLocalGlyphCache;
 
+/// glyph cache shared by all fonts: open addressing hash table keyed by (font, char),
+/// glyph bitmaps are packed into 8 bit atlas pages, pages above max_size bytes are evicted using CLOCK policy
 class LVFontGlobalGlyphCache
 {
 private:
-    LVFontGlyphCacheItem * head;
-    LVFontGlyphCacheItem * tail;
+    LVFontGlyphCacheItem * * table; // NULL for empty slot, size is power of 2
+    int table_size;
+    int count;
+    LVFontGlyphAtlasPage * * pages;
+    int page_count;
+    LVFontGlyphAtlasPage * current; // page to place new glyphs to
+    int hand; // CLOCK hand: page to check for eviction next
+    int page_dim; // width and height of atlas page
     int size;
     int max_size;
-    void removeNoLock( LVFontGlyphCacheItem * item );
-    void putNoLock( LVFontGlyphCacheItem * item );
+    int findSlot( LVFontLocalGlyphCache * local_cache, lUInt16 ch );
+    void removeSlot( int index );
+    void resize( int newSize );
+    LVFontGlyphAtlasPage * newPage( int dx, int dy, int capacity );
+    void freePage( int index );
+    void dropItem( LVFontGlyphCacheItem * item );
+    void freeUnusedPage( LVFontGlyphAtlasPage * page );
 public:
-    LVFontGlobalGlyphCache( int maxSize )
-        : head(NULL), tail(NULL), size(0), max_size(maxSize )
-    {
-    }
-    ~LVFontGlobalGlyphCache()
-    {
-        clear();
-    }
-    void put( LVFontGlyphCacheItem * item );
-    void remove( LVFontGlyphCacheItem * item );
-    void refresh( LVFontGlyphCacheItem * item );
+    LVFontGlobalGlyphCache( int maxSize );
+    ~LVFontGlobalGlyphCache();
+    /// returns cached item pinned until release() or NULL
+    LVFontGlyphCacheItem * get( LVFontLocalGlyphCache * local_cache, lUInt16 ch );
+    /// allocates pinned item with w x h bitmap in atlas page, may evict old pages; item is not found by get() until put()
+    LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lChar16 ch, int w, int h );
+    /// adds item created by newItem(); returns item already cached for the same key instead (new one is dropped then)
+    LVFontGlyphCacheItem * put( LVFontGlyphCacheItem * item );
+    /// unpins item returned by get() or put() without locking the cache: its page may be evicted after this call
+    void release( LVFontGlyphCacheItem * item );
+    /// removes all items of local cache
+    void clear( LVFontLocalGlyphCache * local_cache );
     void clear();
 };
 
+/// glyphs of single font instance, stored in global cache
 class LVFontLocalGlyphCache
 {
+    friend class LVFontGlobalGlyphCache;
 private:
-    LVFontGlyphCacheItem * head;
-    LVFontGlyphCacheItem * tail;
     LVFontGlobalGlyphCache * global_cache;
-    //int size;
+    int count; // number of items in global cache, changed by ls_atomic_add()
 public:
     LVFontLocalGlyphCache( LVFontGlobalGlyphCache * globalCache )
-        : head(NULL), tail(NULL), global_cache( globalCache )
+        : global_cache( globalCache ), count(0)
     { }
     ~LVFontLocalGlyphCache()
     {
@@ -76,85 +92,24 @@ public:
     }
     void clear();
     LVFontGlyphCacheItem * get( lUInt16 ch );
-    void put( LVFontGlyphCacheItem * item );
-    void remove( LVFontGlyphCacheItem * item );
+    LVFontGlyphCacheItem * newItem( lChar16 ch, int w, int h );
+    LVFontGlyphCacheItem * put( LVFontGlyphCacheItem * item );
 };
 
 struct LVFontGlyphCacheItem
 {
-    LVFontGlyphCacheItem * prev_global;
-    LVFontGlyphCacheItem * next_global;
-    LVFontGlyphCacheItem * prev_local;
-    LVFontGlyphCacheItem * next_local;
-    LVFontLocalGlyphCache * local_cache;
+    LVFontLocalGlyphCache * local_cache; // NULL if item is dropped
+    LVFontGlyphAtlasPage * page;
+    lUInt8 * bmp; // top left pixel of glyph bitmap in atlas page
     lChar16 ch;
     lUInt16 bmp_width;
     lUInt16 bmp_height;
+    lUInt16 bmp_pitch; // distance between bitmap rows
     lInt16  origin_x;
     lInt16  origin_y;
     lUInt16 advance;
-    lUInt8 bmp[1];
-    //=======================================================================
-    int getSize()
-    {
-        return sizeof(LVFontGlyphCacheItem)
-            + (bmp_width * bmp_height - 1) * sizeof(lUInt8);
-    }
-    static LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lChar16 ch, int w, int h )
-    {
-        LVFontGlyphCacheItem * item = (LVFontGlyphCacheItem *)malloc( sizeof(LVFontGlyphCacheItem)
-            + (w*h - 1)*sizeof(lUInt8) );
-        item->ch = ch;
-        item->bmp_width = (lUInt16)w;
-        item->bmp_height = (lUInt16)h;
-        item->origin_x =   0;
-        item->origin_y =   0;
-        item->advance =    0;
-        item->prev_global = NULL;
-        item->next_global = NULL;
-        item->prev_local = NULL;
-        item->next_local = NULL;
-        item->local_cache = local_cache;
-        return item;
-    }
-    static void freeItem( LVFontGlyphCacheItem * item )
-    {
-        free( item );
-    }
-};
-
-struct LVFontGlyphIndexCacheItem
-{
-    lUInt32 gindex;
-    lUInt16 bmp_width;
-    lUInt16 bmp_height;
-    lInt16  origin_x;
-    lInt16  origin_y;
-    lUInt16 advance;
-    lUInt8 bmp[1];
-    //=======================================================================
-    int getSize()
-    {
-        return sizeof(LVFontGlyphIndexCacheItem) + (bmp_width * bmp_height - 1) * sizeof(lUInt8);
-    }
-    static LVFontGlyphIndexCacheItem * newItem(lUInt32 glyph_index, int w, int h )
-    {
-        LVFontGlyphIndexCacheItem* item = (LVFontGlyphIndexCacheItem*)malloc( sizeof(LVFontGlyphIndexCacheItem) + (w*h - 1)*sizeof(lUInt8) );
-        if (item) {
-            item->gindex = glyph_index;
-            item->bmp_width = (lUInt16)w;
-            item->bmp_height = (lUInt16)h;
-            item->origin_x =   0;
-            item->origin_y =   0;
-            item->advance =    0;
-        }
-        return item;
-    }
-    static void freeItem(LVFontGlyphIndexCacheItem* item)
-    {
-        if (item)
-            free(item);
-    }
+    /// call when item returned by LVFont::getGlyph() is not needed anymore
+    void release();
 };
 
 
@@ -235,7 +190,7 @@ public:
 //    virtual bool getGlyphImage(lUInt16 code, lUInt8 * buf, lChar16 def_char=0) = 0;
     /** \brief get glyph item
         \param code is unicode character
-        \return glyph pointer if glyph was found, NULL otherwise
+        \return glyph pointer if glyph was found, NULL otherwise; call release() for it after drawing
     */
     virtual LVFontGlyphCacheItem * getGlyph(lUInt16 ch, lChar16 def_char=0) = 0;
     /// returns font baseline offset
@@ -813,6 +768,11 @@ LVFontRef LVCreateFontTransform( LVFontRef baseFont, int transformFlags );
 /// current font manager pointer
 extern LVFontManager * fontMan;
 
+/// sets file to keep catalog of registered font files in, so next time fonts can be registered without opening them; call before InitFontManager
+void SetFontCatalogFile( lString16 fileName );
+/// sets directory to keep glyph indexes and widths of font faces in, to not measure glyphs again after restart; call before InitFontManager
+void SetFontMetricsCacheDir( lString16 dir );
+
 /// initializes font manager
 bool InitFontManager( lString8 path );
 
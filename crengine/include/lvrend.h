@@ -34,6 +34,8 @@ void renderFinalBlock( ldomNode * node, LFormattedText * txform, RenderRectAcces
 int renderBlockElement( LVRendPageContext & context, ldomNode * node, int x, int y, int width );
 /// renders table element
 int renderTable( LVRendPageContext & context, ldomNode * element, int x, int y, int width );
+/// calculates style of element from style of its parent, doesn't use style and font caches of document
+void calcNodeStyle( ldomNode * node, LVStyleSheet * stylesheet, const css_style_ref_t & parent_style, int baseFontSize, css_style_rec_t * style );
 /// sets node style
 void setNodeStyle( ldomNode * node, css_style_ref_t parent_style, LVFontRef parent_font );
 
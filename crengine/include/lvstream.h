@@ -265,6 +265,11 @@ public:
     /// calculate crc32 code for stream, returns 0 for error or empty stream
     inline lUInt32 getcrc32() { lUInt32 res = 0; getcrc32( res ); return res; }
 
+    /// returns modification time of stream source, 0 if unknown
+    virtual lUInt64 getModificationTime() { return 0; }
+    /// calculate fingerprint of stream (size, modification time and hashes of few sampled blocks), much faster than crc32
+    virtual lverror_t getFingerprint( lUInt64 & dst );
+
     /// set write bytes limit to call flush(true) automatically after writing of each sz bytes
     virtual void setAutoSyncSize(lvsize_t /*sz*/) { }
 
@@ -893,6 +898,10 @@ bool LVSplitArcName(lString8 fullPathName, lString8 & arcPathName, lString8 & ar
 bool LVFileExists( const lString16 & pathName );
 /// returns true if specified file exists
 bool LVFileExists( const lString8 & pathName );
+/// reads size and modification time of file without opening it, returns false if file does not exist
+bool LVGetFileInfo( const lString16 & pathName, lUInt64 & size, lUInt64 & modificationTime );
+/// reads size and modification time of file without opening it, returns false if file does not exist
+bool LVGetFileInfo( const lString8 & pathName, lUInt64 & size, lUInt64 & modificationTime );
 /// returns true if specified directory exists
 bool LVDirectoryExists( const lString16 & pathName );
 /// returns true if specified directory exists
@@ -105,6 +105,13 @@ void lStr_findWordBounds( const lChar16 * str, int sz, int pos, int & start, int
 #define CONST_STRING_BUFFER_MASK (CONST_STRING_BUFFER_SIZE - 1)
 #define CONST_STRING_BUFFER_HASH_MULT 31
 
+/// true while strings may be used by several threads, see enable_ls_storage_threading()
+extern bool ls_storage_threading;
+/// adds delta to string reference counter atomically, returns new value (pass 0 to read counter)
+int ls_atomic_add( int * counter, int delta );
+/// adds delta to 64 bit counter atomically, returns new value (pass 0 to read counter)
+lInt64 ls_atomic_add64( lInt64 * counter, lInt64 delta );
+
 
 struct lstring8_chunk_t {
     friend class lString8;
@@ -206,8 +213,9 @@ private:
     static lstring_chunk_t * EMPTY_STR_8;
     void alloc(size_type sz);
     void free();
-    inline void addref() const { ++pchunk->nref; }
-    inline void release() { if (--pchunk->nref==0) free(); }
+    inline void addref() const { if (ls_storage_threading) ls_atomic_add(&pchunk->nref, 1); else ++pchunk->nref; }
+    inline void release() { if ((ls_storage_threading ? ls_atomic_add(&pchunk->nref, -1) : --pchunk->nref)==0) free(); }
+    inline int refs() const { return ls_storage_threading ? ls_atomic_add(&pchunk->nref, 0) : pchunk->nref; }
     explicit lString8(lstring_chunk_t * chunk) : pchunk(chunk) { addref(); }
 public:
     /// default constrictor
@@ -350,7 +358,7 @@ public:
     /// ensures that reference count is 1
     void  lock( size_type newsize );
     /// returns pointer to modifable string buffer
-    value_type * modify() { if (pchunk->nref>1) lock(pchunk->len); return pchunk->buf8; }
+    value_type * modify() { if (refs()>1) lock(pchunk->len); return pchunk->buf8; }
     /// clear string
     void  clear() { release(); pchunk = EMPTY_STR_8; addref(); }
     /// clear string, set buffer size
@@ -441,8 +449,9 @@ private:
     static lstring_chunk_t * EMPTY_STR_16;
     void alloc(size_type sz);
     void free();
-    inline void addref() const { ++pchunk->nref; }
-    inline void release() { if (--pchunk->nref==0) free(); }
+    inline void addref() const { if (ls_storage_threading) ls_atomic_add(&pchunk->nref, 1); else ++pchunk->nref; }
+    inline void release() { if ((ls_storage_threading ? ls_atomic_add(&pchunk->nref, -1) : --pchunk->nref)==0) free(); }
+    inline int refs() const { return ls_storage_threading ? ls_atomic_add(&pchunk->nref, 0) : pchunk->nref; }
 public:
     explicit lString16(lstring_chunk_t * chunk) : pchunk(chunk) { addref(); }
     /// empty string constructor
@@ -606,7 +615,7 @@ public:
     /// resizes string, copies if several references exist
     void  lock( size_type newsize );
     /// returns writable pointer to string buffer
-    value_type * modify() { if (pchunk->nref>1) lock(pchunk->len); return pchunk->buf16; }
+    value_type * modify() { if (refs()>1) lock(pchunk->len); return pchunk->buf16; }
     /// clears string contents
     void  clear() { release(); pchunk = EMPTY_STR_16; addref(); }
     /// resets string, allocates space for specified amount of characters
@@ -1099,6 +1108,11 @@ public:
 
 	SerialBuf & operator >> ( lString16 & s );
 
+    /// put unsigned number in variable length encoding (1 byte for values < 128, up to 5 bytes)
+    void putVarUInt( lUInt32 n );
+    /// read unsigned number written by putVarUInt()
+    lUInt32 getVarUInt();
+
 	bool checkMagic( const char * s );
     /// read crc32 code, comapare with CRC32 for last N bytes
     bool checkCRC( int N );
@@ -1156,7 +1170,15 @@ protected:
 };
 
 
+class CRMutex;
 void free_ls_storage();
+/// pass recursive mutex before strings are used by several threads, NULL after other threads are finished
+/**
+    While enabled, reference counters are changed atomically, and chunk pool (LDOM_USE_OWN_MEM_MAN==1)
+    and constant string tables of cs8() and cs16() are guarded by mutex.
+    Call only when no other thread uses strings: mode is not switched atomically.
+*/
+void enable_ls_storage_threading( CRMutex * mutex );
 
 lUInt64 GetCurrentTimeMillis();
 void CRReinitTimer();
@@ -77,12 +77,17 @@ class ldomNode;
 class LVCssDeclaration {
 private:
     int * _data;
+    int _size; // number of items in _data, including end marker
 public:
     void apply( css_style_rec_t * style );
     bool empty() { return _data==NULL; }
     bool parse( const char * & decl );
     lUInt32 getHash();
-    LVCssDeclaration() : _data(NULL) { }
+    /// writes compiled declaration
+    void serialize( SerialBuf & buf );
+    /// reads compiled declaration
+    bool deserialize( SerialBuf & buf );
+    LVCssDeclaration() : _data(NULL), _size(0) { }
     ~LVCssDeclaration() { if (_data) delete[] _data; }
 };
 
@@ -108,17 +113,28 @@ class LVCssSelectorRule
     LVCssSelectorRuleType _type;
     lUInt16 _id;
     lUInt16 _attrid;
+    lUInt16 _valueId; // interned _value for class, id and attribute equality rules, see lxmlDocBase::getCssNameId()
     LVCssSelectorRule * _next;
     lString16 _value;
 public:
     LVCssSelectorRule(LVCssSelectorRuleType type)
-    : _type(type), _id(0), _attrid(0), _next(NULL)
+    : _type(type), _id(0), _attrid(0), _valueId(0), _next(NULL)
     { }
     LVCssSelectorRule( LVCssSelectorRule & v );
     void setId( lUInt16 id ) { _id = id; }
     void setAttr( lUInt16 id, lString16 value ) { _attrid = id; _value = value; }
+    void setAttr( lUInt16 id, lString16 value, lUInt16 valueId ) { _attrid = id; _value = value; _valueId = valueId; }
     LVCssSelectorRule * getNext() { return _next; }
     void setNext(LVCssSelectorRule * next) { _next = next; }
+    LVCssSelectorRuleType getType() { return _type; }
+    /// element name id for parent, ancessor and predecessor rules
+    lUInt16 getId() { return _id; }
+    /// interned value for class, id and attribute rules
+    lUInt16 getValueId() { return _valueId; }
+    /// attribute id for attribute rules
+    lUInt16 getAttrId() { return _attrid; }
+    /// value for class, id and attribute rules
+    const lString16 & getValue() { return _value; }
     ~LVCssSelectorRule() { if (_next) delete _next; }
     /// check condition for node
     bool check( const ldomNode * & node );
@@ -144,6 +160,7 @@ private:
     LVCssSelectorRule * _rules;
     void insertRuleStart( LVCssSelectorRule * rule );
     void insertRuleAfterStart( LVCssSelectorRule * rule );
+    void updateSpecificity();
 public:
     LVCssSelector( LVCssSelector & v );
     LVCssSelector() : _id(0), _specificity(0), _next(NULL), _rules(NULL) { }
@@ -157,13 +174,57 @@ public:
             _decl->apply(style);
     }
     void setDeclaration( LVCssDeclRef decl ) { _decl = decl; }
+    /// CSS specificity: id rules * 0x10000 + class and attribute rules * 0x100 + element names
     int getSpecificity() { return _specificity; }
+    /// additional rules, starting from ones for element itself, then ones for its relatives
+    LVCssSelectorRule * getRules() { return _rules; }
     LVCssSelector * getNext() { return _next; }
     void setNext(LVCssSelector * next) { _next = next; }
     lUInt32 getHash();
+    /// hash of selector followed by selectors with specified hash
+    lUInt32 getHash( lUInt32 nextHash );
+    /// writes selector and its rules, w/o declaration and next selectors; ids are saved as names
+    void serialize( SerialBuf & buf, lxmlDocBase * doc );
+    /// reads selector written by serialize(), resolving names for specified document
+    bool deserialize( SerialBuf & buf, lxmlDocBase * doc );
 };
 
 
+class LVCssSelectorIndex;
+struct LVCssAncestorPath;
+
+/** \brief set of compiled stylesheet rules
+
+    Rules added after set became shared are placed to a new set over it,
+    so that saved sets are never modified: saving and restoring of stylesheet
+    state only changes references.
+*/
+class LVCssSelectorSet : public LVRefCounter
+{
+    friend class LVStyleSheet;
+    LVFastRef<LVCssSelectorSet> _base;     /// rules added before, NULL for first set
+    LVPtrVector <LVCssSelector> _selectors; /// own rules by element name id, sorted by specificity
+    int _count;                            /// number of selectors, including base sets
+    LVCssSelectorIndex * _index;           /// rule hash for all rules, built on first use
+    /// adds selectors to own rules in given order, each after ones with the same or lower specificity
+    void insert( LVArray<LVCssSelector *> & items );
+public:
+    LVCssSelectorSet( LVFastRef<LVCssSelectorSet> base )
+    : _base(base), _count( base.isNull() ? 0 : base->_count ), _index(NULL) { }
+    ~LVCssSelectorSet();
+    /// returns sets from first to this one
+    void getLayers( LVArray<LVCssSelectorSet *> & layers );
+    /// returns own rules for element name id, sorted by specificity
+    LVCssSelector * getSelectors( int id ) { return id < _selectors.length() ? _selectors[id] : NULL; }
+    /// returns max element name id with own rules + 1
+    int getSelectorsLength() { return _selectors.length(); }
+    /// returns number of selectors, including base sets
+    int getCount() { return _count; }
+    /// returns rule hash, builds it on first call
+    LVCssSelectorIndex * getIndex();
+};
+typedef LVFastRef<LVCssSelectorSet> LVCssSelectorSetRef;
+
 /** \brief stylesheet
     
     Can parse stylesheet and apply compiled rules.
@@ -175,54 +236,63 @@ public:
 */
 class LVStyleSheet {
     lxmlDocBase * _doc;
-    LVPtrVector <LVCssSelector> _selectors;
-
-    LVPtrVector <LVPtrVector <LVCssSelector> > _stack;
-    LVPtrVector <LVCssSelector> * dup()
-    {
-        LVPtrVector <LVCssSelector> * res = new LVPtrVector <LVCssSelector>();
-        for ( int i=0; i<_selectors.length(); i++ ) {
-            LVCssSelector * selector = _selectors[i];
-            if ( selector )
-                res->add( new LVCssSelector(*selector) );
-            else
-                res->add(NULL);
-        }
-        return res;
-    }
-
-    void set(LVPtrVector<LVCssSelector> & v );
+    LVCssSelectorSetRef _rules; /// current rules, NULL if there are no rules
+    lUInt32 _version; /// incremented on each change of rules
+    LVArray <LVCssSelectorSetRef> _stack;
+    LVCssSelectorSetRef _lastParsed; /// set created by last parse() over saved rules
+    lUInt64 _lastParsedKey;           /// key of CSS text of last parse()
+    LVCssAncestorPath * _path;        /// ancestor filters of last element passed to apply()
+    /// prepares set for adding rules: creates new one if current is saved or shared
+    LVCssSelectorSet * getWritableRules();
+    /// adds compiled rules written by parse(), returns false if data is broken
+    bool deserialize( SerialBuf & buf );
 public:
 
 
     // save current state of stylesheet
     void push()
     {
-        _stack.add( dup() );
+        _stack.add( _rules );
     }
     // restore previously saved state
     bool pop()
     {
-        LVPtrVector <LVCssSelector> * v = _stack.pop();
-        if ( !v )
+        if ( _stack.empty() )
             return false;
-        set( *v );
-        delete v;
+        _rules = _stack[_stack.length() - 1];
+        _stack[_stack.length() - 1].Clear();
+        _stack.erase( _stack.length() - 1, 1 );
+        _version++;
         return true;
     }
 
     /// remove all rules from stylesheet
-    void clear() { _selectors.clear(); _stack.clear(); }
+    void clear() { _rules.Clear(); _stack.clear(); _lastParsed.Clear(); _version++; }
     /// set document to retrieve ID values from
     void setDocument( lxmlDocBase * doc ) { _doc = doc; }
     /// constructor
-    LVStyleSheet( lxmlDocBase * doc = NULL ) : _doc(doc) { }
-    /// copy constructor
-    LVStyleSheet( LVStyleSheet & sheet );
+    LVStyleSheet( lxmlDocBase * doc = NULL ) : _doc(doc), _version(0), _lastParsedKey(0), _path(NULL) { }
+    /// copy constructor, shares rules with source stylesheet
+    LVStyleSheet( LVStyleSheet & sheet ) : _doc(sheet._doc), _rules(sheet._rules), _version(0), _lastParsedKey(0), _path(NULL) { }
+    /// destructor
+    ~LVStyleSheet();
     /// parse stylesheet, compile and add found rules to sheet
+    /**
+        Compiled rules are remembered by document (see lxmlDocBase::setCompiledStyleSheet())
+        by key of CSS text, and are read instead of parsing when the same text is parsed again.
+    */
     bool parse( const char * str );
+    /// returns key of CSS text for compiled stylesheet caches
+    static lUInt64 getStyleSheetKey( const char * str );
     /// apply stylesheet to node style
     void apply( const ldomNode * node, css_style_rec_t * style );
+    /// builds rule hash of current rules; pass true to allow apply() and canShareStyle() of copies of this stylesheet
+    /// sharing the same rules to be called from several threads, until call with false
+    void prepareMatching( bool concurrent );
+    /// returns true if the same rules are applied to two children of the same parent
+    bool canShareStyle( const ldomNode * node, const ldomNode * sibling );
+    /// returns number of rules changes, to detect results calculated for previous rules
+    lUInt32 getVersion() { return _version; }
     /// calculate hash
     lUInt32 getHash();
 };
@@ -62,9 +62,12 @@
 
 #define LXML_NS_NONE 0       ///< no namespace specified
 #define LXML_NS_ANY  0xFFFF  ///< any namespace can be specified
-#define LXML_ATTR_VALUE_NONE  0xFFFF  ///< attribute not found
+#define LXML_ATTR_VALUE_NONE  0xFFFFFFFF  ///< attribute not found
 
 #define DOC_STRING_HASH_SIZE  256
+#define CSS_NAME_HASH_SIZE    256
+#define CSS_NAME_ID_NONE      0xFFFE  ///< value is not used in stylesheet
+#define STYLE_SHARING_CACHE_SIZE 32   ///< number of parents with remembered last styled child, power of 2
 #define RESERVED_DOC_SPACE    4096
 #define MAX_TYPE_ID           1024 // max of element, ns, attr
 #define MAX_ELEMENT_TYPE_ID   1024
@@ -203,6 +206,8 @@ public:
 
 class ldomTextStorageChunk;
 class ldomTextStorageChunkBuilder;
+class ldomChunkPrefetcher;
+class ldomTextCache;
 struct ElementDataStorageItem;
 class CacheFile;
 class tinyNodeCollection;
@@ -234,16 +239,20 @@ public:
 class ldomDataStorageManager
 {
     friend class ldomTextStorageChunk;
+    friend class ldomChunkPrefetcher;
+    friend class ldomStorageBudget;
 protected:
     tinyNodeCollection * _owner;
     LVPtrVector<ldomTextStorageChunk> _chunks;
     ldomTextStorageChunk * _activeChunk;
-    ldomTextStorageChunk * _recentChunk;
     CacheFile * _cache;
     int _uncompressedSize;
-    int _maxUncompressedSize;
     int _chunkSize;
     char _type;       /// type, to show in log
+    bool _allPinned;  /// all chunks are unpacked and pinned, see pinAll()
+    lUInt32 _accessStamp; /// incremented when another chunk of this storage is accessed
+    ldomTextStorageChunk * _lastChunk; /// chunk accessed last time
+    int _clockHand;   /// position of storage budget clock hand in _chunks
     ldomTextStorageChunk * getChunk( lUInt32 address );
 public:
     /// type
@@ -254,8 +263,16 @@ public:
     bool load();
     /// sets cache file
     void setCache( CacheFile * cache );
-    /// checks buffer sizes, compacts most unused chunks
-    void compact( int reservedSpace );
+    /// checks buffer sizes of all storages, swaps out most unused chunks except keep; 0xFFFFFF to swap out all chunks of this storage
+    void compact( int reservedSpace, ldomTextStorageChunk * keep = NULL );
+    /// makes private copies of chunk data read directly from mapped cache file
+    void detachMapping();
+#if BUILD_LITE!=1
+    /// unpacks all chunks and keeps them in memory until unpinAll(); items can be read from several threads meanwhile
+    void pinAll();
+    /// releases chunks pinned by pinAll()
+    void unpinAll();
+#endif
     int getUncompressedSize() { return _uncompressedSize; }
 #if BUILD_LITE!=1
     /// allocates new text node, return its address inside storage
@@ -264,6 +281,10 @@ public:
     lUInt32 allocElem( lUInt32 dataIndex, lUInt32 parentIndex, int childCount, int attrCount );
     /// get text by address
     lString8 getText( lUInt32 address );
+    /// returns pointer to text data by address, pins its chunk in memory until unpinText() is called
+    const char * pinText( lUInt32 address, int & length );
+    /// releases chunk pinned by pinText()
+    void unpinText( lUInt32 address );
     /// get pointer to text data
     TextDataStorageItem * getTextItem( lUInt32 addr );
     /// get pointer to element data
@@ -288,7 +309,7 @@ public:
     /// set element style data item
     void setStyleData( lUInt32 elemDataIndex, const ldomNodeStyleInfo * src );
 
-    ldomDataStorageManager( tinyNodeCollection * owner, char type, int maxUnpackedSize, int chunkSize );
+    ldomDataStorageManager( tinyNodeCollection * owner, char type, int chunkSize );
     ~ldomDataStorageManager();
 };
 
@@ -296,17 +317,23 @@ public:
 class ldomTextStorageChunk
 {
     friend class ldomDataStorageManager;
+    friend class ldomChunkPrefetcher;
+    friend class ldomStorageBudget;
     ldomDataStorageManager * _manager;
-    ldomTextStorageChunk * _nextRecent;
-    ldomTextStorageChunk * _prevRecent;
+    lUInt32 _accessStamp; /// value of storage access counter when chunk was used last time
+    lUInt8 _clockCredit;  /// number of clock passes chunk survives, depends on restore cost
     lUInt8 * _buf;     /// buffer for uncompressed data
     lUInt32 _bufsize;  /// _buf (uncompressed) area size, bytes
     lUInt32 _bufpos;  /// _buf (uncompressed) data write position (for appending of new data)
     lUInt16 _index;  /// ? index of chunk in storage
+    lUInt16 _pinCount; /// number of text views referencing _buf, chunk is not swapped out while pinned
     char _type;       /// type, to show in log
     bool _saved;
+    LVStreamBufferRef _mapbuf; /// mapped cache file region, if _buf points directly to it
 
     void setunpacked( const lUInt8 * buf, int bufsize );
+    /// makes private copy of data which is read directly from mapped cache file
+    void detachMapping();
     /// pack data, and remove unpacked
     void compact();
 #if BUILD_LITE!=1
@@ -358,24 +385,158 @@ public:
 // forward declaration
 class ldomNode;
 
-#define TNC_PART_COUNT 1024
 #define TNC_PART_SHIFT 10
 #define TNC_PART_INDEX_SHIFT (TNC_PART_SHIFT+4)
 #define TNC_PART_LEN (1<<TNC_PART_SHIFT)
 #define TNC_PART_MASK (TNC_PART_LEN-1)
+/// max number of node parts of each type: parts are saved as cache file blocks with 16 bit index
+#define TNC_MAX_PART_COUNT 0x10000
+
+/// table of node parts, grows as parts are added
+template <typename T> class ldomNodePartTable
+{
+    T ** _parts;
+    int _size;
+public:
+    ldomNodePartTable() : _parts(NULL), _size(0) { }
+    ~ldomNodePartTable() { free( _parts ); }
+    /// returns number of part slots, parts starting from length() are not allocated
+    inline int length() const { return _size; }
+    /// returns part, NULL if not allocated
+    inline T * operator [] ( int part ) const { return part < _size ? _parts[part] : NULL; }
+    /// sets part, grows table if necessary
+    void set( int part, T * p )
+    {
+        if ( part >= _size ) {
+            if ( part >= TNC_MAX_PART_COUNT )
+                crFatalError( 1003, "Too many nodes in document" );
+            int size = _size ? _size * 2 : 16;
+            while ( size <= part )
+                size *= 2;
+            _parts = cr_realloc( _parts, size );
+            memset( _parts + _size, 0, sizeof(T*) * (size - _size) );
+            _size = size;
+        }
+        _parts[part] = p;
+    }
+    /// forgets all parts, doesn't free them
+    void clear() { free( _parts ); _parts = NULL; _size = 0; }
+    void swap( ldomNodePartTable & v )
+    {
+        T ** parts = _parts; _parts = v._parts; v._parts = parts;
+        int size = _size; _size = v._size; v._size = size;
+    }
+};
+
+#if BUILD_LITE!=1
+/// always resident tree topology of persistent nodes: flat arrays indexed by node data index,
+/// to allow tree walks without unpacking of element storage chunks
+class ldomNodeTopology
+{
+    // element parts: parent, name id, render method, children range in _children
+    ldomNodePartTable<lUInt32> _elemParent;
+    ldomNodePartTable<lUInt16> _elemId;
+    ldomNodePartTable<lUInt8> _elemRendMethod;
+    ldomNodePartTable<lUInt32> _elemChildStart;
+    ldomNodePartTable<lUInt32> _elemChildCount;
+    // text parts: parent
+    ldomNodePartTable<lUInt32> _textParent;
+    /// children of all elements, children of each element are stored contiguously
+    LVArray<lUInt32> _children;
+    /// number of _children items not used by any element
+    int _garbage;
+
+    void allocElemPart( int part );
+    void allocTextPart( int part );
+    lUInt32 * addChildren( int count );
+    void compactChildren();
+public:
+    inline lUInt32 getElemParent( lUInt32 dataIndex ) const
+    {
+        return _elemParent[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    inline lUInt16 getElemId( lUInt32 dataIndex ) const
+    {
+        return _elemId[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    inline lUInt8 getElemRendMethod( lUInt32 dataIndex ) const
+    {
+        return _elemRendMethod[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    inline int getElemChildCount( lUInt32 dataIndex ) const
+    {
+        return (int)_elemChildCount[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    /// returns pointer to array of children data indexes
+    inline const lUInt32 * getElemChildren( lUInt32 dataIndex ) const
+    {
+        return _children.ptr() + _elemChildStart[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    inline lUInt32 getTextParent( lUInt32 dataIndex ) const
+    {
+        return _textParent[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK];
+    }
+    /// sets all fields of persistent element
+    void setElem( lUInt32 dataIndex, lUInt32 parent, lUInt16 id, lUInt8 rendMethod, const lInt32 * children, int childCount );
+    /// forgets element children, call when element is no more persistent
+    void clearElem( lUInt32 dataIndex );
+    void setElemParent( lUInt32 dataIndex, lUInt32 parent )
+    {
+        _elemParent[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK] = parent;
+    }
+    void setElemId( lUInt32 dataIndex, lUInt16 id )
+    {
+        _elemId[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK] = id;
+    }
+    void setElemRendMethod( lUInt32 dataIndex, lUInt8 rendMethod )
+    {
+        _elemRendMethod[dataIndex>>TNC_PART_INDEX_SHIFT][(dataIndex>>4)&TNC_PART_MASK] = rendMethod;
+    }
+    void setTextParent( lUInt32 dataIndex, lUInt32 parent );
+    /// serializes element part (parents, ids, render methods, child counts, children)
+    bool serializeElemPart( int part, int count, SerialBuf & buf );
+    /// deserializes element part
+    bool deserializeElemPart( int part, int count, SerialBuf & buf );
+    /// serializes text part (parents)
+    bool serializeTextPart( int part, int count, SerialBuf & buf );
+    /// deserializes text part
+    bool deserializeTextPart( int part, int count, SerialBuf & buf );
+    /// returns memory used by table, in bytes
+    int getMemoryUsage();
+    /// removes all items
+    void clear();
+    ldomNodeTopology();
+    ~ldomNodeTopology();
+};
+#endif
+
 /// storage of ldomNode
+#if BUILD_LITE!=1
+/// last styled child of element: next children matched by the same rules can reuse its style
+struct ldomStyleSharingEntry {
+    lUInt32 parentIndex;
+    lUInt32 nodeIndex;
+    lUInt32 version;             // stylesheet version
+    css_style_ref_t parentStyle; // style inherited by child
+    ldomStyleSharingEntry() : parentIndex(0), nodeIndex(0), version(0) { }
+};
+#endif
+
 class tinyNodeCollection
 {
     friend class ldomNode;
     friend class tinyElement;
     friend class ldomDocument;
+    friend class ldomDataStorageManager;
+    friend class ldomTextStorageChunk;
+    friend class ldomTextView;
 private:
     int _textCount;
     lUInt32 _textNextFree;
-    ldomNode * _textList[TNC_PART_COUNT];
+    ldomNodePartTable<ldomNode> _textList;
     int _elemCount;
     lUInt32 _elemNextFree;
-    ldomNode * _elemList[TNC_PART_COUNT];
+    ldomNodePartTable<ldomNode> _elemList;
     LVIndexedRefCache<css_style_ref_t> _styles;
     LVIndexedRefCache<font_ref_t> _fonts;
     int _tinyElementCount;
@@ -387,6 +548,11 @@ protected:
     /// final block cache
     CVRendBlockCache _renderedBlockCache;
     CacheFile * _cacheFile;
+    ldomChunkPrefetcher * _chunkPrefetcher;
+    /// decoded text of recently used persistent text nodes
+    ldomTextCache * _textCache;
+    /// last styled children, by parent index hash
+    ldomStyleSharingEntry _styleSharing[STYLE_SHARING_CACHE_SIZE];
     bool _mapped;
     bool _maperror;
     int  _mapSavingStage;
@@ -403,6 +569,9 @@ protected:
     ldomDataStorageManager _elemStorage; // persistent element data storage
     ldomDataStorageManager _rectStorage; // element render rect storage
     ldomDataStorageManager _styleStorage;// element style storage (font & style indexes ldomNodeStyleInfo)
+#if BUILD_LITE!=1
+    ldomNodeTopology _topology;          // resident copy of persistent node tree structure
+#endif
 
     CRPropRef _docProps;
     lUInt32 _docFlags; // document flags
@@ -425,15 +594,21 @@ protected:
     bool updateLoadedStyles( bool enabled );
     lUInt32 calcStyleHash();
     bool saveNodeData();
-    bool saveNodeData( lUInt16 type, ldomNode ** list, int nodecount );
+    bool saveNodeData( lUInt16 type, ldomNodePartTable<ldomNode> & list, int nodecount );
     bool loadNodeData();
-    bool loadNodeData( lUInt16 type, ldomNode ** list, int nodecount );
+    bool loadNodeData( lUInt16 type, ldomNodePartTable<ldomNode> & list, int nodecount );
+    bool saveNodeTopology();
+    bool loadNodeTopology();
+    /// fills topology table from element and text storage, for cache files saved without it
+    void buildNodeTopology();
 
 
     bool openCacheFile();
 
     void setNodeStyleIndex( lUInt32 dataIndex, lUInt16 index );
     void setNodeFontIndex( lUInt32 dataIndex, lUInt16 index );
+    /// sets style and font indexes of element, adding references to cache items and releasing previous ones
+    void setNodeStyleInfo( lUInt32 dataIndex, lUInt16 styleIndex, lUInt16 fontIndex );
     lUInt16 getNodeStyleIndex( lUInt32 dataIndex );
     lUInt16 getNodeFontIndex( lUInt32 dataIndex );
     css_style_ref_t getNodeStyle( lUInt32 dataIndex );
@@ -476,12 +651,38 @@ public:
         return updateMap(infinite)!=CR_ERROR;
     }
 
+    /// starts recording of storage chunks accessed while drawing page
+    void startChunkAccessRecording( int page );
+    /// stops recording of storage chunks access
+    void stopChunkAccessRecording();
+    /// restores swapped out storage chunks needed to draw page, in background thread
+    void prefetchPageChunks( int page, int direction );
+    /// forgets recorded chunk access order, call when pages are changed
+    void clearChunkAccessHistory();
+    /// moves cache file blocks to the beginning of file and truncates it, limited by time interval (can be called again to continue after TIMEOUT)
+    ContinuousOperationResult compactCacheFile( CRTimerUtil & maxTime );
+    /// returns true if cache file with specified path is used by one of open documents
+    static bool isCacheFileOpen( lString16 pathname );
+    /// returns true if some of cache file blocks is found to be corrupted: document should be reloaded from source
+    bool isCacheFileInvalid();
+
     bool swapToCacheIfNecessary();
 
 
     bool createCacheFile();
 #endif
 
+#if BUILD_LITE!=1
+    /// returns styled sibling of element which would get the same style, NULL if style should be calculated
+    ldomNode * findStyleSharingSibling( ldomNode * node, css_style_ref_t & parentStyle );
+    /// remembers element with just calculated style, for reusing its style by next siblings
+    void addStyleSharingSibling( ldomNode * node, css_style_ref_t & parentStyle );
+    /// forgets all remembered styled elements
+    void resetStyleSharing();
+    /// sets style and font of element to ones of another styled element
+    void copyNodeStyle( lUInt32 dataIndex, lUInt32 fromDataIndex );
+#endif
+
     inline bool getDocFlag( lUInt32 mask )
     {
         return (_docFlags & mask) != 0;
@@ -569,10 +770,22 @@ public:
 #endif
 
 /// compact 32bit value for node
+#if defined(__LP64__) || defined(_WIN64)
+// ldomNode is padded to 16 bytes on 64 bit systems: data index takes whole 32 bits without extra memory
+struct ldomNodeHandle {
+    lUInt32 _dataIndex;     // index of node in document's storage and type
+    lUInt8  _docIndex;      // index in ldomNode::_documentInstances[MAX_DOCUMENT_INSTANCE_COUNT];
+};
+/// max index of node of each type (text, element) in document, limited by number of node parts
+#define MAX_NODE_INDEX (TNC_MAX_PART_COUNT*TNC_PART_LEN-1)
+#else
 struct ldomNodeHandle {
     unsigned _docIndex:8;   // index in ldomNode::_documentInstances[MAX_DOCUMENT_INSTANCE_COUNT];
     unsigned _dataIndex:24; // index of node in document's storage and type
 };
+/// max index of node of each type (text, element) in document
+#define MAX_NODE_INDEX 0x000FFFFF
+#endif
 
 /// max number which could be stored in ldomNodeHandle._docIndex
 #define MAX_DOCUMENT_INSTANCE_COUNT 256
@@ -586,6 +799,7 @@ class ldomNode
     friend class tinyNodeCollection;
     friend class RenderRectAccessor;
     friend class NodeImageProxy;
+    friend class ldomTextView;
 
 private:
 
@@ -714,6 +928,10 @@ public:
     int getAttrCount() const;
     /// returns attribute value by attribute name id and namespace id
     const lString16 & getAttributeValue( lUInt16 nsid, lUInt16 id ) const;
+    /// returns attribute value index by attribute name id and namespace id, LXML_ATTR_VALUE_NONE if not set
+    lUInt32 getAttributeValueIndex( lUInt16 nsid, lUInt16 id ) const;
+    /// returns attribute value index by attribute name id, LXML_ATTR_VALUE_NONE if not set
+    inline lUInt32 getAttributeValueIndex( lUInt16 id ) const { return getAttributeValueIndex( LXML_NS_ANY, id ); }
     /// returns attribute value by attribute name
     inline const lString16 & getAttributeValue( const lChar16 * attrName ) const
     {
@@ -868,6 +1086,102 @@ public:
     bool getNodeListMarker( int & counterValue, lString16 & marker, int & markerWidth );
 };
 
+/// flags for ldomNodeCursor
+enum ldomNodeCursorFlags {
+    LDOM_CURSOR_ELEMENTS = 1, ///< report element nodes
+    LDOM_CURSOR_TEXT = 2,     ///< report text nodes
+    LDOM_CURSOR_ENTER = 4,    ///< report element before its children (pre-order)
+    LDOM_CURSOR_LEAVE = 8,    ///< report element after its children (post-order)
+    LDOM_CURSOR_ALL_NODES = LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_TEXT | LDOM_CURSOR_ENTER
+};
+
+/// resumable non-recursive subtree walker with explicit stack
+/**
+    Usage:
+        ldomNodeCursor cursor( root, LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER );
+        while ( cursor.next() )
+            process( cursor.getNode() );
+
+    Child count of element is read when cursor descends into it, i.e. after element
+    is reported on enter, so handler may change children of current node.
+    Cursor state refers nodes by data index and may be saved and restored while document is not modified.
+*/
+class ldomNodeCursor
+{
+    struct Frame {
+        lUInt32 dataIndex;  // element
+        int nextChild;      // index of next child to visit
+        int endChild;       // index after last child to visit, -1 if not yet known
+    };
+    ldomDocument * _document;
+    LVArray<Frame> _stack;
+    lUInt32 _rootIndex;   // subtree root, 0 if cursor walks range of children of bottom frame element
+    lUInt32 _current;     // data index of current node, 0 if none
+    lUInt16 _nodeId;      // report only elements with this id, 0 for all
+    lUInt8 _flags;
+    bool _started;
+    bool _leaving;
+    inline bool matches( lUInt32 dataIndex, bool isElement );
+    inline void push( lUInt32 dataIndex, int nextChild, int endChild );
+public:
+    /// creates cursor for subtree of specified node; nodeId!=0 to report only elements with this name id
+    ldomNodeCursor( ldomNode * root, int flags = LDOM_CURSOR_ALL_NODES, lUInt16 nodeId = 0 );
+    /// creates cursor for children startChild..endChild-1 of specified node (node itself is not reported)
+    ldomNodeCursor( ldomNode * parent, int startChild, int endChild, int flags = LDOM_CURSOR_ALL_NODES, lUInt16 nodeId = 0 );
+    /// creates finished cursor, to be restored by deserialize()
+    ldomNodeCursor( ldomDocument * document );
+    /// moves to next node, returns false if walk is finished
+    bool next();
+    /// returns current node
+    ldomNode * getNode() const;
+    /// returns data index of current node
+    lUInt32 getDataIndex() const { return _current; }
+    /// returns true if current element is reported after its children
+    bool isLeaving() const { return _leaving; }
+    /// returns level of current node relative to cursor root (0 for root)
+    int getLevel() const;
+    /// don't visit children of current element (when reported on enter)
+    void skipChildren();
+    /// returns true if walk is finished
+    bool isFinished() const { return _started && !_current && _stack.empty(); }
+    /// moves second half of unvisited subtrees of the shallowest possible level to new cursor, returns NULL if there is nothing to split
+    ldomNodeCursor * split();
+    /// splits remaining walk into up to maxParts cursors with disjoint subtrees: this cursor and new cursors added to parts
+    void split( int maxParts, LVPtrVector<ldomNodeCursor> & parts );
+    /// saves cursor state
+    void serialize( SerialBuf & buf );
+    /// restores cursor state saved by serialize()
+    bool deserialize( SerialBuf & buf );
+};
+
+/// read-only access to UTF-8 text of text node without copying
+/**
+    For persistent text node, view points directly into storage chunk buffer,
+    and the chunk is pinned in memory (not swapped out) until view is destroyed.
+    Keep views short living, and don't modify node while its view exists.
+*/
+class ldomTextView
+{
+    const ldomNode * _node; // persistent text node with pinned storage chunk, or NULL
+    lUInt32 _addr;          // pinned text address inside storage
+    const char * _text;
+    int _length;
+    // non-copyable
+    ldomTextView( const ldomTextView & );
+    ldomTextView & operator = ( const ldomTextView & );
+public:
+    /// creates view of text node; view of element node is empty
+    ldomTextView( const ldomNode * node );
+    ~ldomTextView();
+    /// pointer to UTF-8 text, not zero terminated
+    const char * text() const { return _text; }
+    /// text length, in bytes
+    int length() const { return _length; }
+    bool empty() const { return _length == 0; }
+    /// decodes text to wide string
+    lString16 getText16() const { return Utf8ToUnicode( _text, _length ); }
+};
+
 
 // default: 512K
 #define DEF_DOC_DATA_BUFFER_SIZE 0x80000
@@ -956,23 +1270,52 @@ public:
     lUInt16 getAttrNameIndex( const lChar8 * name );
 
     /// helper: returns attribute value
-    inline const lString16 & getAttrValue( lUInt16 index ) const
+    inline const lString16 & getAttrValue( lUInt32 index ) const
     {
         return _attrValueTable[index];
     }
 
     /// helper: returns attribute value index
-    inline lUInt16 getAttrValueIndex( const lChar16 * value )
+    inline lUInt32 getAttrValueIndex( const lChar16 * value )
     {
-        return (lUInt16)_attrValueTable.add( value );
+        return (lUInt32)_attrValueTable.add( value );
     }
 
-    /// helper: returns attribute value index, 0xffff if not found
-    inline lUInt16 findAttrValueIndex( const lChar16 * value )
+    /// helper: returns attribute value index, LXML_ATTR_VALUE_NONE if not found
+    inline lUInt32 findAttrValueIndex( const lChar16 * value )
     {
-        return (lUInt16)_attrValueTable.find( value );
+        return (lUInt32)_attrValueTable.find( value );
     }
 
+    /// returns interned id of CSS selector name (class name, id or attribute value), allocates new id if not found
+    lUInt16 getCssNameId( const lString16 & name );
+
+    /// returns interned CSS name id of whole attribute value, to compare with getCssNameId() of selector value
+    /// \return CSS_NAME_ID_NONE if value is not used in stylesheet
+    lUInt16 getAttrValueCssNameId( lUInt32 valueIndex );
+
+    /// returns lowercase class name ids of class attribute value: number of ids followed by ids
+    /**
+        Class attribute value is tokenized once, result is shared by all elements with the same value.
+        Only class names used in stylesheet are returned.
+        Returned pointer is valid until next call.
+    */
+    const lUInt16 * getClassNameIds( lUInt32 valueIndex );
+    /// resolves CSS name ids of all attribute values, so that following getAttrValueCssNameId() and getClassNameIds() calls only read tables
+    /**
+        Call before matching of stylesheet rules in several threads; tables are valid until new CSS names are added.
+    */
+    void resolveCssNameIds();
+
+    /// returns compiled rules of CSS text with specified key, parsed before by this or another document
+    bool getCompiledStyleSheet( lUInt64 key, LVArray<lUInt8> & data );
+    /// remembers compiled rules of CSS text for this document cache file and other documents
+    void setCompiledStyleSheet( lUInt64 key, SerialBuf & data );
+    /// writes all compiled rules remembered by document
+    void serializeCompiledStyleSheets( SerialBuf & buf );
+    /// reads compiled rules written by serializeCompiledStyleSheets()
+    bool deserializeCompiledStyleSheets( SerialBuf & buf );
+
     /// Get element name by id
     /**
         \param id is numeric value of element name
@@ -1045,10 +1388,10 @@ public:
     }
 #endif
 
-    void onAttributeSet( lUInt16 attrId, lUInt16 valueId, ldomNode * node );
+    void onAttributeSet( lUInt16 attrId, lUInt32 valueId, ldomNode * node );
 
     /// get element by id attribute value code
-    inline ldomNode * getNodeById( lUInt16 attrValueId )
+    inline ldomNode * getNodeById( lUInt32 attrValueId )
     {
         return getTinyNode( _idNodeMap.get( attrValueId ) );
     }
@@ -1056,7 +1399,7 @@ public:
     /// get element by id attribute value
     inline ldomNode * getElementById( const lChar16 * id )
     {
-        lUInt16 attrValueId = getAttrValueIndex( id );
+        lUInt32 attrValueId = getAttrValueIndex( id );
         ldomNode * node = getNodeById( attrValueId );
         return node;
     }
@@ -1111,7 +1454,13 @@ protected:
     lUInt16       _nextUnknownAttrId;    // Next Id for unknown attribute
     lUInt16       _nextUnknownNsId;      // Next Id for unknown namespace
     lString16HashedCollection _attrValueTable;
-    LVHashTable<lUInt16,lInt32> _idNodeMap; // id to data index map
+    lString16HashedCollection _cssNameTable;  // interned CSS selector names, not saved to cache
+    LVArray<lUInt16> _attrValueCssNameIds;    // attribute value index -> CSS name id of value, 0xFFFF if not interned yet
+    LVArray<lInt32> _classNameListOffsets;    // attribute value index -> offset in _classNameLists, -1 if not tokenized yet
+    LVArray<lUInt16> _classNameLists;         // tokenized class attribute values: count, class name ids
+    LVHashTable<lUInt64, LVArray<lUInt8> *> _compiledStyleSheets; // CSS text key -> compiled rules, see LVStyleSheet::parse()
+    bool _compiledStyleSheetsChanged;         // compiled rules are added since last saving to cache file
+    LVHashTable<lUInt32,lInt32> _idNodeMap; // id to data index map
     LVHashTable<lString16,LVImageSourceRef> _urlImageMap; // url to image source map
     lUInt16 _idAttrId; // Id for "id" attribute name
     lUInt16 _nameAttrId; // Id for "name" attribute name
@@ -1136,12 +1485,12 @@ struct lxmlAttribute
     //
     lUInt16 nsid;
     lUInt16 id;
-    lUInt16 index;
+    lUInt32 index;
     inline bool compare( lUInt16 nsId, lUInt16 attrId )
     {
         return (nsId == nsid || nsId == LXML_NS_ANY) && (id == attrId);
     }
-    inline void setData( lUInt16 nsId, lUInt16 attrId, lUInt16 valueIndex )
+    inline void setData( lUInt16 nsId, lUInt16 attrId, lUInt32 valueIndex )
     {
         nsid = nsId;
         id = attrId;
@@ -2014,6 +2363,11 @@ public:
     {
         return !_def_style.isNull();
     }
+#if BUILD_LITE!=1
+    /// init styles of subtree in several threads when concurrency provider is set, see setStyleInitThreads();
+    /// returns false if styles should be calculated sequentially
+    bool initNodeStylesInThreads( ldomNode * root );
+#endif
 
     /// return document's embedded font list
     LVEmbeddedFontList & getEmbeddedFontList() { return _fontList; }
@@ -2370,6 +2724,20 @@ ldomDocument * LVParseHTMLStream( LVStreamRef stream,
                               const attr_def_t * attr_table=NULL,
                               const ns_def_t * ns_table=NULL );
 
+/// document cache usage statistics
+struct ldomDocCacheStats
+{
+    lUInt32 hits;          ///< number of documents opened from cache
+    lUInt32 misses;        ///< number of documents not found in cache
+    lUInt32 evictions;     ///< number of files removed to free space
+    lUInt64 evictedBytes;  ///< total size of removed files
+    lUInt64 bytesSaved;    ///< total size of cache files reused instead of parsing documents again
+    lUInt32 files;         ///< number of files in cache
+    lUInt64 totalSize;     ///< total size of files in cache
+    /// returns hit rate, percent
+    int hitRate() const { return hits + misses ? (int)(hits * 100 / (hits + misses)) : 0; }
+};
+
 /// document cache
 class ldomDocCache
 {
@@ -2378,6 +2746,8 @@ public:
     static LVStreamRef openExisting( lString16 filename, lUInt32 crc, lUInt32 docFlags );
     /// create new cache file
     static LVStreamRef createNew( lString16 filename, lUInt32 crc, lUInt32 docFlags, lUInt32 fileSize );
+    /// delete cache file, e.g. found to be corrupted
+    static bool remove( lString16 filename, lUInt32 crc, lUInt32 docFlags );
     /// init document cache
     static bool init( lString16 cacheDir, lvsize_t maxSize );
     /// close document cache manager
@@ -2386,13 +2756,67 @@ public:
     static bool clear();
     /// returns true if cache is enabled (successfully initialized)
     static bool enabled();
+    /// returns crc32 of stream, looked up by stream fingerprint (size, modification time, sampled blocks) to avoid reading of whole stream
+    static lUInt32 getStreamCRC32( LVStreamRef stream );
+    /// returns cache usage statistics for current session, false if cache is disabled
+    static bool getStats( ldomDocCacheStats & stats );
+    /// resets hit, miss and eviction counters
+    static void resetStats();
+    /// compacts fragmented cache files not used by open documents, limited by time interval (can be called again on idle to continue after TIMEOUT)
+    static ContinuousOperationResult compact( CRTimerUtil & maxTime );
+    /// returns compiled stylesheet saved by any document for CSS text key, false if not found
+    static bool getCompiledStyleSheet( lUInt64 key, LVArray<lUInt8> & data );
+    /// saves compiled stylesheet for CSS text key, to be reused by documents with the same CSS
+    static void putCompiledStyleSheet( lUInt64 key, const lUInt8 * data, int size );
 };
 
 
 /// unit test for DOM
 void runTinyDomUnitTests();
 
-/// pass true to enable CRC check for
+/// pass true to enable CRC check of cache file blocks (each block is checked on its first read)
 void enableCacheFileContentsValidation(bool enable);
 
+/// pass true to read existing cache file blocks via memory mapping
+void enableCacheFileMappedRead(bool enable);
+
+/// pass true to write storage chunks to cache file in background thread (when concurrency provider is set)
+void enableCacheFileBackgroundWriter(bool enable);
+
+/// sets number of threads used to pack cache file blocks written in batches (when concurrency provider is set)
+void setCacheFileCompressionThreads(int count);
+
+/// sets number of threads calculating styles of document elements (when concurrency provider is set), 1 to calculate in main thread only;
+/// elements of levels lower than splitLevel are styled by main thread, subtrees of elements of splitLevel are distributed between threads
+void setStyleInitThreads(int count, int splitLevel);
+
+/// sets limit of unpacked DOM storage data (text, elements, rects, styles) for all documents, bytes
+void setDomStorageMemoryLimit(int size);
+/// returns limit of unpacked DOM storage data for all documents, bytes
+int getDomStorageMemoryLimit();
+/// returns current size of unpacked DOM storage data of all documents, bytes
+int getDomStorageMemoryUsage();
+
+/// enables restoring of storage chunks of pages in page turn direction in background thread (when concurrency provider is set)
+void enableStorageChunkPrefetch(bool enable);
+
+/// sets free space of cache file in percents of its size which triggers compaction on save, 0 to disable compaction
+void setCacheFileCompactionThreshold(int freePercent);
+
+/// cache file block compression codecs
+enum cache_file_codec_t {
+    CACHE_CODEC_NONE = 0,
+    CACHE_CODEC_ZLIB,
+    CACHE_CODEC_LZ
+};
+
+/// sets codec and minimal compression ratio in percents (block is stored unpacked if ratio is lower, 0 to disable) for cache file blocks of specified type
+void setCacheFileCodecPolicy(int blockType, int codec, int minRatioPercent);
+
+/// returns decompression statistics for cache file blocks of specified type: number of blocks, uncompressed bytes and time in microseconds
+void getCacheFileUnpackStats(int blockType, lUInt32 & count, lUInt64 & bytes, lUInt64 & micros);
+
+/// resets cache file decompression statistics
+void resetCacheFileUnpackStats();
+
 #endif
@@ -2,12 +2,17 @@
 #include "crconcurrent.h"
 #include "lvptrvec.h"
 #include "lvstring.h"
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
 
 CRMutex * _refMutex = NULL;
 CRMutex * _fontMutex = NULL;
 CRMutex * _fontManMutex = NULL;
 CRMutex * _fontGlyphCacheMutex = NULL;
 CRMutex * _fontLocalGlyphCacheMutex = NULL;
+CRMutex * _fontMetricsCacheMutex = NULL;
 CRMutex * _crengineMutex = NULL;
 
 void CRSetupEngineConcurrency() {
@@ -25,12 +30,85 @@ void CRSetupEngineConcurrency() {
         _fontGlyphCacheMutex = concurrencyProvider->createMutex();
     if (!_fontLocalGlyphCacheMutex)
         _fontLocalGlyphCacheMutex = concurrencyProvider->createMutex();
+    if (!_fontMetricsCacheMutex)
+        _fontMetricsCacheMutex = concurrencyProvider->createMutex();
     if (!_crengineMutex)
     	_crengineMutex = concurrencyProvider->createMutex();
 }
 
 CRConcurrencyProvider * concurrencyProvider = NULL;
 
+class CRStdMutex : public CRMutex {
+protected:
+    std::recursive_mutex _mutex;
+public:
+    virtual void acquire() { _mutex.lock(); }
+    virtual void release() { _mutex.unlock(); }
+};
+
+/// monitor is not recursive: wait() would release only one level of recursive lock and block other threads forever
+class CRStdMonitor : public CRMonitor {
+    std::mutex _mutex;
+    std::condition_variable _cond;
+public:
+    virtual void acquire() { _mutex.lock(); }
+    virtual void release() { _mutex.unlock(); }
+    /// call with monitor acquired once
+    virtual void wait() {
+        std::unique_lock<std::mutex> lock( _mutex, std::adopt_lock );
+        _cond.wait( lock );
+        lock.release(); // still acquired by caller
+    }
+    virtual void notify() { _cond.notify_one(); }
+    virtual void notifyAll() { _cond.notify_all(); }
+};
+
+class CRStdThread : public CRThread {
+    CRRunnable * _task;
+    std::thread _thread;
+public:
+    CRStdThread(CRRunnable * task) : _task(task) {}
+    virtual ~CRStdThread() {
+        if (_thread.joinable())
+            _thread.join();
+    }
+    virtual void start() { _thread = std::thread(&CRRunnable::run, _task); }
+    virtual void join() {
+        if (_thread.joinable())
+            _thread.join();
+    }
+};
+
+CRMutex * CRStdConcurrencyProvider::createMutex() {
+    return new CRStdMutex();
+}
+
+CRMonitor * CRStdConcurrencyProvider::createMonitor() {
+    return new CRStdMonitor();
+}
+
+CRThread * CRStdConcurrencyProvider::createThread(CRRunnable * threadTask) {
+    return new CRStdThread(threadTask);
+}
+
+void CRStdConcurrencyProvider::executeGui(CRRunnable * task) {
+    if (!task)
+        return;
+    task->run();
+    delete task;
+}
+
+void CRStdConcurrencyProvider::executeGui(CRRunnable * task, int delayMillis) {
+    if (!task)
+        return;
+    sleepMs(delayMillis);
+    executeGui(task);
+}
+
+void CRStdConcurrencyProvider::sleepMs(int durationMs) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+}
+
 CRThreadExecutor::CRThreadExecutor() : _stopped(false) {
     _monitor = concurrencyProvider->createMonitor();
     _thread = concurrencyProvider->createThread(this);
@@ -1,6 +1,20 @@
 #include "../include/crtest.h"
 #include "../include/lvtinydom.h"
 #include "../include/chmfmt.h"
+#include "../include/lvdocview.h"
+#include "../include/crconcurrent.h"
+
+#if BUILD_LITE!=1
+// unit test hook of document cache, not part of public API
+bool damageCacheFileTextChunk( lString16 pathname );
+#endif
+
+#if BUILD_LITE!=1 && USE_FREETYPE==1
+// unit test hooks of font manager, not part of public API
+LVFontManager * createFreeTypeFontManager( lString16 catalogFile, lString16 metricsCacheDir );
+int checkFontMetricsCacheFile( lString16 fileName );
+int getFontFileScanCount();
+#endif
 
 #ifdef _DEBUG
 
@@ -172,6 +186,10 @@ LVStreamRef LVCreateCompareTestStream( LVStreamRef stream1, LVStreamRef stream2
 // external tests declarations
 void testTxtSelector();
 
+/// directory for documents and cache files made by unit tests
+#ifndef CR_UNIT_TEST_DIR
+#define CR_UNIT_TEST_DIR "crtest.tmp"
+#endif
 
 void runCRUnitTests()
 {
@@ -180,4 +198,806 @@ void runCRUnitTests()
     runTinyDomUnitTests();
     testTxtSelector();
 #endif
+#if BUILD_LITE!=1
+    lString16 dir( CR_UNIT_TEST_DIR );
+    LVAppendPathDelimiter( dir );
+    MYASSERT( LVCreateDirectory( dir ), "unit test directory" );
+    CRConcurrencyProvider * testProvider = NULL;
+    if ( !concurrencyProvider ) {
+        // threaded code paths are tested with std::thread based provider when frontend has no own one
+        testProvider = new CRStdConcurrencyProvider();
+        concurrencyProvider = testProvider;
+        CRSetupEngineConcurrency();
+    }
+    if ( fontMan ) {
+        MYASSERT( runFontConcurrencyTest( lString8::empty_str, 4, 2000, 3 )>=0, "font concurrency test" );
+        MYASSERT( runFontMetricsCacheTest( dir )>=0, "font metrics cache test" );
+        MYASSERT( runFontCatalogTest( dir )>=0, "font catalog test" );
+        MYASSERT( runThreadedDocumentTest( dir, 3000 )>=0, "threaded document test" );
+        MYASSERT( runCorruptedCacheTest( dir, 3000 )>=0, "corrupted cache test" );
+        // ids and nodes above 16 bit limits; larger sizes are tested by calling runLargeDocumentTest() directly
+        MYASSERT( runLargeDocumentTest( dir, 70000, 200000 )>=0, "large document test" );
+    }
+    if ( testProvider ) {
+        // frontend stays single threaded; engine mutexes created by CRSetupEngineConcurrency() are kept
+        concurrencyProvider = NULL;
+        delete testProvider;
+    }
+#endif
+}
+
+/// measures time of stylesheet matching: applies stylesheet from cssFile (document's own if empty) to each element of document
+int runStyleSheetBenchmark( lString16 cssFile, lString16 docFile, int passes )
+{
+#if BUILD_LITE!=1
+    LVDocView view;
+    view.Resize( 600, 800 );
+    if ( !view.LoadDocument( docFile.c_str() ) ) {
+        CRLog::error("Stylesheet benchmark: cannot open document %s", LCSTR(docFile));
+        return -1;
+    }
+    ldomDocument * doc = view.getDocument();
+    if ( !cssFile.empty() ) {
+        lString8 css;
+        if ( !LVLoadStylesheetFile( cssFile, css ) ) {
+            CRLog::error("Stylesheet benchmark: cannot read stylesheet %s", LCSTR(cssFile));
+            return -1;
+        }
+        doc->getStyleSheet()->clear();
+        doc->getStyleSheet()->parse( css.c_str() );
+    }
+    if ( passes < 1 )
+        passes = 1;
+    int elements = 0;
+    CRTimerUtil timer;
+    for ( int i = 0; i < passes; i++ ) {
+        elements = 0;
+        ldomNodeCursor cursor( doc->getRootNode(), LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER );
+        while ( cursor.next() ) {
+            css_style_rec_t style;
+            doc->applyStyle( cursor.getNode(), &style );
+            elements++;
+        }
+    }
+    int ms = (int)(timer.elapsed() / passes);
+    CRLog::info("Stylesheet benchmark: %d elements, %d passes, %d ms per pass", elements, passes, ms);
+    return ms;
+#else
+    CR_UNUSED3(cssFile, docFile, passes);
+    return -1;
+#endif
+}
+
+#if BUILD_LITE!=1
+/// writes HTML document with paragraphs of different classes and inline elements, returns its path
+static lString16 makeStyleTestDocument( lString16 dir, int paragraphs )
+{
+    lString16 fileName = dir + "styletest.html";
+    LVStreamRef out = LVOpenFileStream( fileName.c_str(), LVOM_WRITE );
+    if ( out.isNull() )
+        return lString16::empty_str;
+    *out << "<html><head><title>Style test</title><style>\n"
+            "p.a { text-indent: 2em; } p.b { font-weight: bold; margin-top: 0.5em; }\n"
+            "p.c { font-size: 120%; text-align: right; } section > p:first-child { font-style: italic; }\n"
+            "h2 + p { text-indent: 0; } span.note { font-size: 70%; }\n"
+            "</style></head><body>\n";
+    static const char * classes[] = { "a", "b", "c", "a" };
+    for ( int i = 0; i < paragraphs; i++ ) {
+        if ( i % 50 == 0 ) {
+            if ( i )
+                *out << "</section>\n";
+            *out << "<section><h2>Chapter " << lString8::itoa( i / 50 + 1 ) << "</h2>\n";
+        }
+        *out << "<p class=\"" << classes[i % 4] << "\">Paragraph " << lString8::itoa( i )
+             << " of <b>style</b> test, <i>emphasized</i> text <span class=\"note\">and note "
+             << lString8::itoa( i * 7 % 1000 ) << "</span> which is long enough to be wrapped to several lines.</p>\n";
+    }
+    if ( paragraphs )
+        *out << "</section>\n";
+    *out << "</body></html>\n";
+    return fileName;
+}
+
+/// opens document in page mode, resizes it, draws pages one by one collecting their text, then saves document to cache
+/// \return number of pages, -1 if document cannot be opened
+static int readStyleTestDocument( lString16 fileName, lString16Collection & texts )
+{
+    LVDocView view;
+    view.setViewMode( DVM_PAGES, 1 );
+    view.Resize( 600, 800 );
+    if ( !view.LoadDocument( fileName.c_str() ) )
+        return -1;
+    LVGrayDrawBuf buf( 600, 800, 8 );
+    view.Draw( buf, false );
+    // new page width makes document styles be calculated again for all elements
+    view.Resize( 560, 800 );
+    view.Draw( buf, false );
+    for (;;) {
+        texts.add( view.getPageText( false ) );
+        // turning page starts prefetching of storage chunks of next pages
+        if ( !view.moveByPage( 1 ) )
+            break;
+        view.Draw( buf, false );
+    }
+    view.swapToCache();
+    return texts.length();
+}
+#endif
+
+/// threaded document test: styles, saves to cache and reopens document using threads, checks that pages don't differ from single threaded ones
+int runThreadedDocumentTest( lString16 dir, int paragraphs )
+{
+#if BUILD_LITE!=1
+    if ( !fontMan || !concurrencyProvider ) {
+        CRLog::error("Threaded document test: font manager or concurrency provider is not initialized");
+        return -1;
+    }
+    lString16 fileName = makeStyleTestDocument( dir, paragraphs );
+    if ( fileName.empty() ) {
+        CRLog::error("Threaded document test: cannot write test document");
+        return -1;
+    }
+    // reference pages: everything is done by main thread, document is not cached
+    ldomDocCache::close();
+    CRConcurrencyProvider * provider = concurrencyProvider;
+    concurrencyProvider = NULL;
+    lString16Collection expected;
+    int pages = readStyleTestDocument( fileName, expected );
+    concurrencyProvider = provider;
+    if ( pages<=0 ) {
+        CRLog::error("Threaded document test: cannot open test document");
+        return -1;
+    }
+    if ( !ldomDocCache::init( dir + "cache", 0x4000000 ) || !ldomDocCache::clear() ) {
+        CRLog::error("Threaded document test: cannot init document cache");
+        return -1;
+    }
+    ldomDocCache::resetStats();
+    // small memory limit makes storage chunks be swapped out and restored while pages are turned
+    int memoryLimit = getDomStorageMemoryLimit();
+    setDomStorageMemoryLimit( 0x40000 );
+    int errors = 0;
+    CRTimerUtil timer;
+    // first pass styles elements in threads and writes cache file in background, second one opens document from cache
+    for ( int pass = 0; pass < 2; pass++ ) {
+        lString16Collection texts;
+        if ( readStyleTestDocument( fileName, texts )!=pages ) {
+            CRLog::error("Threaded document test: pass %d, %d pages instead of %d", pass, texts.length(), pages);
+            errors++;
+            continue;
+        }
+        for ( int i = 0; i < pages; i++ ) {
+            if ( texts[i]!=expected[i] ) {
+                CRLog::error("Threaded document test: pass %d, page %d differs", pass, i);
+                errors++;
+            }
+        }
+    }
+    int ms = (int)timer.elapsed();
+    ldomDocCacheStats stats;
+    if ( !ldomDocCache::getStats( stats ) || stats.hits!=1 ) {
+        CRLog::error("Threaded document test: document is not opened from cache");
+        errors++;
+    }
+    setDomStorageMemoryLimit( memoryLimit );
+    ldomDocCache::close();
+    CRLog::info("Threaded document test: %d pages, %d ms, %d errors", pages, ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED2(dir, paragraphs);
+    return -1;
+#endif
+}
+
+/// corrupted cache test: damages text chunk of document cache file, checks that document opened from it is reloaded from source
+int runCorruptedCacheTest( lString16 dir, int paragraphs )
+{
+#if BUILD_LITE!=1
+    lString16 fileName = makeStyleTestDocument( dir, paragraphs );
+    if ( fileName.empty() ) {
+        CRLog::error("Corrupted cache test: cannot write test document");
+        return -1;
+    }
+    // reference pages: document is not cached
+    ldomDocCache::close();
+    lString16Collection expected;
+    int pages = readStyleTestDocument( fileName, expected );
+    if ( pages<=0 ) {
+        CRLog::error("Corrupted cache test: cannot open test document");
+        return -1;
+    }
+    lString16 cacheDir = dir + "cache";
+    LVAppendPathDelimiter( cacheDir );
+    if ( !ldomDocCache::init( cacheDir, 0x4000000 ) || !ldomDocCache::clear() ) {
+        CRLog::error("Corrupted cache test: cannot init document cache");
+        return -1;
+    }
+    int errors = 0;
+    CRTimerUtil timer;
+    lString16Collection texts;
+    readStyleTestDocument( fileName, texts );
+    lString16 cacheFileName;
+    LVContainerRef container = LVOpenDirectory( cacheDir.c_str(), L"*.cr3" );
+    for ( int i=0; !container.isNull() && i<container->GetObjectCount(); i++ ) {
+        const LVContainerItemInfo * item = container->GetObjectInfo( i );
+        if ( !item->IsContainer() && lString16( item->GetName() ).endsWith(".cr3") )
+            cacheFileName = cacheDir + item->GetName();
+    }
+    if ( cacheFileName.empty() || !damageCacheFileTextChunk( cacheFileName ) ) {
+        CRLog::error("Corrupted cache test: cannot damage cache file");
+        ldomDocCache::close();
+        return -1;
+    }
+    ldomDocCache::resetStats();
+    // damaged chunk is found while opening of document from cache, then document is parsed again;
+    // second pass should open new cache file written instead of damaged one
+    for ( int pass = 0; pass < 2; pass++ ) {
+        texts.clear();
+        if ( readStyleTestDocument( fileName, texts )!=pages ) {
+            CRLog::error("Corrupted cache test: pass %d, %d pages instead of %d", pass, texts.length(), pages);
+            errors++;
+            continue;
+        }
+        for ( int i = 0; i < pages; i++ ) {
+            if ( texts[i]!=expected[i] ) {
+                CRLog::error("Corrupted cache test: pass %d, page %d differs", pass, i);
+                errors++;
+            }
+        }
+    }
+    int ms = (int)timer.elapsed();
+    ldomDocCacheStats stats;
+    if ( !ldomDocCache::getStats( stats ) || stats.hits!=2 ) {
+        CRLog::error("Corrupted cache test: %d cache hits instead of 2", (int)stats.hits);
+        errors++;
+    }
+    ldomDocCache::close();
+    CRLog::info("Corrupted cache test: %d pages, %d ms, %d errors", pages, ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED2(dir, paragraphs);
+    return -1;
+#endif
+}
+
+#if BUILD_LITE!=1
+/// stylesheet of large test document: class and id rules, including values which get attribute value index above 16 bits
+static const char * largeTestDocumentStyleSheet =
+    "p.c3 { font-weight: bold; }\n"
+    "p.late { font-style: italic; }\n"
+    "#p5, #p65540, #p69999 { text-indent: 2em; }\n";
+
+/// returns true if paragraph should match id rule of large test document stylesheet
+static bool largeTestParagraphIndented( int i )
+{
+    return i==5 || i==65540 || i==69999;
+}
+
+/// writes HTML document with paragraphs <p id="pN" class="cK">text</p> grouped by 1000 into sections, returns its path;
+/// paragraphs above idCount have no id, paragraphs starting from 0x10000 have class "late"
+static lString16 makeLargeTestDocument( lString16 dir, int idCount, int paragraphs )
+{
+    lString16 fileName = dir + "largetest.html";
+    LVStreamRef out = LVOpenFileStream( fileName.c_str(), LVOM_WRITE );
+    if ( out.isNull() )
+        return lString16::empty_str;
+    *out << "<html><head><title>Large document test</title></head><body>\n";
+    for ( int i=0; i<paragraphs; i++ ) {
+        if ( i % 1000 == 0 ) {
+            if ( i )
+                *out << "</section>\n";
+            *out << "<section>\n";
+        }
+        *out << "<p";
+        if ( i < idCount )
+            *out << " id=\"p" << lString8::itoa( i ) << "\"";
+        if ( i < 0x10000 )
+            *out << " class=\"c" << lString8::itoa( i % 10 ) << "\">";
+        else
+            *out << " class=\"late\">";
+        *out << "text</p>\n";
+    }
+    if ( paragraphs )
+        *out << "</section>\n";
+    *out << "</body></html>\n";
+    return fileName;
+}
+
+/// checks node count, lookups and styles of sampled ids, including ones around former 16 bit value index limit
+/// \return number of errors
+static int checkLargeTestDocument( ldomDocument * doc, int idCount, int paragraphs )
+{
+    int errors = 0;
+    int nodes = 0;
+    ldomNodeCursor cursor( doc->getRootNode() );
+    while ( cursor.next() )
+        nodes++;
+    if ( nodes < paragraphs * 2 ) {
+        CRLog::error("Large document test: %d nodes instead of %d", nodes, paragraphs * 2);
+        errors++;
+    }
+    LVArray<int> samples;
+    for ( int i=0; i<idCount; i += idCount / 97 + 1 )
+        samples.add( i );
+    for ( int i=0xFFF0; i<0x10010 && i<idCount; i++ )
+        samples.add( i );
+    if ( idCount > 5 )
+        samples.add( 5 );
+    if ( idCount > 0 )
+        samples.add( idCount - 1 );
+    lUInt16 idAttr = doc->getAttrNameIndex( L"id" );
+    for ( int k=0; k<samples.length(); k++ ) {
+        lString16 id = lString16(L"p") + fmt::decimal(samples[k]);
+        ldomNode * node = doc->getElementById( id.c_str() );
+        if ( !node || node->getAttributeValue( idAttr )!=id ) {
+            CRLog::error("Large document test: id %s is not found", LCSTR(id));
+            errors++;
+        }
+    }
+    if ( idCount > 0x10000 ) {
+        lString16 id = lString16(L"p") + fmt::decimal(idCount - 1);
+        if ( doc->findAttrValueIndex( id.c_str() ) <= 0xFFFF ) {
+            CRLog::error("Large document test: attribute value index is not wider than 16 bits");
+            errors++;
+        }
+    }
+    // styles of sampled paragraphs, calculated by rules of largeTestDocumentStyleSheet
+    for ( int k=0; k<samples.length(); k++ ) {
+        int i = samples[k];
+        ldomNode * node = doc->getElementById( (lString16(L"p") + fmt::decimal(i)).c_str() );
+        if ( !node )
+            continue;
+        css_style_ref_t style = node->getStyle();
+        if ( style.isNull() ) {
+            CRLog::error("Large document test: paragraph %d is not styled", i);
+            errors++;
+            continue;
+        }
+        bool bold = style->font_weight>=css_fw_600;
+        bool italic = style->font_style==css_fs_italic;
+        bool indented = style->text_indent.type==css_val_em && style->text_indent.value==2*256;
+        if ( bold!=(i < 0x10000 && i % 10 == 3) || italic!=(i >= 0x10000) || indented!=largeTestParagraphIndented( i ) ) {
+            CRLog::error("Large document test: wrong style of paragraph %d", i);
+            errors++;
+        }
+    }
+    return errors;
+}
+#endif
+
+/// large document test: builds document with idCount id attributes and about nodeCount nodes, saves it to cache in dir, closes and opens it from cache
+int runLargeDocumentTest( lString16 dir, int idCount, int nodeCount )
+{
+#if BUILD_LITE!=1
+    if ( !fontMan ) {
+        CRLog::error("Large document test: font manager is not initialized");
+        return -1;
+    }
+    CRLog::info("Large document test: %d ids, %d nodes", idCount, nodeCount);
+    // <p id="pN">text</p> is two nodes
+    int paragraphs = nodeCount / 2;
+    if ( paragraphs < idCount )
+        paragraphs = idCount;
+    lString16 fileName = makeLargeTestDocument( dir, idCount, paragraphs );
+    if ( fileName.empty() ) {
+        CRLog::error("Large document test: cannot write test document");
+        return -1;
+    }
+    lvsize_t cacheSize = (lvsize_t)paragraphs * 200 + 0x1000000;
+    if ( !ldomDocCache::init( dir + "cache", cacheSize ) || !ldomDocCache::clear() ) {
+        CRLog::error("Large document test: cannot init document cache");
+        return -1;
+    }
+    ldomDocCache::resetStats();
+    int errors = 0;
+    CRTimerUtil timer;
+    // first pass parses and styles document (in several threads if concurrency provider is set) and saves it to cache,
+    // second one opens it from cache
+    for ( int pass = 0; pass < 2 && !errors; pass++ ) {
+        LVDocView view;
+        view.setStyleSheet( lString8( largeTestDocumentStyleSheet ) );
+        view.Resize( 600, 800 );
+        if ( !view.LoadDocument( fileName.c_str() ) ) {
+            CRLog::error("Large document test: pass %d, cannot open document", pass);
+            errors++;
+            break;
+        }
+        LVGrayDrawBuf buf( 600, 800, 8 );
+        view.Draw( buf, false );
+        CRLog::info("Large document test: pass %d, document is opened and rendered in %d ms", pass, (int)timer.elapsed());
+        errors += checkLargeTestDocument( view.getDocument(), idCount, paragraphs );
+        if ( pass==0 )
+            view.swapToCache();
+    }
+    ldomDocCacheStats stats;
+    if ( !errors && (!ldomDocCache::getStats( stats ) || stats.hits!=1) ) {
+        CRLog::error("Large document test: document is not opened from cache");
+        errors++;
+    }
+    int ms = (int)timer.elapsed();
+    ldomDocCache::close();
+    CRLog::info("Large document test: %d ms, %d errors", ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED3(dir, idCount, nodeCount);
+    return -1;
+#endif
+}
+
+#if BUILD_LITE!=1
+/// 50 chars per line of glyph test text, each line uses next script and font size
+#define GLYPH_TEST_LINE_LEN 50
+
+/// makes glyph test text: lines of Latin, Cyrillic, Greek and CJK chars
+static lString16 makeGlyphTestText( int glyphCount )
+{
+    lString16 text;
+    text.reserve( glyphCount );
+    for ( int i = 0; i < glyphCount; i++ ) {
+        int line = i / GLYPH_TEST_LINE_LEN;
+        lChar16 ch;
+        switch ( line % 4 ) {
+        case 0: ch = (lChar16)('a' + (i * 7) % 26); break;
+        case 1: ch = (lChar16)(0x430 + (i * 5) % 32); break;
+        case 2: ch = (lChar16)(0x3B1 + (i * 3) % 25); break;
+        default: ch = (lChar16)(0x4E00 + (i * 13) % 200); break;
+        }
+        text << ch;
+    }
+    return text;
+}
+#endif
+
+#if BUILD_LITE!=1 && USE_FREETYPE==1
+/// measures characters of text by first face of font file with font manager which keeps metrics caches in cacheDir;
+/// font instance is kept while manager is deleted, like fonts referenced by frontends on shutdown
+static bool measureFontMetricsTestText( const lString8 & fontFile, const lString16 & cacheDir, const lString16 & text, LVArray<int> & widths )
+{
+    LVFontManager * man = createFreeTypeFontManager( lString16::empty_str, cacheDir );
+    lString16Collection faces;
+    if ( man->RegisterFont( fontFile ) )
+        man->getFaceList( faces );
+    LVFontRef font;
+    if ( faces.length() )
+        font = man->GetFont( 24, 400, false, css_ff_sans_serif, UnicodeToUtf8( faces[0] ) );
+    widths.clear();
+    if ( !font.isNull() ) {
+        for ( int i = 0; i < text.length(); i++ )
+            widths.add( font->getCharWidth( text[i], '?' ) );
+        widths.add( font->getTextWidth( text.c_str(), text.length() ) );
+    }
+    // metrics caches are saved by destructor
+    delete man;
+    font.Clear();
+    return widths.length() > 0;
+}
+
+/// returns first font file registered by frontend, empty string if there are no font files
+static lString8 getTestFontFile()
+{
+    lString16Collection fontFiles;
+    if ( fontMan )
+        fontMan->getFontFileNameList( fontFiles );
+    return fontFiles.length() ? UnicodeToUtf8( fontFiles[0] ) : lString8::empty_str;
+}
+
+/// registers font file by new font manager keeping catalog in catalogFile; returns number of font files opened
+/// to read faces (0 if faces are taken from catalog), -1 if font is not registered; typefaces are returned in faces
+static int registerFontCatalogTestFile( const lString8 & fontFile, const lString16 & catalogFile, lString16Collection & faces )
+{
+    LVFontManager * man = createFreeTypeFontManager( catalogFile, lString16::empty_str );
+    int scanCount = getFontFileScanCount();
+    bool registered = man->RegisterFont( fontFile );
+    scanCount = getFontFileScanCount() - scanCount;
+    man->getFaceList( faces );
+    // catalog is saved by destructor
+    delete man;
+    return registered ? scanCount : -1;
+}
+
+/// returns metrics cache files in cacheDir, with number of measured characters (-1 for broken file) in counts
+static void getFontMetricsTestFiles( const lString16 & cacheDir, lString16Collection & files, LVArray<int> & counts )
+{
+    files.clear();
+    counts.clear();
+    LVContainerRef container = LVOpenDirectory( cacheDir.c_str(), L"*.fmc" );
+    for ( int i=0; !container.isNull() && i<container->GetObjectCount(); i++ ) {
+        const LVContainerItemInfo * item = container->GetObjectInfo( i );
+        if ( !item->IsContainer() && lString16( item->GetName() ).endsWith(".fmc") ) {
+            files.add( cacheDir + item->GetName() );
+            counts.add( checkFontMetricsCacheFile( cacheDir + item->GetName() ) );
+        }
+    }
+}
+#endif
+
+/// font metrics cache test: measures text by font manager which writes metrics cache files to dir, checks the files,
+/// then measures text again by new manager which maps them
+int runFontMetricsCacheTest( lString16 dir )
+{
+#if BUILD_LITE!=1 && USE_FREETYPE==1
+    lString8 fontFile = getTestFontFile();
+    if ( fontFile.empty() ) {
+        CRLog::error("Font metrics cache test: no font files are registered");
+        return -1;
+    }
+    lString16 cacheDir = dir + "fmc";
+    LVAppendPathDelimiter( cacheDir );
+    LVCreateDirectory( cacheDir );
+    lString16Collection files;
+    LVArray<int> counts;
+    getFontMetricsTestFiles( cacheDir, files, counts );
+    for ( int i=0; i<files.length(); i++ )
+        LVDeleteFile( files[i] );
+    lString16 text = makeGlyphTestText( 2000 );
+    CRTimerUtil timer;
+    LVArray<int> widths;
+    LVArray<int> reloadedWidths;
+    int errors = 0;
+    if ( !measureFontMetricsTestText( fontFile, cacheDir, text, widths ) ) {
+        CRLog::error("Font metrics cache test: cannot measure text by font %s", fontFile.c_str());
+        return -1;
+    }
+    getFontMetricsTestFiles( cacheDir, files, counts );
+    if ( !files.length() ) {
+        CRLog::error("Font metrics cache test: metrics cache file is not written");
+        errors++;
+    }
+    for ( int i=0; i<files.length(); i++ ) {
+        if ( counts[i] <= 0 ) {
+            CRLog::error("Font metrics cache test: file %s is broken or empty", LCSTR(files[i]));
+            errors++;
+        }
+    }
+    LVArray<int> savedCounts( counts );
+    measureFontMetricsTestText( fontFile, cacheDir, text, reloadedWidths );
+    if ( reloadedWidths.length()!=widths.length() ) {
+        CRLog::error("Font metrics cache test: text is not measured after reload");
+        errors++;
+    }
+    for ( int i=0; i<widths.length() && i<reloadedWidths.length(); i++ ) {
+        if ( widths[i]!=reloadedWidths[i] ) {
+            CRLog::error("Font metrics cache test: width %d of item %d differs after reload, was %d", reloadedWidths[i], i, widths[i]);
+            errors++;
+            break;
+        }
+    }
+    // all characters are found in mapped file, so it's not changed
+    getFontMetricsTestFiles( cacheDir, files, counts );
+    if ( counts.length()!=savedCounts.length() ) {
+        CRLog::error("Font metrics cache test: set of files is changed after reload");
+        errors++;
+    }
+    for ( int i=0; i<counts.length() && i<savedCounts.length(); i++ ) {
+        if ( counts[i]!=savedCounts[i] ) {
+            CRLog::error("Font metrics cache test: file %s is changed after reload", LCSTR(files[i]));
+            errors++;
+        }
+    }
+    int ms = (int)timer.elapsed();
+    CRLog::info("Font metrics cache test: %d files, %d ms, %d errors", files.length(), ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED(dir);
+    return -1;
+#endif
+}
+
+/// font catalog test: registers font file by font manager which writes font catalog to dir, then registers it again
+/// by new manager which takes faces from catalog, then damages catalog and checks that it's ignored
+int runFontCatalogTest( lString16 dir )
+{
+#if BUILD_LITE!=1 && USE_FREETYPE==1
+    lString8 fontFile = getTestFontFile();
+    if ( fontFile.empty() ) {
+        CRLog::error("Font catalog test: no font files are registered");
+        return -1;
+    }
+    lString16 catalogFile = dir + "fonts.cat";
+    LVDeleteFile( catalogFile );
+    CRTimerUtil timer;
+    int errors = 0;
+    lString16Collection coldFaces;
+    lString16Collection faces;
+    int scanned = registerFontCatalogTestFile( fontFile, catalogFile, coldFaces );
+    if ( scanned!=1 || !coldFaces.length() ) {
+        CRLog::error("Font catalog test: font file %s is not registered (%d files read)", fontFile.c_str(), scanned);
+        return -1;
+    }
+    lUInt64 size = 0;
+    lUInt64 modificationTime = 0;
+    if ( !LVGetFileInfo( catalogFile, size, modificationTime ) || !size ) {
+        CRLog::error("Font catalog test: catalog file is not written");
+        return -1;
+    }
+    // warm start: faces are read from catalog
+    scanned = registerFontCatalogTestFile( fontFile, catalogFile, faces );
+    if ( scanned!=0 ) {
+        CRLog::error("Font catalog test: font file is opened again (%d files read) while it's in catalog", scanned);
+        errors++;
+    }
+    if ( !faces.contains( coldFaces[0] ) || faces.length()!=coldFaces.length() ) {
+        CRLog::error("Font catalog test: faces registered from catalog differ from ones read from font file");
+        errors++;
+    }
+    // damaged catalog: font file is read again, and catalog is written again
+    {
+        LVArray<lUInt8> data( (int)size, 0 );
+        LVStreamRef stream = LVOpenFileStream( catalogFile.c_str(), LVOM_READ );
+        lvsize_t bytesRead = 0;
+        if ( stream.isNull() || stream->Read( data.get(), size, &bytesRead )!=LVERR_OK || bytesRead!=size ) {
+            CRLog::error("Font catalog test: cannot read catalog file");
+            return -1;
+        }
+        data[(int)size / 2] ^= 0x55;
+        stream = LVOpenFileStream( catalogFile.c_str(), LVOM_WRITE );
+        if ( stream.isNull() || stream->Write( data.get(), size, NULL )!=LVERR_OK ) {
+            CRLog::error("Font catalog test: cannot damage catalog file");
+            return -1;
+        }
+    }
+    faces.clear();
+    scanned = registerFontCatalogTestFile( fontFile, catalogFile, faces );
+    if ( scanned!=1 || faces.length()!=coldFaces.length() ) {
+        CRLog::error("Font catalog test: damaged catalog is not ignored (%d files read)", scanned);
+        errors++;
+    }
+    faces.clear();
+    scanned = registerFontCatalogTestFile( fontFile, catalogFile, faces );
+    if ( scanned!=0 ) {
+        CRLog::error("Font catalog test: catalog is not rewritten after damage (%d files read)", scanned);
+        errors++;
+    }
+    LVDeleteFile( catalogFile );
+    int ms = (int)timer.elapsed();
+    CRLog::info("Font catalog test: %d faces, %d ms, %d errors", coldFaces.length(), ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED(dir);
+    return -1;
+#endif
+}
+
+/// measures glyph cache speed: draws synthetic page of glyphCount glyphs (Latin, Cyrillic, Greek and CJK text in several font sizes)
+int runGlyphCacheBenchmark( lString8 fontFace, int glyphCount, int passes )
+{
+#if BUILD_LITE!=1
+    if ( !fontMan ) {
+        CRLog::error("Glyph cache benchmark: font manager is not initialized");
+        return -1;
+    }
+    static const int sizes[] = { 14, 18, 22, 28 };
+    const int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+    LVFontRef fonts[sizeCount];
+    for ( int i = 0; i < sizeCount; i++ )
+        fonts[i] = fontMan->GetFont( sizes[i], 400, false, css_ff_sans_serif, fontFace );
+    const int lineLen = GLYPH_TEST_LINE_LEN;
+    lString16 text = makeGlyphTestText( glyphCount );
+    LVGrayDrawBuf buf( 1200, 1600, 8 );
+    if ( passes < 1 )
+        passes = 1;
+    CRTimerUtil timer;
+    for ( int pass = 0; pass < passes; pass++ ) {
+        buf.Clear( 0xFFFFFF );
+        int y = 0;
+        for ( int start = 0; start < glyphCount; start += lineLen ) {
+            int line = start / lineLen;
+            LVFont * font = fonts[line % sizeCount].get();
+            int len = glyphCount - start < lineLen ? glyphCount - start : lineLen;
+            if ( y + font->getHeight() > buf.GetHeight() )
+                y = 0;
+            font->DrawTextString( &buf, 0, y, text.c_str() + start, len, '?' );
+            y += font->getHeight();
+        }
+    }
+    int us = (int)(timer.elapsed() * 1000 / passes);
+    CRLog::info("Glyph cache benchmark: %d glyphs, %d passes, %d us per page", glyphCount, passes, us);
+    return us;
+#else
+    CR_UNUSED3(fontFace, glyphCount, passes);
+    return -1;
+#endif
+}
+
+#if BUILD_LITE!=1
+#define FONT_TEST_FONT_COUNT 6
+
+/// draws glyph test text measuring each line, returns checksum of widths and pixels
+static lUInt32 drawFontTestPage( LVFont * * fonts, const lString16 & text, LVGrayDrawBuf & buf )
+{
+    lUInt16 widths[GLYPH_TEST_LINE_LEN];
+    lUInt8 flags[GLYPH_TEST_LINE_LEN];
+    lUInt32 hash = 0;
+    buf.Clear( 0xFFFFFF );
+    int y = 0;
+    for ( int start = 0; start < text.length(); start += GLYPH_TEST_LINE_LEN ) {
+        LVFont * font = fonts[ (start / GLYPH_TEST_LINE_LEN) % FONT_TEST_FONT_COUNT ];
+        int len = text.length() - start < GLYPH_TEST_LINE_LEN ? text.length() - start : GLYPH_TEST_LINE_LEN;
+        int n = font->measureText( text.c_str() + start, len, widths, flags, 10000, '?', 0, false );
+        for ( int i = 0; i < n; i++ )
+            hash = hash * 31 + widths[i];
+        if ( y + font->getHeight() > buf.GetHeight() )
+            y = 0;
+        font->DrawTextString( &buf, 0, y, text.c_str() + start, len, '?' );
+        y += font->getHeight();
+    }
+    for ( int y = 0; y < buf.GetHeight(); y++ ) {
+        const lUInt8 * line = buf.GetScanLine( y );
+        for ( int x = 0; x < buf.GetRowSize(); x++ )
+            hash = hash * 31 + line[x];
+    }
+    return hash;
+}
+
+class FontTestThread : public CRRunnable
+{
+    LVFont * * _fonts;
+    const lString16 & _text;
+    int _passes;
+    lUInt32 _expected;
+    LVGrayDrawBuf _buf; // created by starting thread
+public:
+    int errors;
+    FontTestThread( LVFont * * fonts, const lString16 & text, int passes, lUInt32 expected )
+        : _fonts(fonts), _text(text), _passes(passes), _expected(expected), _buf(600, 800, 8), errors(0)
+    { }
+    virtual void run()
+    {
+        for ( int i = 0; i < _passes; i++ ) {
+            if ( drawFontTestPage( _fonts, _text, _buf ) != _expected )
+                errors++;
+        }
+    }
+};
+#endif
+
+/// stress test of font locking: measures and draws the same text by threadCount threads, checks that results don't differ from single thread ones
+int runFontConcurrencyTest( lString8 fontFace, int threadCount, int glyphCount, int passes )
+{
+#if BUILD_LITE!=1
+    if ( !fontMan || !concurrencyProvider ) {
+        CRLog::error("Font concurrency test: font manager or concurrency provider is not initialized");
+        return -1;
+    }
+    // regular and emboldened fonts, each with its own lock and glyph cache; big sizes make glyph cache evict pages in use
+    static const int sizes[FONT_TEST_FONT_COUNT] = { 16, 24, 32, 48, 24, 32 };
+    static const int weights[FONT_TEST_FONT_COUNT] = { 400, 400, 400, 400, 800, 800 };
+    LVFontRef fontRefs[FONT_TEST_FONT_COUNT];
+    LVFont * fonts[FONT_TEST_FONT_COUNT];
+    for ( int i = 0; i < FONT_TEST_FONT_COUNT; i++ ) {
+        fontRefs[i] = fontMan->GetFont( sizes[i], weights[i], false, css_ff_sans_serif, fontFace );
+        fonts[i] = fontRefs[i].get();
+        // text of fonts with kerning is shaped by HarfBuzz (when enabled) in shared buffer of font
+        fonts[i]->setKerning( (i & 1)!=0 );
+    }
+    lString16 text = makeGlyphTestText( glyphCount );
+    lUInt32 expected;
+    {
+        LVGrayDrawBuf buf( 600, 800, 8 );
+        expected = drawFontTestPage( fonts, text, buf );
+    }
+    // start with empty glyph cache to make threads render and evict glyphs concurrently
+    fontMan->clearGlyphCache();
+    LVPtrVector<FontTestThread> tasks;
+    LVPtrVector<CRThread> threads;
+    CRTimerUtil timer;
+    for ( int i = 0; i < threadCount; i++ ) {
+        tasks.add( new FontTestThread( fonts, text, passes, expected ) );
+        threads.add( concurrencyProvider->createThread( tasks[i] ) );
+        threads[i]->start();
+    }
+    int errors = 0;
+    for ( int i = 0; i < threadCount; i++ ) {
+        threads[i]->join();
+        errors += tasks[i]->errors;
+    }
+    int ms = (int)timer.elapsed();
+    for ( int i = 0; i < FONT_TEST_FONT_COUNT; i++ )
+        fonts[i]->setKerning( fontMan->getKerning() );
+    CRLog::info("Font concurrency test: %d threads, %d passes, %d ms, %d errors", threadCount, passes, ms, errors);
+    return errors ? -1 : ms;
+#else
+    CR_UNUSED4(fontFace, threadCount, glyphCount, passes);
+    return -1;
+#endif
 }
@@ -706,6 +706,7 @@ bool ImportEpubDocument( LVStreamRef stream, ldomDocument * m_doc, LVDocViewCall
 
     LVEmbeddedFontList fontList;
     EmbeddedFontStyleParser styleParser(fontList);
+    lString16Collection cssFiles; // scanned for embedded fonts only if document is not in cache
 
     // reading content stream
     {
@@ -790,17 +791,8 @@ bool ImportEpubDocument( LVStreamRef stream, ldomDocument * m_doc, LVDocViewCall
 //                    fontList.add(codeBase + href);
 //                }
             }
-            if (mediaType == "text/css") {
-                lString16 name = LVCombinePaths(codeBase, href);
-                LVStreamRef cssStream = m_arc->OpenStream(name.c_str(), LVOM_READ);
-                if (!cssStream.isNull()) {
-                    lString8 cssFile = UnicodeToUtf8(LVReadTextFile(cssStream));
-                    lString16 base = name;
-                    LVExtractLastPathElement(base);
-                    //CRLog::trace("style: %s", cssFile.c_str());
-                    styleParser.parse(base, cssFile);
-                }
-            }
+            if (mediaType == "text/css")
+                cssFiles.add(LVCombinePaths(codeBase, href));
         }
 
         // spine == itemrefs
@@ -845,6 +837,18 @@ bool ImportEpubDocument( LVStreamRef stream, ldomDocument * m_doc, LVDocViewCall
     m_doc->setDocFlags( saveFlags );
     m_doc->setContainer( m_arc );
 
+    // embedded font list is restored from cache file, parse CSS for it only when document is not cached
+    for ( int i=0; i<cssFiles.length(); i++ ) {
+        LVStreamRef cssStream = m_arc->OpenStream(cssFiles[i].c_str(), LVOM_READ);
+        if (!cssStream.isNull()) {
+            lString8 cssFile = UnicodeToUtf8(LVReadTextFile(cssStream));
+            lString16 base = cssFiles[i];
+            LVExtractLastPathElement(base);
+            //CRLog::trace("style: %s", cssFile.c_str());
+            styleParser.parse(base, cssFile);
+        }
+    }
+
     ldomDocumentWriter writer(m_doc);
 #if 0
     m_doc->setNodeTypes( fb2_elem_table );
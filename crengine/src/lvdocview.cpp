@@ -573,8 +573,35 @@ void LVDocView::requestRender() {
 	m_doc->clearRendBlockCache();
 }
 
+/// reloads document from source, when some of blocks of its cache file are found to be corrupted while reading
+void LVDocView::reloadCorruptedDocument() {
+	CRLog::error("LVDocView::reloadCorruptedDocument() : cache file is corrupted, reloading document from source");
+	lString16 pos;
+	if (!_posBookmark.isNull())
+		pos = _posBookmark.toString();
+	lString16 fn = m_filename;
+	bool res = false;
+	if (!fn.empty()) {
+		res = LoadDocument(fn.c_str());
+	} else if (!m_stream.isNull()) {
+		// cache file is removed when document is deleted before parsing
+		LVStreamRef stream = m_stream;
+		stream->SetPos(0);
+		res = LoadDocument(stream);
+	}
+	if (!res) {
+		createDefaultDocument(lString16::empty_str, lString16(
+				"Error while opening document ") + fn);
+		return;
+	}
+	if (!pos.empty())
+		_posBookmark = m_doc->createXPointer(pos);
+}
+
 /// render document, if not rendered
 void LVDocView::checkRender() {
+	if (m_doc && m_doc->isCacheFileInvalid())
+		reloadCorruptedDocument();
 	if (!m_is_rendered) {
 		LVLock lock(getMutex());
 		CRLog::trace("LVDocView::checkRender() : render is required");
@@ -2242,12 +2269,19 @@ void LVDocView::Draw(LVDrawBuf & drawbuf, int position, int page, bool rotate, b
         //drawPageBackground(drawbuf, (page * 1356) & 0xFFF, 0x1000 - (page * 1356) & 0xFFF);
         drawPageBackground(drawbuf, 0, 0);
 
-        if (page >= 0 && page < m_pages.length())
+        // storage chunks used by page are remembered for prefetching
+        if (page >= 0 && page < m_pages.length()) {
+			m_doc->startChunkAccessRecording(page);
 			drawPageTo(&drawbuf, *m_pages[page], &m_pageRects[0],
 					m_pages.length(), 1);
-		if (pc == 2 && page >= 0 && page + 1 < m_pages.length())
+			m_doc->stopChunkAccessRecording();
+		}
+		if (pc == 2 && page >= 0 && page + 1 < m_pages.length()) {
+			m_doc->startChunkAccessRecording(page + 1);
 			drawPageTo(&drawbuf, *m_pages[page + 1], &m_pageRects[1],
 					m_pages.length(), 1);
+			m_doc->stopChunkAccessRecording();
+		}
 	}
 #if CR_INTERNAL_PAGE_ORIENTATION==1
 	if ( rotate ) {
@@ -2846,7 +2880,7 @@ bool LVDocView::goLink(lString16 link, bool savePos) {
 			m_doc_props->setString(DOC_PROP_CODE_BASE, LVExtractPath(filename));
 			m_doc_props->setString(DOC_PROP_FILE_SIZE, lString16::itoa(
 					(int) stream->GetSize()));
-            m_doc_props->setHex(DOC_PROP_FILE_CRC32, stream->getcrc32());
+            m_doc_props->setHex(DOC_PROP_FILE_CRC32, ldomDocCache::getStreamCRC32(stream));
 			// TODO: load document from stream properly
 			if (!LoadDocument(stream)) {
                 createDefaultDocument(cs16("Load error"), lString16(
@@ -2870,7 +2904,7 @@ bool LVDocView::goLink(lString16 link, bool savePos) {
 		return false; // only internal links supported (started with #)
 	}
 	link = link.substr(1, link.length() - 1);
-	lUInt16 id = m_doc->getAttrValueIndex(link.c_str());
+	lUInt32 id = m_doc->getAttrValueIndex(link.c_str());
 	ldomNode * dest = m_doc->getNodeById(id);
 	if (!dest)
 		return false;
@@ -3558,7 +3592,7 @@ bool LVDocView::LoadDocument(const lChar16 * fname) {
 		m_doc_props->setString(DOC_PROP_FILE_SIZE, lString16::itoa(
 				(int) stream->GetSize()));
 		m_doc_props->setString(DOC_PROP_FILE_NAME, arcItemPathName);
-        m_doc_props->setHex(DOC_PROP_FILE_CRC32, stream->getcrc32());
+        m_doc_props->setHex(DOC_PROP_FILE_CRC32, ldomDocCache::getStreamCRC32(stream));
 		// loading document
 		if (LoadDocument(stream)) {
 			m_filename = lString16(fname);
@@ -3604,7 +3638,7 @@ bool LVDocView::LoadDocument(const lChar16 * fname) {
     m_doc_props->setString(DOC_PROP_FILE_NAME, fn);
 	m_doc_props->setString(DOC_PROP_FILE_SIZE, lString16::itoa(
 			(int) stream->GetSize()));
-    m_doc_props->setHex(DOC_PROP_FILE_CRC32, stream->getcrc32());
+    m_doc_props->setHex(DOC_PROP_FILE_CRC32, ldomDocCache::getStreamCRC32(stream));
 
 	if (LoadDocument(stream)) {
 		m_filename = lString16(fname);
@@ -4001,7 +4035,7 @@ bool LVDocView::LoadDocument(LVStreamRef stream) {
 					m_doc_props->setString(DOC_PROP_FILE_NAME, fn);
 					m_doc_props->setString(DOC_PROP_CODE_BASE, LVExtractPath(fn) );
 					m_doc_props->setString(DOC_PROP_FILE_SIZE, lString16::itoa((int)m_stream->GetSize()));
-                    m_doc_props->setHex(DOC_PROP_FILE_CRC32, m_stream->getcrc32());
+                    m_doc_props->setHex(DOC_PROP_FILE_CRC32, ldomDocCache::getStreamCRC32(m_stream));
 					found = true;
 				}
 			}
@@ -4188,8 +4222,7 @@ bool LVDocView::ParseDocument() {
 		lString16 fn =
 				m_doc_props->getStringDef(DOC_PROP_FILE_NAME, "untitled");
 		fn = LVExtractFilename(fn);
-		lUInt32 crc = 0;
-        m_stream->getcrc32(crc);
+		lUInt32 crc = m_doc_props->getIntDef(DOC_PROP_FILE_CRC32, 0);
 		CRLog::debug("Check whether document %s crc %08x exists in cache",
 				UnicodeToUtf8(fn).c_str(), crc);
 
@@ -4217,6 +4250,10 @@ bool LVDocView::ParseDocument() {
 			return true;
 		}
 		CRLog::info("Cannot get document from cache, parsing...");
+		if (m_doc->isCacheFileInvalid()) {
+			// document with partially loaded content is dropped together with its corrupted cache file
+			createEmptyDocument();
+		}
 	}
 
 	{
@@ -4795,9 +4832,18 @@ bool LVDocView::moveByPage(int delta) {
 		return GetPos() != p;
 	} else {
 		int cp = getCurPage();
-		int p = cp + delta * getVisiblePageCount();
+		int pc = getVisiblePageCount();
+		int p = cp + delta * pc;
 		goToPage(p);
-		return getCurPage() != cp;
+		if (getCurPage() == cp)
+			return false;
+		if (m_doc) {
+			// restore data of pages to be shown and next ones in the same direction in background
+			int dir = delta > 0 ? 1 : -1;
+			for (int i = 0; i < pc * 2; i++)
+				m_doc->prefetchPageChunks(getCurPage() + (dir > 0 ? i : pc - 1 - i), dir);
+		}
+		return true;
 	}
 }
 
@@ -1005,14 +1005,14 @@ LVGrayDrawBuf::~LVGrayDrawBuf()
     }
 }
 
-void LVGrayDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * )
+void LVGrayDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 *, int bitmapPitch )
 {
     //int buf_width = _dx; /* 2bpp */
     int initial_height = height;
     int bx = 0;
     int by = 0;
     int xx;
-    int bmp_width = width;
+    int bmp_width = bitmapPitch ? bitmapPitch : width;
     lUInt8 * dst;
     lUInt8 * dstline;
     const lUInt8 * src;
@@ -1570,14 +1570,14 @@ void LVColorDrawBuf::InvertRect(int x0, int y0, int x1, int y1)
 }
 
 /// draws bitmap (1 byte per pixel) using specified palette
-void LVColorDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette )
+void LVColorDrawBuf::Draw( int x, int y, const lUInt8 * bitmap, int width, int height, lUInt32 * palette, int bitmapPitch )
 {
     //int buf_width = _dx; /* 2bpp */
     int initial_height = height;
     int bx = 0;
     int by = 0;
     int xx;
-    int bmp_width = width;
+    int bmp_width = bitmapPitch ? bitmapPitch : width;
     lUInt32 bmpcl = palette?palette[0]:GetTextColor();
     const lUInt8 * src;
 
@@ -23,6 +23,8 @@
 #include "../include/lvdrawbuf.h"
 #include "../include/lvstyles.h"
 #include "../include/lvthread.h"
+#include "../include/crconcurrent.h"
+#include "../include/lvhashtable.h"
 
 // define to filter out all fonts except .ttf
 //#define LOAD_TTF_FONTS_ONLY
@@ -65,7 +67,6 @@
 #if USE_HARFBUZZ==1
 #include <hb.h>
 #include <hb-ft.h>
-#include "lvhashtable.h"
 #endif
 
 #if (USE_FONTCONFIG==1)
@@ -88,6 +89,23 @@ LVFontManager * fontMan = NULL;
 
 static double gammaLevel = 1.0;
 static int gammaIndex = GAMMA_LEVELS/2;
+/// font catalog file name, empty if catalog should not be persisted
+static lString16 fontCatalogFileName;
+
+/// sets file to store font catalog in, call before InitFontManager
+void SetFontCatalogFile( lString16 fileName )
+{
+    fontCatalogFileName = fileName;
+}
+
+/// directory for font metrics cache files, empty if metrics should not be persisted
+static lString16 fontMetricsCacheDir;
+
+/// sets directory to store font metrics cache files in, call before InitFontManager
+void SetFontMetricsCacheDir( lString16 dir )
+{
+    fontMetricsCacheDir = dir;
+}
 
 /// returns first found face from passed list, or return face for font found by family only
 lString8 LVFontManager::findFontFace(lString8 commaSeparatedFaceList, css_font_family_t fallbackByFamily) {
@@ -269,7 +287,6 @@ bool LVEmbeddedFontList::deserialize(SerialBuf & buf) {
  */
 int LVFont::getVisualAligmentWidth()
 {
-    FONT_GUARD
     if ( _visual_alignment_width==-1 ) {
         //lChar16 chars[] = { getHyphChar(), ',', '.', '!', ':', ';', 0 };
         lChar16 chars[] = { getHyphChar(), ',', '.', '!', ':', ';',
@@ -510,6 +527,7 @@ public:
 #if (USE_FREETYPE==1)
 
 
+/// glyph widths of single font instance, accessed under its FONT_FACE_GUARD only
 class LVFontGlyphWidthCache
 {
 private:
@@ -517,7 +535,6 @@ private:
 public:
     lUInt8 get( lChar16 ch )
     {
-        FONT_GLYPH_CACHE_GUARD
         int inx = (ch>>9) & 0x7f;
         lUInt8 * ptr = ptrs[inx];
         if ( !ptr )
@@ -526,7 +543,6 @@ public:
     }
     void put( lChar16 ch, lUInt8 w )
     {
-        FONT_GLYPH_CACHE_GUARD
         int inx = (ch>>9) & 0x7f;
         lUInt8 * ptr = ptrs[inx];
         if ( !ptr ) {
@@ -538,7 +554,6 @@ public:
     }
     void clear()
     {
-        FONT_GLYPH_CACHE_GUARD
         for ( int i=0; i<128; i++ ) {
             if ( ptrs[i] )
                 delete [] ptrs[i];
@@ -555,21 +570,300 @@ public:
     }
 };
 
+/// character metrics of font face: glyph index and advance
+struct LVFontCharMetrics
+{
+    lUInt16 glyph;   ///< glyph index, 0 if face has no glyph for character
+    lUInt16 advance; ///< advance in pixels, FONT_METRICS_UNKNOWN if not measured yet
+};
+
+#define FONT_METRICS_UNKNOWN 0xFFFF
+#define FONT_METRICS_PAGE_SHIFT 9
+#define FONT_METRICS_PAGE_SIZE (1<<FONT_METRICS_PAGE_SHIFT)
+#define FONT_METRICS_PAGE_COUNT (0x10000>>FONT_METRICS_PAGE_SHIFT)
+#define FONT_METRICS_FILE_MAGIC "CRFMC001"
+#define FONT_METRICS_BYTE_ORDER 0x01020304
+
+/// header of font metrics cache file, followed by present pages of LVFontCharMetrics
+struct LVFontMetricsFileHeader
+{
+    char magic[8];
+    lUInt32 byteOrder; // files are used as is, so they cannot be shared between platforms with different byte order
+    lUInt32 faceHash;
+    lUInt16 size;
+    lUInt8 hintingMode;
+    lUInt8 flags;
+    lUInt32 pageMask[FONT_METRICS_PAGE_COUNT/32];
+    lUInt32 crc; // CRC32 of pages
+};
+
+/// checks size and CRC of font metrics cache file data, returns number of pages in it or -1 if file is broken
+static int checkFontMetricsFile( const lUInt8 * data, lvsize_t size )
+{
+    if ( size < sizeof(LVFontMetricsFileHeader) )
+        return -1;
+    const LVFontMetricsFileHeader * hdr = (const LVFontMetricsFileHeader *)data;
+    if ( memcmp( hdr->magic, FONT_METRICS_FILE_MAGIC, sizeof(hdr->magic) ) || hdr->byteOrder!=FONT_METRICS_BYTE_ORDER )
+        return -1;
+    int pageCount = 0;
+    for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ )
+        if ( hdr->pageMask[i/32] & (1 << (i & 31)) )
+            pageCount++;
+    lvsize_t pagesSize = (lvsize_t)pageCount * FONT_METRICS_PAGE_SIZE * sizeof(LVFontCharMetrics);
+    if ( size != sizeof(LVFontMetricsFileHeader) + pagesSize )
+        return -1;
+    if ( lStr_crc32( 0, data + sizeof(LVFontMetricsFileHeader), (int)pagesSize )!=hdr->crc )
+        return -1;
+    return pageCount;
+}
+
+#define FONT_METRICS_FLAG_KERNING 1
+#define FONT_METRICS_FLAG_MONOCHROME 2
+#define FONT_METRICS_FLAG_ITALICIZE 4
+
+/// glyph indexes and advances of characters for font face of particular size and rendering options;
+/// pages of cache file are used directly from memory mapping, and copied only when changed
+class LVFontMetricsCache
+{
+    lString8 _key;
+    LVFontMetricsFileHeader _header;
+    LVFontCharMetrics * _pages[FONT_METRICS_PAGE_COUNT];
+    const LVFontCharMetrics * _mappedPages[FONT_METRICS_PAGE_COUNT];
+    LVStreamRef _stream;
+    LVStreamBufferRef _mapped;
+    bool _dirty;
+    bool _inUse;
+public:
+    LVFontMetricsCache( const lString8 & key, lUInt32 faceHash, int size, int hintingMode, int flags )
+    : _key(key), _dirty(false), _inUse(false)
+    {
+        memset( &_header, 0, sizeof(_header) );
+        memcpy( _header.magic, FONT_METRICS_FILE_MAGIC, sizeof(_header.magic) );
+        _header.byteOrder = FONT_METRICS_BYTE_ORDER;
+        _header.faceHash = faceHash;
+        _header.size = (lUInt16)size;
+        _header.hintingMode = (lUInt8)hintingMode;
+        _header.flags = (lUInt8)flags;
+        memset( _pages, 0, sizeof(_pages) );
+        memset( _mappedPages, 0, sizeof(_mappedPages) );
+    }
+    ~LVFontMetricsCache()
+    {
+        for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ )
+            if ( _pages[i] )
+                delete [] _pages[i];
+    }
+    const lString8 & getKey() const { return _key; }
+    bool isDirty() const { return _dirty; }
+    bool isInUse() const { return _inUse; }
+    void setInUse( bool inUse ) { _inUse = inUse; }
+
+    /// returns metrics of character, NULL if it's not measured yet
+    inline const LVFontCharMetrics * get( lChar16 ch ) const
+    {
+        if ( (lUInt32)ch > 0xFFFF )
+            return NULL;
+        int inx = ch >> FONT_METRICS_PAGE_SHIFT;
+        const LVFontCharMetrics * page = _pages[inx] ? _pages[inx] : _mappedPages[inx];
+        if ( !page )
+            return NULL;
+        const LVFontCharMetrics * m = page + (ch & (FONT_METRICS_PAGE_SIZE-1));
+        return m->advance==FONT_METRICS_UNKNOWN ? NULL : m;
+    }
+
+    /// stores metrics of character
+    void put( lChar16 ch, lUInt16 glyph, lUInt16 advance )
+    {
+        if ( (lUInt32)ch > 0xFFFF || advance==FONT_METRICS_UNKNOWN )
+            return;
+        int inx = ch >> FONT_METRICS_PAGE_SHIFT;
+        if ( !_pages[inx] ) {
+            _pages[inx] = new LVFontCharMetrics[FONT_METRICS_PAGE_SIZE];
+            if ( _mappedPages[inx] )
+                memcpy( _pages[inx], _mappedPages[inx], sizeof(LVFontCharMetrics) * FONT_METRICS_PAGE_SIZE );
+            else
+                memset( _pages[inx], 0xFF, sizeof(LVFontCharMetrics) * FONT_METRICS_PAGE_SIZE );
+        }
+        LVFontCharMetrics * m = _pages[inx] + (ch & (FONT_METRICS_PAGE_SIZE-1));
+        m->glyph = glyph;
+        m->advance = advance;
+        _dirty = true;
+    }
+
+    /// maps cache file, returns false if it's not found or doesn't match font
+    bool load( const lString16 & fileName )
+    {
+        lUInt64 fileSize = 0;
+        lUInt64 fileTime = 0;
+        if ( !LVGetFileInfo( fileName, fileSize, fileTime ) )
+            return false; // not measured before
+        LVStreamRef stream = LVMapFileStream( fileName.c_str(), LVOM_READ, 0 );
+        if ( stream.isNull() )
+            return false;
+        lvsize_t size = stream->GetSize();
+        if ( size < sizeof(LVFontMetricsFileHeader) )
+            return false;
+        LVStreamBufferRef buf = stream->GetReadBuffer( 0, size );
+        if ( buf.isNull() || !buf->getReadOnly() )
+            return false;
+        const LVFontMetricsFileHeader * hdr = (const LVFontMetricsFileHeader *)buf->getReadOnly();
+        if ( memcmp( hdr, &_header, (const lUInt8 *)&_header.pageMask - (const lUInt8 *)&_header ) )
+            return false; // different font or options
+        if ( checkFontMetricsFile( buf->getReadOnly(), size ) < 0 ) {
+            CRLog::error("Font metrics cache file %s is corrupted", LCSTR(fileName));
+            return false;
+        }
+        const lUInt8 * pages = buf->getReadOnly() + sizeof(LVFontMetricsFileHeader);
+        for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ ) {
+            if ( hdr->pageMask[i/32] & (1 << (i & 31)) ) {
+                _mappedPages[i] = (const LVFontCharMetrics *)pages;
+                pages += FONT_METRICS_PAGE_SIZE * sizeof(LVFontCharMetrics);
+            }
+        }
+        _stream = stream;
+        _mapped = buf;
+        return true;
+    }
+
+    /// writes all pages to cache file, should not be called while cache is in use
+    bool save( const lString16 & fileName )
+    {
+        _dirty = false;
+        LVFontMetricsFileHeader hdr = _header;
+        int pageCount = 0;
+        for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ ) {
+            if ( _pages[i] || _mappedPages[i] ) {
+                hdr.pageMask[i/32] |= 1 << (i & 31);
+                pageCount++;
+            }
+        }
+        int pageBytes = FONT_METRICS_PAGE_SIZE * sizeof(LVFontCharMetrics);
+        LVArray<lUInt8> buf( sizeof(hdr) + pageCount * pageBytes, 0 );
+        lUInt8 * p = buf.get() + sizeof(hdr);
+        for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ ) {
+            const LVFontCharMetrics * page = _pages[i] ? _pages[i] : _mappedPages[i];
+            if ( page ) {
+                memcpy( p, page, pageBytes );
+                p += pageBytes;
+            }
+        }
+        hdr.crc = lStr_crc32( 0, buf.get() + sizeof(hdr), pageCount * pageBytes );
+        memcpy( buf.get(), &hdr, sizeof(hdr) );
+        // file may be mapped by another process: write new file and replace old one
+        lString16 tmpName = fileName + ".tmp";
+        {
+            LVStreamRef stream = LVOpenFileStream( tmpName.c_str(), LVOM_WRITE );
+            if ( stream.isNull() || stream->Write( buf.get(), buf.length(), NULL )!=LVERR_OK ) {
+                CRLog::error("Cannot write font metrics cache file %s", LCSTR(tmpName));
+                return false;
+            }
+        }
+        // drop own mapping of old file
+        for ( int i=0; i<FONT_METRICS_PAGE_COUNT; i++ ) {
+            if ( _mappedPages[i] && !_pages[i] ) {
+                _pages[i] = new LVFontCharMetrics[FONT_METRICS_PAGE_SIZE];
+                memcpy( _pages[i], _mappedPages[i], sizeof(LVFontCharMetrics) * FONT_METRICS_PAGE_SIZE );
+            }
+            _mappedPages[i] = NULL;
+        }
+        _mapped.Clear();
+        _stream.Clear();
+        if ( !LVRenameFile( tmpName, fileName ) ) {
+            LVDeleteFile( fileName );
+            if ( !LVRenameFile( tmpName, fileName ) ) {
+                CRLog::error("Cannot replace font metrics cache file %s", LCSTR(fileName));
+                LVDeleteFile( tmpName );
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/// metrics caches of all font instances created by font manager: they live longer than font instances,
+/// and are persisted to directory set by SetFontMetricsCacheDir()
+class LVFontMetricsCacheList
+{
+    LVPtrVector<LVFontMetricsCache> _list;
+    LVHashTable<lString8, LVFontMetricsCache *> _map;
+    lString16 _dir;
+
+    lString16 getFileName( LVFontMetricsCache * cache )
+    {
+        return _dir + Utf8ToUnicode( cache->getKey() ) + ".fmc";
+    }
+public:
+    LVFontMetricsCacheList() : _map(256) { }
+
+    void setDir( const lString16 & dir )
+    {
+        _dir = dir;
+        if ( !_dir.empty() )
+            LVAppendPathDelimiter( _dir );
+    }
+
+    /// returns cache for exclusive use by font instance, NULL if cache with the same key is used by another instance
+    LVFontMetricsCache * checkout( lUInt32 faceHash, int size, int hintingMode, int flags )
+    {
+        FONT_METRICS_CACHE_GUARD
+        char key[64];
+        sprintf( key, "%08x-%d-%d-%d", faceHash, size, hintingMode, flags );
+        LVFontMetricsCache * cache = _map.get( lString8(key) );
+        if ( !cache ) {
+            cache = new LVFontMetricsCache( lString8(key), faceHash, size, hintingMode, flags );
+            if ( !_dir.empty() )
+                cache->load( getFileName( cache ) );
+            _list.add( cache );
+            _map.set( cache->getKey(), cache );
+        } else if ( cache->isInUse() ) {
+            return NULL;
+        }
+        cache->setInUse( true );
+        return cache;
+    }
+
+    /// returns cache taken by checkout()
+    void checkin( LVFontMetricsCache * cache )
+    {
+        FONT_METRICS_CACHE_GUARD
+        cache->setInUse( false );
+    }
+
+    /// writes changed caches which are not in use to disk
+    void save()
+    {
+        FONT_METRICS_CACHE_GUARD
+        if ( _dir.empty() )
+            return;
+        for ( int i=0; i<_list.length(); i++ ) {
+            LVFontMetricsCache * cache = _list[i];
+            if ( cache->isDirty() && !cache->isInUse() )
+                cache->save( getFileName( cache ) );
+        }
+    }
+
+    void clear()
+    {
+        FONT_METRICS_CACHE_GUARD
+        _map.clear();
+        _list.clear();
+    }
+};
+
 class LVFreeTypeFace;
 static LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lChar16 ch, FT_GlyphSlot slot ) // , bool drawMonochrome
 {
-    FONT_LOCAL_GLYPH_CACHE_GUARD
     FT_Bitmap*  bitmap = &slot->bitmap;
     int w = bitmap->width;
     int h = bitmap->rows;
-    LVFontGlyphCacheItem * item = LVFontGlyphCacheItem::newItem(local_cache, ch, w, h );
+    LVFontGlyphCacheItem * item = local_cache->newItem( ch, w, h );
     if ( bitmap->pixel_mode==FT_PIXEL_MODE_MONO ) { //drawMonochrome
         lUInt8 mask = 0x80;
         const lUInt8 * ptr = (const lUInt8 *)bitmap->buffer;
-        lUInt8 * dst = item->bmp;
         //int rowsize = ((w + 15) / 16) * 2;
         for ( int y=0; y<h; y++ ) {
             const lUInt8 * row = ptr;
+            lUInt8 * dst = item->bmp + y * item->bmp_pitch;
             mask = 0x80;
             for ( int x=0; x<w; x++ ) {
                 *dst++ = (*row & mask) ? 0xFF : 00;
@@ -582,28 +876,13 @@ static LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lCha
             ptr += bitmap->pitch;//rowsize;
         }
     } else {
-#if 0
-        if ( bitmap->pixel_mode==FT_PIXEL_MODE_MONO ) {
-            memset( item->bmp, 0, w*h );
-            lUInt8 * srcrow = bitmap->buffer;
-            lUInt8 * dstrow = item->bmp;
-            for ( int y=0; y<h; y++ ) {
-                lUInt8 * src = srcrow;
-                for ( int x=0; x<w; x++ ) {
-                    dstrow[x] =  ( (*src)&(0x80>>(x&7)) ) ? 255 : 0;
-                    if ((x&7)==7)
-                        src++;
-                }
-                srcrow += bitmap->pitch;
-                dstrow += w;
-            }
-        } else {
-#endif
-            memcpy( item->bmp, bitmap->buffer, w*h );
+        for ( int y=0; y<h; y++ ) {
+            lUInt8 * dst = item->bmp + y * item->bmp_pitch;
+            memcpy( dst, bitmap->buffer + y * bitmap->pitch, w );
             // correct gamma
             if ( gammaIndex!=GAMMA_LEVELS/2 )
-                cr_correct_gamma_buf(item->bmp, w*h, gammaIndex);
-//            }
+                cr_correct_gamma_buf(dst, w, gammaIndex);
+        }
     }
     item->origin_x =   (lInt16)slot->bitmap_left;
     item->origin_y =   (lInt16)slot->bitmap_top;
@@ -611,172 +890,356 @@ static LVFontGlyphCacheItem * newItem( LVFontLocalGlyphCache * local_cache, lCha
     return item;
 }
 
-#if USE_HARFBUZZ==1
-static LVFontGlyphIndexCacheItem * newItem(lUInt32 index, FT_GlyphSlot slot )
+void LVFontLocalGlyphCache::clear()
 {
-	FONT_LOCAL_GLYPH_CACHE_GUARD
-	FT_Bitmap*  bitmap = &slot->bitmap;
-	int w = bitmap->width;
-	int h = bitmap->rows;
-	LVFontGlyphIndexCacheItem* item = LVFontGlyphIndexCacheItem::newItem(index, w, h );
-	if (!item)
-		return 0;
-	if ( bitmap->pixel_mode==FT_PIXEL_MODE_MONO ) { //drawMonochrome
-		lUInt8 mask = 0x80;
-		const lUInt8 * ptr = (const lUInt8 *)bitmap->buffer;
-		lUInt8 * dst = item->bmp;
-		//int rowsize = ((w + 15) / 16) * 2;
-		for ( int y=0; y<h; y++ ) {
-			const lUInt8 * row = ptr;
-			mask = 0x80;
-			for ( int x=0; x<w; x++ ) {
-				*dst++ = (*row & mask) ? 0xFF : 00;
-				mask >>= 1;
-				if ( !mask && x!=w-1) {
-					mask = 0x80;
-					row++;
-				}
-			}
-			ptr += bitmap->pitch;//rowsize;
-		}
-	} else {
-			memcpy( item->bmp, bitmap->buffer, w*h );
-			// correct gamma
-			if ( gammaIndex!=GAMMA_LEVELS/2 )
-				cr_correct_gamma_buf(item->bmp, w*h, gammaIndex);
-//            }
-	}
-	item->origin_x =   (lInt16)slot->bitmap_left;
-	item->origin_y =   (lInt16)slot->bitmap_top;
-	item->advance =    (lUInt16)(myabs(slot->metrics.horiAdvance) >> 6);
-	return item;
+    // other threads only remove items of this cache, so global cache is not accessed when it's empty:
+    // font cleared by font manager destructor may outlive global cache
+    if ( ls_atomic_add( &count, 0 ) )
+        global_cache->clear( this );
 }
-#endif
 
-void LVFontLocalGlyphCache::clear()
+LVFontGlyphCacheItem * LVFontLocalGlyphCache::get( lUInt16 ch )
+{
+    return global_cache->get( this, ch );
+}
+
+LVFontGlyphCacheItem * LVFontLocalGlyphCache::newItem( lChar16 ch, int w, int h )
 {
-    FONT_LOCAL_GLYPH_CACHE_GUARD
-    while ( head ) {
-        LVFontGlyphCacheItem * ptr = head;
-        remove( ptr );
-        global_cache->remove( ptr );
-        LVFontGlyphCacheItem::freeItem( ptr );
+    return global_cache->newItem( this, ch, w, h );
+}
+
+LVFontGlyphCacheItem * LVFontLocalGlyphCache::put( LVFontGlyphCacheItem * item )
+{
+    return global_cache->put( item );
+}
+
+/// max number of glyph rows in atlas page
+#define GLYPH_ATLAS_MAX_SHELVES 32
+/// min number of atlas pages fitting into glyph cache size
+#define GLYPH_ATLAS_MIN_PAGES 8
+
+/// 8 bit atlas page: glyph bitmaps are placed left to right on shelves (rows of glyphs of similar height)
+struct LVFontGlyphAtlasPage
+{
+    int dx;
+    int dy;
+    int bytes; // size of allocated block
+    int capacity; // max number of items
+    int item_count;
+    int live_count; // items not dropped yet
+    int pins; // items returned by get() or newItem() and not released yet, page is not freed while pinned; changed by ls_atomic_add()
+    int shelf_count;
+    bool referenced; // CLOCK reference bit, set on each hit of page glyphs
+    LVFontGlobalGlyphCache * cache;
+    struct {
+        lUInt16 y;
+        lUInt16 height;
+        lUInt16 x; // free space start
+    } shelves[GLYPH_ATLAS_MAX_SHELVES];
+    LVFontGlyphCacheItem * items; // items and pixels follow page header in the same block
+    lUInt8 * pixels;
+};
+
+static int glyphAtlasPageCapacity( int dx, int dy )
+{
+    int capacity = dx * dy / 128;
+    return capacity < 8 ? 8 : capacity;
+}
+
+static int glyphAtlasPageBytes( int dx, int dy, int capacity )
+{
+    return sizeof(LVFontGlyphAtlasPage) + capacity * sizeof(LVFontGlyphCacheItem) + dx * dy;
+}
+
+/// places w x h bitmap on page, returns NULL if there is no room for it
+static LVFontGlyphCacheItem * allocGlyphAtlasItem( LVFontGlyphAtlasPage * page, int w, int h )
+{
+    if ( page->item_count >= page->capacity )
+        return NULL;
+    int x = 0;
+    int y = 0;
+    if ( w && h ) {
+        int i = 0;
+        for ( ; i < page->shelf_count; i++ ) {
+            // don't waste much higher shelf for small glyph
+            if ( page->shelves[i].height >= h && page->shelves[i].height <= h + h / 4 + 1
+                    && page->shelves[i].x + w <= page->dx )
+                break;
+        }
+        if ( i == page->shelf_count ) {
+            int top = i ? page->shelves[i-1].y + page->shelves[i-1].height : 0;
+            if ( i >= GLYPH_ATLAS_MAX_SHELVES || top + h > page->dy || w > page->dx )
+                return NULL;
+            page->shelves[i].y = (lUInt16)top;
+            page->shelves[i].height = (lUInt16)h;
+            page->shelves[i].x = 0;
+            page->shelf_count++;
+        }
+        x = page->shelves[i].x;
+        y = page->shelves[i].y;
+        page->shelves[i].x += w;
+    }
+    LVFontGlyphCacheItem * item = &page->items[page->item_count++];
+    item->page = page;
+    item->bmp = page->pixels + y * page->dx + x;
+    item->bmp_pitch = (lUInt16)page->dx;
+    page->live_count++;
+    return item;
+}
+
+LVFontGlobalGlyphCache::LVFontGlobalGlyphCache( int maxSize )
+    : table(NULL), table_size(0), count(0), pages(NULL), page_count(0), current(NULL), hand(0), page_dim(256), size(0), max_size(maxSize)
+{
+    while ( page_dim > 16 && glyphAtlasPageBytes( page_dim, page_dim, glyphAtlasPageCapacity( page_dim, page_dim ) ) * GLYPH_ATLAS_MIN_PAGES > max_size )
+        page_dim /= 2;
+}
+
+LVFontGlobalGlyphCache::~LVFontGlobalGlyphCache()
+{
+    clear();
+    free( table );
+    free( pages );
+}
+
+static inline lUInt32 glyphCacheHash( LVFontLocalGlyphCache * local_cache, lUInt16 ch )
+{
+    lUInt32 h = (lUInt32)((size_t)local_cache >> 3) * 0x9E3779B1U + ch * 0x85EBCA6BU;
+    return h ^ (h >> 15);
+}
+
+/// returns slot of item with specified key, or empty slot where it should be placed
+int LVFontGlobalGlyphCache::findSlot( LVFontLocalGlyphCache * local_cache, lUInt16 ch )
+{
+    int mask = table_size - 1;
+    for ( int i = glyphCacheHash( local_cache, ch ) & mask; ; i = (i + 1) & mask ) {
+        LVFontGlyphCacheItem * item = table[i];
+        if ( !item || (item->ch == ch && item->local_cache == local_cache) )
+            return i;
     }
 }
 
-LVFontGlyphCacheItem * LVFontLocalGlyphCache::get( lUInt16 ch )
+/// removes item from slot (item stays in its page), moves following items of the same probe chain back
+void LVFontGlobalGlyphCache::removeSlot( int index )
+{
+    ls_atomic_add( &table[index]->local_cache->count, -1 );
+    count--;
+    int mask = table_size - 1;
+    for ( int i = (index + 1) & mask; table[i]; i = (i + 1) & mask ) {
+        int home = glyphCacheHash( table[i]->local_cache, table[i]->ch ) & mask;
+        // item stays if its home slot is cyclically in (index, i]
+        if ( index <= i ? (home > index && home <= i) : (home > index || home <= i) )
+            continue;
+        table[index] = table[i];
+        index = i;
+    }
+    table[index] = NULL;
+}
+
+void LVFontGlobalGlyphCache::resize( int newSize )
+{
+    LVFontGlyphCacheItem * * oldTable = table;
+    int oldSize = table_size;
+    table = (LVFontGlyphCacheItem * *)calloc( newSize, sizeof(LVFontGlyphCacheItem *) );
+    table_size = newSize;
+    for ( int i = 0; i < oldSize; i++ )
+        if ( oldTable[i] )
+            table[ findSlot( oldTable[i]->local_cache, oldTable[i]->ch ) ] = oldTable[i];
+    free( oldTable );
+}
+
+/// allocates new atlas page, evicting pages not used since last pass of CLOCK hand
+LVFontGlyphAtlasPage * LVFontGlobalGlyphCache::newPage( int dx, int dy, int capacity )
 {
-    FONT_LOCAL_GLYPH_CACHE_GUARD
-    LVFontGlyphCacheItem * ptr = head;
-    for ( ; ptr; ptr = ptr->next_local ) {
-        if ( ptr->ch == ch ) {
-            global_cache->refresh( ptr );
-            return ptr;
+    int bytes = glyphAtlasPageBytes( dx, dy, capacity );
+    // pages whose glyphs were all dropped while pinned are left for us by release()
+    for ( int i = page_count - 1; i >= 0; i-- )
+        if ( !pages[i]->live_count && pages[i] != current && !ls_atomic_add( &pages[i]->pins, 0 ) )
+            freePage( i );
+    // pinned pages are skipped: if all pages are in use by other threads, cache grows above max_size for a while
+    int steps = page_count * 2;
+    while ( size + bytes > max_size && page_count && steps-- > 0 ) {
+        if ( hand >= page_count )
+            hand = 0;
+        if ( pages[hand]->referenced || ls_atomic_add( &pages[hand]->pins, 0 ) ) {
+            pages[hand]->referenced = false;
+            hand++;
+        } else {
+            // next page is moved to this index, so hand stays here
+            freePage( hand );
         }
     }
-    return NULL;
+    LVFontGlyphAtlasPage * page = (LVFontGlyphAtlasPage *)malloc( bytes );
+    page->dx = dx;
+    page->dy = dy;
+    page->bytes = bytes;
+    page->capacity = capacity;
+    page->item_count = 0;
+    page->live_count = 0;
+    page->pins = 0;
+    page->shelf_count = 0;
+    page->referenced = true;
+    page->cache = this;
+    page->items = (LVFontGlyphCacheItem *)(page + 1);
+    page->pixels = (lUInt8 *)(page->items + capacity);
+    pages = (LVFontGlyphAtlasPage * *)realloc( pages, (page_count + 1) * sizeof(LVFontGlyphAtlasPage *) );
+    pages[page_count++] = page;
+    size += bytes;
+    return page;
+}
+
+/// frees atlas page, removing its glyphs from hash table
+void LVFontGlobalGlyphCache::freePage( int index )
+{
+    LVFontGlyphAtlasPage * page = pages[index];
+    for ( int i = 0; i < page->item_count && page->live_count; i++ ) {
+        LVFontGlyphCacheItem * item = &page->items[i];
+        if ( !item->local_cache )
+            continue;
+        int slot = findSlot( item->local_cache, item->ch );
+        if ( table[slot] == item )
+            removeSlot( slot );
+        page->live_count--;
+    }
+    size -= page->bytes;
+    page_count--;
+    memmove( pages + index, pages + index + 1, (page_count - index) * sizeof(LVFontGlyphAtlasPage *) );
+    if ( current == page )
+        current = NULL;
+    free( page );
 }
 
-void LVFontLocalGlyphCache::put( LVFontGlyphCacheItem * item )
+/// marks item as unused, frees its page if all its glyphs are dropped
+void LVFontGlobalGlyphCache::dropItem( LVFontGlyphCacheItem * item )
 {
-    FONT_LOCAL_GLYPH_CACHE_GUARD
-    global_cache->put( item );
-    item->next_local = head;
-    if ( head )
-        head->prev_local = item;
-    if ( !tail )
-        tail = item;
-    head = item;
+    item->local_cache = NULL;
+    item->page->live_count--;
+    freeUnusedPage( item->page );
 }
 
-/// remove from list, but don't delete
-void LVFontLocalGlyphCache::remove( LVFontGlyphCacheItem * item )
+/// frees page if it has no live glyphs and is not pinned
+void LVFontGlobalGlyphCache::freeUnusedPage( LVFontGlyphAtlasPage * page )
 {
-    FONT_LOCAL_GLYPH_CACHE_GUARD
-    if ( item==head )
-        head = item->next_local;
-    if ( item==tail )
-        tail = item->prev_local;
-    if ( !head || !tail )
+    if ( page->live_count || page == current || ls_atomic_add( &page->pins, 0 ) )
         return;
-    if ( item->prev_local )
-        item->prev_local->next_local = item->next_local;
-    if ( item->next_local )
-        item->next_local->prev_local = item->prev_local;
-    item->next_local = NULL;
-    item->prev_local = NULL;
+    for ( int i = 0; i < page_count; i++ ) {
+        if ( pages[i] == page ) {
+            freePage( i );
+            break;
+        }
+    }
 }
 
-void LVFontGlobalGlyphCache::refresh( LVFontGlyphCacheItem * item )
+LVFontGlyphCacheItem * LVFontGlobalGlyphCache::get( LVFontLocalGlyphCache * local_cache, lUInt16 ch )
 {
     FONT_GLYPH_CACHE_GUARD
-    if ( tail!=item ) {
-        //move to head
-        removeNoLock( item );
-        putNoLock( item );
+    if ( !count )
+        return NULL;
+    LVFontGlyphCacheItem * item = table[ findSlot( local_cache, ch ) ];
+    if ( item ) {
+        item->page->referenced = true;
+        ls_atomic_add( &item->page->pins, 1 );
     }
+    return item;
 }
 
-void LVFontGlobalGlyphCache::put( LVFontGlyphCacheItem * item )
+LVFontGlyphCacheItem * LVFontGlobalGlyphCache::newItem( LVFontLocalGlyphCache * local_cache, lChar16 ch, int w, int h )
 {
     FONT_GLYPH_CACHE_GUARD
-    putNoLock(item);
+    LVFontGlyphCacheItem * item = current ? allocGlyphAtlasItem( current, w, h ) : NULL;
+    if ( !item ) {
+        if ( w > page_dim || h > page_dim ) {
+            // too big glyph gets its own page
+            item = allocGlyphAtlasItem( newPage( w, h, 1 ), w, h );
+        } else {
+            current = newPage( page_dim, page_dim, glyphAtlasPageCapacity( page_dim, page_dim ) );
+            item = allocGlyphAtlasItem( current, w, h );
+        }
+    }
+    ls_atomic_add( &item->page->pins, 1 );
+    item->local_cache = local_cache;
+    item->ch = ch;
+    item->bmp_width = (lUInt16)w;
+    item->bmp_height = (lUInt16)h;
+    item->origin_x = 0;
+    item->origin_y = 0;
+    item->advance = 0;
+    return item;
 }
 
-void LVFontGlobalGlyphCache::putNoLock( LVFontGlyphCacheItem * item )
+LVFontGlyphCacheItem * LVFontGlobalGlyphCache::put( LVFontGlyphCacheItem * item )
 {
-    int sz = item->getSize();
-    // remove extra items from tail
-    while ( sz + size > max_size ) {
-        LVFontGlyphCacheItem * removed_item = tail;
-        if ( !removed_item )
-            break;
-        removeNoLock( removed_item );
-        removed_item->local_cache->remove( removed_item );
-        LVFontGlyphCacheItem::freeItem( removed_item );
-    }
-    // add new item to head
-    item->next_global = head;
-    if ( head )
-        head->prev_global = item;
-    head = item;
-    if ( !tail )
-        tail = item;
-    size += sz;
+    FONT_GLYPH_CACHE_GUARD
+    if ( count ) {
+        LVFontGlyphCacheItem * existing = table[ findSlot( item->local_cache, item->ch ) ];
+        if ( existing ) {
+            // already added by another thread
+            existing->page->referenced = true;
+            ls_atomic_add( &existing->page->pins, 1 );
+            ls_atomic_add( &item->page->pins, -1 );
+            dropItem( item );
+            return existing;
+        }
+    }
+    if ( (count + 1) * 2 > table_size )
+        resize( table_size ? table_size * 2 : 256 );
+    table[ findSlot( item->local_cache, item->ch ) ] = item;
+    ls_atomic_add( &item->local_cache->count, 1 );
+    count++;
+    return item;
 }
 
-void LVFontGlobalGlyphCache::remove( LVFontGlyphCacheItem * item )
+void LVFontGlobalGlyphCache::release( LVFontGlyphCacheItem * item )
 {
-    FONT_GLYPH_CACHE_GUARD
-    removeNoLock(item);
+    // no cache lock: page may be freed by another thread right after unpinning, so it's not accessed anymore;
+    // page without live glyphs is freed by next newPage() then
+    ls_atomic_add( &item->page->pins, -1 );
 }
 
-void LVFontGlobalGlyphCache::removeNoLock( LVFontGlyphCacheItem * item )
+void LVFontGlyphCacheItem::release()
 {
-    if ( item==head )
-        head = item->next_global;
-    if ( item==tail )
-        tail = item->prev_global;
-    if ( !head || !tail )
-        return;
-    if ( item->prev_global )
-        item->prev_global->next_global = item->next_global;
-    if ( item->next_global )
-        item->next_global->prev_global = item->prev_global;
-    item->next_global = NULL;
-    item->prev_global = NULL;
-    size -= item->getSize();
+    page->cache->release( this );
+}
+
+void LVFontGlobalGlyphCache::clear( LVFontLocalGlyphCache * local_cache )
+{
+    FONT_GLYPH_CACHE_GUARD
+    for ( int i = 0; i < table_size && ls_atomic_add( &local_cache->count, 0 ); i++ ) {
+        // removal moves next items back to this slot
+        while ( table[i] && table[i]->local_cache == local_cache ) {
+            LVFontGlyphCacheItem * item = table[i];
+            removeSlot( i );
+            dropItem( item );
+        }
+    }
 }
 
 void LVFontGlobalGlyphCache::clear()
 {
     FONT_GLYPH_CACHE_GUARD
-    while ( head ) {
-        LVFontGlyphCacheItem * ptr = head;
-        remove( ptr );
-        ptr->local_cache->remove( ptr );
-        LVFontGlyphCacheItem::freeItem( ptr );
+    for ( int i = 0; i < table_size; i++ ) {
+        LVFontGlyphCacheItem * item = table[i];
+        if ( item ) {
+            ls_atomic_add( &item->local_cache->count, -1 );
+            item->local_cache = NULL;
+            item->page->live_count--;
+            table[i] = NULL;
+        }
+    }
+    current = NULL;
+    count = 0;
+    hand = 0;
+    // pages pinned by drawing threads are freed by newPage() after last release()
+    int pinned = 0;
+    for ( int i = 0; i < page_count; i++ ) {
+        LVFontGlyphAtlasPage * page = pages[i];
+        if ( ls_atomic_add( &page->pins, 0 ) ) {
+            pages[pinned++] = page;
+        } else {
+            size -= page->bytes;
+            free( page );
+        }
     }
+    page_count = pinned;
 }
 
 lString8 familyName( FT_Face face )
@@ -805,10 +1268,19 @@ static lUInt16 char_flags[] = {
         (ch==UNICODE_NO_BREAK_SPACE?LCHAR_DEPRECATED_WRAP_AFTER|LCHAR_IS_SPACE: \
         (ch==UNICODE_HYPHEN?LCHAR_DEPRECATED_WRAP_AFTER:0))))
 
+/// use FONT_FACE_GUARD in font instance methods: fonts of different faces and sizes are used by threads independently
+#define FONT_FACE_GUARD CRGuard _fontFaceGuard(_faceMutex); CR_UNUSED(_fontFaceGuard);
+
+/// creates lock for single font instance, NULL if concurrency is not set up
+static CRMutex * createFontFaceMutex()
+{
+    return concurrencyProvider ? concurrencyProvider->createMutex() : NULL;
+}
+
 class LVFreeTypeFace : public LVFont
 {
 protected:
-    LVMutex &      _mutex;
+    CRMutexRef    _faceMutex;
     lString8      _fileName;
     lString8      _faceName;
     css_font_family_t _fontFamily;
@@ -822,7 +1294,11 @@ protected:
     int           _baseline;
     int            _weight;
     int            _italic;
-    LVFontGlyphWidthCache _wcache;
+    LVFontGlyphWidthCache _wcache; // widths of characters taken from fallback font or def_char
+    LVFontMetricsCacheList * _metricsCaches;
+    LVFontMetricsCache * _metrics; // widths and glyph indexes of characters of this face
+    bool          _metricsChecked;
+    lUInt32       _faceHash; // hash of font file and face index, 0 if unknown
     LVFontLocalGlyphCache _glyph_cache;
     bool          _drawMonochrome;
     bool          _allowKerning;
@@ -833,19 +1309,21 @@ protected:
     hb_buffer_t* _hb_buffer;
     hb_font_t* _hb_font;
     hb_feature_t _hb_kern_feature;
-    LVHashTable<lUInt32, LVFontGlyphIndexCacheItem*> _glyph_cache2;
+    LVFontLocalGlyphCache _glyph_cache2; // glyphs by glyph index
 #endif
 public:
 
     // fallback font support
     /// set fallback font for this font
     void setFallbackFont( LVFontRef font ) {
+        FONT_FACE_GUARD
         _fallbackFont = font;
         _fallbackFontIsSet = !font.isNull();
     }
 
     /// get fallback font for this font
     LVFont * getFallbackFont() {
+        FONT_FACE_GUARD
         if ( _fallbackFontIsSet )
             return _fallbackFont.get();
         if ( fontMan->GetFallbackFontFace()!=_faceName ) // to avoid circular link, disable fallback for fallback font
@@ -861,14 +1339,13 @@ public:
     /// sets face name
     virtual void setFaceName( lString8 face ) { _faceName = face; }
 
-    LVMutex & getMutex() { return _mutex; }
     FT_Library getLibrary() { return _library; }
 
-    LVFreeTypeFace( LVMutex &mutex, FT_Library  library, LVFontGlobalGlyphCache * globalCache )
-    : _mutex(mutex), _fontFamily(css_ff_sans_serif), _library(library), _face(NULL), _size(0), _hyphen_width(0), _baseline(0)
-    , _weight(400), _italic(0)
+    LVFreeTypeFace( FT_Library  library, LVFontGlobalGlyphCache * globalCache, LVFontMetricsCacheList * metricsCaches )
+    : _faceMutex(createFontFaceMutex()), _fontFamily(css_ff_sans_serif), _library(library), _face(NULL), _size(0), _hyphen_width(0), _baseline(0)
+    , _weight(400), _italic(0), _metricsCaches(metricsCaches), _metrics(NULL), _metricsChecked(false), _faceHash(0)
 #if USE_HARFBUZZ==1
-    , _glyph_cache2(256)
+    , _glyph_cache2(globalCache)
 #endif
     , _glyph_cache(globalCache), _drawMonochrome(false), _allowKerning(false), _hintingMode(HINTING_MODE_AUTOHINT), _fallbackFontIsSet(false)
     {
@@ -880,8 +1357,8 @@ public:
 #if USE_HARFBUZZ==1
         _hb_font = 0;
         _hb_buffer = hb_buffer_create();
-        hb_feature_from_string("-kern", -1, &_hb_kern_feature);
 #endif
+        applyKerning( fontMan->getKerning() );
     }
 
     virtual ~LVFreeTypeFace()
@@ -890,37 +1367,47 @@ public:
         if (_hb_buffer)
             hb_buffer_destroy(_hb_buffer);
 #endif
-        Clear();
+        clearFace();
     }
 
     void clearCache() {
         _glyph_cache.clear();
         _wcache.clear();
-#if USE_HARFBUZZ==1
-        LVHashTable<lUInt32, LVFontGlyphIndexCacheItem*>::pair* pair;
-        LVHashTable<lUInt32, LVFontGlyphIndexCacheItem*>::iterator it = _glyph_cache2.forwardIterator();
-        while (pair = it.next()) {
-            LVFontGlyphIndexCacheItem* item = pair->value;
-            if (item)
-                LVFontGlyphIndexCacheItem::freeItem(item);
+        // options may be changed: take metrics cache for new ones on next use
+        if ( _metrics ) {
+            _metricsCaches->checkin( _metrics );
+            _metrics = NULL;
         }
+        _metricsChecked = false;
+#if USE_HARFBUZZ==1
         _glyph_cache2.clear();
 #endif
     }
 
     virtual int getHyphenWidth()
     {
-        FONT_GUARD
+        FONT_FACE_GUARD
         if ( !_hyphen_width ) {
             _hyphen_width = getCharWidth( UNICODE_SOFT_HYPHEN_CODE );
         }
         return _hyphen_width;
     }
 
+    virtual int getVisualAligmentWidth()
+    {
+        FONT_FACE_GUARD
+        return LVFont::getVisualAligmentWidth();
+    }
+
     /// get kerning mode: true==ON, false=OFF
     virtual bool getKerning() const { return _allowKerning; }
     /// get kerning mode: true==ON, false=OFF
     virtual void setKerning( bool kerningEnabled ) {
+        FONT_FACE_GUARD
+        applyKerning( kerningEnabled );
+    }
+
+    void applyKerning( bool kerningEnabled ) {
         _allowKerning = kerningEnabled;
 #if USE_HARFBUZZ==1
         if (_allowKerning)
@@ -934,6 +1421,7 @@ public:
 
     /// sets current hinting mode
     virtual void setHintingMode(hinting_mode_t mode) {
+        FONT_FACE_GUARD
         if (_hintingMode == mode)
             return;
         _hintingMode = mode;
@@ -947,15 +1435,16 @@ public:
     /// set bitmap mode (true=bitmap, false=antialiased)
     virtual void setBitmapMode( bool drawBitmap )
     {
+        FONT_FACE_GUARD
         if ( _drawMonochrome == drawBitmap )
             return;
         _drawMonochrome = drawBitmap;
         clearCache();
     }
 
+    /// called by font manager under FONT_MAN_GUARD before font is shared, so font lock is not needed
     bool loadFromBuffer(LVByteArrayRef buf, int index, int size, css_font_family_t fontFamily, bool monochrome, bool italicize )
     {
-        FONT_GUARD
         _hintingMode = fontMan->GetHintingMode();
         _drawMonochrome = monochrome;
         _fontFamily = fontFamily;
@@ -964,6 +1453,7 @@ public:
         int error = FT_New_Memory_Face( _library, buf->get(), buf->length(), index, &_face ); /* create face object */
         if (error)
             return false;
+        _faceHash = lStr_crc32( index, buf->get(), buf->length() ) | 1;
         if ( _fileName.endsWith(".pfb") || _fileName.endsWith(".pfa") ) {
             lString8 kernFile = _fileName.substr(0, _fileName.length()-4);
             if ( LVFileExists(Utf8ToUnicode(kernFile) + ".afm" ) ) {
@@ -998,7 +1488,7 @@ public:
         }
 #endif
         if (error) {
-            Clear();
+            clearFace();
             return false;
         }
 #if 0
@@ -1028,9 +1518,9 @@ public:
         return true;
     }
 
+    /// called by font manager under FONT_MAN_GUARD before font is shared, so font lock is not needed
     bool loadFromFile( const char * fname, int index, int size, css_font_family_t fontFamily, bool monochrome, bool italicize )
     {
-        FONT_GUARD
         _hintingMode = fontMan->GetHintingMode();
         _drawMonochrome = monochrome;
         _fontFamily = fontFamily;
@@ -1043,6 +1533,12 @@ public:
         int error = FT_New_Face( _library, _fileName.c_str(), index, &_face ); /* create face object */
         if (error)
             return false;
+        lUInt64 fileSize = 0;
+        lUInt64 fileTime = 0;
+        if ( LVGetFileInfo( _fileName, fileSize, fileTime ) ) {
+            lUInt64 info[2] = { fileSize, fileTime };
+            _faceHash = lStr_crc32( lStr_crc32( index, _fileName.c_str(), _fileName.length() ), info, sizeof(info) ) | 1;
+        }
         if ( _fileName.endsWith(".pfb") || _fileName.endsWith(".pfa") ) {
         	lString8 kernFile = _fileName.substr(0, _fileName.length()-4);
             if ( LVFileExists(Utf8ToUnicode(kernFile) + ".afm") ) {
@@ -1077,7 +1573,7 @@ public:
         }
 #endif
         if (error) {
-            Clear();
+            clearFace();
             return false;
         }
 #if 0
@@ -1144,7 +1640,7 @@ public:
     */
     virtual bool getGlyphInfo( lUInt16 code, glyph_info_t * glyph, lChar16 def_char=0 )
     {
-        //FONT_GUARD
+        FONT_FACE_GUARD
         int glyph_index = getCharIndex( code, 0 );
         if ( glyph_index==0 ) {
             LVFont * fallback = getFallbackFont();
@@ -1178,6 +1674,82 @@ public:
         glyph->width =     (lUInt8)(myabs(_slot->metrics.horiAdvance) >> 6);
         return true;
     }
+
+    /// returns metrics cache for current font options, it's taken from font manager on first use
+    LVFontMetricsCache * getMetrics()
+    {
+        if ( !_metricsChecked ) {
+            _metricsChecked = true;
+            if ( _faceHash && _face ) {
+                int flags = 0;
+                if ( _allowKerning )
+                    flags |= FONT_METRICS_FLAG_KERNING;
+                if ( _drawMonochrome )
+                    flags |= FONT_METRICS_FLAG_MONOCHROME;
+                if ( _matrix.xy )
+                    flags |= FONT_METRICS_FLAG_ITALICIZE;
+                _metrics = _metricsCaches->checkout( _faceHash, _size, _hintingMode, flags );
+            }
+        }
+        return _metrics;
+    }
+
+    /// loads glyph of this face to get its advance, returns -1 on error
+    int getGlyphAdvance( FT_UInt glyph_index )
+    {
+        int flags = FT_LOAD_DEFAULT;
+        flags |= (!_drawMonochrome ? FT_LOAD_TARGET_NORMAL : FT_LOAD_TARGET_MONO);
+        if (_hintingMode == HINTING_MODE_AUTOHINT)
+            flags |= FT_LOAD_FORCE_AUTOHINT;
+        else if (_hintingMode == HINTING_MODE_DISABLED)
+            flags |= FT_LOAD_NO_AUTOHINT | FT_LOAD_NO_HINTING;
+        updateTransform();
+        if ( FT_Load_Glyph( _face, glyph_index, flags ) )
+            return -1;
+        int w = myabs(_slot->metrics.horiAdvance) >> 6;
+        return w < FONT_METRICS_UNKNOWN ? w : -1;
+    }
+
+    /// returns advance of character, -1 if there is no glyph for it
+    int getCharAdvance( lChar16 ch, lChar16 def_char )
+    {
+        LVFontMetricsCache * metrics = getMetrics();
+        if ( metrics ) {
+            const LVFontCharMetrics * m = metrics->get( ch );
+            if ( m && m->glyph )
+                return m->advance;
+            if ( !m ) {
+                FT_UInt glyph_index = getCharIndex( ch, 0 );
+                if ( !glyph_index ) {
+                    metrics->put( ch, 0, 0 ); // remember that face has no such glyph
+                } else {
+                    int w = getGlyphAdvance( glyph_index );
+                    if ( w>=0 ) {
+                        metrics->put( ch, (lUInt16)glyph_index, (lUInt16)w );
+                        return w;
+                    }
+                }
+            }
+        }
+        // glyph of fallback font or def_char depends on other fonts, so it's not persisted
+        int w = _wcache.get(ch);
+        if ( w==0xFF ) {
+            if ( metrics && def_char && def_char!=ch && !getFallbackFont() ) {
+                // def_char glyph of this face is used, its width is in metrics cache
+                w = getCharAdvance( def_char, 0 );
+                if ( w<0 )
+                    return -1;
+            } else {
+                glyph_info_t glyph;
+                if ( !getGlyphInfo( ch, &glyph, def_char ) )
+                    return -1;
+                w = glyph.width;
+            }
+            if ( w<0xFF )
+                _wcache.put(ch, w);
+        }
+        return w;
+    }
 /*
   // USE GET_CHAR_FLAGS instead
     inline int calcCharFlags( lChar16 ch )
@@ -1212,7 +1784,7 @@ public:
                         bool allow_hyphenation = true
                      )
     {
-        FONT_GUARD
+        FONT_FACE_GUARD
         if ( len <= 0 || _face==NULL )
             return 0;
 
@@ -1307,17 +1879,10 @@ public:
 
                 flags[i] = GET_CHAR_FLAGS(ch); //calcCharFlags( ch );
 
-                /* load glyph image into the slot (erase previous one) */
-                int w = _wcache.get(ch);
-                if ( w==0xFF ) {
-                    glyph_info_t glyph;
-                    if ( getGlyphInfo( ch, &glyph, def_char ) ) {
-                        w = glyph.width;
-                        _wcache.put(ch, w);
-                    } else {
-                        widths[i] = prev_width;
-                        continue;  /* ignore errors */
-                    }
+                int w = getCharAdvance( ch, def_char );
+                if ( w<0 ) {
+                    widths[i] = prev_width;
+                    continue;  /* ignore errors */
                 }
                 widths[i] = prev_width + w + letter_spacing;
                 if ( !isHyphen ) // avoid soft hyphens inside text string
@@ -1340,6 +1905,9 @@ public:
             lChar16 ch = text[i];
             bool isHyphen = (ch==UNICODE_SOFT_HYPHEN_CODE);
             FT_UInt ch_glyph_index = (FT_UInt)-1;
+            const LVFontCharMetrics * m = getMetrics() ? _metrics->get( ch ) : NULL;
+            if ( m && m->glyph )
+                ch_glyph_index = m->glyph;
             int kerning = 0;
 #if (ALLOW_KERNING==1)
             if ( use_kerning && previous>0  ) {
@@ -1360,19 +1928,13 @@ public:
 
             flags[i] = GET_CHAR_FLAGS(ch); //calcCharFlags( ch );
 
-            /* load glyph image into the slot (erase previous one) */
-            int w = _wcache.get(ch);
-            if ( w==0xFF ) {
-                glyph_info_t glyph;
-                if ( getGlyphInfo( ch, &glyph, def_char ) ) {
-                    w = glyph.width;
-                    _wcache.put(ch, w);
-                } else {
-                    widths[i] = prev_width;
-                    continue;  /* ignore errors */
-                }
-                if ( ch_glyph_index==(FT_UInt)-1 )
-                    ch_glyph_index = getCharIndex( ch, 0 );
+            int w = getCharAdvance( ch, def_char );
+            if ( w<0 ) {
+                widths[i] = prev_width;
+                continue;  /* ignore errors */
+            }
+            if ( ch_glyph_index==(FT_UInt)-1 ) {
+                ch_glyph_index = getCharIndex( ch, 0 );
 //                error = FT_Load_Glyph( _face,          /* handle to face object */
 //                        ch_glyph_index,                /* glyph index           */
 //                        FT_LOAD_DEFAULT );             /* load flags, see below */
@@ -1427,8 +1989,8 @@ public:
                         const lChar16 * text, int len
         )
     {
-        static lUInt16 widths[MAX_LINE_CHARS+1];
-        static lUInt8 flags[MAX_LINE_CHARS+1];
+        lUInt16 widths[MAX_LINE_CHARS+1];
+        lUInt8 flags[MAX_LINE_CHARS+1];
         if ( len>MAX_LINE_CHARS )
             len = MAX_LINE_CHARS;
         if ( len<=0 )
@@ -1459,7 +2021,7 @@ public:
         \return glyph pointer if glyph was found, NULL otherwise
     */
     virtual LVFontGlyphCacheItem * getGlyph(lUInt16 ch, lChar16 def_char=0) {
-        //FONT_GUARD
+        FONT_FACE_GUARD
         FT_UInt ch_glyph_index = getCharIndex( ch, 0 );
         if ( ch_glyph_index==0 ) {
             LVFont * fallback = getFallbackFont();
@@ -1490,17 +2052,17 @@ public:
             if ( error ) {
                 return NULL;  /* ignore errors */
             }
-            item = newItem( &_glyph_cache, ch, _slot ); //, _drawMonochrome
-            _glyph_cache.put( item );
+            item = _glyph_cache.put( newItem( &_glyph_cache, ch, _slot ) ); //, _drawMonochrome
         }
         return item;
     }
 
 #if USE_HARFBUZZ==1
-    LVFontGlyphIndexCacheItem * getGlyphByIndex(lUInt32 index) {
-        //FONT_GUARD
-        LVFontGlyphIndexCacheItem * item = 0;
-        if (!_glyph_cache2.get(index, item)) {
+    LVFontGlyphCacheItem * getGlyphByIndex(lUInt32 index) {
+        FONT_FACE_GUARD
+        // OpenType glyph indexes are 16 bit
+        LVFontGlyphCacheItem * item = _glyph_cache2.get( (lUInt16)index );
+        if ( !item ) {
             // glyph not found in cache, rendering...
             int rend_flags = FT_LOAD_RENDER | ( !_drawMonochrome ? FT_LOAD_TARGET_NORMAL : (FT_LOAD_TARGET_MONO) ); //|FT_LOAD_MONOCHROME|FT_LOAD_FORCE_AUTOHINT
             if (_hintingMode == HINTING_MODE_AUTOHINT)
@@ -1516,9 +2078,7 @@ public:
             if ( error ) {
                 return NULL;  /* ignore errors */
             }
-            item = newItem(index, _slot);
-            if (item)
-                _glyph_cache2.set(index, item);
+            item = _glyph_cache2.put( newItem( &_glyph_cache2, (lChar16)index, _slot ) );
         }
         return item;
     }
@@ -1558,14 +2118,10 @@ public:
     /// returns char width
     virtual int getCharWidth( lChar16 ch, lChar16 def_char='?' )
     {
-        int w = _wcache.get(ch);
-        if ( w==0xFF ) {
-            glyph_info_t glyph;
-            if ( getGlyphInfo( ch, &glyph, def_char ) ) {
-                w = glyph.width;
-            } else {
-                w = 0;
-            }
+        FONT_FACE_GUARD
+        int w = getCharAdvance( ch, def_char );
+        if ( w<0 ) {
+            w = 0;
             _wcache.put(ch, w);
         }
         return w;
@@ -1606,7 +2162,7 @@ public:
                        const lChar16 * text, int len, 
                        lChar16 def_char, lUInt32 * palette, bool addHyphen, lUInt32 flags, int letter_spacing )
     {
-        FONT_GUARD
+        // font is locked only to get glyphs: they are pinned, so drawing itself doesn't block other threads
         if ( len <= 0 || _face==NULL )
             return;
         if ( letter_spacing<0 || letter_spacing>50 )
@@ -1631,26 +2187,35 @@ public:
         register int len_new = 0;
         bool allowKerning = _allowKerning;
         if (allowKerning) {
-            // Use HarfBuzz only for kerning - it's a slow variant
-            hb_buffer_clear_contents(_hb_buffer);
-            hb_buffer_set_replacement_codepoint(_hb_buffer, 0);
-            // fill HarfBuzz buffer with filtering
-            for (i = 0; i < len; i++) {
-                ch = text[i];
-                bool isHyphen = (ch == UNICODE_SOFT_HYPHEN_CODE) && (i < len - 1);
-                if (!isHyphen) {		// avoid soft hyphens inside text string
-                    // Also replaced any chars to similar if not glyph not found
-                    hb_buffer_add(_hb_buffer, (hb_codepoint_t)filterChar(ch), i);
-                    len_new++;
+            // shaping buffer is shared by all users of this font: shaping results are copied,
+            // glyphs are drawn without font lock
+            LVArray<hb_glyph_info_t> infos;
+            LVArray<hb_glyph_position_t> positions;
+            {
+                FONT_FACE_GUARD
+                // Use HarfBuzz only for kerning - it's a slow variant
+                hb_buffer_clear_contents(_hb_buffer);
+                hb_buffer_set_replacement_codepoint(_hb_buffer, 0);
+                // fill HarfBuzz buffer with filtering
+                for (i = 0; i < len; i++) {
+                    ch = text[i];
+                    bool isHyphen = (ch == UNICODE_SOFT_HYPHEN_CODE) && (i < len - 1);
+                    if (!isHyphen) {		// avoid soft hyphens inside text string
+                        // Also replaced any chars to similar if not glyph not found
+                        hb_buffer_add(_hb_buffer, (hb_codepoint_t)filterChar(ch), i);
+                        len_new++;
+                    }
                 }
+                hb_buffer_set_content_type(_hb_buffer, HB_BUFFER_CONTENT_TYPE_UNICODE);
+                hb_buffer_guess_segment_properties(_hb_buffer);
+                // shape
+                hb_shape(_hb_font, _hb_buffer, &_hb_kern_feature, 1);
+                glyph_count = hb_buffer_get_length(_hb_buffer);
+                infos.add(hb_buffer_get_glyph_infos(_hb_buffer, 0), glyph_count);
+                positions.add(hb_buffer_get_glyph_positions(_hb_buffer, 0), glyph_count);
             }
-            hb_buffer_set_content_type(_hb_buffer, HB_BUFFER_CONTENT_TYPE_UNICODE);
-            hb_buffer_guess_segment_properties(_hb_buffer);
-            // shape
-            hb_shape(_hb_font, _hb_buffer, &_hb_kern_feature, 1);
-            glyph_count = hb_buffer_get_length(_hb_buffer);
-            glyph_info = hb_buffer_get_glyph_infos(_hb_buffer, 0);
-            glyph_pos = hb_buffer_get_glyph_positions(_hb_buffer, 0);
+            glyph_info = infos.get();
+            glyph_pos = positions.get();
 #ifdef _DEBUG
             if (glyph_count != len_new) {
                 CRLog::debug(
@@ -1671,11 +2236,13 @@ public:
                               item->bmp,
                               item->bmp_width,
                               item->bmp_height,
-                              palette);
+                              palette,
+                              item->bmp_pitch);
+                        item->release();
                         x += w + letter_spacing;
                     }
                 } else {
-                    LVFontGlyphIndexCacheItem *item = getGlyphByIndex(glyph_info[i].codepoint);
+                    LVFontGlyphCacheItem *item = getGlyphByIndex(glyph_info[i].codepoint);
                     if (item) {
                         w = glyph_pos[i].x_advance >> 6;
                         buf->Draw(x + item->origin_x + (glyph_pos[i].x_offset >> 6),
@@ -1683,7 +2250,9 @@ public:
                                   item->bmp,
                                   item->bmp_width,
                                   item->bmp_height,
-                                  palette);
+                                  palette,
+                                  item->bmp_pitch);
+                        item->release();
                         x += w + letter_spacing;
                    }
                }
@@ -1703,7 +2272,9 @@ public:
                               item->bmp,
                               item->bmp_width,
                               item->bmp_height,
-                              palette);
+                              palette,
+                              item->bmp_pitch);
+                    item->release();
                     x += w + letter_spacing;
                 }
             }
@@ -1718,7 +2289,9 @@ public:
                            item->bmp,
                            item->bmp_width,
                            item->bmp_height,
-                           palette);
+                           palette,
+                           item->bmp_pitch);
+                item->release();
                 x  += w + letter_spacing;
             }
         }
@@ -1740,20 +2313,24 @@ public:
                 ch = UNICODE_SOFT_HYPHEN_CODE;
                 isHyphen = 0;
             }
-            FT_UInt ch_glyph_index = getCharIndex( ch, def_char );
+            FT_UInt ch_glyph_index;
             int kerning = 0;
+            {
+                FONT_FACE_GUARD
+                ch_glyph_index = getCharIndex( ch, def_char );
 #if (ALLOW_KERNING==1)
-            if ( use_kerning && previous>0 && ch_glyph_index>0 ) {
-                FT_Vector delta;
-                error = FT_Get_Kerning( _face,          /* handle to face object */
-                              previous,          /* left glyph index      */
-                              ch_glyph_index,         /* right glyph index     */
-                              FT_KERNING_DEFAULT,  /* kerning mode          */
-                              &delta );    /* target vector         */
-                if ( !error )
-                    kerning = delta.x;
-            }
+                if ( use_kerning && previous>0 && ch_glyph_index>0 ) {
+                    FT_Vector delta;
+                    error = FT_Get_Kerning( _face,          /* handle to face object */
+                                  previous,          /* left glyph index      */
+                                  ch_glyph_index,         /* right glyph index     */
+                                  FT_KERNING_DEFAULT,  /* kerning mode          */
+                                  &delta );    /* target vector         */
+                    if ( !error )
+                        kerning = delta.x;
+                }
 #endif
+            }
             LVFontGlyphCacheItem * item = getGlyph(ch, def_char);
             if ( !item )
                 continue;
@@ -1764,11 +2341,13 @@ public:
                     item->bmp,
                     item->bmp_width,
                     item->bmp_height,
-                    palette);
+                    palette,
+                    item->bmp_pitch);
 
                 x  += w + letter_spacing;
                 previous = ch_glyph_index;
             }
+            item->release();
         }
 #endif
         if ( flags & LTEXT_TD_MASK ) {
@@ -1804,7 +2383,12 @@ public:
 
     virtual void Clear()
     {
-        LVLock lock(_mutex);
+        FONT_FACE_GUARD
+        clearFace();
+    }
+
+    void clearFace()
+    {
         clearCache();
 #if USE_HARFBUZZ==1
         if (_hb_font) {
@@ -1813,6 +2397,8 @@ public:
         }
 #endif
         if ( _face ) {
+            // faces are created and destroyed in shared FT_Library under font manager lock
+            FONT_MAN_GUARD
             FT_Done_Face(_face);
             _face = NULL;
         }
@@ -1832,6 +2418,7 @@ class LVFontBoldTransform : public LVFont
     //int           _hyphen_width;
     int           _baseline;
     LVFontLocalGlyphCache _glyph_cache;
+    CRMutexRef    _faceMutex;
 public:
     /// returns font weight
     virtual int getWeight() const
@@ -1847,7 +2434,7 @@ public:
         return _baseFont->getItalic();
     }
     LVFontBoldTransform( LVFontRef baseFont, LVFontGlobalGlyphCache * globalCache )
-        : _baseFontRef( baseFont ), _baseFont( baseFont.get() ), _hyphWidth(-1), _glyph_cache(globalCache)
+        : _baseFontRef( baseFont ), _baseFont( baseFont.get() ), _hyphWidth(-1), _glyph_cache(globalCache), _faceMutex(createFontFaceMutex())
     {
         _size = _baseFont->getSize();
         _height = _baseFont->getHeight();
@@ -1861,12 +2448,18 @@ public:
 
     /// hyphen width
     virtual int getHyphenWidth() {
-        FONT_GUARD
+        FONT_FACE_GUARD
         if ( _hyphWidth<0 )
             _hyphWidth = getCharWidth( getHyphChar() );
         return _hyphWidth;
     }
 
+    virtual int getVisualAligmentWidth()
+    {
+        FONT_FACE_GUARD
+        return LVFont::getVisualAligmentWidth();
+    }
+
     /** \brief get glyph info
         \param glyph is pointer to glyph_info_t struct to place retrieved info
         \return true if glyh was found
@@ -1927,8 +2520,8 @@ public:
                         const lChar16 * text, int len
         )
     {
-        static lUInt16 widths[MAX_LINE_CHARS+1];
-        static lUInt8 flags[MAX_LINE_CHARS+1];
+        lUInt16 widths[MAX_LINE_CHARS+1];
+        lUInt8 flags[MAX_LINE_CHARS+1];
         if ( len>MAX_LINE_CHARS )
             len = MAX_LINE_CHARS;
         if ( len<=0 )
@@ -1951,11 +2544,12 @@ public:
         \return glyph pointer if glyph was found, NULL otherwise
     */
     virtual LVFontGlyphCacheItem * getGlyph(lUInt16 ch, lChar16 def_char=0) {
-
+        FONT_FACE_GUARD
         LVFontGlyphCacheItem * item = _glyph_cache.get( ch );
         if ( item )
             return item;
 
+        // base glyph is pinned, so allocation of new glyph cannot evict its atlas page
         LVFontGlyphCacheItem * olditem = _baseFont->getGlyph( ch, def_char );
         if ( !olditem )
             return NULL;
@@ -1965,21 +2559,21 @@ public:
         int dx = oldx ? oldx + _hShift : 0;
         int dy = oldy ? oldy + _vShift : 0;
 
-        item = LVFontGlyphCacheItem::newItem( &_glyph_cache, ch, dx, dy ); //, _drawMonochrome
+        item = _glyph_cache.newItem( ch, dx, dy ); //, _drawMonochrome
         item->advance = olditem->advance + _hShift;
         item->origin_x = olditem->origin_x;
         item->origin_y = olditem->origin_y;
 
         if ( dx && dy ) {
             for ( int y=0; y<dy; y++ ) {
-                lUInt8 * dst = item->bmp + y*dx;
+                lUInt8 * dst = item->bmp + y*item->bmp_pitch;
                 for ( int x=0; x<dx; x++ ) {
                     int s = 0;
                     for ( int yy=-_vShift; yy<=0; yy++ ) {
                         int srcy = y+yy;
                         if ( srcy<0 || srcy>=oldy )
                             continue;
-                        lUInt8 * src = olditem->bmp + srcy*oldx;
+                        const lUInt8 * src = olditem->bmp + srcy*olditem->bmp_pitch;
                         for ( int xx=-_hShift; xx<=0; xx++ ) {
                             int srcx = x+xx;
                             if ( srcx>=0 && srcx<oldx && src[srcx] > s )
@@ -1990,8 +2584,8 @@ public:
                 }
             }
         }
-        _glyph_cache.put( item );
-        return item;
+        olditem->release();
+        return _glyph_cache.put( item );
     }
 
     /** \brief get glyph image in 1 byte per pixel format
@@ -2138,8 +2732,10 @@ public:
                         item->bmp,
                         item->bmp_width,
                         item->bmp_height,
-                        palette);
+                        palette,
+                        item->bmp_pitch);
                 }
+                item->release();
             }
             x  += w + letter_spacing;
         }
@@ -2197,6 +2793,10 @@ public:
     }
     virtual void Clear()
     {
+        {
+            FONT_FACE_GUARD
+            _glyph_cache.clear();
+        }
         _baseFont->Clear();
     }
     virtual ~LVFontBoldTransform()
@@ -2215,6 +2815,276 @@ public:
 //    }
 //}
 
+#define FONT_CATALOG_MAGIC "CR3 FONT CATALOG v1"
+
+/// number of font files opened to read their faces since start, changed under FONT_MAN_GUARD
+static int fontFileScanCount = 0;
+
+/// font face properties read from font file, to register font without opening it
+class LVFontCatalogFace
+{
+public:
+    int index;
+    int weight;
+    bool italic;
+    bool scalable;
+    css_font_family_t family;
+    lString8 typeface;
+    /// sorted ranges of supported characters: start0, end0, start1, end1, ... (end is inclusive)
+    LVArray<lUInt32> coverage;
+
+    LVFontCatalogFace() : index(0), weight(400), italic(false), scalable(false), family(css_ff_sans_serif) { }
+
+    /// returns true if face has glyph for character
+    bool hasChar( lUInt32 ch ) const
+    {
+        int a = 0;
+        int b = coverage.length() / 2;
+        while ( a < b ) {
+            int c = (a + b) / 2;
+            if ( ch < coverage[c*2] )
+                b = c;
+            else if ( ch > coverage[c*2+1] )
+                a = c + 1;
+            else
+                return true;
+        }
+        return false;
+    }
+
+    /// returns true if face has glyphs for all of characters
+    bool hasChars( const lString16 & chars ) const
+    {
+        for ( int i=0; i<chars.length(); i++ ) {
+            if ( !hasChar( chars[i] ) ) {
+                CRLog::debug("Required char not found in font: %04x", chars[i]);
+                return false; // no required char!!!
+            }
+        }
+        return true;
+    }
+
+    /// reads face properties and character coverage from FreeType face
+    void read( FT_Face face, int faceIndex )
+    {
+        index = faceIndex;
+        scalable = FT_IS_SCALABLE( face );
+        family = css_ff_sans_serif;
+        if ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH )
+            family = css_ff_monospace;
+        typeface = ::familyName(face);
+        if ( typeface=="Times" || typeface=="Times New Roman" )
+            family = css_ff_serif;
+        weight = ( face->style_flags & FT_STYLE_FLAG_BOLD ) ? 700 : 400;
+        italic = ( face->style_flags & FT_STYLE_FLAG_ITALIC ) ? true : false;
+        coverage.clear();
+        FT_UInt glyphIndex = 0;
+        FT_ULong ch = FT_Get_First_Char( face, &glyphIndex );
+        while ( glyphIndex!=0 ) {
+            int len = coverage.length();
+            if ( len && coverage[len-1]+1==ch )
+                coverage[len-1] = ch;
+            else {
+                coverage.add( ch );
+                coverage.add( ch );
+            }
+            ch = FT_Get_Next_Char( face, ch, &glyphIndex );
+        }
+    }
+
+    void serialize( SerialBuf & buf )
+    {
+        buf.putVarUInt( index );
+        buf.putVarUInt( weight );
+        buf << italic << scalable << (lUInt8)family << typeface;
+        buf.putVarUInt( coverage.length() / 2 );
+        // ranges are sorted, so store them as deltas
+        lUInt32 prev = 0;
+        for ( int i=0; i<coverage.length(); i+=2 ) {
+            buf.putVarUInt( coverage[i] - prev );
+            buf.putVarUInt( coverage[i+1] - coverage[i] );
+            prev = coverage[i+1];
+        }
+    }
+
+    bool deserialize( SerialBuf & buf )
+    {
+        lUInt8 f = 0;
+        index = buf.getVarUInt();
+        weight = buf.getVarUInt();
+        buf >> italic >> scalable >> f >> typeface;
+        family = (css_font_family_t)f;
+        int count = buf.getVarUInt();
+        if ( buf.error() || count > buf.space() )
+            return false;
+        coverage.clear();
+        lUInt32 prev = 0;
+        for ( int i=0; i<count && !buf.error(); i++ ) {
+            lUInt32 start = prev + buf.getVarUInt();
+            prev = start + buf.getVarUInt();
+            coverage.add( start );
+            coverage.add( prev );
+        }
+        return !buf.error();
+    }
+};
+
+/// font file entry of font catalog, valid while file size and modification time are not changed
+class LVFontCatalogFile
+{
+public:
+    lString8 path;
+    lUInt64 size;
+    lUInt64 modificationTime;
+    /// true if file has been registered by this process
+    bool used;
+    LVPtrVector<LVFontCatalogFace> faces;
+
+    LVFontCatalogFile( const lString8 & fname, lUInt64 sz, lUInt64 mtime )
+    : path(fname), size(sz), modificationTime(mtime), used(false) { }
+
+    void serialize( SerialBuf & buf )
+    {
+        buf << path << (lUInt32)(size >> 32) << (lUInt32)size
+            << (lUInt32)(modificationTime >> 32) << (lUInt32)modificationTime;
+        buf.putVarUInt( faces.length() );
+        for ( int i=0; i<faces.length(); i++ )
+            faces[i]->serialize( buf );
+    }
+
+    bool deserialize( SerialBuf & buf )
+    {
+        lUInt32 sizeHi = 0, sizeLo = 0, timeHi = 0, timeLo = 0;
+        buf >> path >> sizeHi >> sizeLo >> timeHi >> timeLo;
+        size = ((lUInt64)sizeHi << 32) | sizeLo;
+        modificationTime = ((lUInt64)timeHi << 32) | timeLo;
+        int count = buf.getVarUInt();
+        if ( buf.error() || count > buf.space() )
+            return false;
+        for ( int i=0; i<count; i++ ) {
+            LVFontCatalogFace * face = new LVFontCatalogFace();
+            faces.add( face );
+            if ( !face->deserialize( buf ) )
+                return false;
+        }
+        return !buf.error();
+    }
+};
+
+/// persistent catalog of font files: allows to register fonts without opening font files
+class LVFontCatalog
+{
+    lString16 _fileName;
+    LVPtrVector<LVFontCatalogFile> _files;
+    LVHashTable<lString8, LVFontCatalogFile *> _index;
+    bool _loaded;
+    bool _dirty;
+public:
+    LVFontCatalog() : _index(256), _loaded(false), _dirty(false) { }
+
+    /// sets file to keep catalog in, call before first use
+    void setFileName( const lString16 & fileName ) { _fileName = fileName; }
+
+    /// returns entry for file if it's found and file is not changed since it's been added, NULL otherwise
+    LVFontCatalogFile * find( const lString8 & path, lUInt64 size, lUInt64 modificationTime )
+    {
+        if ( !_loaded )
+            load();
+        LVFontCatalogFile * file = NULL;
+        if ( !_index.get( path, file ) )
+            return NULL;
+        if ( file->size!=size || file->modificationTime!=modificationTime )
+            return NULL;
+        file->used = true;
+        return file;
+    }
+
+    /// adds new entry, replacing old one for the same path
+    void add( LVFontCatalogFile * file )
+    {
+        LVFontCatalogFile * old = NULL;
+        if ( _index.get( file->path, old ) ) {
+            _index.remove( file->path );
+            _files.remove( old );
+            delete old;
+        }
+        file->used = true;
+        _files.add( file );
+        _index.set( file->path, file );
+        _dirty = true;
+    }
+
+    /// reads catalog file, if it's set
+    bool load()
+    {
+        _loaded = true;
+        if ( _fileName.empty() )
+            return false;
+        LVStreamRef stream = LVOpenFileStream( _fileName.c_str(), LVOM_READ );
+        if ( stream.isNull() )
+            return false;
+        LVStreamBufferRef sb = stream->GetReadBuffer( 0, stream->GetSize() );
+        if ( !sb )
+            return false;
+        SerialBuf buf( sb->getReadOnly(), sb->getSize() );
+        if ( !buf.checkMagic( FONT_CATALOG_MAGIC ) ) {
+            CRLog::error("wrong font catalog file format");
+            return false;
+        }
+        int start = buf.pos();
+        lUInt32 count = 0;
+        buf >> count;
+        if ( count > (lUInt32)buf.space() )
+            buf.seterror();
+        for ( lUInt32 i=0; i<count && !buf.error(); i++ ) {
+            LVFontCatalogFile * file = new LVFontCatalogFile( lString8::empty_str, 0, 0 );
+            _files.add( file );
+            file->deserialize( buf );
+        }
+        buf.checkCRC( buf.pos() - start );
+        if ( buf.error() ) {
+            CRLog::error("font catalog file is corrupted, ignoring");
+            _files.clear();
+            return false;
+        }
+        for ( int i=0; i<_files.length(); i++ )
+            _index.set( _files[i]->path, _files[i] );
+        CRLog::info("Font catalog: %d font files loaded from %s", _files.length(), LCSTR(_fileName));
+        return true;
+    }
+
+    /// writes catalog file if it has been changed; when dropUnused is set, only files used by this process are saved
+    bool save( bool dropUnused )
+    {
+        if ( _fileName.empty() )
+            return false;
+        lUInt32 count = 0;
+        for ( int i=0; i<_files.length(); i++ )
+            if ( _files[i]->used || !dropUnused )
+                count++;
+        if ( !_dirty && count==(lUInt32)_files.length() )
+            return false;
+        _dirty = false;
+        SerialBuf buf( 16384, true );
+        buf.putMagic( FONT_CATALOG_MAGIC );
+        int start = buf.pos();
+        buf << count;
+        for ( int i=0; i<_files.length() && !buf.error(); i++ )
+            if ( _files[i]->used || !dropUnused )
+                _files[i]->serialize( buf );
+        buf.putCRC( buf.pos() - start );
+        if ( buf.error() )
+            return false;
+        LVStreamRef stream = LVOpenFileStream( _fileName.c_str(), LVOM_WRITE );
+        if ( stream.isNull() || stream->Write( buf.buf(), buf.pos(), NULL )!=LVERR_OK ) {
+            CRLog::error("Cannot write font catalog file %s", LCSTR(_fileName));
+            return false;
+        }
+        CRLog::info("Font catalog: %d font files saved to %s", count, LCSTR(_fileName));
+        return true;
+    }
+};
+
 #if (DEBUG_FONT_SYNTHESIS==1)
 static LVFontRef dumpFontRef( LVFontRef fnt ) {
     CRLog::trace("%s %d (%d) w=%d %s", fnt->getTypeFace().c_str(), fnt->getSize(), fnt->getHeight(), fnt->getWeight(), fnt->getItalic()?"italic":"" );
@@ -2230,11 +3100,12 @@ private:
     LVFontCache _cache;
     FT_Library  _library;
     LVFontGlobalGlyphCache _globalCache;
+    LVFontMetricsCacheList _metricsCaches;
     lString16 _requiredChars;
+    LVFontCatalog _catalog;
     #if (DEBUG_FONT_MAN==1)
     FILE * _log;
     #endif
-    LVMutex   _lock;
 public:
 
     /// get hash of installed fonts and fallback font
@@ -2296,16 +3167,25 @@ public:
         return bitmap;
     }
 
+    /// returns all font instances: their methods lock fonts, so they should be called out of FONT_MAN_GUARD
+    void getInstances( LVArray<LVFontRef> & list )
+    {
+        FONT_MAN_GUARD
+        LVPtrVector< LVFontCacheItem > * fonts = _cache.getInstances();
+        for ( int i=0; i<fonts->length(); i++ )
+            list.add( fonts->get(i)->getFont() );
+    }
+
     /// set antialiasing mode
     virtual void SetAntialiasMode( int mode )
     { 
         _antialiasMode = mode; 
         gc(); 
         clearGlyphCache();
-        FONT_MAN_GUARD
-        LVPtrVector< LVFontCacheItem > * fonts = _cache.getInstances();
-        for ( int i=0; i<fonts->length(); i++ ) {
-            fonts->get(i)->getFont()->setBitmapMode( isBitmapModeForSize( fonts->get(i)->getFont()->getHeight() ) );
+        LVArray<LVFontRef> fonts;
+        getInstances( fonts );
+        for ( int i=0; i<fonts.length(); i++ ) {
+            fonts[i]->setBitmapMode( isBitmapModeForSize( fonts[i]->getHeight() ) );
         }
     }
 
@@ -2313,14 +3193,17 @@ public:
     virtual void SetHintingMode(hinting_mode_t mode) {
         if (_hintingMode == mode)
             return;
-        FONT_MAN_GUARD
-        CRLog::debug("Hinting mode is changed: %d", (int)mode);
-        _hintingMode = mode;
-        gc();
-        clearGlyphCache();
-        LVPtrVector< LVFontCacheItem > * fonts = _cache.getInstances();
-        for ( int i=0; i<fonts->length(); i++ ) {
-            fonts->get(i)->getFont()->setHintingMode(mode);
+        LVArray<LVFontRef> fonts;
+        {
+            FONT_MAN_GUARD
+            CRLog::debug("Hinting mode is changed: %d", (int)mode);
+            _hintingMode = mode;
+            gc();
+            clearGlyphCache();
+            getInstances( fonts );
+        }
+        for ( int i=0; i<fonts.length(); i++ ) {
+            fonts[i]->setHintingMode(mode);
         }
     }
 
@@ -2332,13 +3215,16 @@ public:
     /// set antialiasing mode
     virtual void setKerning( bool kerning )
     {
-        FONT_MAN_GUARD
-        _allowKerning = kerning;
-        gc();
-        clearGlyphCache();
-        LVPtrVector< LVFontCacheItem > * fonts = _cache.getInstances();
-        for ( int i=0; i<fonts->length(); i++ ) {
-            fonts->get(i)->getFont()->setKerning( kerning );
+        LVArray<LVFontRef> fonts;
+        {
+            FONT_MAN_GUARD
+            _allowKerning = kerning;
+            gc();
+            clearGlyphCache();
+            getInstances( fonts );
+        }
+        for ( int i=0; i<fonts.length(); i++ ) {
+            fonts[i]->setKerning( kerning );
         }
     }
     /// clear glyph cache
@@ -2602,9 +3488,19 @@ public:
 
     virtual ~LVFreeTypeFontManager() 
     {
+        // fonts may be still referenced outside: drop their faces, glyphs and metrics caches while library
+        // and caches exist; font methods lock fonts, so it's done out of FONT_MAN_GUARD
+        LVArray<LVFontRef> fonts;
+        getInstances( fonts );
+        for ( int i=0; i<fonts.length(); i++ )
+            fonts[i]->Clear();
+        fonts.clear();
         FONT_MAN_GUARD
+        _catalog.save( true );
         _globalCache.clear();
         _cache.clear();
+        _metricsCaches.save();
+        _metricsCaches.clear();
         if ( _library )
             FT_Done_FreeType( _library );
     #if (DEBUG_FONT_MAN==1)
@@ -2614,7 +3510,7 @@ public:
     #endif
     }
 
-    LVFreeTypeFontManager()
+    LVFreeTypeFontManager( const lString16 & catalogFile, const lString16 & metricsCacheDir )
     : _library(NULL), _globalCache(GLYPH_CACHE_SIZE)
     {
         FONT_MAN_GUARD
@@ -2630,12 +3526,16 @@ public:
         }
     #endif
         _requiredChars = L"azAZ09";//\x0410\x042F\x0430\x044F";
+        _catalog.setFileName( catalogFile );
+        _metricsCaches.setDir( metricsCacheDir );
     }
 
     virtual void gc() // garbage collector
     {
         FONT_MAN_GUARD
         _cache.gc();
+        // metrics of dropped font instances
+        _metricsCaches.save();
     }
 
     lString8 makeFontFileName( lString8 name )
@@ -2647,6 +3547,44 @@ public:
         return filename;
     }
 
+    /// returns catalog entry for font file; file is opened only if it's not in catalog or has been changed
+    LVFontCatalogFile * getCatalogFile( const lString8 & fname )
+    {
+        lUInt64 size = 0;
+        lUInt64 modificationTime = 0;
+        if ( !LVGetFileInfo( fname, size, modificationTime ) ) {
+            CRLog::error("Font file %s is not found", fname.c_str());
+            return NULL;
+        }
+        LVFontCatalogFile * file = _catalog.find( fname, size, modificationTime );
+        if ( file )
+            return file;
+        file = new LVFontCatalogFile( fname, size, modificationTime );
+        fontFileScanCount++;
+        FT_Face face = NULL;
+        // for all faces in file
+        for ( int index = 0; ; index++ ) {
+            int error = FT_New_Face( _library, fname.c_str(), index, &face ); /* create face object */
+            if ( error ) {
+                if (index == 0) {
+                    CRLog::error("FT_New_Face returned error %d", error);
+                }
+                break;
+            }
+            LVFontCatalogFace * item = new LVFontCatalogFace();
+            item->read( face, index );
+            file->faces.add( item );
+            int num_faces = face->num_faces;
+            FT_Done_Face( face );
+            face = NULL;
+            if ( index>=num_faces-1 )
+                break;
+        }
+        // files which cannot be loaded are kept too, to not retry them until changed
+        _catalog.add( file );
+        return file;
+    }
+
     /// returns available typefaces
     virtual void getFaceList( lString16Collection & list )
     {
@@ -2693,33 +3631,23 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
             newDef.setTypeFace(alias);
             LVFontRef ref = item->getFont();
             _cache.update(&newDef, ref);*/
-            int index = 0;
-
-            FT_Face face = NULL;
+            LVFontCatalogFile * file = getCatalogFile( item->getDef()->getName() );
+            if ( !file )
+                return true;
 
             // for all faces in file
-            for ( ;; index++ ) {
-                int error = FT_New_Face( _library, item->getDef()->getName().c_str(), index, &face ); /* create face object */
-                if ( error ) {
-                    if (index == 0) {
-                        CRLog::error("FT_New_Face returned error %d", error);
-                    }
-                    break;
-                }
-                //bool scal = FT_IS_SCALABLE( face );
-                //bool charset = checkCharSet( face );
+            for ( int i=0; i<file->faces.length(); i++ ) {
+                LVFontCatalogFace * face = file->faces[i];
+                //bool scal = face->scalable;
+                //bool charset = face->hasChars( _requiredChars );
 
-                int num_faces = face->num_faces;
-
-                css_font_family_t fontFamily = css_ff_sans_serif;
-                if ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH )
-                    fontFamily = css_ff_monospace;
-                lString8 familyName(!facename.empty() ? facename : ::familyName(face));
+                css_font_family_t fontFamily = face->family==css_ff_monospace ? css_ff_monospace : css_ff_sans_serif;
+                lString8 familyName(!facename.empty() ? facename : face->typeface);
                 if ( familyName=="Times" || familyName=="Times New Roman" )
                     fontFamily = css_ff_serif;
 
-                bool boldFlag = !facename.empty() ? bold : (face->style_flags & FT_STYLE_FLAG_BOLD) != 0;
-                bool italicFlag = !facename.empty() ? italic : (face->style_flags & FT_STYLE_FLAG_ITALIC) != 0;
+                bool boldFlag = !facename.empty() ? bold : face->weight > 400;
+                bool italicFlag = !facename.empty() ? italic : face->italic;
 
                 LVFontDef def2(
                         item->getDef()->getName(),
@@ -2728,15 +3656,10 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
                         italicFlag,
                         fontFamily,
                         alias,
-                        index,
+                        face->index,
                         id
                 );
 
-                if ( face ) {
-                    FT_Done_Face( face );
-                    face = NULL;
-                }
-
                 if ( _cache.findDuplicate( &def2 ) ) {
                     CRLog::trace("font definition is duplicate");
                     return false;
@@ -2748,8 +3671,6 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
                     if ( !_cache.findDuplicate( &newDef ) )
                         _cache.update( &newDef, LVFontRef(NULL) );
                 }
-                if ( index>=num_faces-1 )
-                    break;
             }
             return true;
         }
@@ -2822,7 +3743,7 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
             fprintf(_log, "   no instance: adding new one for filename=%s, index = %d\n", fname.c_str(), index );
         }
     #endif
-        LVFreeTypeFace * font = new LVFreeTypeFace(_lock, _library, &_globalCache);
+        LVFreeTypeFace * font = new LVFreeTypeFace(_library, &_globalCache, &_metricsCaches);
         lString8 pathname = makeFontFileName( fname );
         //def.setName( fname );
         //def.setIndex( index );
@@ -2847,7 +3768,6 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
             //fprintf(_log, "    : loading from file %s : %s %d\n", item->getDef()->getName().c_str(),
             //    item->getDef()->getTypeFace().c_str(), item->getDef()->getSize() );
             LVFontRef ref(font);
-            font->setKerning( getKerning() );
             font->setFaceName( item->getDef()->getTypeFace() );
             newDef.setSize( size );
             //item->setFont( ref );
@@ -3043,55 +3963,33 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
 			name = name.substr(7);
 		lString8 fname = UnicodeToUtf8(name);
 
+        FONT_MAN_GUARD
+        LVFontCatalogFile * file = getCatalogFile( fname );
+        if ( !file )
+            return false;
         bool res = false;
 
-        int index = 0;
-
-        FT_Face face = NULL;
-
         // for all faces in file
-        for ( ;; index++ ) {
-            int error = FT_New_Face( _library, fname.c_str(), index, &face ); /* create face object */
-            if ( error ) {
-                if (index == 0) {
-                    CRLog::error("FT_New_Face returned error %d", error);
-                }
-                break;
-            }
-            bool scal = FT_IS_SCALABLE( face );
-            bool charset = checkCharSet( face );
+        for ( int i=0; i<file->faces.length(); i++ ) {
+            LVFontCatalogFace * face = file->faces[i];
+            bool scal = face->scalable;
+            bool charset = face->hasChars( _requiredChars );
             //bool monospaced = isMonoSpaced( face );
             if ( !scal || !charset ) {
-    //#if (DEBUG_FONT_MAN==1)
-     //           if ( _log ) {
                 CRLog::debug("    won't register font %s: %s",
                     name.c_str(), !charset?"no mandatory characters in charset" : "font is not scalable"
                     );
-    //            }
-    //#endif
-                if ( face ) {
-                    FT_Done_Face( face );
-                    face = NULL;
-                }
                 break;
             }
-            int num_faces = face->num_faces;
-
-            css_font_family_t fontFamily = css_ff_sans_serif;
-            if ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH )
-                fontFamily = css_ff_monospace;
-            lString8 familyName( ::familyName(face) );
-            if ( familyName=="Times" || familyName=="Times New Roman" )
-                fontFamily = css_ff_serif;
 
             LVFontDef def(
                 fname,
                 -1, // height==-1 for scalable fonts
                 bold?700:400,
                 italic?true:false,
-                fontFamily,
+                face->family,
                 family_name,
-                index
+                face->index
             );
     #if (DEBUG_FONT_MAN==1)
         if ( _log ) {
@@ -3112,14 +4010,6 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
                     _cache.update( &newDef, LVFontRef(NULL) );
             }
             res = true;
-
-            if ( face ) {
-                FT_Done_Face( face );
-                face = NULL;
-            }
-
-            if ( index>=num_faces-1 )
-                break;
         }
 
         return res;
@@ -3142,55 +4032,32 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
             );
         }
     #endif
+        LVFontCatalogFile * file = getCatalogFile( fname );
+        if ( !file )
+            return false;
         bool res = false;
 
-        int index = 0;
-
-        FT_Face face = NULL;
-
         // for all faces in file
-        for ( ;; index++ ) {
-            int error = FT_New_Face( _library, fname.c_str(), index, &face ); /* create face object */
-            if ( error ) {
-                if (index == 0) {
-                    CRLog::error("FT_New_Face returned error %d", error);
-                }
-                break;
-            }
-            bool scal = FT_IS_SCALABLE( face );
-            bool charset = checkCharSet( face );
+        for ( int i=0; i<file->faces.length(); i++ ) {
+            LVFontCatalogFace * face = file->faces[i];
+            bool scal = face->scalable;
+            bool charset = face->hasChars( _requiredChars );
             //bool monospaced = isMonoSpaced( face );
             if ( !scal || !charset ) {
-    //#if (DEBUG_FONT_MAN==1)
-     //           if ( _log ) {
                 CRLog::debug("    won't register font %s: %s",
                     name.c_str(), !charset?"no mandatory characters in charset" : "font is not scalable"
                     );
-    //            }
-    //#endif
-                if ( face ) {
-                    FT_Done_Face( face );
-                    face = NULL;
-                }
                 break;
             }
-            int num_faces = face->num_faces;
-
-            css_font_family_t fontFamily = css_ff_sans_serif;
-            if ( face->face_flags & FT_FACE_FLAG_FIXED_WIDTH )
-                fontFamily = css_ff_monospace;
-            lString8 familyName( ::familyName(face) );
-            if ( familyName=="Times" || familyName=="Times New Roman" )
-                fontFamily = css_ff_serif;
 
             LVFontDef def(
                 name,
                 -1, // height==-1 for scalable fonts
-                ( face->style_flags & FT_STYLE_FLAG_BOLD ) ? 700 : 400,
-                ( face->style_flags & FT_STYLE_FLAG_ITALIC ) ? true : false,
-                fontFamily,
-                familyName,
-                index
+                face->weight,
+                face->italic,
+                face->family,
+                face->typeface,
+                face->index
             );
     #if (DEBUG_FONT_MAN==1)
         if ( _log ) {
@@ -3200,11 +4067,6 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
         }
     #endif
 
-			if ( face ) {
-				FT_Done_Face( face );
-				face = NULL;
-			}
-
 			if ( _cache.findDuplicate( &def ) ) {
                 CRLog::trace("font definition is duplicate");
                 return false;
@@ -3217,9 +4079,6 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
                     _cache.update( &newDef, LVFontRef(NULL) );
             }
             res = true;
-
-            if ( index>=num_faces-1 )
-                break;
         }
 
         return res;
@@ -3229,6 +4088,11 @@ bool setalias(lString8 alias,lString8 facename,int id,bool italic, bool bold)
     {
         _path = path;
         initSystemFonts();
+        {
+            FONT_MAN_GUARD
+            // persist catalog entries of system fonts; fonts registered later are saved on shutdown
+            _catalog.save( false );
+        }
         return (_library != NULL);
     }
 };
@@ -3575,7 +4439,7 @@ bool InitFontManager( lString8 path )
 #if (USE_WIN32_FONTS==1)
     fontMan = new LVWin32FontManager;
 #elif (USE_FREETYPE==1)
-    fontMan = new LVFreeTypeFontManager;
+    fontMan = new LVFreeTypeFontManager( fontCatalogFileName, fontMetricsCacheDir );
 #else
     fontMan = new LVBitmapFontManager;
 #endif
@@ -3593,6 +4457,44 @@ bool ShutdownFontManager()
     return false;
 }
 
+#if (USE_FREETYPE==1)
+// unit test hooks, declared in crtest.cpp
+
+/// creates FreeType font manager without system fonts, which keeps font catalog and metrics caches in specified places
+LVFontManager * createFreeTypeFontManager( lString16 catalogFile, lString16 metricsCacheDir )
+{
+    return new LVFreeTypeFontManager( catalogFile, metricsCacheDir );
+}
+
+/// returns number of font files opened to read their faces, which were not found in font catalog
+int getFontFileScanCount()
+{
+    FONT_MAN_GUARD
+    return fontFileScanCount;
+}
+
+/// checks font metrics cache file, returns number of measured characters in it, -1 if file is broken
+int checkFontMetricsCacheFile( lString16 fileName )
+{
+    LVStreamRef stream = LVMapFileStream( fileName.c_str(), LVOM_READ, 0 );
+    if ( stream.isNull() )
+        return -1;
+    lvsize_t size = stream->GetSize();
+    LVStreamBufferRef buf = stream->GetReadBuffer( 0, size );
+    if ( buf.isNull() || !buf->getReadOnly() )
+        return -1;
+    int pageCount = checkFontMetricsFile( buf->getReadOnly(), size );
+    if ( pageCount < 0 )
+        return -1;
+    const LVFontCharMetrics * m = (const LVFontCharMetrics *)(buf->getReadOnly() + sizeof(LVFontMetricsFileHeader));
+    int count = 0;
+    for ( int i=0; i<pageCount * FONT_METRICS_PAGE_SIZE; i++ )
+        if ( m[i].advance!=FONT_METRICS_UNKNOWN )
+            count++;
+    return count;
+}
+#endif
+
 int LVFontDef::CalcDuplicateMatch( const LVFontDef & def ) const
 {
     if (def._documentId != -1 && _documentId != def._documentId)
@@ -3681,8 +4583,10 @@ void LVBaseFont::DrawTextString( LVDrawBuf * buf, int x, int y,
                       item->bmp,
                       item->bmp_width,
                       item->bmp_height,
-                      palette);
+                      palette,
+                      item->bmp_pitch);
               }
+              item->release();
           }
           x  += w; // + letter_spacing;
 
@@ -1810,13 +1810,8 @@ inline void spreadParent( css_length_t & val, css_length_t & parent_val, bool in
         val = parent_val;
 }
 
-void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef parent_font )
+void calcNodeStyle( ldomNode * enode, LVStyleSheet * stylesheet, const css_style_ref_t & parent_style, int baseFontSize, css_style_rec_t * pstyle )
 {
-    CR_UNUSED(parent_font);
-    //lvdomElementFormatRec * fmt = node->getRenderData();
-    css_style_ref_t style( new css_style_rec_t );
-    css_style_rec_t * pstyle = style.get();
-
 //    if ( parent_style.isNull() ) {
 //        CRLog::error("parent style is null!!!");
 //    }
@@ -1829,19 +1824,18 @@ void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef par
         pstyle->white_space = type_ptr->white_space;
     }
 
-    int baseFontSize = enode->getDocument()->getDefaultFont()->getSize();
-
     //////////////////////////////////////////////////////
     // apply style sheet
     //////////////////////////////////////////////////////
-    enode->getDocument()->applyStyle( enode, pstyle );
+    stylesheet->apply( enode, pstyle );
 
     if ( enode->getDocument()->getDocFlag(DOC_FLAG_ENABLE_INTERNAL_STYLES) && enode->hasAttribute( LXML_NS_ANY, attr_style ) ) {
-        lString16 nodeStyle = enode->getAttributeValue( LXML_NS_ANY, attr_style );
+        // no copies of shared strings here: may be called from several threads
+        const lString16 & nodeStyle = enode->getAttributeValue( LXML_NS_ANY, attr_style );
         if ( !nodeStyle.empty() ) {
-            nodeStyle = cs16("{") + nodeStyle + "}";
+            lString8 s8( "{" );
+            s8 << UnicodeToUtf8(nodeStyle) << "}";
             LVCssDeclaration decl;
-            lString8 s8 = UnicodeToUtf8(nodeStyle);
             const char * s = s8.c_str();
             if ( decl.parse( s ) ) {
                 decl.apply( pstyle );
@@ -1981,6 +1975,21 @@ void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef par
     spreadParent( pstyle->line_height, parent_style->line_height );
     spreadParent( pstyle->color, parent_style->color );
     spreadParent( pstyle->background_color, parent_style->background_color, false );
+}
+
+void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef parent_font )
+{
+    CR_UNUSED(parent_font);
+    // reuse style and font of sibling with the same matching rules and attributes
+    ldomNode * sibling = enode->getDocument()->findStyleSharingSibling( enode, parent_style );
+    if ( sibling ) {
+        enode->getDocument()->copyNodeStyle( enode->getDataIndex(), sibling->getDataIndex() );
+        return;
+    }
+    //lvdomElementFormatRec * fmt = node->getRenderData();
+    css_style_ref_t style( new css_style_rec_t );
+    calcNodeStyle( enode, enode->getDocument()->getStyleSheet(), parent_style,
+                   enode->getDocument()->getDefaultFont()->getSize(), style.get() );
 
     // set calculated style
     //enode->getDocument()->cacheStyle( style );
@@ -1992,6 +2001,7 @@ void setNodeStyle( ldomNode * enode, css_style_ref_t parent_style, LVFontRef par
 
     // set font
     enode->initNodeFont();
+    enode->getDocument()->addStyleSharingSibling( enode, parent_style );
 }
 
 int renderTable( LVRendPageContext & context, ldomNode * node, int x, int y, int width )
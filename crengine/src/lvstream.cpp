@@ -318,6 +318,35 @@ lverror_t LVStream::getcrc32( lUInt32 & dst )
     }
 }
 
+#define FINGERPRINT_SAMPLE_SIZE 4096
+#define FINGERPRINT_SAMPLE_COUNT 4
+
+/// calculate fingerprint of stream: size, modification time and hashes of few sampled blocks
+lverror_t LVStream::getFingerprint( lUInt64 & dst )
+{
+    dst = 0;
+    if ( GetMode() != LVOM_READ && GetMode() != LVOM_APPEND )
+        return LVERR_NOTIMPL;
+    lvpos_t savepos = GetPos();
+    lvsize_t size = GetSize();
+    lUInt8 buf[FINGERPRINT_SAMPLE_SIZE];
+    lUInt64 hash = (lUInt64)size * 1000003 + getModificationTime();
+    int count = size > FINGERPRINT_SAMPLE_SIZE ? FINGERPRINT_SAMPLE_COUNT : 1;
+    for ( int i = 0; i < count; i++ ) {
+        // first and last blocks, and blocks evenly spaced between them
+        lvpos_t pos = count > 1 ? (lvpos_t)((lUInt64)(size - FINGERPRINT_SAMPLE_SIZE) * i / (count - 1)) : 0;
+        lvsize_t sz = size < FINGERPRINT_SAMPLE_SIZE ? size : FINGERPRINT_SAMPLE_SIZE;
+        lvsize_t bytesRead = 0;
+        if ( SetPos( pos )!=pos || Read( buf, sz, &bytesRead )!=LVERR_OK || bytesRead!=sz ) {
+            SetPos( savepos );
+            return LVERR_FAIL;
+        }
+        hash = hash * 1000003 + lStr_crc32( 0, buf, sz );
+    }
+    SetPos( savepos );
+    dst = hash;
+    return LVERR_OK;
+}
 
 //#if USE__FILES==1
 #if defined(_LINUX) || defined(_WIN32)
@@ -1024,6 +1053,21 @@ public:
     {
         return m_size<=m_pos;
     }
+    /// returns file modification time
+    virtual lUInt64 getModificationTime()
+    {
+#ifdef _WIN32
+        FILETIME ft;
+        if ( m_hFile==INVALID_HANDLE_VALUE || !GetFileTime( m_hFile, NULL, NULL, &ft ) )
+            return 0;
+        return ((lUInt64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+#else
+        struct stat st;
+        if ( m_fd==-1 || fstat( m_fd, &st )!=0 )
+            return 0;
+        return (lUInt64)st.st_mtime;
+#endif
+    }
 //    virtual LVContainer * GetParentContainer()
 //    {
 //        return (LVContainer*)m_parent;
@@ -1108,15 +1152,21 @@ public:
         if (!Seek(size, LVSEEK_SET, NULL))
             return LVERR_FAIL;
         SetEndOfFile( m_hFile);
+        m_size = size;
+        if (oldpos > size)
+            oldpos = size;
         Seek(oldpos, LVSEEK_SET, NULL);
         return LVERR_OK;
 #else
-        if (m_fd == -1)
+        if (m_fd == -1 || m_mode==LVOM_READ)
             return LVERR_FAIL;
         lvpos_t oldpos;
         Tell(&oldpos);
-        if (!Seek(size, LVSEEK_SET, NULL))
+        if (ftruncate(m_fd, (off_t)size) != 0)
             return LVERR_FAIL;
+        m_size = size;
+        if (oldpos > size)
+            oldpos = size;
         Seek(oldpos, LVSEEK_SET, NULL);
         return LVERR_OK;
 #endif
@@ -1891,6 +1941,16 @@ public:
         return m_stream->getcrc32( dst );
     }
 
+    virtual lUInt64 getModificationTime()
+    {
+        return m_stream->getModificationTime();
+    }
+
+    virtual lverror_t getFingerprint( lUInt64 & dst )
+    {
+        return m_stream->getFingerprint( dst );
+    }
+
     virtual bool Eof()
     {
         return m_pos >= m_size;
@@ -2371,6 +2431,15 @@ public:
         return LVERR_OK;
     }
 
+    /// size and CRC from archive header identify entry without decoding of sampled blocks
+    virtual lverror_t getFingerprint( lUInt64 & dst )
+    {
+        if ( !m_originalCRC )
+            return LVNamedStream::getFingerprint( dst );
+        dst = ((lUInt64)m_unpacksize << 32) ^ m_originalCRC;
+        return LVERR_OK;
+    }
+
     virtual bool Eof()
     {
         return m_outbytesleft==0; //m_pos >= m_size;
@@ -3849,6 +3918,38 @@ bool LVFileExists( const lString16 & pathName )
 #endif
 }
 
+/// reads size and modification time of file without opening it, returns false if file does not exist
+bool LVGetFileInfo( const lString8 & pathName, lUInt64 & size, lUInt64 & modificationTime ) {
+    return LVGetFileInfo(Utf8ToUnicode(pathName), size, modificationTime);
+}
+
+/// reads size and modification time of file without opening it, returns false if file does not exist
+bool LVGetFileInfo( const lString16 & pathName, lUInt64 & size, lUInt64 & modificationTime )
+{
+    size = 0;
+    modificationTime = 0;
+    if (pathName.length() > 1 && pathName[0] == ASSET_PATH_PREFIX)
+        return false; // assets have no file attributes
+#if !defined(__SYMBIAN32__) && defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if ( !GetFileAttributesExW( pathName.c_str(), GetFileExInfoStandard, &data ) )
+        return false;
+    if ( data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+        return false;
+    size = ((lUInt64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    // same value as LVFileStream::getModificationTime()
+    modificationTime = ((lUInt64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    return true;
+#else
+    struct stat st;
+    if ( stat( UnicodeToUtf8(pathName).c_str(), &st )!=0 || !S_ISREG(st.st_mode) )
+        return false;
+    size = (lUInt64)st.st_size;
+    modificationTime = (lUInt64)st.st_mtime;
+    return true;
+#endif
+}
+
 /// returns true if directory exists and your app can write to directory
 bool LVDirectoryIsWritable(const lString16 & pathName) {
     lString16 fn = pathName;
@@ -4065,7 +4166,8 @@ class LVBlockWriteStream : public LVNamedStream
             }
             for (unsigned i = 0; i < len; i++ ) {
                 lUInt8 ch1 = buf[offset+i];
-                if ( pos+i>block_end || ch1!=ptr[i] ) {
+                // bytes beyond block_end are not in file yet: they are written even if equal to buffer contents
+                if ( pos+i>=block_end || ch1!=ptr[i] ) {
                     buf[offset+i] = ptr[i];
                     if ( modified_start==(lvpos_t)-1 ) {
                         modified_start = pos + i;
@@ -4075,9 +4177,9 @@ class LVBlockWriteStream : public LVNamedStream
                             modified_start = pos+i;
                         if ( modified_end<pos+i+1)
                             modified_end = pos+i+1;
-                        if ( block_end<pos+i+1)
-                            block_end = pos+i+1;
                     }
+                    if ( block_end<pos+i+1)
+                        block_end = pos+i+1;
                 }
             }
 
@@ -4348,10 +4450,14 @@ public:
     }
     virtual lverror_t SetSize( lvsize_t size )
     {
-        // TODO:
+        // write and drop cached blocks, so that none of them extends file again later
+        Flush( false );
         lverror_t res = _baseStream->SetSize(size);
-        if ( res==LVERR_OK )
+        if ( res==LVERR_OK ) {
             _size = size;
+            if ( _pos > _size )
+                _pos = _size;
+        }
         return res;
     }
 
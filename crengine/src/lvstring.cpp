@@ -12,6 +12,7 @@
 *******************************************************/
 
 #include "../include/lvstring.h"
+#include "../include/crlocks.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
@@ -59,6 +60,39 @@ static lChar16 empty_str_16[] = {0};
 static lstring16_chunk_t empty_chunk_16(empty_str_16);
 lstring16_chunk_t * lString16::EMPTY_STR_16 = &empty_chunk_16;
 
+/// guards chunk pool and constant string tables while strings are used by several threads
+static CRMutex * ls_storage_mutex = NULL;
+bool ls_storage_threading = false;
+
+void enable_ls_storage_threading( CRMutex * mutex )
+{
+    if ( (mutex!=NULL)==ls_storage_threading )
+        crFatalError(-1, "enable_ls_storage_threading: mode is already set");
+    ls_storage_mutex = mutex;
+    ls_storage_threading = mutex!=NULL;
+}
+
+int ls_atomic_add( int * counter, int delta )
+{
+#if defined(_MSC_VER)
+    return InterlockedExchangeAdd( (volatile LONG *)counter, delta ) + delta;
+#else
+    return __sync_add_and_fetch( counter, delta );
+#endif
+}
+
+lInt64 ls_atomic_add64( lInt64 * counter, lInt64 delta )
+{
+#if defined(_MSC_VER)
+    return InterlockedExchangeAdd64( (volatile LONGLONG *)counter, delta ) + delta;
+#else
+    return __sync_add_and_fetch( counter, delta );
+#endif
+}
+
+// use LS_STORAGE_GUARD to access chunk pool or constant string tables
+#define LS_STORAGE_GUARD CRGuard _lsStorageGuard(ls_storage_mutex); CR_UNUSED(_lsStorageGuard);
+
 //================================================================================
 // atomic string storages for string literals
 //================================================================================
@@ -69,6 +103,7 @@ static int size_8 = 0;
 
 /// get reference to atomic constant string for string literal e.g. cs8("abc") -- fast and memory effective
 const lString8 & cs8(const char * str) {
+    LS_STORAGE_GUARD
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
         const void * p = const_ptrs_8[index];
@@ -98,6 +133,7 @@ static int size_16 = 0;
 
 /// get reference to atomic constant wide string for string literal e.g. cs16("abc") -- fast and memory effective
 const lString16 & cs16(const char * str) {
+    LS_STORAGE_GUARD
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
         const void * p = const_ptrs_16[index];
@@ -123,6 +159,7 @@ const lString16 & cs16(const char * str) {
 
 /// get reference to atomic constant wide string for string literal e.g. cs16(L"abc") -- fast and memory effective
 const lString16 & cs16(const lChar16 * str) {
+    LS_STORAGE_GUARD
     int index = (((int)((ptrdiff_t)str)) * CONST_STRING_BUFFER_HASH_MULT) & CONST_STRING_BUFFER_MASK;
     for (;;) {
         const void * p = const_ptrs_16[index];
@@ -250,6 +287,7 @@ void free_ls_storage()
 
 lstring8_chunk_t * lstring8_chunk_t::alloc()
 {
+    LS_STORAGE_GUARD
     if (!slices_initialized)
         init_ls_storage();
     // search for existing slice
@@ -268,6 +306,7 @@ lstring8_chunk_t * lstring8_chunk_t::alloc()
 
 void lstring8_chunk_t::free( lstring8_chunk_t * pChunk )
 {
+    LS_STORAGE_GUARD
     for (int i=slices_count-1; i>=0; --i)
     {
         if (slices[i]->free_chunk(pChunk))
@@ -278,6 +317,7 @@ void lstring8_chunk_t::free( lstring8_chunk_t * pChunk )
 
 lstring16_chunk_t * lstring16_chunk_t::alloc()
 {
+    LS_STORAGE_GUARD
     if (!slices_initialized)
         init_ls_storage();
     // search for existing slice
@@ -296,6 +336,7 @@ lstring16_chunk_t * lstring16_chunk_t::alloc()
 
 void lstring16_chunk_t::free( lstring16_chunk_t * pChunk )
 {
+    LS_STORAGE_GUARD
     for (int i=slices_count-1; i>=0; --i)
     {
         if (slices[i]->free_chunk16(pChunk))
@@ -576,6 +617,7 @@ void lString16::free()
     //assert(pchunk->buf16[pchunk->len]==0);
     ::free(pchunk->buf16);
 #if (LDOM_USE_OWN_MEM_MAN == 1)
+    LS_STORAGE_GUARD
     for (int i=slices_count-1; i>=0; --i)
     {
         if (slices[i]->free_chunk16(pchunk))
@@ -688,7 +730,7 @@ lString16 & lString16::assign(const lChar16 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -717,7 +759,7 @@ lString16 & lString16::assign(const lChar8 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -746,7 +788,7 @@ lString16 & lString16::assign(const lChar16 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -775,7 +817,7 @@ lString16 & lString16::assign(const lChar8 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -820,7 +862,7 @@ lString16 & lString16::assign(const lString16 & str, size_type offset, size_type
         }
         else
         {
-            if (pchunk->nref==1)
+            if (refs()==1)
             {
                 if (pchunk->size<=count)
                 {
@@ -853,7 +895,7 @@ lString16 & lString16::erase(size_type offset, size_type count)
     else
     {
         size_type newlen = length()-count;
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             _lStr_memcpy( pchunk->buf16+offset, pchunk->buf16+offset+count, newlen-offset+1 );
         }
@@ -873,7 +915,7 @@ lString16 & lString16::erase(size_type offset, size_type count)
 
 void lString16::reserve(size_type n)
 {
-    if (pchunk->nref==1)
+    if (refs()==1)
     {
         if (pchunk->size < n)
         {
@@ -893,7 +935,7 @@ void lString16::reserve(size_type n)
 
 void lString16::lock( size_type newsize )
 {
-    if (pchunk->nref>1)
+    if (refs()>1)
     {
         lstring_chunk_t * poldchunk = pchunk;
         release();
@@ -910,7 +952,7 @@ void lString16::lock( size_type newsize )
 // lock string, allocate buffer and reset length to 0
 void lString16::reset( size_type size )
 {
-    if (pchunk->nref>1 || pchunk->size<size)
+    if (refs()>1 || pchunk->size<size)
     {
         release();
         alloc( size );
@@ -1039,7 +1081,7 @@ lString16 & lString16::pack()
 {
     if (pchunk->len + 4 < pchunk->size )
     {
-        if (pchunk->nref>1)
+        if (refs()>1)
         {
             lock(pchunk->len);
         }
@@ -1076,7 +1118,7 @@ lString16 & lString16::trimNonAlpha()
     int newlen = lastns-firstns+1;
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (refs()==1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf16, pchunk->buf16+firstns, newlen );
@@ -1114,7 +1156,7 @@ lString16 & lString16::trim()
     int newlen = lastns-firstns+1;
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (refs()==1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf16, pchunk->buf16+firstns, newlen );
@@ -1514,6 +1556,8 @@ bool lString16HashedCollection::deserialize( SerialBuf & buf )
     if ( buf.error() )
         return false;
     clear();
+    clearHash(); // drop indexes of previous contents
+    hashSize = 0;
     int start = buf.pos();
     buf.putMagic( str_hash_magic );
     lInt32 count = 0;
@@ -1669,6 +1713,7 @@ void lString8::free()
     CHECK_STARTUP_STAGE;
     ::free(pchunk->buf8);
 #if (LDOM_USE_OWN_MEM_MAN == 1)
+    LS_STORAGE_GUARD
     for (int i=slices_count-1; i>=0; --i)
     {
         if (slices[i]->free_chunk(pchunk))
@@ -1765,7 +1810,7 @@ lString8 & lString8::assign(const lChar8 * str)
     else
     {
         size_type len = _lStr_len(str);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -1794,7 +1839,7 @@ lString8 & lString8::assign(const lChar8 * str, size_type count)
     else
     {
         size_type len = _lStr_nlen(str, count);
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             if (pchunk->size<=len)
             {
@@ -1839,7 +1884,7 @@ lString8 & lString8::assign(const lString8 & str, size_type offset, size_type co
         }
         else
         {
-            if (pchunk->nref==1)
+            if (refs()==1)
             {
                 if (pchunk->size<=count)
                 {
@@ -1872,7 +1917,7 @@ lString8 & lString8::erase(size_type offset, size_type count)
     else
     {
         size_type newlen = length()-count;
-        if (pchunk->nref==1)
+        if (refs()==1)
         {
             _lStr_memcpy( pchunk->buf8+offset, pchunk->buf8+offset+count, newlen-offset+1 );
         }
@@ -1892,7 +1937,7 @@ lString8 & lString8::erase(size_type offset, size_type count)
 
 void lString8::reserve(size_type n)
 {
-    if (pchunk->nref==1)
+    if (refs()==1)
     {
         if (pchunk->size < n)
         {
@@ -1912,7 +1957,7 @@ void lString8::reserve(size_type n)
 
 void lString8::lock( size_type newsize )
 {
-    if (pchunk->nref>1)
+    if (refs()>1)
     {
         lstring_chunk_t * poldchunk = pchunk;
         release();
@@ -1929,7 +1974,7 @@ void lString8::lock( size_type newsize )
 // lock string, allocate buffer and reset length to 0
 void lString8::reset( size_type size )
 {
-    if (pchunk->nref>1 || pchunk->size<size)
+    if (refs()>1 || pchunk->size<size)
     {
         release();
         alloc( size );
@@ -2382,7 +2427,7 @@ lString8 & lString8::pack()
 {
     if (pchunk->len + 4 < pchunk->size )
     {
-        if (pchunk->nref>1)
+        if (refs()>1)
         {
             lock(pchunk->len);
         }
@@ -2419,7 +2464,7 @@ lString8 & lString8::trim()
     int newlen = (int)(lastns - firstns + 1);
     if (newlen == pchunk->len)
         return *this;
-    if (pchunk->nref == 1)
+    if (refs()==1)
     {
         if (firstns>0)
             lStr_memcpy( pchunk->buf8, pchunk->buf8+firstns, newlen );
@@ -2840,7 +2885,7 @@ int Utf8CharCount( const lChar8 * str, int len )
     int count = 0;
     lUInt8 ch;
     const lChar8 * endp = str + len;
-    while ((ch=*str++)) {
+    while (str < endp && (ch=*str++)) {
         if ( (ch & 0x80) == 0 ) {
         } else if ( (ch & 0xE0) == 0xC0 ) {
             str++;
@@ -4884,6 +4929,36 @@ SerialBuf & SerialBuf::operator >> ( lString16 & s )
 	return *this;
 }
 
+/// put unsigned number using 7 bits per byte, high bit is set when more bytes follow
+void SerialBuf::putVarUInt( lUInt32 n )
+{
+    while ( n >= 0x80 ) {
+        if ( check(1) )
+            return;
+        _buf[_pos++] = (lUInt8)((n & 0x7F) | 0x80);
+        n >>= 7;
+    }
+    if ( check(1) )
+        return;
+    _buf[_pos++] = (lUInt8)n;
+}
+
+/// read number written by putVarUInt()
+lUInt32 SerialBuf::getVarUInt()
+{
+    lUInt32 n = 0;
+    for ( int shift = 0; shift < 35; shift += 7 ) {
+        if ( check(1) )
+            return 0;
+        lUInt8 b = _buf[_pos++];
+        n |= ((lUInt32)(b & 0x7F)) << shift;
+        if ( !(b & 0x80) )
+            return n;
+    }
+    seterror(); // too long
+    return 0;
+}
+
 // read methods
 bool SerialBuf::checkMagic( const char * s )
 {
@@ -17,6 +17,7 @@
 #include "../include/lvtinydom.h"
 #include "../include/fb2def.h"
 #include "../include/lvstream.h"
+#include "../include/crconcurrent.h"
 
 // define to dump all tokens
 //#define DUMP_CSS_PARSING
@@ -768,6 +769,7 @@ bool LVCssDeclaration::parse( const char * &decl )
     if (buf_pos)
     {
         buf[buf_pos++] = cssd_stop; // add end marker
+        _size = buf_pos;
         _data = new int[buf_pos];
         for (int i=0; i<buf_pos; i++)
             _data[i] = buf[i];
@@ -932,6 +934,35 @@ lUInt32 LVCssDeclaration::getHash() {
     return hash;
 }
 
+void LVCssDeclaration::serialize( SerialBuf & buf )
+{
+    buf << (lUInt32)_size;
+    for ( int i = 0; i < _size; i++ )
+        buf << (lInt32)_data[i];
+}
+
+bool LVCssDeclaration::deserialize( SerialBuf & buf )
+{
+    lUInt32 size = 0;
+    buf >> size;
+    if ( buf.error() || size > (lUInt32)buf.space() / 4 )
+        return false;
+    if ( _data ) {
+        delete[] _data;
+        _data = NULL;
+    }
+    _size = size;
+    if ( !size )
+        return true;
+    _data = new int[size];
+    for ( int i = 0; i < _size; i++ ) {
+        lInt32 v = 0;
+        buf >> v;
+        _data[i] = v;
+    }
+    return !buf.error() && _data[_size - 1] == cssd_stop;
+}
+
 static bool parse_ident( const char * &str, char * ident )
 {
     *ident = 0;
@@ -1000,20 +1031,19 @@ bool LVCssSelectorRule::check( const ldomNode * & node )
         }
         break;
     case cssrt_attreq:        // E[foo="value"]
+    case cssrt_id:            // E#id
         {
-            lString16 val = node->getAttributeValue(_attrid);
-            bool res = (val == _value);
-            //if ( res )
-            //    return true;
-            //CRLog::trace("attreq: %s %s", LCSTR(val), LCSTR(_value) );
-            return res;
+            lUInt32 valueIndex = node->getAttributeValueIndex(_attrid);
+            if ( valueIndex==LXML_ATTR_VALUE_NONE )
+                return _value.empty();
+            return node->getDocument()->getAttrValueCssNameId(valueIndex) == _valueId;
         }
         break;
     case cssrt_attrhas:       // E[foo~="value"]
         // one of space separated values
         {
-            lString16 val = node->getAttributeValue(_attrid);
-            int p = val.pos( lString16(_value.c_str()) );            
+            const lString16 & val = node->getAttributeValue(_attrid);
+            int p = val.pos( _value.c_str() );
             if (p<0)
                 return false;
             if ( (p>0 && val[p-1]!=' ') 
@@ -1025,31 +1055,21 @@ bool LVCssSelectorRule::check( const ldomNode * & node )
     case cssrt_attrstarts:    // E[foo|="value"]
         // todo
         {
-            lString16 val = node->getAttributeValue(_attrid);
-            if (_value.length()>val.length())
-                return false;
-            val = val.substr(0, _value.length());
-            return val == _value;
-        }
-        break;
-    case cssrt_id:            // E#id
-        // todo
-        {
-            lString16 val = node->getAttributeValue(attr_id);
-            if (_value.length()>val.length())
-                return false;
-            return val == _value;
+            const lString16 & val = node->getAttributeValue(_attrid);
+            return val.startsWith( _value.c_str() );
         }
         break;
     case cssrt_class:         // E.class
-        // todo
+        // one of space separated lowercase class names
         {
-            lString16 val = node->getAttributeValue(attr_class);
-            val.lowercase();
-//            if ( val.length() != _value.length() )
-//                return false;
-            //CRLog::trace("attr_class: %s %s", LCSTR(val), LCSTR(_value) );
-            return val == _value;
+            lUInt32 valueIndex = node->getAttributeValueIndex(attr_class);
+            if ( valueIndex==LXML_ATTR_VALUE_NONE )
+                return false;
+            const lUInt16 * ids = node->getDocument()->getClassNameIds(valueIndex);
+            for ( int i=1; i<=ids[0]; i++ )
+                if ( ids[i]==_valueId )
+                    return true;
+            return false;
         }
         break;
     case cssrt_universal:     // *
@@ -1134,7 +1154,7 @@ LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
         LVCssSelectorRule * rule = new LVCssSelectorRule(cssrt_class);
         lString16 s( attrvalue );
         s.lowercase();
-        rule->setAttr(attr_class, s);
+        rule->setAttr(attr_class, s, doc->getCssNameId(s));
         return rule;
     } else if ( *str=='#' ) {
         // E#id
@@ -1145,7 +1165,7 @@ LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
         skip_spaces( str );
         LVCssSelectorRule * rule = new LVCssSelectorRule(cssrt_id);
         lString16 s( attrvalue );
-        rule->setAttr(attr_id, s);
+        rule->setAttr(attr_id, s, doc->getCssNameId(s));
         return rule;
     } else if (*str != '[')
         return NULL;
@@ -1188,7 +1208,7 @@ LVCssSelectorRule * parse_attr( const char * &str, lxmlDocBase * doc )
     LVCssSelectorRule * rule = new LVCssSelectorRule(st);
     lString16 s( attrvalue );
     lUInt16 id = doc->getAttrNameIndex( lString16(attrname).c_str() );
-    rule->setAttr(id, s);
+    rule->setAttr(id, s, doc->getCssNameId(s));
     return rule;
 }
 
@@ -1221,7 +1241,7 @@ bool LVCssSelector::parse( const char * &str, lxmlDocBase * doc )
             skip_spaces( str );
             _id = 0;
         } 
-        else if ( *str == '.' ) // classname follows
+        else if ( *str == '.' || *str == '#' ) // classname or id follows
         {
             _id = 0;
         }
@@ -1238,8 +1258,10 @@ bool LVCssSelector::parse( const char * &str, lxmlDocBase * doc )
         {
             return false;
         }
-        if ( *str == ',' || *str == '{' )
+        if ( *str == ',' || *str == '{' ) {
+            updateSpecificity();
             return true;
+        }
         // one or more attribute rules
         bool attr_rule = false;
         while ( *str == '[' || *str=='.' || *str=='#' )
@@ -1292,11 +1314,47 @@ bool LVCssSelector::parse( const char * &str, lxmlDocBase * doc )
         }
         if ( !attr_rule )
             return false;
-        else if ( *str == ',' || *str == '{' )
+        else if ( *str == ',' || *str == '{' ) {
+            updateSpecificity();
             return true;
+        }
     }
 }
 
+void LVCssSelector::updateSpecificity()
+{
+    int ids = 0;
+    int attrs = 0;
+    int elements = _id ? 1 : 0;
+    for ( LVCssSelectorRule * rule = _rules; rule; rule = rule->getNext() ) {
+        switch ( rule->getType() ) {
+        case cssrt_id:
+            ids++;
+            break;
+        case cssrt_class:
+        case cssrt_attrset:
+        case cssrt_attreq:
+        case cssrt_attrhas:
+        case cssrt_attrstarts:
+            attrs++;
+            break;
+        case cssrt_parent:
+        case cssrt_ancessor:
+        case cssrt_predecessor:
+            if ( rule->getId() )
+                elements++;
+            break;
+        default:
+            break;
+        }
+    }
+    if ( attrs>0xFF )
+        attrs = 0xFF;
+    if ( elements>0xFF )
+        elements = 0xFF;
+    _specificity = (ids << 16) | (attrs << 8) | elements;
+}
+
 static bool skip_until_end_of_rule( const char * &str )
 {
     while ( *str && *str!='}' )
@@ -1307,7 +1365,7 @@ static bool skip_until_end_of_rule( const char * &str )
 }
 
 LVCssSelectorRule::LVCssSelectorRule( LVCssSelectorRule & v )
-: _type(v._type), _id(v._id), _attrid(v._attrid)
+: _type(v._type), _id(v._id), _attrid(v._attrid), _valueId(v._valueId)
 , _next(NULL)
 , _value( v._value )
 {
@@ -1324,65 +1382,495 @@ LVCssSelector::LVCssSelector( LVCssSelector & v )
         _rules = new LVCssSelectorRule( *v._rules );
 }
 
-void LVStyleSheet::set(LVPtrVector<LVCssSelector> & v  )
+void LVCssSelector::serialize( SerialBuf & buf, lxmlDocBase * doc )
 {
-    _selectors.clear();
-    if ( !v.size() )
-        return;
-    _selectors.reserve( v.size() );
-    for ( int i=0; i<v.size(); i++ ) {
-        LVCssSelector * selector = v[i];
-        if ( selector )
-            _selectors.add( new LVCssSelector( *selector ) );
-        else
-            _selectors.add( NULL );
+    buf << ( _id ? doc->getElementName( _id ) : lString16::empty_str );
+    buf << (lUInt32)_specificity;
+    lUInt16 count = 0;
+    for ( LVCssSelectorRule * p = _rules; p; p = p->getNext() )
+        count++;
+    buf << count;
+    for ( LVCssSelectorRule * p = _rules; p; p = p->getNext() ) {
+        buf << (lUInt8)p->getType();
+        buf << ( p->getId() ? doc->getElementName( p->getId() ) : lString16::empty_str );
+        buf << ( p->getAttrId() ? doc->getAttrName( p->getAttrId() ) : lString16::empty_str );
+        buf << p->getValue();
     }
 }
 
-LVStyleSheet::LVStyleSheet( LVStyleSheet & sheet )
-:   _doc( sheet._doc )
+bool LVCssSelector::deserialize( SerialBuf & buf, lxmlDocBase * doc )
 {
-    set( sheet._selectors );
+    lString16 name;
+    lUInt32 specificity = 0;
+    lUInt16 count = 0;
+    buf >> name >> specificity >> count;
+    if ( buf.error() )
+        return false;
+    _specificity = specificity;
+    LVArray<lUInt8> types( count, 0 );
+    lString16Collection names; // element, attribute and value of each rule
+    for ( int i = 0; i < count; i++ ) {
+        lString16 elem, attr, value;
+        buf >> types[i] >> elem >> attr >> value;
+        if ( buf.error() || types[i] > cssrt_class )
+            return false;
+        names.add( elem );
+        names.add( attr );
+        names.add( value );
+    }
+    // rules are prepended while parsing: resolve names from the last rule
+    // to get the same element and attribute ids as parse() would assign
+    for ( int i = count - 1; i >= 0; i-- ) {
+        LVCssSelectorRule * rule = new LVCssSelectorRule( (LVCssSelectorRuleType)types[i] );
+        rule->setNext( _rules );
+        _rules = rule;
+        if ( !names[i*3].empty() )
+            rule->setId( doc->getElementNameIndex( names[i*3].c_str() ) );
+        if ( types[i] >= cssrt_attrset ) {
+            lUInt16 attrId = names[i*3+1].empty() ? 0 : doc->getAttrNameIndex( names[i*3+1].c_str() );
+            rule->setAttr( attrId, names[i*3+2], doc->getCssNameId( names[i*3+2] ) );
+        }
+    }
+    _id = name.empty() ? 0 : doc->getElementNameIndex( name.c_str() );
+    return true;
 }
 
-void LVStyleSheet::apply( const ldomNode * node, css_style_rec_t * style )
+#define CSS_BLOOM_BITS 256
+/// key kinds of ancestor bloom filter
+enum {
+    CSS_BLOOM_TAG = 1,
+    CSS_BLOOM_CLASS = 2,
+    CSS_BLOOM_ID = 3
+};
+/// max number of ancestor keys checked by bloom filter per selector
+#define CSS_BLOOM_MAX_SELECTOR_KEYS 4
+
+/// bloom filter of tags, classes and ids of element and its ancestors
+struct LVCssAncestorFilter {
+    lUInt32 dataIndex; // element
+    lUInt32 bits[CSS_BLOOM_BITS / 32];
+    static inline lUInt32 hash( lUInt32 key ) { return key * 0x9E3779B1; }
+    inline void add( lUInt32 key )
+    {
+        lUInt32 h = hash( key );
+        bits[(h >> 24) >> 5] |= 1 << ((h >> 24) & 31);
+        bits[((h >> 16) & 0xFF) >> 5] |= 1 << ((h >> 16) & 31);
+    }
+    inline bool mayContain( lUInt32 key ) const
+    {
+        lUInt32 h = hash( key );
+        return (bits[(h >> 24) >> 5] & (1 << ((h >> 24) & 31)))
+            && (bits[((h >> 16) & 0xFF) >> 5] & (1 << ((h >> 16) & 31)));
+    }
+};
+
+/// filters of ancestors of last matched element, from root, see LVStyleSheet::apply()
+struct LVCssAncestorPath {
+    LVArray<LVCssAncestorFilter> filters;
+    lUInt32 version; // stylesheet version filters were calculated for
+    LVCssAncestorPath() : version(0) { }
+};
+
+/// selector with data for rule hash matching
+struct LVCssIndexedSelector {
+    LVCssSelector * selector;
+    int specificity;
+    int order;        // position in stylesheet, to apply rules of the same specificity in source order
+    int keyCount;
+    lUInt32 keys[CSS_BLOOM_MAX_SELECTOR_KEYS]; // some of tags, classes and ids required for ancestors
+};
+
+/// candidate selectors for element name, id and class value, with data for style sharing
+struct LVCssCandidates {
+    LVArray<int> items;      // selector indexes, ordered by specificity
+    bool siblingDependent;   // some of selectors check preceding sibling
+    LVArray<lUInt16> attrs;  // attributes of element itself checked by selectors
+    LVCssCandidates() : siblingDependent(false) { }
+};
+
+static int compareIndexedSelectors( const LVCssIndexedSelector * a, const LVCssIndexedSelector * b )
 {
-    if (!_selectors.length())
-        return; // no rules!
-        
-    lUInt16 id = node->getNodeId();
-    
-    LVCssSelector * selector_0 = _selectors[0];
-    LVCssSelector * selector_id = id>0 && id<_selectors.length() ? _selectors[id] : NULL;
+    if ( a->specificity != b->specificity )
+        return a->specificity < b->specificity ? -1 : 1;
+    return a->order - b->order;
+}
 
-    for (;;)
+/// rule hash: selectors by rightmost id, class, element name, and universal ones
+/**
+    For element, only buckets of its id, classes and name and universal bucket are checked.
+    Candidate lists merged by specificity are cached per element name, id and class attribute value.
+    Selectors which require some ancestors are rejected using bloom filter of element ancestors.
+
+    Children of the same parent with the same candidate list get the same rules applied
+    unless some candidate checks preceding sibling or attributes which differ, see canShareStyle().
+
+    Ancestor filters are kept by caller, so that the same index can be used from several threads
+    if access to candidate lists is guarded, see setConcurrent().
+*/
+class LVCssSelectorIndex
+{
+    LVCssIndexedSelector * _items;
+    int _count;
+    LVHashTable<lUInt32, LVArray<int> *> _buckets;  // key: kind << 16 | id
+    LVArray<int> _universal;
+    LVHashTable<lUInt64, LVCssCandidates *> _candidates; // element name, id and class value -> merged bucket items
+    CRMutexRef _mutex; // guards _candidates while index is used from several threads
+    LVCssAncestorFilter _all; // passes any key, for too deep elements
+
+    static lUInt32 bucketKey( int kind, lUInt16 id ) { return ((lUInt32)kind << 16) | id; }
+
+    void addKey( LVCssIndexedSelector & item, lUInt32 key )
     {
-        if (selector_0!=NULL)
-        {
-            if (selector_id==NULL || selector_0->getSpecificity() < selector_id->getSpecificity() )
-            {
-                // step by sel_0
-                selector_0->apply( node, style );
-                selector_0 = selector_0->getNext();
+        if ( item.keyCount < CSS_BLOOM_MAX_SELECTOR_KEYS )
+            item.keys[item.keyCount++] = key;
+    }
+
+    void addToBucket( lUInt32 key, int index )
+    {
+        LVArray<int> * bucket = NULL;
+        if ( !_buckets.get( key, bucket ) ) {
+            bucket = new LVArray<int>();
+            _buckets.set( key, bucket );
+        }
+        bucket->add( index );
+    }
+
+    void addItem( LVCssSelector * selector, int order )
+    {
+        int index = _count++;
+        LVCssIndexedSelector & item = _items[index];
+        item.selector = selector;
+        item.specificity = selector->getSpecificity();
+        item.order = order;
+        item.keyCount = 0;
+        // rules of element itself go first, until first relation
+        lUInt32 bucket = 0;
+        LVCssSelectorRule * rule = selector->getRules();
+        for ( ; rule; rule = rule->getNext() ) {
+            LVCssSelectorRuleType type = rule->getType();
+            if ( type==cssrt_parent || type==cssrt_ancessor || type==cssrt_predecessor )
+                break;
+            if ( type==cssrt_id )
+                bucket = bucketKey( CSS_BLOOM_ID, rule->getValueId() );
+            else if ( type==cssrt_class && (bucket>>16)!=CSS_BLOOM_ID )
+                bucket = bucketKey( CSS_BLOOM_CLASS, rule->getValueId() );
+        }
+        if ( !bucket && selector->getElementNameId() )
+            bucket = bucketKey( CSS_BLOOM_TAG, selector->getElementNameId() );
+        // rules of ancestors
+        bool ancestor = false;
+        for ( ; rule; rule = rule->getNext() ) {
+            switch ( rule->getType() ) {
+            case cssrt_parent:
+            case cssrt_ancessor:
+                ancestor = true;
+                if ( rule->getId() )
+                    addKey( item, bucketKey( CSS_BLOOM_TAG, rule->getId() ) );
+                break;
+            case cssrt_predecessor:
+                // following rules are checked for sibling
+                ancestor = false;
+                break;
+            case cssrt_class:
+                if ( ancestor )
+                    addKey( item, bucketKey( CSS_BLOOM_CLASS, rule->getValueId() ) );
+                break;
+            case cssrt_id:
+                if ( ancestor )
+                    addKey( item, bucketKey( CSS_BLOOM_ID, rule->getValueId() ) );
+                break;
+            default:
+                break;
             }
+        }
+        if ( bucket )
+            addToBucket( bucket, index );
+        else
+            _universal.add( index );
+    }
+
+    /// returns filter of element and its ancestors, updating path of filters of previous element
+    const LVCssAncestorFilter * getFilter( const ldomNode * node, LVArray<LVCssAncestorFilter> & _path )
+    {
+        // ancestors chain, from node to root
+        lUInt32 chain[256];
+        int depth = 0;
+        for ( const ldomNode * p = node; p && !p->isNull(); p = p->getParentNode() ) {
+            if ( depth >= 256 )
+                return &_all;
+            chain[depth++] = p->getDataIndex();
+        }
+        // keep common part of previous path
+        int common = 0;
+        while ( common < depth && common < _path.length() && _path[common].dataIndex == chain[depth - 1 - common] )
+            common++;
+        if ( _path.length() > common )
+            _path.erase( common, _path.length() - common );
+        for ( int i = depth - 1 - common; i >= 0; i-- ) {
+            ldomNode * p = node->getDocument()->getTinyNode( chain[i] );
+            LVCssAncestorFilter filter;
+            if ( _path.length() )
+                filter = _path[_path.length() - 1];
             else
-            {
-                // step by sel_id
-                selector_id->apply( node, style );
-                selector_id = selector_id->getNext();
+                memset( &filter, 0, sizeof(filter) );
+            filter.dataIndex = chain[i];
+            addNodeKeys( p, filter );
+            _path.add( filter );
+        }
+        return _path.length() ? &_path[_path.length() - 1] : NULL;
+    }
+
+    static void addNodeKeys( const ldomNode * node, LVCssAncestorFilter & filter )
+    {
+        filter.add( bucketKey( CSS_BLOOM_TAG, node->getNodeId() ) );
+        lxmlDocBase * doc = node->getDocument();
+        lUInt32 id = node->getAttributeValueIndex( attr_id );
+        if ( id != LXML_ATTR_VALUE_NONE ) {
+            lUInt16 nameId = doc->getAttrValueCssNameId( id );
+            if ( nameId != CSS_NAME_ID_NONE )
+                filter.add( bucketKey( CSS_BLOOM_ID, nameId ) );
+        }
+        lUInt32 cls = node->getAttributeValueIndex( attr_class );
+        if ( cls != LXML_ATTR_VALUE_NONE ) {
+            const lUInt16 * ids = doc->getClassNameIds( cls );
+            for ( int i = 1; i <= ids[0]; i++ )
+                filter.add( bucketKey( CSS_BLOOM_CLASS, ids[i] ) );
+        }
+    }
+
+    void addBucket( LVArray<int> & list, lUInt32 key )
+    {
+        LVArray<int> * bucket = NULL;
+        if ( _buckets.get( key, bucket ) )
+            list.add( *bucket );
+    }
+
+    /// collects sibling and attribute dependencies of candidate selector
+    static void addSharingInfo( LVCssCandidates & list, LVCssSelector * selector )
+    {
+        bool self = true;
+        for ( LVCssSelectorRule * rule = selector->getRules(); rule; rule = rule->getNext() ) {
+            switch ( rule->getType() ) {
+            case cssrt_predecessor:
+                list.siblingDependent = true;
+                return;
+            case cssrt_parent:
+            case cssrt_ancessor:
+                // ancestors are the same for siblings
+                self = false;
+                break;
+            case cssrt_attrset:
+            case cssrt_attreq:
+            case cssrt_attrhas:
+            case cssrt_attrstarts:
+                if ( self ) {
+                    int i = 0;
+                    while ( i < list.attrs.length() && list.attrs[i] != rule->getAttrId() )
+                        i++;
+                    if ( i == list.attrs.length() )
+                        list.attrs.add( rule->getAttrId() );
+                }
+                break;
+            default:
+                // id and class are parts of candidates key
+                break;
             }
         }
-        else if (selector_id!=NULL)
-        {
-            // step by sel_id
-            selector_id->apply( node, style );
-            selector_id = selector_id->getNext();
+    }
+
+    /// returns candidate selectors for element, ordered by specificity
+    LVCssCandidates * getCandidates( const ldomNode * node )
+    {
+        lxmlDocBase * doc = node->getDocument();
+        lUInt16 nodeId = node->getNodeId();
+        lUInt16 idNameId = CSS_NAME_ID_NONE;
+        lUInt32 id = node->getAttributeValueIndex( attr_id );
+        if ( id != LXML_ATTR_VALUE_NONE )
+            idNameId = doc->getAttrValueCssNameId( id );
+        lUInt32 cls = node->getAttributeValueIndex( attr_class );
+        lUInt64 key = ((lUInt64)nodeId << 48) | ((lUInt64)idNameId << 32) | cls;
+        LVCssCandidates * list = NULL;
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        if ( _candidates.get( key, list ) )
+            return list;
+        list = new LVCssCandidates();
+        LVArray<int> & items = list->items;
+        items.add( _universal );
+        if ( nodeId )
+            addBucket( items, bucketKey( CSS_BLOOM_TAG, nodeId ) );
+        if ( idNameId != CSS_NAME_ID_NONE )
+            addBucket( items, bucketKey( CSS_BLOOM_ID, idNameId ) );
+        if ( cls != LXML_ATTR_VALUE_NONE ) {
+            const lUInt16 * ids = doc->getClassNameIds( cls );
+            for ( int i = 1; i <= ids[0]; i++ )
+                addBucket( items, bucketKey( CSS_BLOOM_CLASS, ids[i] ) );
         }
-        else
-        {
-            break; // end of chains
+        // merge: sort by specificity and position in stylesheet
+        int * p = items.get();
+        for ( int i = 1; i < items.length(); i++ ) {
+            int v = p[i];
+            int j = i;
+            for ( ; j > 0 && compareIndexedSelectors( &_items[p[j - 1]], &_items[v] ) > 0; j-- )
+                p[j] = p[j - 1];
+            p[j] = v;
+        }
+        for ( int i = 0; i < items.length(); i++ )
+            addSharingInfo( *list, _items[p[i]].selector );
+        _candidates.set( key, list );
+        return list;
+    }
+
+public:
+    LVCssSelectorIndex( LVCssSelectorSet * rules )
+    : _items(NULL), _count(0), _buckets(64), _candidates(256)
+    {
+        memset( &_all, 0xFF, sizeof(_all) );
+        int count = rules->getCount();
+        _items = new LVCssIndexedSelector[count > 0 ? count : 1];
+        LVArray<LVCssSelectorSet *> layers;
+        rules->getLayers( layers );
+        int length = 0;
+        for ( int k = 0; k < layers.length(); k++ )
+            if ( length < layers[k]->getSelectorsLength() )
+                length = layers[k]->getSelectorsLength();
+        // for equal specificity, selectors with element name go before universal ones,
+        // in stylesheet order inside of each list: rules of earlier set first
+        int order = 0;
+        for ( int i = 1; i <= length; i++ ) {
+            int id = i < length ? i : 0;
+            for ( int k = 0; k < layers.length(); k++ )
+                for ( LVCssSelector * p = layers[k]->getSelectors( id ); p; p = p->getNext() )
+                    addItem( p, order++ );
+        }
+    }
+
+    ~LVCssSelectorIndex()
+    {
+        LVHashTable<lUInt32, LVArray<int> *>::iterator i = _buckets.forwardIterator();
+        for ( LVHashTable<lUInt32, LVArray<int> *>::pair * p = i.next(); p; p = i.next() )
+            delete p->value;
+        LVHashTable<lUInt64, LVCssCandidates *>::iterator j = _candidates.forwardIterator();
+        for ( LVHashTable<lUInt64, LVCssCandidates *>::pair * p = j.next(); p; p = j.next() )
+            delete p->value;
+        delete[] _items;
+    }
+
+    /// guards candidate lists for use of index from several threads, when concurrency provider is set
+    void setConcurrent( bool concurrent )
+    {
+        if ( !concurrent )
+            _mutex.clear();
+        else if ( _mutex.isNull() && concurrencyProvider )
+            _mutex = concurrencyProvider->createMutex();
+    }
+
+    void apply( const ldomNode * node, css_style_rec_t * style, LVArray<LVCssAncestorFilter> & path )
+    {
+        LVArray<int> & list = getCandidates( node )->items;
+        const LVCssAncestorFilter * filter = NULL;
+        for ( int i = 0; i < list.length(); i++ ) {
+            const LVCssIndexedSelector & item = _items[list[i]];
+            if ( item.keyCount ) {
+                if ( !filter )
+                    filter = getFilter( node->getParentNode(), path );
+                if ( !filter )
+                    continue;
+                bool rejected = false;
+                for ( int k = 0; k < item.keyCount && !rejected; k++ )
+                    rejected = !filter->mayContain( item.keys[k] );
+                if ( rejected )
+                    continue;
+            }
+            item.selector->apply( node, style );
+        }
+    }
+
+    bool canShareStyle( const ldomNode * node, const ldomNode * sibling )
+    {
+        LVCssCandidates * list = getCandidates( node );
+        if ( list->siblingDependent || getCandidates( sibling ) != list )
+            return false;
+        for ( int i = 0; i < list->attrs.length(); i++ ) {
+            lUInt16 attrId = list->attrs[i];
+            if ( node->getAttributeValueIndex( attrId ) != sibling->getAttributeValueIndex( attrId ) )
+                return false;
         }
+        return true;
     }
+};
+
+LVCssSelectorSet::~LVCssSelectorSet()
+{
+    if ( _index )
+        delete _index;
+}
+
+void LVCssSelectorSet::getLayers( LVArray<LVCssSelectorSet *> & layers )
+{
+    if ( !_base.isNull() )
+        _base->getLayers( layers );
+    layers.add( this );
+}
+
+LVCssSelectorIndex * LVCssSelectorSet::getIndex()
+{
+    if ( !_index )
+        _index = new LVCssSelectorIndex( this );
+    return _index;
+}
+
+LVCssSelectorSet * LVStyleSheet::getWritableRules()
+{
+    _version++;
+    if ( !_lastParsed.isNull() && _lastParsed.get() == _rules.get() ) {
+        // rules of last parse() are changed in place, they cannot be reused for the same text anymore
+        _lastParsed.Clear();
+    }
+    if ( _rules.isNull() || _rules->getRefCount() > 1 ) {
+        // current rules are saved in stack or shared with another stylesheet
+        _rules = LVCssSelectorSetRef( new LVCssSelectorSet( _rules ) );
+    } else if ( _rules->_index ) {
+        delete _rules->_index;
+        _rules->_index = NULL;
+    }
+    return _rules.get();
+}
+
+LVStyleSheet::~LVStyleSheet()
+{
+    if ( _path )
+        delete _path;
+}
+
+void LVStyleSheet::apply( const ldomNode * node, css_style_rec_t * style )
+{
+    if ( _rules.isNull() || !_rules->getCount() )
+        return; // no rules!
+    if ( !_path )
+        _path = new LVCssAncestorPath();
+    if ( _path->version != _version ) {
+        // filters depend on CSS names known to document
+        _path->filters.clear();
+        _path->version = _version;
+    }
+    _rules->getIndex()->apply( node, style, _path->filters );
+}
+
+void LVStyleSheet::prepareMatching( bool concurrent )
+{
+    if ( _rules.isNull() || !_rules->getCount() )
+        return;
+    _rules->getIndex()->setConcurrent( concurrent );
+}
+
+bool LVStyleSheet::canShareStyle( const ldomNode * node, const ldomNode * sibling )
+{
+    if ( node->getNodeId() != sibling->getNodeId() )
+        return false;
+    if ( _rules.isNull() || !_rules->getCount() )
+        return true;
+    return _rules->getIndex()->canShareStyle( node, sibling );
 }
 
 lUInt32 LVCssSelectorRule::getHash()
@@ -1397,16 +1885,18 @@ lUInt32 LVCssSelectorRule::getHash()
 
 lUInt32 LVCssSelector::getHash()
 {
-    lUInt32 hash = 0;
-    lUInt32 nextHash = 0;
+    return getHash( _next ? _next->getHash() : 0 );
+}
 
-    if (_next)
-        nextHash = _next->getHash();
+lUInt32 LVCssSelector::getHash( lUInt32 nextHash )
+{
+    lUInt32 hash = 0;
     for (LVCssSelectorRule * p = _rules; p; p = p->getNext()) {
         lUInt32 ruleHash = p->getHash();
         hash = hash * 31 + ruleHash;
     }
     hash = hash * 31 + nextHash;
+    hash = hash * 31 + _specificity;
     if (!_decl.isNull())
         hash = hash * 31 + _decl->getHash();
     //CRLog::trace("selector hash: %8x", hash);
@@ -1417,16 +1907,182 @@ lUInt32 LVCssSelector::getHash()
 lUInt32 LVStyleSheet::getHash()
 {
     lUInt32 hash = 0;
-    for ( int i=0; i<_selectors.length(); i++ ) {
-        if ( _selectors[i] )
-            hash = hash * 31 + _selectors[i]->getHash() + i*15324;
+    if ( _rules.isNull() )
+        return hash;
+    LVArray<LVCssSelectorSet *> layers;
+    _rules->getLayers( layers );
+    int length = 0;
+    for ( int k = 0; k < layers.length(); k++ )
+        if ( length < layers[k]->getSelectorsLength() )
+            length = layers[k]->getSelectorsLength();
+    LVArray<LVCssSelector *> list;
+    for ( int i=0; i<length; i++ ) {
+        // rules of all sets for element, ordered as if they were parsed into single list
+        list.reset();
+        for ( int k = 0; k < layers.length(); k++ ) {
+            for ( LVCssSelector * p = layers[k]->getSelectors( i ); p; p = p->getNext() ) {
+                int j = list.length();
+                list.add( p );
+                for ( ; j > 0 && list[j - 1]->getSpecificity() > p->getSpecificity(); j-- )
+                    list[j] = list[j - 1];
+                list[j] = p;
+            }
+        }
+        if ( !list.length() )
+            continue;
+        lUInt32 chainHash = 0;
+        for ( int j = list.length() - 1; j >= 0; j-- )
+            chainHash = list[j]->getHash( chainHash );
+        hash = hash * 31 + chainHash + i*15324;
     }
     //CRLog::trace("LVStyleSheet::getHash() selector count: %d  hash: %x", _selectors.length(), hash);
     return hash;
 }
 
+/// signature of compiled stylesheet data
+static const char * css_compiled_magic = "CR3CSS01";
+
+struct LVCssSelectorSortItem {
+    LVCssSelector * selector;
+    lUInt16 id;
+    int specificity;
+    int order;
+};
+
+static int compareCssSelectorSortItems( const void * p1, const void * p2 )
+{
+    const LVCssSelectorSortItem * a = (const LVCssSelectorSortItem *)p1;
+    const LVCssSelectorSortItem * b = (const LVCssSelectorSortItem *)p2;
+    if ( a->id != b->id )
+        return a->id < b->id ? -1 : 1;
+    if ( a->specificity != b->specificity )
+        return a->specificity < b->specificity ? -1 : 1;
+    return a->order - b->order;
+}
+
+void LVCssSelectorSet::insert( LVArray<LVCssSelector *> & items )
+{
+    if ( items.empty() )
+        return;
+    _count += items.length();
+    // sort own rules of affected element names together with new ones,
+    // by specificity, then by order of adding -- same as inserting one by one
+    LVArray<LVCssSelectorSortItem> list;
+    list.reserve( items.length() );
+    LVArray<lUInt8> affected;
+    int order = 0;
+    for ( int i = 0; i < items.length(); i++ ) {
+        lUInt16 id = items[i]->getElementNameId();
+        if ( _selectors.length() <= id )
+            _selectors.set( id, NULL );
+        while ( affected.length() <= id )
+            affected.add( 0 );
+        if ( !affected[id] ) {
+            affected[id] = 1;
+            for ( LVCssSelector * p = _selectors[id]; p; p = p->getNext() ) {
+                LVCssSelectorSortItem item = { p, id, p->getSpecificity(), order++ };
+                list.add( item );
+            }
+        }
+        LVCssSelectorSortItem item = { items[i], id, items[i]->getSpecificity(), order++ };
+        list.add( item );
+    }
+    qsort( list.get(), list.length(), sizeof(LVCssSelectorSortItem), compareCssSelectorSortItems );
+    for ( int i = 0; i < list.length(); i++ ) {
+        bool first = i == 0 || list[i - 1].id != list[i].id;
+        bool last = i == list.length() - 1 || list[i + 1].id != list[i].id;
+        if ( first )
+            _selectors[list[i].id] = list[i].selector;
+        list[i].selector->setNext( last ? NULL : list[i + 1].selector );
+    }
+}
+
+lUInt64 LVStyleSheet::getStyleSheetKey( const char * str )
+{
+    // two different 32 bit hashes, and length
+    lUInt32 h1 = 0;
+    lUInt32 h2 = 2166136261U;
+    lUInt32 len = 0;
+    for ( const char * p = str; *p; p++, len++ ) {
+        h1 = h1 * 31 + (lUInt8)*p;
+        h2 = (h2 ^ (lUInt8)*p) * 16777619U;
+    }
+    return ((lUInt64)(h1 ^ (len * 0x9E3779B1)) << 32) | h2;
+}
+
+bool LVStyleSheet::deserialize( SerialBuf & buf )
+{
+    if ( !buf.checkMagic( css_compiled_magic ) )
+        return false;
+    LVArray<LVCssSelector *> items;
+    bool ok = true;
+    for (;;) {
+        lUInt8 marker = 0;
+        buf >> marker;
+        if ( buf.error() ) {
+            ok = false;
+            break;
+        }
+        if ( !marker )
+            break;
+        // rule: declaration and its selectors
+        LVCssDeclRef decl( new LVCssDeclaration );
+        lUInt16 count = 0;
+        if ( decl->deserialize( buf ) )
+            buf >> count;
+        else
+            ok = false;
+        int start = items.length();
+        for ( int i = 0; i < count && ok; i++ ) {
+            LVCssSelector * selector = new LVCssSelector;
+            items.insert( start, selector ); // back to order of parse()
+            if ( selector->deserialize( buf, _doc ) )
+                selector->setDeclaration( decl );
+            else
+                ok = false;
+        }
+        if ( !ok || buf.error() ) {
+            ok = false;
+            break;
+        }
+    }
+    if ( !ok ) {
+        for ( int i = 0; i < items.length(); i++ )
+            delete items[i];
+        return false;
+    }
+    _rules->insert( items );
+    return true;
+}
+
 bool LVStyleSheet::parse( const char * str )
 {
+    lUInt64 key = getStyleSheetKey( str );
+    LVCssSelectorSet * prev = _rules.get();
+    if ( !_lastParsed.isNull() && _lastParsedKey == key && _lastParsed->_base.get() == prev ) {
+        // the same text is parsed over the same rules again, e.g. CSS of next DocFragment
+        _rules = _lastParsed;
+        _version++;
+        return _rules->_count > 0;
+    }
+    LVCssSelectorSet * rules = getWritableRules();
+    bool created = rules != prev;
+    if ( created ) {
+        _lastParsed = _rules;
+        _lastParsedKey = key;
+    }
+    if ( _doc ) {
+        LVArray<lUInt8> data;
+        if ( _doc->getCompiledStyleSheet( key, data ) ) {
+            SerialBuf buf( data.get(), data.length() );
+            if ( deserialize( buf ) )
+                return rules->_count > 0;
+            CRLog::error("Cannot read compiled stylesheet, parsing CSS text");
+        }
+    }
+    SerialBuf compiled( 4096, true );
+    compiled.putMagic( css_compiled_magic );
+    LVArray<LVCssSelector *> items;
     LVCssSelector * selector = NULL;
     LVCssSelector * prev_selector;
     int err_count = 0;
@@ -1465,9 +2121,15 @@ bool LVStyleSheet::parse( const char * str )
             else
             {
                 // set decl to selectors
-                for (LVCssSelector * p = selector; p; p=p->getNext())
+                lUInt16 count = 0;
+                for (LVCssSelector * p = selector; p; p=p->getNext()) {
                     p->setDeclaration( decl );
+                    count++;
+                }
                 rule_count++;
+                compiled << (lUInt8)1;
+                decl->serialize( compiled );
+                compiled << count;
             }
             break;
         }
@@ -1482,40 +2144,26 @@ bool LVStyleSheet::parse( const char * str )
         else
         {
             // Ok:
+            // selectors are chained in reverse order: save them in source order
+            LVArray<LVCssSelector *> group;
+            for (LVCssSelector * p = selector; p; p = p->getNext() )
+                group.add( p );
+            for ( int i = group.length() - 1; i >= 0; i-- )
+                group[i]->serialize( compiled, _doc );
             // place rules to sheet
             for (LVCssSelector * p = selector; p;  )
             {
                 LVCssSelector * item = p;
                 p=p->getNext();
-                lUInt16 id = item->getElementNameId();
-                if (_selectors.length()<=id)
-                    _selectors.set(id, NULL);
-                // insert with specificity sorting
-                if ( _selectors[id] == NULL 
-                    || _selectors[id]->getSpecificity() > item->getSpecificity() )
-                {
-                    // insert as first item
-                    item->setNext( _selectors[id] );
-                    _selectors[id] = item;
-                }
-                else
-                {
-                    // insert as internal item
-                    for (LVCssSelector * p = _selectors[id]; p; p = p->getNext() )
-                    {
-                        if ( p->getNext() == NULL
-                            || p->getNext()->getSpecificity() > item->getSpecificity() )
-                        {
-                            item->setNext( p->getNext() );
-                            p->setNext( item );
-                            break;
-                        }
-                    }
-                }
+                items.add( item );
             }
         }
     }
-    return _selectors.length() > 0;
+    rules->insert( items );
+    compiled << (lUInt8)0;
+    if ( _doc && !compiled.error() )
+        _doc->setCompiledStyleSheet( key, compiled );
+    return rules->_count > 0;
 }
 
 /// extract @import filename from beginning of CSS
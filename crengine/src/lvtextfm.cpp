@@ -825,7 +825,6 @@ public:
                             lastc==L'”' || lastc==L'’' || lastc==L'」' || lastc==L'』' 
 #endif
 								) {
-                            FONT_GUARD
                             int w = font->getCharWidth(lastc);
                             TR("floating: %c w=%d", lastc, w);
                             word->width -= w;
@@ -13,7 +13,7 @@
 
 /// change in case of incompatible changes in swap/cache file format to avoid using incompatible swap file
 // increment to force complete reload/reparsing of old file
-#define CACHE_FILE_FORMAT_VERSION "3.12.53"
+#define CACHE_FILE_FORMAT_VERSION "3.12.55"
 /// increment following value to force re-formatting of old book after load
 #define FORMATTING_VERSION_ID 0x0003
 
@@ -43,14 +43,16 @@
 
 #define WRITE_CACHE_TOTAL_SIZE    (10*DOC_BUFFER_SIZE/100)
 
-#define TEXT_CACHE_UNPACKED_SPACE (25*DOC_BUFFER_SIZE/100)
+/// default limit of unpacked text, element, rect and style data of all documents
+#define STORAGE_UNPACKED_SPACE    (95*DOC_BUFFER_SIZE/100)
 #define TEXT_CACHE_CHUNK_SIZE     0x008000 // 32K
-#define ELEM_CACHE_UNPACKED_SPACE (45*DOC_BUFFER_SIZE/100)
 #define ELEM_CACHE_CHUNK_SIZE     0x004000 // 16K
-#define RECT_CACHE_UNPACKED_SPACE (15*DOC_BUFFER_SIZE/100)
 #define RECT_CACHE_CHUNK_SIZE     0x008000 // 32K
-#define STYLE_CACHE_UNPACKED_SPACE (10*DOC_BUFFER_SIZE/100)
 #define STYLE_CACHE_CHUNK_SIZE    0x00C000 // 48K
+/// number of decoded (UTF-16) persistent text nodes kept per document
+#ifndef TEXT_NODE_CACHE_SIZE
+#define TEXT_NODE_CACHE_SIZE      256
+#endif
 //--------------------------------------------------------
 
 #define COMPRESS_NODE_DATA          true
@@ -67,10 +69,45 @@
 /// set t 1 to log storage reads/writes
 #define DEBUG_DOM_STORAGE 0
 //#define TRACE_AUTOBOX
-/// set to 1 to enable crc check of all blocks of cache file on open
+/// set to 1 to enable crc check of cache file blocks, each block is checked on its first read
 #ifndef ENABLE_CACHE_FILE_CONTENTS_VALIDATION
 #define ENABLE_CACHE_FILE_CONTENTS_VALIDATION 1
 #endif
+/// set to 1 to compress and write storage chunks in background thread (requires concurrency provider)
+#ifndef ENABLE_CACHE_FILE_BACKGROUND_WRITER
+#define ENABLE_CACHE_FILE_BACKGROUND_WRITER 1
+#endif
+/// number of threads used to pack blocks written by CacheFile::writeBatch() (requires concurrency provider)
+#ifndef CACHE_FILE_COMPRESSION_THREADS
+#define CACHE_FILE_COMPRESSION_THREADS 4
+#endif
+/// max number of storage chunks packed in one batch while saving, to keep time limit
+#define CACHE_FILE_BATCH_SIZE 16
+/// set to 1 to read blocks of existing cache file via memory mapping
+#ifndef ENABLE_CACHE_FILE_MAPPED_READ
+#define ENABLE_CACHE_FILE_MAPPED_READ 1
+#endif
+/// set to 1 to restore storage chunks of pages in page turn direction in background thread (requires concurrency provider)
+#ifndef ENABLE_STORAGE_CHUNK_PREFETCH
+#define ENABLE_STORAGE_CHUNK_PREFETCH 1
+#endif
+/// cache file is compacted on save when free space exceeds this percent of file size (0 to disable)
+#ifndef CACHE_FILE_COMPACT_FREE_PERCENT
+#define CACHE_FILE_COMPACT_FREE_PERCENT 25
+#endif
+/// cache file is not compacted while free space is less than this size
+#define CACHE_FILE_COMPACT_MIN_FREE 0x40000
+/// number of threads calculating styles of element subtrees in initNodeStyleRecursive() (requires concurrency provider)
+#ifndef STYLE_INIT_THREADS
+#define STYLE_INIT_THREADS 4
+#endif
+/// elements of lower levels (root is 0) are styled by main thread, subtrees of elements of this level by worker threads
+#ifndef STYLE_INIT_SPLIT_LEVEL
+#define STYLE_INIT_SPLIT_LEVEL 3
+#endif
+
+/// rect and style chunks are stored uncompressed when they can be used directly from mapped cache file
+#define COMPRESS_RAW_STORAGE_DATA   (!_enableCacheFileMappedRead)
 
 #define RECT_DATA_CHUNK_ITEMS_SHIFT 11
 #define STYLE_DATA_CHUNK_ITEMS_SHIFT 12
@@ -126,10 +163,13 @@ enum CacheFileBlockType {
     CBT_STYLE_DATA,
     CBT_BLOB_INDEX, //15
     CBT_BLOB_DATA,
-    CBT_FONT_DATA  //17
+    CBT_FONT_DATA,  //17
+    CBT_ELEM_TOPOLOGY,
+    CBT_TEXT_TOPOLOGY,
+    CBT_STYLESHEET_DATA, //20
+    CBT_MAX_TYPE
 };
 
-
 #include <stdlib.h>
 #include <string.h>
 #include "../include/crsetup.h"
@@ -141,6 +181,7 @@ enum CacheFileBlockType {
 #include "../include/chmfmt.h"
 #endif
 #include "../include/crtest.h"
+#include "../include/crconcurrent.h"
 #include <stddef.h>
 #include <math.h>
 #include <zlib.h>
@@ -154,6 +195,139 @@ void enableCacheFileContentsValidation(bool enable) {
 	_enableCacheFileContentsValidation = enable;
 }
 
+static bool _enableCacheFileMappedRead = (bool)ENABLE_CACHE_FILE_MAPPED_READ;
+void enableCacheFileMappedRead(bool enable) {
+	_enableCacheFileMappedRead = enable;
+}
+
+static bool _enableCacheFileBackgroundWriter = (bool)ENABLE_CACHE_FILE_BACKGROUND_WRITER;
+void enableCacheFileBackgroundWriter(bool enable) {
+	_enableCacheFileBackgroundWriter = enable;
+}
+
+static bool _enableStorageChunkPrefetch = (bool)ENABLE_STORAGE_CHUNK_PREFETCH;
+void enableStorageChunkPrefetch(bool enable) {
+	_enableStorageChunkPrefetch = enable;
+}
+
+static int _cacheFileCompactFreePercent = CACHE_FILE_COMPACT_FREE_PERCENT;
+void setCacheFileCompactionThreshold(int freePercent) {
+	_cacheFileCompactFreePercent = freePercent > 0 ? freePercent : 0;
+}
+
+static int _cacheFileCompressionThreads = CACHE_FILE_COMPRESSION_THREADS;
+void setCacheFileCompressionThreads(int count) {
+	_cacheFileCompressionThreads = count > 0 ? count : 1;
+}
+
+static int _styleInitThreads = STYLE_INIT_THREADS;
+static int _styleInitSplitLevel = STYLE_INIT_SPLIT_LEVEL;
+void setStyleInitThreads(int count, int splitLevel) {
+	_styleInitThreads = count > 0 ? count : 1;
+	_styleInitSplitLevel = splitLevel > 0 ? splitLevel : 1;
+}
+
+/// codec selection for block type
+struct CacheFileCodecPolicy
+{
+    int codec;     // codec for blocks of this type which are allowed to be compressed
+    int minRatio;  // block is stored unpacked if size/packed size ratio (in percents) is less than this value, 0 to disable
+};
+
+/// fast codec for rect and style data which is read all the time while drawing, zlib for other data
+static CacheFileCodecPolicy _cacheFileCodecPolicy[CBT_MAX_TYPE] = {
+    {CACHE_CODEC_ZLIB, 0}, // CBT_FREE
+    {CACHE_CODEC_ZLIB, 0}, // CBT_INDEX
+    {CACHE_CODEC_ZLIB, 0}, // CBT_TEXT_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_ELEM_DATA
+    {CACHE_CODEC_LZ, 150}, // CBT_RECT_DATA
+    {CACHE_CODEC_LZ, 150}, // CBT_ELEM_STYLE_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_MAPS_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_PAGE_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_PROP_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_NODE_INDEX
+    {CACHE_CODEC_ZLIB, 0}, // CBT_ELEM_NODE
+    {CACHE_CODEC_ZLIB, 0}, // CBT_TEXT_NODE
+    {CACHE_CODEC_ZLIB, 0}, // CBT_REND_PARAMS
+    {CACHE_CODEC_ZLIB, 0}, // CBT_TOC_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_STYLE_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_BLOB_INDEX
+    {CACHE_CODEC_ZLIB, 0}, // CBT_BLOB_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_FONT_DATA
+    {CACHE_CODEC_ZLIB, 0}, // CBT_ELEM_TOPOLOGY
+    {CACHE_CODEC_ZLIB, 0}, // CBT_TEXT_TOPOLOGY
+    {CACHE_CODEC_ZLIB, 0}, // CBT_STYLESHEET_DATA
+};
+
+/// sets codec and minimal compression ratio for cache file blocks of specified type
+void setCacheFileCodecPolicy( int blockType, int codec, int minRatioPercent )
+{
+    if ( blockType<0 || blockType>=CBT_MAX_TYPE || codec<CACHE_CODEC_NONE || codec>CACHE_CODEC_LZ )
+        return;
+    _cacheFileCodecPolicy[blockType].codec = codec;
+    _cacheFileCodecPolicy[blockType].minRatio = minRatioPercent;
+}
+
+/// decompression statistics for block type, updated by ls_atomic_add() from prefetch and style threads too
+struct CacheFileUnpackStats
+{
+    int count;
+    lInt64 bytes;
+    lInt64 micros;
+};
+static CacheFileUnpackStats _cacheFileUnpackStats[CBT_MAX_TYPE];
+
+/// returns decompression statistics for cache file blocks of specified type
+void getCacheFileUnpackStats( int blockType, lUInt32 & count, lUInt64 & bytes, lUInt64 & micros )
+{
+    count = 0;
+    bytes = micros = 0;
+    if ( blockType<0 || blockType>=CBT_MAX_TYPE )
+        return;
+    CacheFileUnpackStats & st = _cacheFileUnpackStats[blockType];
+    count = (lUInt32)ls_atomic_add( &st.count, 0 );
+    bytes = (lUInt64)ls_atomic_add64( &st.bytes, 0 );
+    micros = (lUInt64)ls_atomic_add64( &st.micros, 0 );
+}
+
+/// resets cache file decompression statistics
+void resetCacheFileUnpackStats()
+{
+    for ( int i=0; i<CBT_MAX_TYPE; i++ ) {
+        CacheFileUnpackStats & st = _cacheFileUnpackStats[i];
+        ls_atomic_add( &st.count, -ls_atomic_add( &st.count, 0 ) );
+        ls_atomic_add64( &st.bytes, -ls_atomic_add64( &st.bytes, 0 ) );
+        ls_atomic_add64( &st.micros, -ls_atomic_add64( &st.micros, 0 ) );
+    }
+}
+
+/// writes decompression statistics to log
+static void dumpCacheFileUnpackStats()
+{
+    for ( int i=0; i<CBT_MAX_TYPE; i++ ) {
+        lUInt32 count;
+        lUInt64 bytes, micros;
+        getCacheFileUnpackStats( i, count, bytes, micros );
+        if ( count )
+            CRLog::info("*** Cache blocks of type %d: %d unpacked, %dKb, %d us", i, (int)count, (int)(bytes/1024), (int)micros);
+    }
+}
+
+/// current time in microseconds, for decompression statistics
+static lInt64 getTimeMicros()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency( &freq );
+    QueryPerformanceCounter( &t );
+    return (lInt64)(t.QuadPart * 1000000 / freq.QuadPart);
+#else
+    timeval ts;
+    gettimeofday( &ts, 0 );
+    return ((lInt64)ts.tv_sec)*1000000 + ts.tv_usec;
+#endif
+}
+
 static int _nextDocumentIndex = 0;
 ldomDocument * ldomNode::_documentInstances[MAX_DOCUMENT_INSTANCE_COUNT] = {NULL,};
 
@@ -211,6 +385,12 @@ public:
         return _text;
     }
 
+    /// returns reference to text, valid until text is changed
+    const lString8 & getTextRef()
+    {
+        return _text;
+    }
+
     lString16 getText16()
     {
         return Utf8ToUnicode(_text);
@@ -240,6 +420,90 @@ public:
 bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize );
 /// unpack data from _compbuf to _buf
 bool ldomUnpack( const lUInt8 * compbuf, int compsize, lUInt8 * &dstbuf, lUInt32 & dstsize  );
+/// unpack data from compbuf directly to preallocated buffer of known uncompressed size
+bool ldomUnpackTo( const lUInt8 * compbuf, int compsize, lUInt8 * dstbuf, lUInt32 dstsize );
+
+/// compression codec of cache file blocks
+class CacheFileCodec
+{
+public:
+    virtual ~CacheFileCodec() { }
+    /// packs data, returns false if data cannot be packed
+    virtual bool pack( const lUInt8 * buf, int size, lUInt8 * &dstbuf, lUInt32 & dstsize ) = 0;
+    /// unpacks data to buffer of known uncompressed size
+    virtual bool unpack( const lUInt8 * buf, int size, lUInt8 * dstbuf, lUInt32 dstsize ) = 0;
+};
+/// returns codec by id, NULL for unknown id
+CacheFileCodec * getCacheFileCodec( int codec );
+
+/// reusable deflate context, to avoid deflateInit() for each packed block
+class ldomPacker
+{
+    z_stream _z;
+    bool _ready;
+public:
+    ldomPacker() : _ready(false)
+    {
+        memset( &_z, 0, sizeof(_z) );
+        _ready = deflateInit( &_z, DOC_DATA_COMPRESSION_LEVEL )==Z_OK;
+    }
+    ~ldomPacker()
+    {
+        if ( _ready )
+            deflateEnd( &_z );
+    }
+    /// pack data with specified codec, zlib result is the same as of ldomPack()
+    bool pack( int codec, const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize )
+    {
+        if ( codec!=CACHE_CODEC_ZLIB ) {
+            CacheFileCodec * c = getCacheFileCodec( codec );
+            return c && c->pack( buf, bufsize, dstbuf, dstsize );
+        }
+        if ( !_ready || deflateReset( &_z )!=Z_OK )
+            return false;
+        uLong bound = deflateBound( &_z, bufsize );
+        lUInt8 * tmp = (lUInt8 *)malloc( bound );
+        _z.avail_in = bufsize;
+        _z.next_in = (unsigned char *)buf;
+        _z.avail_out = bound;
+        _z.next_out = tmp;
+        int ret = deflate( &_z, Z_FINISH );
+        int have = bound - _z.avail_out;
+        if ( ret!=Z_STREAM_END || have==0 || have>=PACK_BUF_SIZE || _z.avail_in!=0 ) {
+            // some error occured while packing, leave unpacked
+            free( tmp );
+            return false;
+        }
+        dstsize = have;
+        dstbuf = (lUInt8 *)realloc( tmp, have );
+        return true;
+    }
+};
+
+/// packs block with codec selected for its type, returns false if block should be stored unpacked
+static bool packCacheFileBlock( lUInt16 type, const lUInt8 * buf, int size, lUInt8 * &dstbuf, lUInt32 & dstsize, lUInt32 & codec, ldomPacker * packer )
+{
+    CacheFileCodecPolicy policy = type<CBT_MAX_TYPE ? _cacheFileCodecPolicy[type] : _cacheFileCodecPolicy[CBT_FREE];
+    codec = policy.codec;
+    if ( codec==CACHE_CODEC_NONE )
+        return false;
+    bool res;
+    if ( packer ) {
+        res = packer->pack( codec, buf, size, dstbuf, dstsize );
+    } else {
+        CacheFileCodec * c = getCacheFileCodec( codec );
+        res = c && c->pack( buf, size, dstbuf, dstsize );
+    }
+    if ( !res )
+        return false;
+    if ( policy.minRatio>0 && (lInt64)size*100 < (lInt64)dstsize*policy.minRatio ) {
+        // compression ratio is too low to pay for unpacking
+        free( dstbuf );
+        dstbuf = NULL;
+        return false;
+    }
+    return true;
+}
 
 
 #if BUILD_LITE!=1
@@ -321,6 +585,7 @@ struct CacheFileItem
     lUInt64 _dataHash; // additional hash of data
     lUInt64 _packedHash; // additional hash of packed data
     lUInt32 _uncompressedSize;   // size of uncompressed block, if compression is applied, 0 if no compression
+    lUInt32 _codec;    // codec of compressed block, CACHE_CODEC_*
     bool validate( int fsize )
     {
         if ( _magic!=CACHE_FILE_ITEM_MAGIC ) {
@@ -347,6 +612,7 @@ struct CacheFileItem
     , _dataHash(0)          // hash of data
     , _packedHash(0) // additional hash of packed data
     , _uncompressedSize(0)  // size of uncompressed block, if compression is applied, 0 if no compression
+    , _codec(CACHE_CODEC_NONE) // codec of compressed block
     {
     }
 };
@@ -391,6 +657,66 @@ struct CacheFileHeader : public SimpleCacheFileHeader
     }
 };
 
+/// block data snapshot waiting to be written by background cache writer
+struct CacheFilePendingBlock
+{
+    lUInt16 type;
+    lUInt16 index;
+    lUInt8 * buf;
+    int size;
+    bool compress;
+    // set if block is already hashed and packed by CacheFile::writeBatch()
+    bool prepared;
+    lUInt8 * packed;     // packed data, NULL if block is stored as is
+    lUInt32 packedSize;
+    lUInt32 codec;
+    lUInt64 hash;
+    lUInt64 packedHash;
+    CacheFilePendingBlock( lUInt16 _type, lUInt16 _index, lUInt8 * _buf, int _size, bool _compress )
+    : type(_type), index(_index), buf(_buf), size(_size), compress(_compress)
+    , prepared(false), packed(NULL), packedSize(0), codec(CACHE_CODEC_NONE), hash(0), packedHash(0)
+    {
+    }
+    ~CacheFilePendingBlock()
+    {
+        free( buf );
+        if ( packed )
+            free( packed );
+    }
+};
+
+/// block to be written by CacheFile::writeBatch()
+struct CacheFileBatchItem
+{
+    lUInt16 type;
+    lUInt16 index;
+    const lUInt8 * buf;
+    int size;
+    bool compress;
+    bool ownBuf;         // free buf on destroy
+    // filled while batch is processed
+    int existingSize;    // uncompressed size of block already written to file, -1 if none
+    lUInt64 existingHash;
+    bool unchanged;      // same data is already written
+    lUInt8 * packed;     // packed data, NULL if block is stored as is
+    lUInt32 packedSize;
+    lUInt32 codec;       // codec of packed data
+    lUInt64 hash;
+    lUInt64 packedHash;
+    CacheFileBatchItem( lUInt16 _type, lUInt16 _index, const lUInt8 * _buf, int _size, bool _compress, bool _ownBuf )
+    : type(_type), index(_index), buf(_buf), size(_size), compress(_compress), ownBuf(_ownBuf)
+    , existingSize(-1), existingHash(0), unchanged(false), packed(NULL), packedSize(0), codec(CACHE_CODEC_NONE), hash(0), packedHash(0)
+    {
+    }
+    ~CacheFileBatchItem()
+    {
+        if ( ownBuf )
+            free( (void*)buf );
+        if ( packed )
+            free( packed );
+    }
+};
+
 /**
  * Cache file implementation.
  */
@@ -401,9 +727,20 @@ class CacheFile
     bool _indexChanged;
     bool _dirty;
     LVStreamRef _stream; // file stream
+    LVStreamRef _mapped; // read only memory mapping of file, as it was on open
     LVPtrVector<CacheFileItem, true> _index; // full file block index
     LVPtrVector<CacheFileItem, false> _freeIndex; // free file block index
     LVHashTable<lUInt32, CacheFileItem*> _map; // hash map for fast search
+    LVHashTable<lUInt32, bool> _mapStale; // blocks written after mapping, to be read from stream
+    LVHashTable<lUInt32, bool> _validated; // blocks which CRC is already checked or which are written in this session
+    bool _invalid; // some of blocks is corrupted: file should not be used next time
+    CRMutexRef _mutex; // guards index and stream while background writer is running
+    CRMonitorRef _pendingMonitor; // guards queue of pending blocks
+    CRThreadExecutor * _writer; // background writer thread, NULL if all writes are synchronous
+    LVHashTable<lUInt32, CacheFilePendingBlock*> _pending; // most recent snapshots of queued blocks
+    int _pendingCount; // number of queued write tasks
+    bool _writeError; // set if one of background writes is failed
+    bool _compacting; // compaction is started, but not finished yet
     // searches for existing block
     CacheFileItem * findBlock( lUInt16 type, lUInt16 index );
     // alocates block at index, reuses existing one, if possible
@@ -416,8 +753,22 @@ class CacheFile
     bool writeIndex();
     // reads index from file
     bool readIndex();
-    // reads all blocks of index and checks CRCs
-    bool validateContents();
+    // returns mapped file region of block, NULL if block cannot be read via mapping
+    LVStreamBufferRef getMappedBlock( CacheFileItem * block );
+    // writes already packed block data to file, call under lock
+    bool writeBlock( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int size, lUInt64 hash, lUInt64 packedHash, lUInt32 uncompressedSize, lUInt32 codec );
+    // returns copy of block snapshot which is queued for writing, false if there is no such block
+    bool readPending( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size );
+    // starts background writer thread, if concurrency provider is set
+    void startBackgroundWriter();
+    // adds block to queue of background writer
+    void queuePending( CacheFilePendingBlock * block );
+    // reads block, using mapped file if allowed
+    bool readBlock( lUInt16 type, lUInt16 dataIndex, LVStreamBufferRef & mapbuf, lUInt8 * &buf, int &size, bool useMapping );
+    // joins adjacent free blocks, drops free blocks at the end of file
+    void mergeFreeBlocks();
+    // moves used block to beginning of free block placed before it, call under lock
+    bool relocateBlock( int from, int to );
 public:
     // return current file size
     int getSize() { return _size; }
@@ -435,10 +786,54 @@ public:
     bool create( LVStreamRef stream );
     /// writes block to file
     bool write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int size, bool compress );
+    /// writes set of blocks: packs them in parallel threads, then writes to file in order (by background writer, if running)
+    bool writeBatch( LVPtrVector<CacheFileBatchItem> & items );
+    /// queues block for writing by background thread; takes ownership of malloc'ed buf
+    bool writeAsync( lUInt16 type, lUInt16 dataIndex, lUInt8 * buf, int size, bool compress );
+    /// writes queued block, called from background writer thread
+    void writePending( CacheFilePendingBlock * block );
+    /// returns true if background writer is running
+    bool hasBackgroundWriter() { return _writer!=NULL; }
+    /// allows blocks to be read by readUnmapped() from other threads, if concurrency provider is set
+    void enableConcurrentReads();
+    /// returns true if file is mapped to memory for reading
+    bool isMapped() { return !_mapped.isNull(); }
+    /// returns true if some blocks are queued for background writing
+    bool hasPendingWrites();
+    /// marks file as invalid after block CRC mismatch or read error, to rebuild document on next open
+    void setInvalid( lUInt16 type, lUInt16 dataIndex );
+    /// returns true if some of blocks is found to be corrupted: file should not be used next time
+    bool isInvalid()
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        return _invalid;
+    }
+    /// waits until all queued blocks are written, returns false if some of writes is failed
+    bool waitPendingWrites();
+    /// reads and allocates block in memory, without use of mapped file: can be called from other threads
+    bool readUnmapped( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size );
     /// reads and allocates block in memory
     bool read( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size );
+    /// reads block; uncompressed data may be returned as read only pointer into mapped file, kept alive by mapbuf
+    bool read( lUInt16 type, lUInt16 dataIndex, LVStreamBufferRef & mapbuf, lUInt8 * &buf, int &size );
     /// reads and validates block
     bool validate( CacheFileItem * block );
+    /// checks CRC of all blocks not validated yet, marks file as invalid if some of them is corrupted
+    bool validateBlocks();
+    /// returns true if block is stored in file or queued for writing, to read optional blocks without error logging
+    bool hasBlock( lUInt16 type, lUInt16 dataIndex );
+    /// returns size of file space not occupied by block data
+    int getFreeSpace();
+    /// returns true if file contains too much free space, or its compaction is not finished
+    bool needsCompaction();
+    /// moves blocks to the beginning of file and truncates it, limited by time interval (can be called again to continue after TIMEOUT)
+    /// mapped buffers returned by read() should be released before call
+    ContinuousOperationResult compact( CRTimerUtil & maxTime );
+    /// stops reading of blocks via memory mapping, mapped buffers returned by read() should be released before call
+    void unmap();
+    /// returns name of file
+    lString16 getFileName() { return lString16( _stream->GetName() ); }
     /// writes content of serial buffer
     bool write( lUInt16 type, lUInt16 index, SerialBuf & buf, bool compress );
     /// reads content of serial buffer
@@ -465,6 +860,8 @@ public:
         return (n + (_sectorSize-1)) & ~(_sectorSize-1);
     }
     void setAutoSyncSize(int sz) {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
         _stream->setAutoSyncSize(sz);
     }
 };
@@ -472,13 +869,19 @@ public:
 
 // create uninitialized cache file, call open or create to initialize
 CacheFile::CacheFile()
-: _sectorSize( CACHE_FILE_SECTOR_SIZE ), _size(0), _indexChanged(false), _dirty(true), _map(1024)
+: _sectorSize( CACHE_FILE_SECTOR_SIZE ), _size(0), _indexChanged(false), _dirty(true), _map(1024), _mapStale(256), _validated(1024), _invalid(false)
+, _writer(NULL), _pending(256), _pendingCount(0), _writeError(false), _compacting(false)
 {
 }
 
 // free resources
 CacheFile::~CacheFile()
 {
+    if ( _writer ) {
+        // let queued blocks get to file
+        waitPendingWrites();
+        delete _writer;
+    }
     if ( !_stream.isNull() ) {
         // don't flush -- leave file dirty
         //CRTimerUtil infinite;
@@ -491,6 +894,8 @@ bool CacheFile::setDirtyFlag( bool dirty )
 {
     if ( _dirty==dirty )
         return false;
+    if ( !dirty && _invalid )
+        return false; // keep corrupted file dirty
     if ( !dirty ) {
         CRLog::info("CacheFile::clearing Dirty flag");
         _stream->Flush(true);
@@ -513,32 +918,34 @@ bool CacheFile::setDirtyFlag( bool dirty )
 bool CacheFile::flush( bool clearDirtyFlag, CRTimerUtil & maxTime )
 {
     if ( clearDirtyFlag ) {
+        // all queued blocks should be written before index
+        if ( !waitPendingWrites() )
+            return false;
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
         //setDirtyFlag(true);
         if ( !writeIndex() )
             return false;
         setDirtyFlag(false);
     } else {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
         _stream->Flush(false, maxTime);
         //CRLog::trace("CacheFile->flush() took %d ms ", (int)timer.elapsed());
     }
     return true;
 }
 
-// reads all blocks of index and checks CRCs
-bool CacheFile::validateContents()
+// marks file as invalid after block CRC mismatch or read error, to rebuild document on next open
+void CacheFile::setInvalid( lUInt16 type, lUInt16 dataIndex )
 {
-    CRLog::info("Started validation of cache file contents");
-    LVHashTable<lUInt32, CacheFileItem*>::pair * pair;
-    for ( LVHashTable<lUInt32, CacheFileItem*>::iterator p = _map.forwardIterator(); (pair=p.next())!=NULL; ) {
-        if ( pair->value->_dataType==CBT_INDEX )
-            continue;
-        if ( !validate(pair->value) ) {
-            CRLog::error("Contents validation is failed for block type=%d index=%d", (int)pair->value->_dataType, pair->value->_dataIndex );
-            return false;
-        }
-    }
-    CRLog::info("Finished validation of cache file contents -- successful");
-    return true;
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    if ( _invalid )
+        return;
+    CRLog::error("CacheFile: block %d:%d is corrupted, cache file will be rebuilt", type, dataIndex);
+    setDirtyFlag(true);
+    _invalid = true;
 }
 
 // reads index from file
@@ -640,7 +1047,7 @@ bool CacheFile::writeIndex()
             index[i]._dataSize = 0;
         }
     }
-    bool res = write(CBT_INDEX, 0, (const lUInt8*)index, sz, false);
+    bool res = writeBlock(CBT_INDEX, 0, (const lUInt8*)index, sz, calcHash64((const lUInt8*)index, sz), 0, 0, CACHE_CODEC_NONE);
     delete[] index;
 
     indexItem = findBlock(CBT_INDEX, 0);
@@ -683,6 +1090,17 @@ void CacheFile::freeBlock( CacheFileItem * block )
 /// reads block as a stream
 LVStreamRef CacheFile::readStream(lUInt16 type, lUInt16 index)
 {
+    if ( !_mutex.isNull() ) {
+        // stream fragment cannot be read concurrently with background writer or reader
+        lUInt8 * buf = NULL;
+        int size = 0;
+        if ( read(type, index, buf, size) ) {
+            LVStreamRef res = LVCreateMemoryStream(buf, size, true);
+            free(buf);
+            return res;
+        }
+        return LVStreamRef();
+    }
     CacheFileItem * block = findBlock(type, index);
     if (block && block->_dataSize) {
 #if 0
@@ -785,109 +1203,250 @@ bool CacheFile::validate( CacheFileItem * block )
         return false;
     }
     free(buf);
+    _validated.set( ((lUInt32)block->_dataType)<<16 | block->_dataIndex, true );
+    return true;
+}
+
+/// checks CRC of all blocks not validated yet, marks file as invalid if some of them is corrupted
+bool CacheFile::validateBlocks()
+{
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    for ( int i=0; i<_index.length(); i++ ) {
+        CacheFileItem * block = _index[i];
+        // index is checked by readIndex() against hash stored in header
+        if ( block->_dataType==CBT_FREE || block->_dataType==CBT_INDEX || !block->_dataSize || _validated.get( ((lUInt32)block->_dataType)<<16 | block->_dataIndex ) )
+            continue;
+        if ( !validate( block ) ) {
+            setInvalid( block->_dataType, block->_dataIndex );
+            return false;
+        }
+    }
     return true;
 }
 
+// returns mapped file region of block, NULL if block cannot be read via mapping
+LVStreamBufferRef CacheFile::getMappedBlock( CacheFileItem * block )
+{
+    LVStreamBufferRef res;
+    if ( _mapped.isNull() || !block->_dataSize )
+        return res;
+    if ( _mapStale.get( ((lUInt32)block->_dataType)<<16 | block->_dataIndex ) )
+        return res; // mapping may contain outdated data
+    res = _mapped->GetReadBuffer( block->_blockFilePos, block->_dataSize );
+    if ( !res.isNull() && !res->getReadOnly() )
+        res.Clear();
+    return res;
+}
+
 // reads and allocates block in memory
 bool CacheFile::read( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size )
 {
-    buf = NULL;
-    size = 0;
-    CacheFileItem * block = findBlock( type, dataIndex );
-    if ( !block ) {
-        CRLog::error("CacheFile::read: Block %d:%d not found in file", type, dataIndex);
+    LVStreamBufferRef mapbuf;
+    if ( !read( type, dataIndex, mapbuf, buf, size ) )
         return false;
+    if ( !mapbuf.isNull() ) {
+        // make private copy of mapped data
+        lUInt8 * copy = (lUInt8 *)malloc(size);
+        memcpy( copy, buf, size );
+        buf = copy;
     }
-    if ( (int)_stream->SetPos( block->_blockFilePos )!=block->_blockFilePos )
-        return false;
+    // Success. Don't forget to free allocated block externally
+    return true;
+}
 
-    // read block from file
-    size = block->_dataSize;
-    buf = (lUInt8 *)malloc(size);
-    lvsize_t bytesRead = 0;
-    _stream->Read(buf, size, &bytesRead );
-    if ( (int)bytesRead!=size ) {
-        CRLog::error("CacheFile::read: Cannot read block %d:%d of size %d", type, dataIndex, (int)size);
-        free(buf);
-        buf = NULL;
-        size = 0;
-        return false;
+// reads block; uncompressed data is returned as pointer into mapped file, if possible
+bool CacheFile::read( lUInt16 type, lUInt16 dataIndex, LVStreamBufferRef & mapbuf, lUInt8 * &buf, int &size )
+{
+    return readBlock( type, dataIndex, mapbuf, buf, size, true );
+}
+
+// reads and allocates block in memory, without use of mapped file: can be called from other threads
+bool CacheFile::readUnmapped( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size )
+{
+    // mapped buffers hold not thread safe reference to mapped stream
+    LVStreamBufferRef mapbuf;
+    return readBlock( type, dataIndex, mapbuf, buf, size, false );
+}
+
+// reads block, using mapped file if allowed
+bool CacheFile::readBlock( lUInt16 type, lUInt16 dataIndex, LVStreamBufferRef & mapbuf, lUInt8 * &buf, int &size, bool useMapping )
+{
+    buf = NULL;
+    size = 0;
+    mapbuf.Clear();
+    if ( readPending( type, dataIndex, buf, size ) )
+        return true;
+
+    const lUInt8 * data = NULL; // block data as stored in file
+    lUInt8 * readbuf = NULL; // allocated buffer, if data is read from stream
+    LVStreamBufferRef region;
+    lUInt32 uncompressedSize;
+    lUInt32 codec;
+    lUInt64 packedHash;
+    lUInt64 dataHash;
+    bool validated;
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        validated = !_enableCacheFileContentsValidation || _validated.get( ((lUInt32)type)<<16 | dataIndex );
+        CacheFileItem * block = findBlock( type, dataIndex );
+        if ( !block ) {
+            CRLog::error("CacheFile::read: Block %d:%d not found in file", type, dataIndex);
+            return false;
+        }
+        size = block->_dataSize;
+        uncompressedSize = block->_uncompressedSize;
+        codec = block->_codec;
+        packedHash = block->_packedHash;
+        dataHash = block->_dataHash;
+        if ( useMapping )
+            region = getMappedBlock( block );
+        if ( !region.isNull() ) {
+            data = region->getReadOnly();
+        } else {
+            if ( (int)_stream->SetPos( block->_blockFilePos )!=block->_blockFilePos ) {
+                size = 0;
+                return false;
+            }
+            // read block from file
+            readbuf = (lUInt8 *)malloc(size);
+            lvsize_t bytesRead = 0;
+            _stream->Read(readbuf, size, &bytesRead );
+            if ( (int)bytesRead!=size ) {
+                CRLog::error("CacheFile::read: Cannot read block %d:%d of size %d", type, dataIndex, (int)size);
+                free(readbuf);
+                size = 0;
+                return false;
+            }
+            data = readbuf;
+        }
     }
 
-    bool compress = block->_uncompressedSize!=0;
+    bool compress = uncompressedSize!=0;
 
     if ( compress ) {
         // block is compressed
 
         // check crc separately only for compressed data
-        lUInt64 packedhash = calcHash64( buf, size );
-        if ( packedhash!=block->_packedHash ) {
+        if ( !validated && calcHash64( data, size )!=packedHash ) {
             CRLog::error("CacheFile::read: packed data CRC doesn't match for block %d:%d of size %d", type, dataIndex, (int)size);
-            free(buf);
-            buf = NULL;
+            free(readbuf);
             size = 0;
+            setInvalid( type, dataIndex );
             return false;
         }
 
-        // uncompress block data
-        lUInt8 * uncomp_buf = NULL;
-        lUInt32 uncomp_size = 0;
-        if ( ldomUnpack(buf, size, uncomp_buf, uncomp_size) && uncomp_size==block->_uncompressedSize ) {
-            free( buf );
-            buf = uncomp_buf;
-            size = uncomp_size;
-        } else {
+        // uncompress block data directly to its final buffer
+        CacheFileCodec * unpacker = getCacheFileCodec( codec );
+        lUInt8 * uncomp_buf = (lUInt8 *)malloc(uncompressedSize);
+        lInt64 startTime = getTimeMicros();
+        if ( !unpacker || !unpacker->unpack(data, size, uncomp_buf, uncompressedSize) ) {
             CRLog::error("CacheFile::read: error while uncompressing data for block %d:%d of size %d", type, dataIndex, (int)size);
-            free(buf);
-            buf = NULL;
+            free(uncomp_buf);
+            free(readbuf);
             size = 0;
             return false;
         }
+        if ( type<CBT_MAX_TYPE ) {
+            CacheFileUnpackStats & st = _cacheFileUnpackStats[type];
+            ls_atomic_add( &st.count, 1 );
+            ls_atomic_add64( &st.bytes, uncompressedSize );
+            ls_atomic_add64( &st.micros, getTimeMicros() - startTime );
+        }
+        free(readbuf);
+        buf = uncomp_buf;
+        size = uncompressedSize;
+    } else if ( readbuf ) {
+        buf = readbuf;
+    } else {
+        // zero copy: buffer points to read only mapped memory
+        buf = (lUInt8 *)data;
+        mapbuf = region;
     }
 
-    // check CRC
+    if ( validated )
+        return true;
+    // check CRC on first read only
     lUInt64 hash = calcHash64( buf, size );
-    if (hash != block->_dataHash) {
+    if (hash != dataHash) {
         CRLog::error("CacheFile::read: CRC doesn't match for block %d:%d of size %d", type, dataIndex, (int)size);
-        free(buf);
+        if ( mapbuf.isNull() )
+            free(buf);
+        mapbuf.Clear();
         buf = NULL;
         size = 0;
+        setInvalid( type, dataIndex );
         return false;
     }
-    // Success. Don't forget to free allocated block externally
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    _validated.set( ((lUInt32)type)<<16 | dataIndex, true );
+    return true;
+}
+
+// returns copy of block snapshot which is queued for writing, false if there is no such block
+bool CacheFile::readPending( lUInt16 type, lUInt16 dataIndex, lUInt8 * &buf, int &size )
+{
+    if ( !_writer )
+        return false;
+    CRGuard guard(_pendingMonitor);
+    CR_UNUSED(guard);
+    CacheFilePendingBlock * pending = _pending.get( ((lUInt32)type)<<16 | dataIndex );
+    if ( !pending )
+        return false;
+    size = pending->size;
+    buf = (lUInt8 *)malloc(size);
+    memcpy( buf, pending->buf, size );
     return true;
 }
 
+/// returns true if block is stored in file or queued for writing
+bool CacheFile::hasBlock( lUInt16 type, lUInt16 dataIndex )
+{
+    if ( _writer ) {
+        CRGuard guard(_pendingMonitor);
+        CR_UNUSED(guard);
+        if ( _pending.get( ((lUInt32)type)<<16 | dataIndex ) )
+            return true;
+    }
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    return findBlock( type, dataIndex )!=NULL;
+}
+
 // writes block to file
 bool CacheFile::write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int size, bool compress )
 {
     // check whether data is changed
     lUInt64 newhash = calcHash64( buf, size );
-    CacheFileItem * existingblock = findBlock( type, dataIndex );
-
-    if (existingblock) {
-        bool sameSize = ((int)existingblock->_uncompressedSize==size) || (existingblock->_uncompressedSize==0 && (int)existingblock->_dataSize==size);
-        if (sameSize && existingblock->_dataHash == newhash ) {
-            return true;
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        CacheFileItem * existingblock = findBlock( type, dataIndex );
+        if (existingblock) {
+            bool sameSize = ((int)existingblock->_uncompressedSize==size) || (existingblock->_uncompressedSize==0 && (int)existingblock->_dataSize==size);
+            if (sameSize && existingblock->_dataHash == newhash ) {
+                return true;
+            }
         }
     }
 
 #if 0
-    if (existingblock)
-        CRLog::trace("*    oldsz=%d oldhash=%08x", (int)existingblock->_uncompressedSize, (int)existingblock->_dataHash);
     CRLog::trace("* wr block t=%d[%d] sz=%d hash=%08x", type, dataIndex, size, newhash);
 #endif
-    setDirtyFlag(true);
 
+    // compression is done without lock, so readers are not blocked by it
     lUInt32 uncompressedSize = 0;
     lUInt64 newpackedhash = newhash;
+    lUInt32 codec = CACHE_CODEC_NONE;
 #if DOC_DATA_COMPRESSION_LEVEL==0
     compress = false;
 #else
     if ( compress ) {
         lUInt8 * dstbuf = NULL;
         lUInt32 dstsize = 0;
-        if ( !ldomPack( buf, size, dstbuf, dstsize ) ) {
+        if ( !packCacheFileBlock( type, buf, size, dstbuf, dstsize, codec, NULL ) ) {
             compress = false;
         } else {
             uncompressedSize = size;
@@ -901,6 +1460,30 @@ bool CacheFile::write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int
     }
 #endif
 
+    bool res;
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        res = writeBlock( type, dataIndex, buf, size, newhash, newpackedhash, uncompressedSize, compress ? codec : CACHE_CODEC_NONE );
+    }
+#if DOC_DATA_COMPRESSION_LEVEL!=0
+    if ( compress ) {
+        free( (void*)buf );
+    }
+#endif
+    return res;
+}
+
+// writes already packed block data to file, call under lock
+bool CacheFile::writeBlock( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int size, lUInt64 hash, lUInt64 packedHash, lUInt32 uncompressedSize, lUInt32 codec )
+{
+    setDirtyFlag(true);
+    if ( !_mapped.isNull() )
+        _mapStale.set( ((lUInt32)type)<<16 | dataIndex, true );
+    // data is known to be correct
+    _validated.set( ((lUInt32)type)<<16 | dataIndex, true );
+
+    CacheFileItem * existingblock = findBlock( type, dataIndex );
     CacheFileItem * block = NULL;
     if ( existingblock && existingblock->_dataSize>=size ) {
         // reuse existing block
@@ -912,46 +1495,21 @@ bool CacheFile::write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int
         block = allocBlock( type, dataIndex, size );
     }
     if ( !block )
-    {
-#if DOC_DATA_COMPRESSION_LEVEL!=0
-        if ( compress ) {
-            free( (void*)buf );
-        }
-#endif
         return false;
-    }
     if ( (int)_stream->SetPos( block->_blockFilePos )!=block->_blockFilePos )
-    {
-#if DOC_DATA_COMPRESSION_LEVEL!=0
-        if ( compress ) {
-            free( (void*)buf );
-        }
-#endif
         return false;
-    }
     // assert: size == block->_dataSize
     // actual writing of data
     block->_dataSize = size;
     lvsize_t bytesWritten = 0;
     _stream->Write(buf, size, &bytesWritten );
     if ( (int)bytesWritten!=size )
-    {
-#if DOC_DATA_COMPRESSION_LEVEL!=0
-        if ( compress ) {
-            free( (void*)buf );
-        }
-#endif
         return false;
-    }
 #if CACHE_FILE_WRITE_BLOCK_PADDING==1
     int paddingSize = block->_blockSize - size; //roundSector( size ) - size
     if ( paddingSize ) {
         if ((int)block->_blockFilePos + (int)block->_dataSize >= (int)_stream->GetSize() - _sectorSize) {
             LASSERT(size + paddingSize == block->_blockSize );
-//            if (paddingSize > 16384) {
-//                CRLog::error("paddingSize > 16384");
-//            }
-//            LASSERT(paddingSize <= 16384);
             lUInt8 tmp[16384];//paddingSize];
             memset(tmp, 0xFF, paddingSize < 16384 ? paddingSize : 16384);
             do {
@@ -964,15 +1522,10 @@ bool CacheFile::write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int
 #endif
     //_stream->Flush(true);
     // update CRC
-    block->_dataHash = newhash;
-    block->_packedHash = newpackedhash;
+    block->_dataHash = hash;
+    block->_packedHash = packedHash;
     block->_uncompressedSize = uncompressedSize;
-
-#if DOC_DATA_COMPRESSION_LEVEL!=0
-    if ( compress ) {
-        free( (void*)buf );
-    }
-#endif
+    block->_codec = codec;
     _indexChanged = true;
 
     //CRLog::error("CacheFile::write: block %d:%d (pos %ds, size %ds) is written (crc=%08x)", type, dataIndex, (int)block->_blockFilePos/_sectorSize, (int)(size+_sectorSize-1)/_sectorSize, block->_dataCRC);
@@ -980,18 +1533,267 @@ bool CacheFile::write( lUInt16 type, lUInt16 dataIndex, const lUInt8 * buf, int
     return true;
 }
 
-/// writes content of serial buffer
-bool CacheFile::write( lUInt16 type, lUInt16 index, SerialBuf & buf, bool compress )
+/// shared queue of batch items, packed by several threads
+class CacheFileBatchQueue
 {
-    return write( type, index, buf.buf(), buf.pos(), compress );
-}
+    LVPtrVector<CacheFileBatchItem> & _items;
+    CRMutexRef _mutex;
+    int _next;
+public:
+    CacheFileBatchQueue( LVPtrVector<CacheFileBatchItem> & items, bool threaded )
+    : _items(items), _next(0)
+    {
+        if ( threaded )
+            _mutex = concurrencyProvider->createMutex();
+    }
+    /// returns next item to pack, NULL if there are no more items
+    CacheFileBatchItem * next()
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        return _next < _items.length() ? _items[_next++] : NULL;
+    }
+};
 
-/// reads content of serial buffer
-bool CacheFile::read( lUInt16 type, lUInt16 index, SerialBuf & buf )
+/// packs items taken from batch queue, reusing own deflate context
+class CacheFileBatchPackTask : public CRRunnable
 {
-    lUInt8 * tmp = NULL;
-    int size = 0;
-    bool res = read( type, index, tmp, size );
+    CacheFileBatchQueue * _queue;
+public:
+    CacheFileBatchPackTask( CacheFileBatchQueue * queue ) : _queue(queue) { }
+    virtual void run()
+    {
+        ldomPacker packer;
+        CacheFileBatchItem * item;
+        while ( (item = _queue->next())!=NULL ) {
+            item->hash = calcHash64( item->buf, item->size );
+            if ( item->existingSize==item->size && item->existingHash==item->hash ) {
+                item->unchanged = true;
+                continue;
+            }
+            item->packedHash = item->hash;
+            if ( item->compress && packCacheFileBlock( item->type, item->buf, item->size, item->packed, item->packedSize, item->codec, &packer ) )
+                item->packedHash = calcHash64( item->packed, item->packedSize );
+            else
+                item->packed = NULL;
+        }
+    }
+};
+
+/// writes set of blocks: packs them in parallel threads, then writes to file in order
+bool CacheFile::writeBatch( LVPtrVector<CacheFileBatchItem> & items )
+{
+    if ( items.length()==0 )
+        return true;
+    // block with queued older version cannot be skipped as unchanged: file data will be replaced by queued one
+    LVArray<bool> queued( items.length(), false );
+    if ( _writer ) {
+        CRGuard guard(_pendingMonitor);
+        CR_UNUSED(guard);
+        for ( int i=0; i<items.length(); i++ )
+            queued[i] = _pending.get( ((lUInt32)items[i]->type)<<16 | items[i]->index )!=NULL;
+    }
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        for ( int i=0; i<items.length(); i++ ) {
+            CacheFileItem * existing = queued[i] ? NULL : findBlock( items[i]->type, items[i]->index );
+            if ( existing ) {
+                items[i]->existingSize = existing->_uncompressedSize ? (int)existing->_uncompressedSize : existing->_dataSize;
+                items[i]->existingHash = existing->_dataHash;
+            }
+#if DOC_DATA_COMPRESSION_LEVEL==0
+            items[i]->compress = false;
+#endif
+        }
+    }
+
+    int threadCount = concurrencyProvider ? _cacheFileCompressionThreads : 1;
+    if ( threadCount > items.length() )
+        threadCount = items.length();
+    if ( threadCount < 1 )
+        threadCount = 1;
+    CacheFileBatchQueue queue( items, threadCount>1 );
+    LVPtrVector<CacheFileBatchPackTask> tasks;
+    LVPtrVector<CRThread> threads;
+    for ( int i=1; i<threadCount; i++ ) {
+        CacheFileBatchPackTask * task = new CacheFileBatchPackTask( &queue );
+        tasks.add( task );
+        CRThread * thread = concurrencyProvider->createThread( task );
+        threads.add( thread );
+        thread->start();
+    }
+    // current thread packs as well
+    CacheFileBatchPackTask task( &queue );
+    task.run();
+    for ( int i=0; i<threads.length(); i++ )
+        threads[i]->join();
+
+    if ( _writer ) {
+        // packed blocks are written by background writer, in original order
+        for ( int i=0; i<items.length(); i++ ) {
+            CacheFileBatchItem * item = items[i];
+            if ( item->unchanged )
+                continue;
+            lUInt8 * snapshot;
+            if ( item->ownBuf ) {
+                snapshot = (lUInt8 *)item->buf;
+                item->ownBuf = false;
+            } else {
+                snapshot = (lUInt8 *)malloc( item->size );
+                memcpy( snapshot, item->buf, item->size );
+            }
+            CacheFilePendingBlock * block = new CacheFilePendingBlock( item->type, item->index, snapshot, item->size, item->compress );
+            block->prepared = true;
+            block->packed = item->packed;
+            block->packedSize = item->packedSize;
+            block->codec = item->codec;
+            block->hash = item->hash;
+            block->packedHash = item->packedHash;
+            item->packed = NULL;
+            queuePending( block );
+        }
+        return true;
+    }
+
+    // allocate space and write in original order
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    for ( int i=0; i<items.length(); i++ ) {
+        CacheFileBatchItem * item = items[i];
+        if ( item->unchanged )
+            continue;
+        bool res;
+        if ( item->packed )
+            res = writeBlock( item->type, item->index, item->packed, item->packedSize, item->hash, item->packedHash, item->size, item->codec );
+        else
+            res = writeBlock( item->type, item->index, item->buf, item->size, item->hash, item->packedHash, 0, CACHE_CODEC_NONE );
+        if ( !res ) {
+            CRLog::error("CacheFile::writeBatch: error while writing block %d:%d", item->type, item->index);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// task for background cache writer
+class CacheFileWriteTask : public CRRunnable
+{
+    CacheFile * _file;
+    CacheFilePendingBlock * _block;
+public:
+    CacheFileWriteTask( CacheFile * file, CacheFilePendingBlock * block ) : _file(file), _block(block) { }
+    virtual void run()
+    {
+        _file->writePending( _block );
+    }
+};
+
+// starts background writer thread, if concurrency provider is set
+void CacheFile::startBackgroundWriter()
+{
+    if ( _writer || !_enableCacheFileBackgroundWriter || !concurrencyProvider )
+        return;
+    if ( _mutex.isNull() )
+        _mutex = concurrencyProvider->createMutex();
+    _pendingMonitor = concurrencyProvider->createMonitor();
+    _writer = new CRThreadExecutor();
+}
+
+/// allows blocks to be read by readUnmapped() from other threads, if concurrency provider is set
+void CacheFile::enableConcurrentReads()
+{
+    if ( _mutex.isNull() && concurrencyProvider )
+        _mutex = concurrencyProvider->createMutex();
+}
+
+/// queues block for writing by background thread; takes ownership of malloc'ed buf
+bool CacheFile::writeAsync( lUInt16 type, lUInt16 dataIndex, lUInt8 * buf, int size, bool compress )
+{
+    if ( !_writer ) {
+        bool res = write( type, dataIndex, buf, size, compress );
+        free( buf );
+        return res;
+    }
+    queuePending( new CacheFilePendingBlock( type, dataIndex, buf, size, compress ) );
+    return true;
+}
+
+// adds block to queue of background writer
+void CacheFile::queuePending( CacheFilePendingBlock * block )
+{
+    {
+        CRGuard guard(_pendingMonitor);
+        CR_UNUSED(guard);
+        // replaces older snapshot of the same block, if it's still queued: it will be written first, but not read anymore
+        _pending.set( ((lUInt32)block->type)<<16 | block->index, block );
+        _pendingCount++;
+    }
+    _writer->execute( new CacheFileWriteTask( this, block ) );
+}
+
+/// writes queued block, called from background writer thread
+void CacheFile::writePending( CacheFilePendingBlock * block )
+{
+    bool res;
+    if ( block->prepared ) {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        if ( block->packed )
+            res = writeBlock( block->type, block->index, block->packed, block->packedSize, block->hash, block->packedHash, block->size, block->codec );
+        else
+            res = writeBlock( block->type, block->index, block->buf, block->size, block->hash, block->packedHash, 0, CACHE_CODEC_NONE );
+    } else {
+        res = write( block->type, block->index, block->buf, block->size, block->compress );
+    }
+    CRGuard guard(_pendingMonitor);
+    CR_UNUSED(guard);
+    if ( !res ) {
+        CRLog::error("CacheFile::writePending: error while writing block %d:%d", block->type, block->index);
+        _writeError = true;
+    }
+    lUInt32 key = ((lUInt32)block->type)<<16 | block->index;
+    if ( _pending.get( key )==block )
+        _pending.remove( key );
+    delete block;
+    _pendingCount--;
+    _pendingMonitor->notifyAll();
+}
+
+/// returns true if some blocks are queued for background writing
+bool CacheFile::hasPendingWrites()
+{
+    if ( !_writer )
+        return false;
+    CRGuard guard(_pendingMonitor);
+    CR_UNUSED(guard);
+    return _pendingCount>0;
+}
+
+/// waits until all queued blocks are written, returns false if some of writes is failed
+bool CacheFile::waitPendingWrites()
+{
+    if ( !_writer )
+        return true;
+    CRGuard guard(_pendingMonitor);
+    CR_UNUSED(guard);
+    while ( _pendingCount>0 )
+        _pendingMonitor->wait();
+    return !_writeError;
+}
+
+/// writes content of serial buffer
+bool CacheFile::write( lUInt16 type, lUInt16 index, SerialBuf & buf, bool compress )
+{
+    return write( type, index, buf.buf(), buf.pos(), compress );
+}
+
+/// reads content of serial buffer
+bool CacheFile::read( lUInt16 type, lUInt16 index, SerialBuf & buf )
+{
+    lUInt8 * tmp = NULL;
+    int size = 0;
+    bool res = read( type, index, tmp, size );
     if ( res ) {
         buf.set( tmp, size );
     }
@@ -1023,10 +1825,14 @@ bool CacheFile::open( LVStreamRef stream )
         CRLog::error("CacheFile::open : cannot read index from file");
         return false;
     }
-    if (_enableCacheFileContentsValidation && !validateContents() ) {
-        CRLog::error("CacheFile::open : file contents validation failed");
-        return false;
+    // header and index CRC are checked by readIndex(), blocks are validated on first read
+    if ( _enableCacheFileMappedRead && _stream->GetName() ) {
+        // blocks existing at the moment of open may be read directly from mapped memory
+        _mapped = LVMapFileStream( _stream->GetName(), LVOM_READ, 0 );
+        if ( _mapped.isNull() )
+            CRLog::warn("CacheFile::open : cannot map file to memory, using stream reads");
     }
+    startBackgroundWriter();
     return true;
 }
 
@@ -1063,9 +1869,236 @@ bool CacheFile::create( LVStreamRef stream )
         _stream.Clear();
         return false;
     }
+    startBackgroundWriter();
+    return true;
+}
+
+/// unit test hook, not part of public API: overwrites packed data of last text storage chunk in cache file with garbage, to test handling of corrupted cache files
+bool damageCacheFileTextChunk( lString16 pathname )
+{
+    LVStreamRef stream = LVOpenFileStream( pathname.c_str(), LVOM_APPEND );
+    if ( stream.isNull() )
+        return false;
+    CacheFileHeader hdr(NULL, 0, 0);
+    lvsize_t bytesRead = 0;
+    stream->SetPos(0);
+    stream->Read(&hdr, sizeof(hdr), &bytesRead );
+    if ( bytesRead!=sizeof(hdr) || !hdr.validate() || !hdr._indexBlock._blockFilePos )
+        return false;
+    int count = hdr._indexBlock._dataSize / sizeof(CacheFileItem);
+    LVArray<CacheFileItem> index( count, CacheFileItem() );
+    lvsize_t sz = sizeof(CacheFileItem)*count;
+    bytesRead = 0;
+    stream->SetPos( hdr._indexBlock._blockFilePos );
+    stream->Read( index.get(), sz, &bytesRead );
+    if ( bytesRead!=sz )
+        return false;
+    CacheFileItem * block = NULL;
+    for ( int i=0; i<count; i++ ) {
+        // storage chunk index is saved as block 0xFFFF
+        if ( index[i]._dataType==CBT_TEXT_DATA && index[i]._dataIndex!=0xFFFF && index[i]._dataSize>0 && ( !block || index[i]._dataIndex>block->_dataIndex ) )
+            block = &index[i];
+    }
+    if ( !block )
+        return false;
+    LVArray<lUInt8> garbage( block->_dataSize, 0 );
+    for ( int i=0; i<garbage.length(); i++ )
+        garbage[i] = (lUInt8)(i * 31 + 7);
+    stream->SetPos( block->_blockFilePos );
+    lvsize_t bytesWritten = 0;
+    stream->Write( garbage.get(), garbage.length(), &bytesWritten );
+    CRLog::info("Text chunk %d of cache file %s is damaged", block->_dataIndex, LCSTR(pathname));
+    return bytesWritten==(lvsize_t)garbage.length();
+}
+
+// returns size of file space not occupied by block data
+int CacheFile::getFreeSpace()
+{
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    int used = _sectorSize;
+    for ( int i=0; i<_index.length(); i++ ) {
+        CacheFileItem * item = _index[i];
+        if ( item->_dataType==CBT_INDEX )
+            used += item->_blockSize;
+        else if ( item->_dataType!=CBT_FREE )
+            used += roundSector( item->_dataSize );
+    }
+    return _size > used ? _size - used : 0;
+}
+
+// returns true if file contains too much free space, or its compaction is not finished
+bool CacheFile::needsCompaction()
+{
+    if ( _compacting )
+        return true;
+    if ( !_cacheFileCompactFreePercent )
+        return false;
+    int freeSpace = getFreeSpace();
+    return freeSpace >= CACHE_FILE_COMPACT_MIN_FREE && freeSpace >= (int)((lInt64)_size * _cacheFileCompactFreePercent / 100);
+}
+
+// stops reading of blocks via memory mapping
+void CacheFile::unmap()
+{
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    _mapped.Clear();
+    _mapStale.clear();
+}
+
+// joins adjacent free blocks, drops free blocks at the end of file
+void CacheFile::mergeFreeBlocks()
+{
+    for ( int i=0; i<_index.length(); ) {
+        CacheFileItem * item = _index[i];
+        if ( item->_dataType!=CBT_FREE ) {
+            i++;
+            continue;
+        }
+        if ( i+1<_index.length() && _index[i+1]->_dataType==CBT_FREE ) {
+            item->_blockSize += _index[i+1]->_blockSize;
+            _freeIndex.remove( _index[i+1] );
+            _index.erase( i+1, 1 );
+            continue;
+        }
+        if ( item->_blockSize==0 || i==_index.length()-1 ) {
+            if ( i==_index.length()-1 )
+                _size = item->_blockFilePos;
+            _freeIndex.remove( item );
+            _index.erase( i, 1 );
+            continue;
+        }
+        i++;
+    }
+}
+
+// moves used block to beginning of free block placed before it, call under lock
+bool CacheFile::relocateBlock( int from, int to )
+{
+    CacheFileItem * block = _index[from];
+    CacheFileItem * hole = _index[to];
+    int oldPos = block->_blockFilePos;
+    int oldSize = block->_blockSize;
+    int newPos = hole->_blockFilePos;
+    int newSize = roundSector( block->_dataSize );
+    int size = block->_dataSize;
+    if ( size>0 ) {
+        // new place may overlap old one: read whole block first
+        lUInt8 * buf = (lUInt8 *)malloc( size );
+        lvsize_t bytesRead = 0;
+        lvsize_t bytesWritten = 0;
+        if ( (int)_stream->SetPos( oldPos )!=oldPos || _stream->Read( buf, size, &bytesRead )!=LVERR_OK || (int)bytesRead!=size ) {
+            CRLog::error("CacheFile::compact: cannot read block %d:%d of size %d", block->_dataType, block->_dataIndex, size);
+            free( buf );
+            return false;
+        }
+        if ( (int)_stream->SetPos( newPos )!=newPos || _stream->Write( buf, size, &bytesWritten )!=LVERR_OK || (int)bytesWritten!=size ) {
+            CRLog::error("CacheFile::compact: cannot write block %d:%d of size %d", block->_dataType, block->_dataIndex, size);
+            free( buf );
+            return false;
+        }
+        free( buf );
+    }
+    block->_blockFilePos = newPos;
+    block->_blockSize = newSize;
+    if ( from==to+1 ) {
+        // hole moves after block
+        hole->_blockFilePos = newPos + newSize;
+        hole->_blockSize = oldPos + oldSize - hole->_blockFilePos;
+        _index.move( to, from );
+    } else {
+        // old place of block becomes free
+        CacheFileItem * freed = new CacheFileItem( CBT_FREE, 0 );
+        freed->_blockFilePos = oldPos;
+        freed->_blockSize = oldSize;
+        _index.remove( from );
+        _index.insert( from, freed );
+        _freeIndex.add( freed );
+        hole->_blockFilePos += newSize;
+        hole->_blockSize -= newSize;
+        _index.insert( to, block );
+    }
+    _indexChanged = true;
     return true;
 }
 
+// moves blocks to the beginning of file and truncates it, limited by time interval
+ContinuousOperationResult CacheFile::compact( CRTimerUtil & maxTime )
+{
+    // queued blocks may be placed to any free block
+    if ( !waitPendingWrites() )
+        return CR_ERROR;
+    if ( !_compacting ) {
+        CRLog::info("CacheFile::compact: started, file size %d, free space %d", _size, getFreeSpace());
+        _compacting = true;
+    }
+    CRGuard guard(_mutex);
+    CR_UNUSED(guard);
+    // mapped regions of moved blocks would be overwritten or truncated
+    _mapped.Clear();
+    _mapStale.clear();
+    // file stays invalid until compaction is finished and new index is written
+    setDirtyFlag(true);
+    CacheFileItem * indexItem = findBlock( CBT_INDEX, 0 );
+    if ( indexItem )
+        freeBlock( indexItem );
+    _indexChanged = true;
+    // unused tails of blocks rewritten with smaller data become free blocks
+    for ( int i=0; i<_index.length(); i++ ) {
+        CacheFileItem * item = _index[i];
+        int size = roundSector( item->_dataSize );
+        if ( item->_dataType==CBT_FREE || item->_blockSize<=size )
+            continue;
+        CacheFileItem * tail = new CacheFileItem( CBT_FREE, 0 );
+        tail->_blockFilePos = item->_blockFilePos + size;
+        tail->_blockSize = item->_blockSize - size;
+        item->_blockSize = size;
+        _index.insert( i+1, tail );
+        _freeIndex.add( tail );
+    }
+    for (;;) {
+        mergeFreeBlocks();
+        int first = -1;
+        for ( int i=0; i<_index.length(); i++ ) {
+            if ( _index[i]->_dataType==CBT_FREE ) {
+                first = i;
+                break;
+            }
+        }
+        if ( first<0 )
+            break;
+        // last block is used after merging: try to find first hole it fits into
+        int last = _index.length() - 1;
+        int lastSize = roundSector( _index[last]->_dataSize );
+        int to = -1;
+        for ( int i=first; i<last; i++ ) {
+            if ( _index[i]->_dataType==CBT_FREE && _index[i]->_blockSize>=lastSize ) {
+                to = i;
+                break;
+            }
+        }
+        bool res = to>=0 ? relocateBlock( last, to ) : relocateBlock( first+1, first );
+        if ( !res )
+            return CR_ERROR;
+        if ( maxTime.expired() )
+            return CR_TIMEOUT;
+    }
+    if ( _index.length()==0 )
+        _size = _sectorSize;
+    for ( int i=0; i<_index.length(); i++ )
+        _index[i]->_blockIndex = i;
+    if ( _stream->SetSize( _size )!=LVERR_OK )
+        CRLog::warn("CacheFile::compact: cannot truncate file to %d bytes", _size);
+    // new index is written after all blocks, and only then header points to it
+    if ( !writeIndex() )
+        return CR_ERROR;
+    setDirtyFlag(false);
+    _compacting = false;
+    CRLog::info("CacheFile::compact: finished, file size %d", _size);
+    return CR_DONE;
+}
+
 // BLOB storage
 
 class ldomBlobItem {
@@ -1433,13 +2466,13 @@ struct ElementDataStorageItem : public DataStorageItemHeader {
     lUInt8  reserved8;
     lInt32  childCount;
     lInt32  children[1];
-    lUInt16 * attrs() { return (lUInt16 *)(children + childCount); }
-    lxmlAttribute * attr( int index ) { return (lxmlAttribute *)&(((lUInt16 *)(children + childCount))[index*3]); }
-    lUInt16 getAttrValueId( lUInt16 ns, lUInt16 id )
+    lxmlAttribute * attrs() { return (lxmlAttribute *)(children + childCount); }
+    lxmlAttribute * attr( int index ) { return attrs() + index; }
+    lUInt32 getAttrValueId( lUInt16 ns, lUInt16 id )
     {
-        lUInt16 * a = attrs();
+        lxmlAttribute * a = attrs();
         for ( int i=0; i<attrCount; i++ ) {
-            lxmlAttribute * attr = (lxmlAttribute *)(&a[i*3]);
+            lxmlAttribute * attr = &a[i];
             if ( !attr->compare( ns, id ) )
                 continue;
             return  attr->index;
@@ -1448,9 +2481,9 @@ struct ElementDataStorageItem : public DataStorageItemHeader {
     }
     lxmlAttribute * findAttr( lUInt16 ns, lUInt16 id )
     {
-        lUInt16 * a = attrs();
+        lxmlAttribute * a = attrs();
         for ( int i=0; i<attrCount; i++ ) {
-            lxmlAttribute * attr = (lxmlAttribute *)(&a[i*3]);
+            lxmlAttribute * attr = &a[i];
             if ( attr->compare( ns, id ) )
                 return attr;
         }
@@ -1464,6 +2497,281 @@ struct ElementDataStorageItem : public DataStorageItemHeader {
 #endif
 
 
+#if BUILD_LITE!=1
+/// chunks accessed by last switches between chunks of storage are never evicted: pointers to their data may be in use
+/// (the same number of chunks as fitted into former per-storage limit)
+#define STORAGE_BUDGET_PROTECTED_CHUNKS 8
+/// max value of chunk clock credit
+#define STORAGE_BUDGET_MAX_CREDIT 15
+
+/// process wide limit of unpacked storage data, shared by storage managers of all documents
+class ldomStorageBudget
+{
+    LVArray<ldomDataStorageManager *> _managers;
+    int _maxSize;
+    /// swaps out chunks of single storage, walking its clock hand; returns new total size
+    int evict( ldomDataStorageManager * manager, int size, int reservedSpace, ldomTextStorageChunk * keep )
+    {
+        int chunkCount = manager->_chunks.length();
+        // each chunk may be visited until its credit is spent
+        int steps = chunkCount * (STORAGE_BUDGET_MAX_CREDIT + 2);
+        while ( size + reservedSpace > _maxSize && steps-- > 0 ) {
+            if ( manager->_clockHand>=chunkCount )
+                manager->_clockHand = 0;
+            ldomTextStorageChunk * p = manager->_chunks[manager->_clockHand++];
+            if ( !p->_buf || p==keep || p==manager->_activeChunk || p->_pinCount || manager->_accessStamp - p->_accessStamp < STORAGE_BUDGET_PROTECTED_CHUNKS )
+                continue;
+            if ( p->_clockCredit ) {
+                p->_clockCredit--;
+                continue;
+            }
+            if ( !manager->_cache )
+                manager->_owner->createCacheFile();
+            if ( manager->_cache ) {
+                int sz = p->_bufsize;
+                if ( !p->swapToCache(true) ) {
+                    crFatalError(111, "Swap file writing error!");
+                }
+                size -= sz;
+            }
+        }
+        return size;
+    }
+public:
+    ldomStorageBudget()
+    : _maxSize(STORAGE_UNPACKED_SPACE)
+    {
+    }
+    void addManager( ldomDataStorageManager * manager )
+    {
+        _managers.add( manager );
+    }
+    void removeManager( ldomDataStorageManager * manager )
+    {
+        for ( int i=0; i<_managers.length(); i++ ) {
+            if ( _managers[i]==manager ) {
+                _managers.remove( i );
+                break;
+            }
+        }
+    }
+    int getMaxSize() { return _maxSize; }
+    void setMaxSize( int size ) { _maxSize = size; }
+    /// returns total size of unpacked data of all managers
+    int getSize()
+    {
+        int sz = 0;
+        for ( int i=0; i<_managers.length(); i++ )
+            sz += _managers[i]->_uncompressedSize;
+        return sz;
+    }
+    /// chunk is being accessed: gives it credit which depends on its restore cost and size
+    void touch( ldomTextStorageChunk * chunk )
+    {
+        ldomDataStorageManager * manager = chunk->_manager;
+        if ( chunk==manager->_lastChunk )
+            return;
+        manager->_lastChunk = chunk;
+        chunk->_accessStamp = ++manager->_accessStamp;
+        // relative cost of chunk restore: unpack (zlib or fast/none), and write if unsaved
+        int cost = (chunk->_type=='t' || chunk->_type=='e') ? 4 : 2;
+        if ( cost==2 && manager->_cache && manager->_cache->isMapped() )
+            cost = 1;
+        if ( !chunk->_saved )
+            cost += 2;
+        int size = chunk->_bufsize ? (int)chunk->_bufsize : manager->_chunkSize;
+        // cost per byte: large chunks of cheap data are evicted first
+        int credit = size>0 ? cost * 0x10000 / size : STORAGE_BUDGET_MAX_CREDIT;
+        if ( credit<1 )
+            credit = 1;
+        if ( credit>STORAGE_BUDGET_MAX_CREDIT )
+            credit = STORAGE_BUDGET_MAX_CREDIT;
+        chunk->_clockCredit = (lUInt8)credit;
+    }
+    /// swaps out chunks until there is enough space for reservedSpace bytes more; never evicts keep chunk
+    /**
+        Only chunks of requesting storage are swapped out: callers may hold pointers into chunks of other storages
+        and documents. When manager is NULL (limit is changed), chunks of all storages which have cache file are swapped out.
+    */
+    void compact( int reservedSpace, ldomTextStorageChunk * keep, ldomDataStorageManager * manager )
+    {
+        int size = getSize();
+        if ( size + reservedSpace <= _maxSize + _maxSize/10 ) // allow +10% overflow
+            return;
+        if ( manager ) {
+            evict( manager, size, reservedSpace, keep );
+            return;
+        }
+        for ( int i=0; i<_managers.length() && size + reservedSpace > _maxSize; i++ ) {
+            if ( _managers[i]->_cache )
+                size = evict( _managers[i], size, reservedSpace, keep );
+        }
+    }
+};
+
+static ldomStorageBudget _storageBudget;
+
+/// sets limit of unpacked DOM storage data for all documents, bytes
+void setDomStorageMemoryLimit( int size )
+{
+    _storageBudget.setMaxSize( size );
+    _storageBudget.compact( 0, NULL, NULL );
+}
+
+/// returns limit of unpacked DOM storage data for all documents, bytes
+int getDomStorageMemoryLimit()
+{
+    return _storageBudget.getMaxSize();
+}
+
+/// returns current size of unpacked DOM storage data of all documents, bytes
+int getDomStorageMemoryUsage()
+{
+    return _storageBudget.getSize();
+}
+#endif
+
+#if BUILD_LITE!=1
+/// LRU cache of wide strings decoded from persistent text nodes, by node data index
+class ldomTextCache
+{
+    struct Item {
+        lUInt32 dataIndex; // 0 for free item
+        lString16 text;
+        int prev;          // more recently used item, -1 for head
+        int next;          // less recently used item, -1 for tail
+    };
+    Item * _items;
+    int _size;
+    int _count; // number of items ever used
+    int _head;
+    int _tail;
+    LVHashTable<lUInt32, int> _index;
+    void unlink( int i )
+    {
+        Item & item = _items[i];
+        if ( item.prev>=0 )
+            _items[item.prev].next = item.next;
+        else
+            _head = item.next;
+        if ( item.next>=0 )
+            _items[item.next].prev = item.prev;
+        else
+            _tail = item.prev;
+    }
+    void linkHead( int i )
+    {
+        _items[i].prev = -1;
+        _items[i].next = _head;
+        if ( _head>=0 )
+            _items[_head].prev = i;
+        _head = i;
+        if ( _tail<0 )
+            _tail = i;
+    }
+    void linkTail( int i )
+    {
+        _items[i].next = -1;
+        _items[i].prev = _tail;
+        if ( _tail>=0 )
+            _items[_tail].next = i;
+        _tail = i;
+        if ( _head<0 )
+            _head = i;
+    }
+public:
+    ldomTextCache( int size )
+    : _size(size), _count(0), _head(-1), _tail(-1), _index(size * 2)
+    {
+        _items = new Item[size];
+    }
+    ~ldomTextCache()
+    {
+        delete[] _items;
+    }
+    /// finds text of node, marks it as recently used
+    bool get( lUInt32 dataIndex, lString16 & text )
+    {
+        int i;
+        if ( !_index.get( dataIndex, i ) )
+            return false;
+        if ( i!=_head ) {
+            unlink( i );
+            linkHead( i );
+        }
+        text = _items[i].text;
+        return true;
+    }
+    /// adds text of node, replacing least recently used one if cache is full
+    void put( lUInt32 dataIndex, const lString16 & text )
+    {
+        int i;
+        if ( _index.get( dataIndex, i ) ) {
+            unlink( i );
+        } else if ( _count<_size && (_tail<0 || _items[_tail].dataIndex) ) {
+            i = _count++;
+        } else {
+            // reuse free or least recently used item
+            i = _tail;
+            unlink( i );
+            if ( _items[i].dataIndex )
+                _index.remove( _items[i].dataIndex );
+        }
+        _items[i].dataIndex = dataIndex;
+        _items[i].text = text;
+        _index.set( dataIndex, i );
+        linkHead( i );
+    }
+    /// forgets text of node, call when node text is changed or node is removed
+    void remove( lUInt32 dataIndex )
+    {
+        int i;
+        if ( !_index.get( dataIndex, i ) )
+            return;
+        _index.remove( dataIndex );
+        unlink( i );
+        _items[i].dataIndex = 0;
+        _items[i].text.clear();
+        linkTail( i );
+    }
+};
+
+struct ldomPrefetchItem;
+/// restores swapped out storage chunks in background thread, in order learned while pages were drawn
+class ldomChunkPrefetcher
+{
+    ldomDataStorageManager * _managers[4];
+    CRThreadExecutor * _executor;
+    CRMonitorRef _monitor; // guards _items
+    LVPtrVector<ldomPrefetchItem> _items; // requested chunks
+    LVHashTable<lUInt32, LVArray<lUInt32> *> _history; // page -> chunks accessed while drawing (manager index << 16 | chunk index)
+    LVArray<lUInt32> * _recording;
+    int _recordingPage;
+    int managerIndex( ldomDataStorageManager * manager );
+    ldomPrefetchItem * find( ldomDataStorageManager * manager, int index, int * pos );
+    void request( ldomDataStorageManager * manager, int index );
+    void adoptReady();
+public:
+    ldomChunkPrefetcher( ldomDataStorageManager * text, ldomDataStorageManager * elem, ldomDataStorageManager * rect, ldomDataStorageManager * style );
+    ~ldomChunkPrefetcher();
+    bool isRecording() { return _recording!=NULL; }
+    /// starts recording of chunks accessed while drawing page
+    void startRecording( int page );
+    /// stops recording, remembers chunk access order for page
+    void stopRecording();
+    /// adds chunk to list of chunks accessed while drawing current page
+    void recordAccess( ldomDataStorageManager * manager, int chunkIndex );
+    /// forgets recorded chunk access order
+    void clearHistory();
+    /// schedules background restore of chunks needed to draw page
+    void prefetch( int page, int direction );
+    /// reads and unpacks chunk, called from background thread
+    void load( ldomDataStorageManager * manager, int index );
+    /// takes prefetched data of swapped out chunk; returns false if chunk is not prefetched
+    bool adopt( ldomTextStorageChunk * chunk );
+};
+#endif
+
 //=================================================================
 // tinyNodeCollection implementation
 //=================================================================
@@ -1485,16 +2793,18 @@ tinyNodeCollection::tinyNodeCollection()
 , _mapSavingStage(0)
 , _minSpaceCondensingPercent(DEF_MIN_SPACE_CONDENSING_PERCENT)
 #endif
-, _textStorage(this, 't', TEXT_CACHE_UNPACKED_SPACE, TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
-, _elemStorage(this, 'e', ELEM_CACHE_UNPACKED_SPACE, ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
-, _rectStorage(this, 'r', RECT_CACHE_UNPACKED_SPACE, RECT_CACHE_CHUNK_SIZE ) // element render rect storage
-, _styleStorage(this, 's', STYLE_CACHE_UNPACKED_SPACE, STYLE_CACHE_CHUNK_SIZE ) // element style info storage
+, _textStorage(this, 't', TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
+, _elemStorage(this, 'e', ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
+, _rectStorage(this, 'r', RECT_CACHE_CHUNK_SIZE ) // element render rect storage
+, _styleStorage(this, 's', STYLE_CACHE_CHUNK_SIZE ) // element style info storage
 ,_docProps(LVCreatePropsContainer())
 ,_docFlags(DOC_FLAG_DEFAULTS)
 ,_fontMap(113)
 {
-    memset( _textList, 0, sizeof(_textList) );
-    memset( _elemList, 0, sizeof(_elemList) );
+#if BUILD_LITE!=1
+    _chunkPrefetcher = new ldomChunkPrefetcher( &_textStorage, &_elemStorage, &_rectStorage, &_styleStorage );
+    _textCache = new ldomTextCache( TEXT_NODE_CACHE_SIZE );
+#endif
     _docIndex = ldomNode::registerDocument((ldomDocument*)this);
 }
 
@@ -1515,15 +2825,19 @@ tinyNodeCollection::tinyNodeCollection( tinyNodeCollection & v )
 , _mapSavingStage(0)
 , _minSpaceCondensingPercent(DEF_MIN_SPACE_CONDENSING_PERCENT)
 #endif
-, _textStorage(this, 't', TEXT_CACHE_UNPACKED_SPACE, TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
-, _elemStorage(this, 'e', ELEM_CACHE_UNPACKED_SPACE, ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
-, _rectStorage(this, 'r', RECT_CACHE_UNPACKED_SPACE, RECT_CACHE_CHUNK_SIZE ) // element render rect storage
-, _styleStorage(this, 's', STYLE_CACHE_UNPACKED_SPACE, STYLE_CACHE_CHUNK_SIZE ) // element style info storage
+, _textStorage(this, 't', TEXT_CACHE_CHUNK_SIZE ) // persistent text node data storage
+, _elemStorage(this, 'e', ELEM_CACHE_CHUNK_SIZE ) // persistent element data storage
+, _rectStorage(this, 'r', RECT_CACHE_CHUNK_SIZE ) // element render rect storage
+, _styleStorage(this, 's', STYLE_CACHE_CHUNK_SIZE ) // element style info storage
 ,_docProps(LVCreatePropsContainer())
 ,_docFlags(v._docFlags)
 ,_stylesheet(v._stylesheet)
 ,_fontMap(113)
 {
+#if BUILD_LITE!=1
+    _chunkPrefetcher = new ldomChunkPrefetcher( &_textStorage, &_elemStorage, &_rectStorage, &_styleStorage );
+    _textCache = new ldomTextCache( TEXT_NODE_CACHE_SIZE );
+#endif
     _docIndex = ldomNode::registerDocument((ldomDocument*)this);
 }
 
@@ -1627,6 +2941,26 @@ void tinyNodeCollection::clearNodeStyle( lUInt32 dataIndex )
     _styleStorage.setStyleData( dataIndex, &info );
 }
 
+void tinyNodeCollection::setNodeStyleInfo( lUInt32 dataIndex, lUInt16 styleIndex, lUInt16 fontIndex )
+{
+    ldomNodeStyleInfo info;
+    _styleStorage.getStyleData( dataIndex, &info );
+    _styles.addIndexRef( styleIndex );
+    _fonts.addIndexRef( fontIndex );
+    _styles.release( info._styleIndex );
+    _fonts.release( info._fontIndex );
+    info._styleIndex = styleIndex;
+    info._fontIndex = fontIndex;
+    _styleStorage.setStyleData( dataIndex, &info );
+}
+
+void tinyNodeCollection::copyNodeStyle( lUInt32 dataIndex, lUInt32 fromDataIndex )
+{
+    ldomNodeStyleInfo info;
+    _styleStorage.getStyleData( fromDataIndex, &info );
+    setNodeStyleInfo( dataIndex, info._styleIndex, info._fontIndex );
+}
+
 void tinyNodeCollection::setNodeStyleIndex( lUInt32 dataIndex, lUInt16 index )
 {
     ldomNodeStyleInfo info;
@@ -1687,7 +3021,49 @@ void tinyNodeCollection::setNodeStyle( lUInt32 dataIndex, css_style_ref_t & v )
     _styleStorage.setStyleData( dataIndex, &info );
 }
 
-void tinyNodeCollection::setNodeFont( lUInt32 dataIndex, font_ref_t & v )
+static inline int styleSharingSlot( lUInt32 parentIndex )
+{
+    return (parentIndex >> 4) & (STYLE_SHARING_CACHE_SIZE - 1);
+}
+
+ldomNode * tinyNodeCollection::findStyleSharingSibling( ldomNode * node, css_style_ref_t & parentStyle )
+{
+    lUInt32 parentIndex = node->getParentIndex();
+    ldomStyleSharingEntry & entry = _styleSharing[styleSharingSlot( parentIndex )];
+    if ( !entry.parentIndex || entry.parentIndex != parentIndex || entry.nodeIndex == (lUInt32)node->getDataIndex()
+            || entry.version != _stylesheet.getVersion() || entry.parentStyle.get() != parentStyle.get() )
+        return NULL;
+    ldomNode * sibling = getTinyNode( entry.nodeIndex );
+    if ( !sibling || !sibling->isElement() || (lUInt32)sibling->getParentIndex() != parentIndex
+            || !getNodeStyleIndex( entry.nodeIndex ) )
+        return NULL;
+    if ( getDocFlag( DOC_FLAG_ENABLE_INTERNAL_STYLES )
+            && node->getAttributeValueIndex( attr_style ) != sibling->getAttributeValueIndex( attr_style ) )
+        return NULL;
+    if ( !_stylesheet.canShareStyle( node, sibling ) )
+        return NULL;
+    return sibling;
+}
+
+void tinyNodeCollection::addStyleSharingSibling( ldomNode * node, css_style_ref_t & parentStyle )
+{
+    lUInt32 parentIndex = node->getParentIndex();
+    ldomStyleSharingEntry & entry = _styleSharing[styleSharingSlot( parentIndex )];
+    entry.parentIndex = parentIndex;
+    entry.nodeIndex = node->getDataIndex();
+    entry.version = _stylesheet.getVersion();
+    entry.parentStyle = parentStyle;
+}
+
+void tinyNodeCollection::resetStyleSharing()
+{
+    for ( int i = 0; i < STYLE_SHARING_CACHE_SIZE; i++ ) {
+        _styleSharing[i].parentIndex = 0;
+        _styleSharing[i].parentStyle.Clear();
+    }
+}
+
+void tinyNodeCollection::setNodeFont( lUInt32 dataIndex, font_ref_t & v )
 {
     ldomNodeStyleInfo info;
     _styleStorage.getStyleData( dataIndex, &info );
@@ -1702,10 +3078,10 @@ lUInt16 tinyNodeCollection::getNodeFontIndex( lUInt32 dataIndex )
     return info._fontIndex;
 }
 
-bool tinyNodeCollection::loadNodeData(lUInt16 type, ldomNode ** list, int nodecount)
+bool tinyNodeCollection::loadNodeData(lUInt16 type, ldomNodePartTable<ldomNode> & list, int nodecount)
 {
     int count = ((nodecount + TNC_PART_LEN - 1) >> TNC_PART_SHIFT);
-    for (lUInt16 i=0; i<count; i++) {
+    for (int i=0; i<count; i++) {
         int offs = i*TNC_PART_LEN;
         int sz = TNC_PART_LEN;
         if (offs + sz > nodecount) {
@@ -1714,12 +3090,12 @@ bool tinyNodeCollection::loadNodeData(lUInt16 type, ldomNode ** list, int nodeco
 
         lUInt8 * p;
         int buflen;
-        if (!_cacheFile->read( type, i, p, buflen ))
+        if (!_cacheFile->read( type, (lUInt16)i, p, buflen ))
             return false;
         ldomNode * buf = (ldomNode *)p;
         if (!buf || (unsigned)buflen != sizeof(ldomNode) * sz)
             return false;
-        list[i] = buf;
+        list.set( i, buf );
         for (int j=0; j<sz; j++) {
             buf[j].setDocumentIndex( _docIndex );
             if ( buf[j].isElement() ) {
@@ -1733,10 +3109,11 @@ bool tinyNodeCollection::loadNodeData(lUInt16 type, ldomNode ** list, int nodeco
     return true;
 }
 
-bool tinyNodeCollection::saveNodeData( lUInt16 type, ldomNode ** list, int nodecount )
+bool tinyNodeCollection::saveNodeData( lUInt16 type, ldomNodePartTable<ldomNode> & list, int nodecount )
 {
     int count = ((nodecount+TNC_PART_LEN-1) >> TNC_PART_SHIFT);
-    for (lUInt16 i=0; i<count; i++) {
+    LVPtrVector<CacheFileBatchItem> batch;
+    for (int i=0; i<count; i++) {
         if (!list[i])
             continue;
         int offs = i*TNC_PART_LEN;
@@ -1744,16 +3121,291 @@ bool tinyNodeCollection::saveNodeData( lUInt16 type, ldomNode ** list, int nodec
         if (offs + sz > nodecount) {
             sz = nodecount - offs;
         }
-        ldomNode buf[TNC_PART_LEN];
+        ldomNode * buf = (ldomNode *)malloc(sizeof(ldomNode) * sz);
         memcpy(buf, list[i], sizeof(ldomNode) * sz);
         for (int j = 0; j < sz; j++)
             buf[j].setDocumentIndex(_docIndex);
-        if (!_cacheFile->write(type, i, (lUInt8*)buf, sizeof(ldomNode) * sz, COMPRESS_NODE_DATA))
-            crFatalError(-1, "Cannot write node data");
+        batch.add(new CacheFileBatchItem(type, (lUInt16)i, (lUInt8*)buf, sizeof(ldomNode) * sz, COMPRESS_NODE_DATA, true));
+    }
+    // parts are packed in parallel
+    if (!_cacheFile->writeBatch(batch))
+        crFatalError(-1, "Cannot write node data");
+    return true;
+}
+
+ldomNodeTopology::ldomNodeTopology()
+: _garbage(0)
+{
+}
+
+ldomNodeTopology::~ldomNodeTopology()
+{
+    clear();
+}
+
+/// removes all items
+void ldomNodeTopology::clear()
+{
+    for ( int i=0; i<_elemParent.length(); i++ ) {
+        if ( _elemParent[i] ) {
+            free( _elemParent[i] );
+            free( _elemId[i] );
+            free( _elemRendMethod[i] );
+            free( _elemChildStart[i] );
+            free( _elemChildCount[i] );
+        }
+    }
+    for ( int i=0; i<_textParent.length(); i++ ) {
+        if ( _textParent[i] )
+            free( _textParent[i] );
+    }
+    _elemParent.clear();
+    _elemId.clear();
+    _elemRendMethod.clear();
+    _elemChildStart.clear();
+    _elemChildCount.clear();
+    _textParent.clear();
+    _children.clear();
+    _garbage = 0;
+}
+
+void ldomNodeTopology::allocElemPart( int part )
+{
+    _elemParent.set( part, (lUInt32*)calloc( TNC_PART_LEN, sizeof(lUInt32) ) );
+    _elemId.set( part, (lUInt16*)calloc( TNC_PART_LEN, sizeof(lUInt16) ) );
+    _elemRendMethod.set( part, (lUInt8*)calloc( TNC_PART_LEN, sizeof(lUInt8) ) );
+    _elemChildStart.set( part, (lUInt32*)calloc( TNC_PART_LEN, sizeof(lUInt32) ) );
+    _elemChildCount.set( part, (lUInt32*)calloc( TNC_PART_LEN, sizeof(lUInt32) ) );
+}
+
+void ldomNodeTopology::allocTextPart( int part )
+{
+    _textParent.set( part, (lUInt32*)calloc( TNC_PART_LEN, sizeof(lUInt32) ) );
+}
+
+/// moves children of all elements to new array, to drop unused items
+void ldomNodeTopology::compactChildren()
+{
+    LVArray<lUInt32> children;
+    children.reserve( _children.length() - _garbage );
+    for ( int part=0; part<_elemParent.length(); part++ ) {
+        if ( !_elemParent[part] )
+            continue;
+        for ( int i=0; i<TNC_PART_LEN; i++ ) {
+            int count = _elemChildCount[part][i];
+            if ( !count )
+                continue;
+            lUInt32 start = children.length();
+            children.add( _children.ptr() + _elemChildStart[part][i], count );
+            _elemChildStart[part][i] = start;
+        }
+    }
+    _children = children;
+    _garbage = 0;
+}
+
+/// allocates space for element children at end of children array
+lUInt32 * ldomNodeTopology::addChildren( int count )
+{
+    if ( _children.length() + count > _children.size() )
+        _children.reserve( (_children.length() + count) * 3 / 2 + 1024 );
+    return _children.addSpace( count );
+}
+
+/// sets all fields of persistent element
+void ldomNodeTopology::setElem( lUInt32 dataIndex, lUInt32 parent, lUInt16 id, lUInt8 rendMethod, const lInt32 * children, int childCount )
+{
+    int part = dataIndex>>TNC_PART_INDEX_SHIFT;
+    int index = (dataIndex>>4)&TNC_PART_MASK;
+    if ( !_elemParent[part] )
+        allocElemPart( part );
+    _elemParent[part][index] = parent;
+    _elemId[part][index] = id;
+    _elemRendMethod[part][index] = rendMethod;
+    _garbage += _elemChildCount[part][index];
+    _elemChildStart[part][index] = _children.length();
+    _elemChildCount[part][index] = childCount;
+    if ( childCount )
+        memcpy( addChildren( childCount ), children, childCount * sizeof(lUInt32) );
+    if ( _garbage > 0x10000 && _garbage > _children.length() / 2 )
+        compactChildren();
+}
+
+/// forgets element children, call when element is no more persistent
+void ldomNodeTopology::clearElem( lUInt32 dataIndex )
+{
+    int part = dataIndex>>TNC_PART_INDEX_SHIFT;
+    int index = (dataIndex>>4)&TNC_PART_MASK;
+    if ( !_elemParent[part] )
+        return;
+    _garbage += _elemChildCount[part][index];
+    _elemChildCount[part][index] = 0;
+    _elemChildStart[part][index] = 0;
+}
+
+void ldomNodeTopology::setTextParent( lUInt32 dataIndex, lUInt32 parent )
+{
+    int part = dataIndex>>TNC_PART_INDEX_SHIFT;
+    if ( !_textParent[part] )
+        allocTextPart( part );
+    _textParent[part][(dataIndex>>4)&TNC_PART_MASK] = parent;
+}
+
+/// serializes element part (parents, ids, render methods, child counts, children)
+bool ldomNodeTopology::serializeElemPart( int part, int count, SerialBuf & buf )
+{
+    if ( !_elemParent[part] )
+        allocElemPart( part );
+    for ( int i=0; i<count; i++ )
+        buf << _elemParent[part][i];
+    for ( int i=0; i<count; i++ )
+        buf << _elemId[part][i];
+    for ( int i=0; i<count; i++ )
+        buf << _elemRendMethod[part][i];
+    for ( int i=0; i<count; i++ )
+        buf << _elemChildCount[part][i];
+    for ( int i=0; i<count; i++ ) {
+        const lUInt32 * children = _children.ptr() + _elemChildStart[part][i];
+        for ( int j=0; j<(int)_elemChildCount[part][i]; j++ )
+            buf << children[j];
+    }
+    return !buf.error();
+}
+
+/// deserializes element part
+bool ldomNodeTopology::deserializeElemPart( int part, int count, SerialBuf & buf )
+{
+    if ( !_elemParent[part] )
+        allocElemPart( part );
+    for ( int i=0; i<count; i++ )
+        buf >> _elemParent[part][i];
+    for ( int i=0; i<count; i++ )
+        buf >> _elemId[part][i];
+    for ( int i=0; i<count; i++ )
+        buf >> _elemRendMethod[part][i];
+    for ( int i=0; i<count; i++ )
+        buf >> _elemChildCount[part][i];
+    for ( int i=0; i<count && !buf.error(); i++ ) {
+        int childCount = _elemChildCount[part][i];
+        if ( childCount<0 || childCount*4 > buf.space() )
+            return false;
+        _elemChildStart[part][i] = _children.length();
+        lUInt32 * children = addChildren( childCount );
+        for ( int j=0; j<childCount; j++ )
+            buf >> children[j];
+    }
+    return !buf.error();
+}
+
+/// serializes text part (parents)
+bool ldomNodeTopology::serializeTextPart( int part, int count, SerialBuf & buf )
+{
+    if ( !_textParent[part] )
+        allocTextPart( part );
+    for ( int i=0; i<count; i++ )
+        buf << _textParent[part][i];
+    return !buf.error();
+}
+
+/// deserializes text part
+bool ldomNodeTopology::deserializeTextPart( int part, int count, SerialBuf & buf )
+{
+    if ( !_textParent[part] )
+        allocTextPart( part );
+    for ( int i=0; i<count; i++ )
+        buf >> _textParent[part][i];
+    return !buf.error();
+}
+
+/// returns memory used by table, in bytes
+int ldomNodeTopology::getMemoryUsage()
+{
+    int size = _children.size() * sizeof(lUInt32);
+    for ( int i=0; i<_elemParent.length(); i++ ) {
+        if ( _elemParent[i] )
+            size += TNC_PART_LEN * (sizeof(lUInt32) * 3 + sizeof(lUInt16) + sizeof(lUInt8));
+    }
+    for ( int i=0; i<_textParent.length(); i++ ) {
+        if ( _textParent[i] )
+            size += TNC_PART_LEN * sizeof(lUInt32);
+    }
+    return size;
+}
+
+/// saves node topology table to cache file, part by part, like node data
+bool tinyNodeCollection::saveNodeTopology()
+{
+    LVPtrVector<CacheFileBatchItem> batch;
+    for ( int t=0; t<2; t++ ) {
+        int nodecount = (t==0 ? _elemCount : _textCount) + 1;
+        int count = ((nodecount+TNC_PART_LEN-1) >> TNC_PART_SHIFT);
+        for ( int i=0; i<count; i++ ) {
+            int sz = TNC_PART_LEN;
+            if ( i*TNC_PART_LEN + sz > nodecount )
+                sz = nodecount - i*TNC_PART_LEN;
+            SerialBuf buf( t==0 ? sz * 16 : sz * 4, true );
+            bool res = t==0 ? _topology.serializeElemPart( i, sz, buf ) : _topology.serializeTextPart( i, sz, buf );
+            if ( !res )
+                return false;
+            int size = buf.pos();
+            lUInt8 * data = (lUInt8*)malloc( size );
+            memcpy( data, buf.buf(), size );
+            batch.add( new CacheFileBatchItem( t==0 ? CBT_ELEM_TOPOLOGY : CBT_TEXT_TOPOLOGY, i, data, size, COMPRESS_NODE_DATA, true ) );
+        }
+    }
+    // parts are packed in parallel
+    return _cacheFile->writeBatch( batch );
+}
+
+/// loads node topology table from cache file
+bool tinyNodeCollection::loadNodeTopology()
+{
+    _topology.clear();
+    for ( int t=0; t<2; t++ ) {
+        int nodecount = (t==0 ? _elemCount : _textCount) + 1;
+        int count = ((nodecount+TNC_PART_LEN-1) >> TNC_PART_SHIFT);
+        for ( int i=0; i<count; i++ ) {
+            int sz = TNC_PART_LEN;
+            if ( i*TNC_PART_LEN + sz > nodecount )
+                sz = nodecount - i*TNC_PART_LEN;
+            lUInt8 * p;
+            int buflen;
+            if ( !_cacheFile->read( t==0 ? CBT_ELEM_TOPOLOGY : CBT_TEXT_TOPOLOGY, i, p, buflen ) ) {
+                _topology.clear();
+                return false;
+            }
+            SerialBuf buf( p, buflen );
+            bool res = t==0 ? _topology.deserializeElemPart( i, sz, buf ) : _topology.deserializeTextPart( i, sz, buf );
+            free( p );
+            if ( !res || buf.pos()!=buflen ) {
+                CRLog::error("Wrong node topology data in cache file");
+                _topology.clear();
+                return false;
+            }
+        }
     }
     return true;
 }
 
+/// fills topology table from element and text storage, for cache files saved without it
+void tinyNodeCollection::buildNodeTopology()
+{
+    _topology.clear();
+    for ( int i=1; i<=_elemCount; i++ ) {
+        ldomNode * node = getTinyNode( (i << 4) | 1 );
+        if ( node->isNull() || !node->isPersistent() )
+            continue;
+        ElementDataStorageItem * data = _elemStorage.getElem( node->_data._pelem_addr );
+        _topology.setElem( node->_handle._dataIndex, data->parentIndex, data->id, data->rendMethod, data->children, data->childCount );
+    }
+    for ( int i=1; i<=_textCount; i++ ) {
+        ldomNode * node = getTinyNode( i << 4 );
+        if ( node->isNull() || !node->isPersistent() )
+            continue;
+        _topology.setTextParent( node->_handle._dataIndex, _textStorage.getParent( node->_data._ptext_addr ) );
+    }
+}
+
 #define NODE_INDEX_MAGIC 0x19283746
 bool tinyNodeCollection::saveNodeData()
 {
@@ -1763,6 +3415,8 @@ bool tinyNodeCollection::saveNodeData()
         return false;
     if ( !saveNodeData( CBT_TEXT_NODE, _textList, _textCount+1 ) )
         return false;
+    if ( !saveNodeTopology() )
+        return false;
     if ( !_cacheFile->write(CBT_NODE_INDEX, buf, COMPRESS_NODE_DATA) )
         return false;
     return true;
@@ -1780,34 +3434,27 @@ bool tinyNodeCollection::loadNodeData()
     if ( magic != NODE_INDEX_MAGIC ) {
         return false;
     }
-    if ( elemcount<=0 || elemcount>200000 )
-        return false;
-    if ( textcount<=0 || textcount>200000 )
+    if ( elemcount<=0 || elemcount>MAX_NODE_INDEX )
         return false;
-    ldomNode * elemList[TNC_PART_COUNT];
-    memset( elemList, 0, sizeof(elemList) );
-    ldomNode * textList[TNC_PART_COUNT];
-    memset( textList, 0, sizeof(textList) );
-    if ( !loadNodeData( CBT_ELEM_NODE, elemList, elemcount+1 ) ) {
-        for ( int i=0; i<TNC_PART_COUNT; i++ )
-            if ( elemList[i] )
-                free( elemList[i] );
+    if ( textcount<=0 || textcount>MAX_NODE_INDEX )
         return false;
-    }
-    if ( !loadNodeData( CBT_TEXT_NODE, textList, textcount+1 ) ) {
-        for ( int i=0; i<TNC_PART_COUNT; i++ )
-            if ( textList[i] )
-                free( textList[i] );
+    ldomNodePartTable<ldomNode> elemList;
+    ldomNodePartTable<ldomNode> textList;
+    bool res = loadNodeData( CBT_ELEM_NODE, elemList, elemcount+1 )
+            && loadNodeData( CBT_TEXT_NODE, textList, textcount+1 );
+    if ( res ) {
+        elemList.swap( _elemList );
+        textList.swap( _textList );
+    }
+    // free parts of failed load, or replaced parts
+    for ( int i=0; i<elemList.length(); i++ )
+        if ( elemList[i] )
+            free( elemList[i] );
+    for ( int i=0; i<textList.length(); i++ )
+        if ( textList[i] )
+            free( textList[i] );
+    if ( !res )
         return false;
-    }
-    for ( int i=0; i<TNC_PART_COUNT; i++ ) {
-        if ( _elemList[i] )
-            free( _elemList[i] );
-        if ( _textList[i] )
-            free( _textList[i] );
-    }
-    memcpy( _elemList, elemList, sizeof(elemList) );
-    memcpy( _textList, textList, sizeof(textList) );
     _elemCount = elemcount;
     _textCount = textcount;
     return true;
@@ -1839,12 +3486,14 @@ ldomNode * tinyNodeCollection::allocTinyNode( int type )
             _elemNextFree = res->_data._nextFreeIndex;
         } else {
             // create new item
+            if ( _elemCount >= MAX_NODE_INDEX )
+                crFatalError( 1003, "Too many nodes in document" );
             _elemCount++;
             ldomNode * part = _elemList[_elemCount >> TNC_PART_SHIFT];
             if ( !part ) {
                 part = (ldomNode*)malloc( sizeof(ldomNode) * TNC_PART_LEN );
                 memset( part, 0, sizeof(ldomNode) * TNC_PART_LEN );
-                _elemList[ _elemCount >> TNC_PART_SHIFT ] = part;
+                _elemList.set( _elemCount >> TNC_PART_SHIFT, part );
             }
             res = &part[_elemCount & TNC_PART_MASK];
             res->setDocumentIndex( _docIndex );
@@ -1861,12 +3510,14 @@ ldomNode * tinyNodeCollection::allocTinyNode( int type )
             _textNextFree = res->_data._nextFreeIndex;
         } else {
             // create new item
+            if ( _textCount >= MAX_NODE_INDEX )
+                crFatalError( 1003, "Too many nodes in document" );
             _textCount++;
             ldomNode * part = _textList[_textCount >> TNC_PART_SHIFT];
             if ( !part ) {
                 part = (ldomNode*)malloc( sizeof(ldomNode) * TNC_PART_LEN );
                 memset( part, 0, sizeof(ldomNode) * TNC_PART_LEN );
-                _textList[ _textCount >> TNC_PART_SHIFT ] = part;
+                _textList.set( _textCount >> TNC_PART_SHIFT, part );
             }
             res = &part[_textCount & TNC_PART_MASK];
             res->setDocumentIndex( _docIndex );
@@ -1890,6 +3541,9 @@ void tinyNodeCollection::recycleTinyNode( lUInt32 index )
         _itemCount--;
     } else {
         // text
+#if BUILD_LITE!=1
+        _textCache->remove( index );
+#endif
         index >>= 4;
         ldomNode * part = _textList[index >> TNC_PART_SHIFT];
         ldomNode * p = &part[index & TNC_PART_MASK];
@@ -1900,11 +3554,69 @@ void tinyNodeCollection::recycleTinyNode( lUInt32 index )
     }
 }
 
+#if BUILD_LITE!=1
+/// starts recording of storage chunks accessed while drawing page
+void tinyNodeCollection::startChunkAccessRecording( int page )
+{
+    _chunkPrefetcher->startRecording( page );
+}
+
+/// stops recording of storage chunks access
+void tinyNodeCollection::stopChunkAccessRecording()
+{
+    _chunkPrefetcher->stopRecording();
+}
+
+/// restores swapped out storage chunks needed to draw page, in background thread
+void tinyNodeCollection::prefetchPageChunks( int page, int direction )
+{
+    _chunkPrefetcher->prefetch( page, direction );
+}
+
+/// forgets recorded chunk access order, call when pages are changed
+void tinyNodeCollection::clearChunkAccessHistory()
+{
+    _chunkPrefetcher->clearHistory();
+}
+
+/// moves cache file blocks to the beginning of file and truncates it, limited by time interval
+ContinuousOperationResult tinyNodeCollection::compactCacheFile( CRTimerUtil & maxTime )
+{
+    if ( !_cacheFile )
+        return CR_DONE;
+    // blocks are moved over file regions which chunks may still use via mapping
+    _textStorage.detachMapping();
+    _elemStorage.detachMapping();
+    _rectStorage.detachMapping();
+    _styleStorage.detachMapping();
+    return _cacheFile->compact( maxTime );
+}
+
+/// returns true if some of cache file blocks is found to be corrupted: document should be reloaded from source
+bool tinyNodeCollection::isCacheFileInvalid()
+{
+    return _cacheFile && _cacheFile->isInvalid();
+}
+
+/// returns true if cache file with specified path is used by one of open documents
+bool tinyNodeCollection::isCacheFileOpen( lString16 pathname )
+{
+    for ( int i=0; i<MAX_DOCUMENT_INSTANCE_COUNT; i++ ) {
+        tinyNodeCollection * doc = (tinyNodeCollection *)ldomNode::_documentInstances[i];
+        if ( doc && doc->_cacheFile && doc->_cacheFile->getFileName()==pathname )
+            return true;
+    }
+    return false;
+}
+#endif
+
 tinyNodeCollection::~tinyNodeCollection()
 {
 #if BUILD_LITE!=1
-    if ( _cacheFile )
-        delete _cacheFile;
+    // stop background reads before cache file is closed
+    delete _chunkPrefetcher;
+    _chunkPrefetcher = NULL; // nodes below may still touch storage chunks
+    delete _textCache;
 #endif
     // clear all elem parts
     for ( int partindex = 0; partindex<=(_elemCount>>TNC_PART_SHIFT); partindex++ ) {
@@ -1914,7 +3626,7 @@ tinyNodeCollection::~tinyNodeCollection()
             for ( int i=0; i<TNC_PART_LEN && n0+i<=_elemCount; i++ )
                 part[i].onCollectionDestroy();
             free(part);
-            _elemList[partindex] = NULL;
+            _elemList.set( partindex, NULL );
         }
     }
     // clear all text parts
@@ -1925,9 +3637,27 @@ tinyNodeCollection::~tinyNodeCollection()
             for ( int i=0; i<TNC_PART_LEN && n0+i<=_textCount; i++ )
                 part[i].onCollectionDestroy();
             free(part);
-            _textList[partindex] = NULL;
+            _textList.set( partindex, NULL );
         }
     }
+#if BUILD_LITE!=1
+    // storage chunks of nodes above may be read from cache file
+    if ( _cacheFile ) {
+        bool invalid = _cacheFile->isInvalid();
+        delete _cacheFile;
+        _cacheFile = NULL;
+        // storages stay in storage budget until destroyed
+        _textStorage.setCache( NULL );
+        _elemStorage.setCache( NULL );
+        _rectStorage.setCache( NULL );
+        _styleStorage.setCache( NULL );
+        if ( invalid ) {
+            // don't keep corrupted file in cache
+            ldomDocCache::remove( getProps()->getStringDef( DOC_PROP_FILE_NAME, "noname" ),
+                                  getProps()->getIntDef( DOC_PROP_FILE_CRC32, 0 ), getPersistenceFlags() );
+        }
+    }
+#endif
     ldomNode::unregisterDocument((ldomDocument*)this);
 }
 
@@ -1994,6 +3724,12 @@ void tinyNodeCollection::persist( CRTimerUtil & maxTime )
  */
 
 
+/// returns true if chunks of storage of specified type are compressed in cache file
+static bool storageChunkCompressed( char type )
+{
+    return (type=='r' || type=='s') ? COMPRESS_RAW_STORAGE_DATA : COMPRESS_NODE_STORAGE_DATA;
+}
+
 /// saves all unsaved chunks to cache file
 bool ldomDataStorageManager::save( CRTimerUtil & maxTime )
 {
@@ -2001,11 +3737,24 @@ bool ldomDataStorageManager::save( CRTimerUtil & maxTime )
 #if BUILD_LITE!=1
     if ( !_cache )
         return true;
-    for ( int i=0; i<_chunks.length(); i++ ) {
-        if ( !_chunks[i]->save() ) {
+    for ( int i=0; i<_chunks.length(); ) {
+        // pack group of unsaved chunks in parallel; packed blocks go to background writer, if it's running
+        LVPtrVector<CacheFileBatchItem> batch;
+        LVArray<ldomTextStorageChunk *> batchChunks;
+        for ( ; i<_chunks.length() && batch.length()<CACHE_FILE_BATCH_SIZE; i++ ) {
+            ldomTextStorageChunk * chunk = _chunks[i];
+            if ( chunk->_saved || !chunk->_buf )
+                continue;
+            batch.add( new CacheFileBatchItem( cacheType(), chunk->_index, chunk->_buf, chunk->_bufpos, storageChunkCompressed(_type), false ) );
+            batchChunks.add( chunk );
+        }
+        if ( !_cache->writeBatch( batch ) ) {
+            CRLog::error("ldomDataStorageManager::save() - Cannot write chunks");
             res = false;
             break;
         }
+        for ( int j=0; j<batchChunks.length(); j++ )
+            batchChunks[j]->_saved = true;
         //CRLog::trace("time elapsed: %d", (int)maxTime.elapsed());
         if (maxTime.expired())
             return res;
@@ -2047,9 +3796,8 @@ bool ldomDataStorageManager::load()
     }
     lUInt32 n;
     buf >> n;
-    if (n > 10000)
-        return false; // invalid
-    _recentChunk = NULL;
+    if (n >= 0xFFFF)
+        return false; // invalid: chunk index is 16 bit part of address, 0xFFFF is used by chunk index block
     _chunks.clear();
     lUInt32 compsize = 0;
     lUInt32 uncompsize = 0;
@@ -2071,20 +3819,18 @@ bool ldomDataStorageManager::load()
 ldomTextStorageChunk * ldomDataStorageManager::getChunk( lUInt32 address )
 {
     ldomTextStorageChunk * chunk = _chunks[address>>16];
-    if ( chunk!=_recentChunk ) {
-        if ( chunk->_prevRecent )
-            chunk->_prevRecent->_nextRecent = chunk->_nextRecent;
-        if ( chunk->_nextRecent )
-            chunk->_nextRecent->_prevRecent = chunk->_prevRecent;
-        chunk->_prevRecent = NULL;
-        if (((chunk->_nextRecent = _recentChunk)))
-            _recentChunk->_prevRecent = chunk;
-        _recentChunk = chunk;
-    }
+#if BUILD_LITE!=1
+    if ( _allPinned )
+        return chunk; // read only access, maybe from several threads
+    _storageBudget.touch( chunk );
+    if ( _owner->_chunkPrefetcher && _owner->_chunkPrefetcher->isRecording() )
+        _owner->_chunkPrefetcher->recordAccess( this, address>>16 );
+#endif
     chunk->ensureUnpacked();
     return chunk;
 }
 
+
 void ldomDataStorageManager::setCache( CacheFile * cache )
 {
     _cache = cache;
@@ -2254,6 +4000,29 @@ lString8 ldomDataStorageManager::getText( lUInt32 address )
     return chunk->getText(address&0xFFFF);
 }
 
+/// returns pointer to text data by address, pins its chunk in memory until unpinText() is called
+const char * ldomDataStorageManager::pinText( lUInt32 address, int & length )
+{
+    ldomTextStorageChunk * chunk = getChunk(address);
+    int offset = (address&0xFFFF) << 4;
+    chunk->_pinCount++;
+    if ( offset>=(int)chunk->_bufpos ) {
+        length = 0;
+        return "";
+    }
+    TextDataStorageItem * item = (TextDataStorageItem *)(chunk->_buf+offset);
+    length = item->length;
+    return item->text;
+}
+
+/// releases chunk pinned by pinText()
+void ldomDataStorageManager::unpinText( lUInt32 address )
+{
+    ldomTextStorageChunk * chunk = _chunks[address>>16];
+    if ( chunk->_pinCount )
+        chunk->_pinCount--;
+}
+
 /// get pointer to element data
 ElementDataStorageItem * ldomDataStorageManager::getElem( lUInt32 addr )
 {
@@ -2269,58 +4038,98 @@ lUInt32 ldomDataStorageManager::getParent( lUInt32 addr )
 }
 #endif
 
-void ldomDataStorageManager::compact( int reservedSpace )
+void ldomDataStorageManager::compact( int reservedSpace, ldomTextStorageChunk * keep )
 {
 #if BUILD_LITE!=1
-    if ( _uncompressedSize + reservedSpace > _maxUncompressedSize + _maxUncompressedSize/10 ) { // allow +10% overflow
-        // do compacting
-        int sumsize = reservedSpace;
-        for ( ldomTextStorageChunk * p = _recentChunk; p; p = p->_nextRecent ) {
-			if ( (int)p->_bufsize + sumsize < _maxUncompressedSize || (p==_activeChunk && reservedSpace<0xFFFFFFF)) {
-				// fits
-				sumsize += p->_bufsize;
-			} else {
-				if ( !_cache )
-					_owner->createCacheFile();
-				if ( _cache ) {
-					if ( !p->swapToCache(true) ) {
-						crFatalError(111, "Swap file writing error!");
-					}
-				}
-			}
+    if ( reservedSpace<0xFFFFFF ) {
+        _storageBudget.compact( reservedSpace, keep, this );
+        return;
+    }
+    // minimize memory: swap out all chunks of this storage except active one
+    for ( int i=0; i<_chunks.length(); i++ ) {
+        ldomTextStorageChunk * p = _chunks[i];
+        if ( !p->_buf || p==_activeChunk || p==keep || p->_pinCount )
+            continue;
+        if ( !_cache )
+            _owner->createCacheFile();
+        if ( _cache ) {
+            if ( !p->swapToCache(true) ) {
+                crFatalError(111, "Swap file writing error!");
+            }
         }
+    }
+#endif
+}
 
+#if BUILD_LITE!=1
+/// unpacks all chunks and keeps them in memory until unpinAll(); items can be read from several threads meanwhile
+void ldomDataStorageManager::pinAll()
+{
+    if ( _allPinned )
+        return;
+    for ( int i=0; i<_chunks.length(); i++ ) {
+        // pinned chunks are not swapped out while next ones are unpacked
+        getChunk( i<<16 )->_pinCount++;
     }
+    _allPinned = true;
+}
+
+/// releases chunks pinned by pinAll()
+void ldomDataStorageManager::unpinAll()
+{
+    if ( !_allPinned )
+        return;
+    _allPinned = false;
+    for ( int i=0; i<_chunks.length(); i++ ) {
+        if ( _chunks[i]->_pinCount )
+            _chunks[i]->_pinCount--;
+    }
+}
+#endif
+
+/// makes private copies of chunk data read directly from mapped cache file
+void ldomDataStorageManager::detachMapping()
+{
+#if BUILD_LITE!=1
+    for ( int i=0; i<_chunks.length(); i++ )
+        _chunks[i]->detachMapping();
 #endif
 }
 
-// max 512K of uncompressed data (~8 chunks)
-#define DEF_MAX_UNCOMPRESSED_SIZE 0x80000
-ldomDataStorageManager::ldomDataStorageManager( tinyNodeCollection * owner, char type, int maxUnpackedSize, int chunkSize )
+ldomDataStorageManager::ldomDataStorageManager( tinyNodeCollection * owner, char type, int chunkSize )
 : _owner( owner )
 , _activeChunk(NULL)
-, _recentChunk(NULL)
 , _cache(NULL)
 , _uncompressedSize(0)
-, _maxUncompressedSize(maxUnpackedSize)
 , _chunkSize(chunkSize)
 , _type(type)
+, _allPinned(false)
+, _accessStamp(0)
+, _lastChunk(NULL)
+, _clockHand(0)
 {
+#if BUILD_LITE!=1
+    _storageBudget.addManager( this );
+#endif
 }
 
 ldomDataStorageManager::~ldomDataStorageManager()
 {
+#if BUILD_LITE!=1
+    _storageBudget.removeManager( this );
+#endif
 }
 
 /// create chunk to be read from cache file
 ldomTextStorageChunk::ldomTextStorageChunk(ldomDataStorageManager * manager, lUInt16 index, int compsize, int uncompsize)
 	: _manager(manager)
-	, _nextRecent(NULL)
-	, _prevRecent(NULL)
+	, _accessStamp(0)
+	, _clockCredit(0)
 	, _buf(NULL)   /// buffer for uncompressed data
 	, _bufsize(0)    /// _buf (uncompressed) area size, bytes
 	, _bufpos(uncompsize)     /// _buf (uncompressed) data write position (for appending of new data)
 	, _index(index)      /// ? index of chunk in storage
+	, _pinCount(0)
 	, _type( manager->_type )
 	, _saved(true)
 {
@@ -2329,12 +4138,13 @@ ldomTextStorageChunk::ldomTextStorageChunk(ldomDataStorageManager * manager, lUI
 
 ldomTextStorageChunk::ldomTextStorageChunk(int preAllocSize, ldomDataStorageManager * manager, lUInt16 index)
 	: _manager(manager)
-	, _nextRecent(NULL)
-	, _prevRecent(NULL)
+	, _accessStamp(0)
+	, _clockCredit(0)
 	, _buf(NULL)   /// buffer for uncompressed data
 	, _bufsize(preAllocSize)    /// _buf (uncompressed) area size, bytes
 	, _bufpos(preAllocSize)     /// _buf (uncompressed) data write position (for appending of new data)
 	, _index(index)      /// ? index of chunk in storage
+	, _pinCount(0)
 	, _type( manager->_type )
 	, _saved(false)
 {
@@ -2345,12 +4155,13 @@ ldomTextStorageChunk::ldomTextStorageChunk(int preAllocSize, ldomDataStorageMana
 
 ldomTextStorageChunk::ldomTextStorageChunk(ldomDataStorageManager * manager, lUInt16 index)
 	: _manager(manager)
-	, _nextRecent(NULL)
-	, _prevRecent(NULL)
+	, _accessStamp(0)
+	, _clockCredit(0)
 	, _buf(NULL)   /// buffer for uncompressed data
 	, _bufsize(0)    /// _buf (uncompressed) area size, bytes
 	, _bufpos(0)     /// _buf (uncompressed) data write position (for appending of new data)
 	, _index(index)      /// ? index of chunk in storage
+	, _pinCount(0)
 	, _type( manager->_type )
 	, _saved(false)
 {
@@ -2383,7 +4194,22 @@ bool ldomTextStorageChunk::swapToCache( bool removeFromMemory )
 #if DEBUG_DOM_STORAGE==1
             CRLog::debug("Writing %d bytes of chunk %c%d to cache", _bufpos, _type, _index);
 #endif
-            if ( !_manager->_cache->write( _manager->cacheType(), _index, _buf, _bufpos, COMPRESS_NODE_STORAGE_DATA) ) {
+            bool compress = storageChunkCompressed( _type );
+            if ( _manager->_cache->hasBackgroundWriter() ) {
+                // snapshot is compressed and written by background thread
+                lUInt8 * snapshot;
+                if ( removeFromMemory && _mapbuf.isNull() ) {
+                    // buffer is not needed anymore: pass it instead of copying
+                    snapshot = _buf;
+                    _manager->_uncompressedSize -= _bufsize;
+                    _buf = NULL;
+                    _bufsize = 0;
+                } else {
+                    snapshot = (lUInt8 *)malloc( _bufpos );
+                    memcpy( snapshot, _buf, _bufpos );
+                }
+                _manager->_cache->writeAsync( _manager->cacheType(), _index, snapshot, _bufpos, compress );
+            } else if ( !_manager->_cache->write( _manager->cacheType(), _index, _buf, _bufpos, compress) ) {
                 CRLog::error("Error while swapping of chunk %c%d to cache file", _type, _index);
                 crFatalError(-1, "Error while swapping of chunk to cache file");
                 return false;
@@ -2405,8 +4231,14 @@ bool ldomTextStorageChunk::restoreFromCache()
     if ( !_saved )
         return false;
     int size;
-    if ( !_manager->_cache->read( _manager->cacheType(), _index, _buf, size ) )
-        return false;
+    if ( _type=='r' || _type=='s' ) {
+        // raw chunks are modified only by setRaw, which detaches them from mapped file
+        if ( !_manager->_cache->read( _manager->cacheType(), _index, _mapbuf, _buf, size ) )
+            return false;
+    } else {
+        if ( !_manager->_cache->read( _manager->cacheType(), _index, _buf, size ) )
+            return false;
+    }
     _bufsize = size;
     _manager->_uncompressedSize += _bufsize;
 #if DEBUG_DOM_STORAGE==1
@@ -2434,11 +4266,23 @@ void ldomTextStorageChunk::setRaw( int offset, int size, const lUInt8 * buf )
         crFatalError(123, "ldomTextStorageChunk: Invalid raw data buffer position");
 #endif
     if (memcmp(_buf+offset, buf, size) != 0) {
+        detachMapping();
         memcpy(_buf+offset, buf, size);
         modified();
     }
 }
 
+/// makes private copy of data which is read directly from mapped cache file
+void ldomTextStorageChunk::detachMapping()
+{
+    if ( _mapbuf.isNull() )
+        return;
+    lUInt8 * buf = (lUInt8 *)malloc( _bufsize );
+    memcpy( buf, _buf, _bufsize );
+    _buf = buf;
+    _mapbuf.Clear();
+}
+
 
 /// returns free space in buffer
 int ldomTextStorageChunk::space()
@@ -2476,7 +4320,7 @@ int ldomTextStorageChunk::addText( lUInt32 dataIndex, lUInt32 parentIndex, const
 /// adds new element item to buffer, returns offset inside chunk of stored data
 int ldomTextStorageChunk::addElem(lUInt32 dataIndex, lUInt32 parentIndex, int childCount, int attrCount)
 {
-    int itemsize = (sizeof(ElementDataStorageItem) + attrCount*sizeof(lUInt16)*3 + childCount*sizeof(lUInt32) - sizeof(lUInt32) + 15) & 0xFFFFFFF0;
+    int itemsize = (sizeof(ElementDataStorageItem) + attrCount*sizeof(lxmlAttribute) + childCount*sizeof(lUInt32) - sizeof(lUInt32) + 15) & 0xFFFFFFF0;
     if ( !_buf ) {
         // create new buffer, if necessary
         _bufsize = _manager->_chunkSize > itemsize ? _manager->_chunkSize : itemsize;
@@ -2583,6 +4427,195 @@ lString8 ldomTextStorageChunk::getText( int offset )
 #endif
 
 
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+
+static inline lUInt32 lzRead32( const lUInt8 * p )
+{
+    lUInt32 v;
+    memcpy( &v, p, 4 );
+    return v;
+}
+
+/// writes remainder of length which doesn't fit into token nibble
+static lUInt8 * lzWriteLength( lUInt8 * op, const lUInt8 * oend, int len )
+{
+    for ( ; len>=255; len -= 255 ) {
+        if ( op>=oend )
+            return NULL;
+        *op++ = 255;
+    }
+    if ( op>=oend )
+        return NULL;
+    *op++ = (lUInt8)len;
+    return op;
+}
+
+/// writes sequence of literals followed by match (matchLen==0 for last sequence)
+static lUInt8 * lzWriteSequence( lUInt8 * op, const lUInt8 * oend, const lUInt8 * lit, int litLen, int offset, int matchLen )
+{
+    if ( op>=oend )
+        return NULL;
+    lUInt8 * token = op++;
+    int ml = matchLen ? matchLen - LZ_MIN_MATCH : 0;
+    *token = (lUInt8)(((litLen<15 ? litLen : 15) << 4) | (ml<15 ? ml : 15));
+    if ( litLen>=15 && (op = lzWriteLength( op, oend, litLen - 15 ))==NULL )
+        return NULL;
+    if ( litLen > oend - op )
+        return NULL;
+    memcpy( op, lit, litLen );
+    op += litLen;
+    if ( matchLen ) {
+        if ( oend - op < 2 )
+            return NULL;
+        *op++ = (lUInt8)(offset & 0xFF);
+        *op++ = (lUInt8)(offset >> 8);
+        if ( ml>=15 && (op = lzWriteLength( op, oend, ml - 15 ))==NULL )
+            return NULL;
+    }
+    return op;
+}
+
+/// fast LZ77 packing (LZ4-like byte oriented format), fails if data cannot be packed smaller than source
+bool ldomLZPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize )
+{
+    if ( bufsize<=0 )
+        return false;
+    lUInt8 * dst = (lUInt8 *)malloc( bufsize );
+    lUInt8 * op = dst;
+    const lUInt8 * oend = dst + bufsize;
+    int table[1<<LZ_HASH_BITS];
+    for ( int i=0; i<(1<<LZ_HASH_BITS); i++ )
+        table[i] = -1;
+    int anchor = 0;
+    int ip = 0;
+    while ( ip + LZ_MIN_MATCH <= bufsize ) {
+        lUInt32 seq = lzRead32( buf + ip );
+        int h = (int)((seq * 2654435761U) >> (32 - LZ_HASH_BITS));
+        int ref = table[h];
+        table[h] = ip;
+        if ( ref>=0 && ip - ref<=LZ_MAX_OFFSET && lzRead32( buf + ref )==seq ) {
+            int len = LZ_MIN_MATCH;
+            while ( ip + len<bufsize && buf[ref + len]==buf[ip + len] )
+                len++;
+            op = lzWriteSequence( op, oend, buf + anchor, ip - anchor, ip - ref, len );
+            if ( !op ) {
+                free( dst );
+                return false;
+            }
+            ip += len;
+            anchor = ip;
+        } else {
+            // skip faster through data which doesn't compress
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+    op = lzWriteSequence( op, oend, buf + anchor, bufsize - anchor, 0, 0 );
+    if ( !op ) {
+        free( dst );
+        return false;
+    }
+    dstsize = (lUInt32)(op - dst);
+    dstbuf = (lUInt8 *)realloc( dst, dstsize );
+    return true;
+}
+
+/// unpacks data packed by ldomLZPack() to buffer of known uncompressed size
+bool ldomLZUnpack( const lUInt8 * compbuf, int compsize, lUInt8 * dstbuf, lUInt32 dstsize )
+{
+    const lUInt8 * ip = compbuf;
+    const lUInt8 * iend = compbuf + compsize;
+    lUInt8 * op = dstbuf;
+    lUInt8 * oend = dstbuf + dstsize;
+    while ( ip<iend ) {
+        int token = *ip++;
+        int litLen = token >> 4;
+        if ( litLen==15 ) {
+            int b;
+            do {
+                if ( ip>=iend )
+                    return false;
+                b = *ip++;
+                litLen += b;
+            } while ( b==255 );
+        }
+        if ( litLen > iend - ip || litLen > oend - op )
+            return false;
+        memcpy( op, ip, litLen );
+        op += litLen;
+        ip += litLen;
+        if ( ip==iend )
+            break; // last sequence has no match
+        if ( iend - ip < 2 )
+            return false;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ( offset==0 || offset > op - dstbuf )
+            return false;
+        int matchLen = token & 15;
+        if ( matchLen==15 ) {
+            int b;
+            do {
+                if ( ip>=iend )
+                    return false;
+                b = *ip++;
+                matchLen += b;
+            } while ( b==255 );
+        }
+        matchLen += LZ_MIN_MATCH;
+        if ( matchLen > oend - op )
+            return false;
+        // byte by byte: source and destination may overlap
+        const lUInt8 * ref = op - offset;
+        while ( matchLen-- )
+            *op++ = *ref++;
+    }
+    return op==oend;
+}
+
+/// zlib codec
+class CacheFileZlibCodec : public CacheFileCodec
+{
+public:
+    virtual bool pack( const lUInt8 * buf, int size, lUInt8 * &dstbuf, lUInt32 & dstsize )
+    {
+        return ldomPack( buf, size, dstbuf, dstsize );
+    }
+    virtual bool unpack( const lUInt8 * buf, int size, lUInt8 * dstbuf, lUInt32 dstsize )
+    {
+        return ldomUnpackTo( buf, size, dstbuf, dstsize );
+    }
+};
+
+/// fast LZ codec
+class CacheFileLZCodec : public CacheFileCodec
+{
+public:
+    virtual bool pack( const lUInt8 * buf, int size, lUInt8 * &dstbuf, lUInt32 & dstsize )
+    {
+        return ldomLZPack( buf, size, dstbuf, dstsize );
+    }
+    virtual bool unpack( const lUInt8 * buf, int size, lUInt8 * dstbuf, lUInt32 dstsize )
+    {
+        return ldomLZUnpack( buf, size, dstbuf, dstsize );
+    }
+};
+
+/// returns codec by id, NULL for unknown id
+CacheFileCodec * getCacheFileCodec( int codec )
+{
+    static CacheFileZlibCodec zlibCodec;
+    static CacheFileLZCodec lzCodec;
+    switch ( codec ) {
+    case CACHE_CODEC_ZLIB:
+        return &zlibCodec;
+    case CACHE_CODEC_LZ:
+        return &lzCodec;
+    }
+    return NULL;
+}
+
 /// pack data from _buf to _compbuf
 bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dstsize )
 {
@@ -2613,6 +4646,31 @@ bool ldomPack( const lUInt8 * buf, int bufsize, lUInt8 * &dstbuf, lUInt32 & dsts
     return true;
 }
 
+/// unpack data from compbuf directly to preallocated buffer of known uncompressed size
+bool ldomUnpackTo( const lUInt8 * compbuf, int compsize, lUInt8 * dstbuf, lUInt32 dstsize )
+{
+    int ret;
+    z_stream z;
+    memset( &z, 0, sizeof(z) );
+    z.zalloc = Z_NULL;
+    z.zfree = Z_NULL;
+    z.opaque = Z_NULL;
+    ret = inflateInit( &z );
+    if ( ret != Z_OK )
+        return false;
+    z.avail_in = compsize;
+    z.next_in = (unsigned char *)compbuf;
+    z.avail_out = dstsize;
+    z.next_out = dstbuf;
+    ret = inflate( &z, Z_FINISH );
+    inflateEnd(&z);
+    if ( ret!=Z_STREAM_END || z.avail_out!=0 || z.avail_in!=0 ) {
+        // some error occured while unpacking, or size doesn't match
+        return false;
+    }
+    return true;
+}
+
 /// unpack data from _compbuf to _buf
 bool ldomUnpack( const lUInt8 * compbuf, int compsize, lUInt8 * &dstbuf, lUInt32 & dstsize  )
 {
@@ -2647,7 +4705,9 @@ void ldomTextStorageChunk::setunpacked( const lUInt8 * buf, int bufsize )
 {
     if ( _buf ) {
         _manager->_uncompressedSize -= _bufsize;
-        free(_buf);
+        if ( _mapbuf.isNull() )
+            free(_buf);
+        _mapbuf.Clear();
         _buf = NULL;
         _bufsize = 0;
     }
@@ -2666,11 +4726,17 @@ void ldomTextStorageChunk::ensureUnpacked()
 #if BUILD_LITE!=1
     if ( !_buf ) {
         if ( _saved ) {
-            if ( !restoreFromCache() ) {
+            if ( !(_manager->_owner->_chunkPrefetcher && _manager->_owner->_chunkPrefetcher->adopt( this )) && !restoreFromCache() ) {
+                // if contents validation is enabled, corrupted blocks are found when cache file is opened, so it's read error:
+                // cache file is marked as invalid and document reload is requested via isCacheFileInvalid(),
+                // until then items of chunk are read as zeroes
                 CRLog::error( "restoreFromCache() failed for chunk %c%d", _type, _index);
-                crFatalError( 111, "restoreFromCache() failed for chunk");
+                _bufsize = _bufpos > (lUInt32)_manager->_chunkSize ? _bufpos : _manager->_chunkSize;
+                _buf = (lUInt8 *)calloc( _bufsize, sizeof(lUInt8) );
+                _manager->_uncompressedSize += _bufsize;
+                _manager->_cache->setInvalid( _manager->cacheType(), _index );
             }
-            _manager->compact( 0 );
+            _manager->compact( 0, this );
         }
     } else {
         // compact
@@ -2678,6 +4744,302 @@ void ldomTextStorageChunk::ensureUnpacked()
 #endif
 }
 
+#if BUILD_LITE!=1
+/// max number of pages with remembered chunk access order
+#define PREFETCH_MAX_HISTORY_PAGES 1024
+/// max number of chunks restored by prefetcher and not yet used
+#define PREFETCH_MAX_CHUNKS 32
+/// how far to look back for drawn page to guess chunks of page which is not drawn yet
+#define PREFETCH_MAX_GUESS_DISTANCE 4
+
+enum ldomPrefetchState {
+    PREFETCH_QUEUED,
+    PREFETCH_LOADING,
+    PREFETCH_READY,
+    PREFETCH_FAILED
+};
+
+/// storage chunk requested from prefetcher
+struct ldomPrefetchItem
+{
+    ldomDataStorageManager * manager;
+    lUInt16 index;
+    ldomPrefetchState state;
+    lUInt8 * buf;
+    int size;
+    ldomPrefetchItem( ldomDataStorageManager * m, lUInt16 i ) : manager(m), index(i), state(PREFETCH_QUEUED), buf(NULL), size(0) { }
+    ~ldomPrefetchItem() { if ( buf ) free( buf ); }
+};
+
+/// restores chunk in background thread
+class ldomPrefetchTask : public CRRunnable
+{
+    ldomChunkPrefetcher * _prefetcher;
+    ldomDataStorageManager * _manager;
+    lUInt16 _index;
+public:
+    ldomPrefetchTask( ldomChunkPrefetcher * prefetcher, ldomDataStorageManager * manager, lUInt16 index )
+    : _prefetcher(prefetcher), _manager(manager), _index(index) { }
+    virtual void run()
+    {
+        _prefetcher->load( _manager, _index );
+    }
+};
+
+ldomChunkPrefetcher::ldomChunkPrefetcher( ldomDataStorageManager * text, ldomDataStorageManager * elem, ldomDataStorageManager * rect, ldomDataStorageManager * style )
+: _executor(NULL), _history(256), _recording(NULL), _recordingPage(-1)
+{
+    _managers[0] = text;
+    _managers[1] = elem;
+    _managers[2] = rect;
+    _managers[3] = style;
+}
+
+ldomChunkPrefetcher::~ldomChunkPrefetcher()
+{
+    if ( _executor ) {
+        // queued tasks are dropped, running one is finished
+        _executor->stop();
+        delete _executor;
+    }
+    clearHistory();
+    delete _recording;
+}
+
+int ldomChunkPrefetcher::managerIndex( ldomDataStorageManager * manager )
+{
+    for ( int i=0; i<4; i++ )
+        if ( _managers[i]==manager )
+            return i;
+    return -1;
+}
+
+/// finds requested chunk, call under lock
+ldomPrefetchItem * ldomChunkPrefetcher::find( ldomDataStorageManager * manager, int index, int * pos )
+{
+    for ( int i=0; i<_items.length(); i++ ) {
+        if ( _items[i]->manager==manager && _items[i]->index==index ) {
+            if ( pos )
+                *pos = i;
+            return _items[i];
+        }
+    }
+    return NULL;
+}
+
+/// starts recording of chunks accessed while drawing page
+void ldomChunkPrefetcher::startRecording( int page )
+{
+    adoptReady();
+    if ( !_enableStorageChunkPrefetch || !concurrencyProvider )
+        return;
+    if ( !_recording )
+        _recording = new LVArray<lUInt32>();
+    _recording->clear();
+    _recordingPage = page;
+}
+
+/// stops recording, remembers chunk access order for page
+void ldomChunkPrefetcher::stopRecording()
+{
+    if ( !_recording )
+        return;
+    if ( _recording->length() ) {
+        if ( _history.length()>=PREFETCH_MAX_HISTORY_PAGES )
+            clearHistory();
+        LVArray<lUInt32> * old = _history.get( _recordingPage );
+        delete old;
+        _history.set( _recordingPage, _recording );
+        _recording = NULL;
+    } else {
+        delete _recording;
+        _recording = NULL;
+    }
+}
+
+/// adds chunk to list of chunks accessed while drawing current page
+void ldomChunkPrefetcher::recordAccess( ldomDataStorageManager * manager, int chunkIndex )
+{
+    lUInt32 key = ((lUInt32)managerIndex(manager) << 16) | chunkIndex;
+    int len = _recording->length();
+    if ( len && _recording->get(len-1)==key )
+        return;
+    for ( int i=0; i<len; i++ )
+        if ( _recording->get(i)==key )
+            return;
+    _recording->add( key );
+}
+
+/// forgets recorded chunk access order
+void ldomChunkPrefetcher::clearHistory()
+{
+    LVHashTable<lUInt32, LVArray<lUInt32> *>::iterator iter = _history.forwardIterator();
+    for ( ;; ) {
+        LVHashTable<lUInt32, LVArray<lUInt32> *>::pair * p = iter.next();
+        if ( !p )
+            break;
+        delete p->value;
+    }
+    _history.clear();
+}
+
+/// schedules background restore of chunks needed to draw page
+void ldomChunkPrefetcher::prefetch( int page, int direction )
+{
+    if ( !_enableStorageChunkPrefetch || !concurrencyProvider || page<0 )
+        return;
+    LVArray<lUInt32> * keys = _history.get( page );
+    LVArray<lUInt32> guess;
+    if ( !keys ) {
+        // page is not drawn yet: chunks are allocated in document order,
+        // so it's likely to need the last chunks of previously drawn page and the following ones
+        LVArray<lUInt32> * prev = NULL;
+        for ( int i=1; i<=PREFETCH_MAX_GUESS_DISTANCE && !prev; i++ )
+            prev = _history.get( page - direction * i );
+        if ( !prev )
+            return;
+        for ( int m=0; m<4; m++ ) {
+            int minIndex = -1;
+            int maxIndex = -1;
+            for ( int i=0; i<prev->length(); i++ ) {
+                if ( (int)(prev->get(i) >> 16)!=m )
+                    continue;
+                int index = prev->get(i) & 0xFFFF;
+                if ( minIndex<0 || index<minIndex )
+                    minIndex = index;
+                if ( index>maxIndex )
+                    maxIndex = index;
+            }
+            if ( maxIndex<0 )
+                continue;
+            int first = direction>0 ? maxIndex : minIndex;
+            guess.add( ((lUInt32)m << 16) | first );
+            if ( first + direction>=0 )
+                guess.add( ((lUInt32)m << 16) | (first + direction) );
+        }
+        keys = &guess;
+    }
+    for ( int i=0; i<keys->length(); i++ )
+        request( _managers[keys->get(i) >> 16], keys->get(i) & 0xFFFF );
+}
+
+/// queues chunk for background restore, if it's swapped out
+void ldomChunkPrefetcher::request( ldomDataStorageManager * manager, int index )
+{
+    if ( index>=manager->_chunks.length() )
+        return;
+    ldomTextStorageChunk * chunk = manager->_chunks[index];
+    if ( chunk->_buf || !chunk->_saved || !manager->_cache )
+        return;
+    CacheFile * cache = manager->_cache;
+    if ( (manager->_type=='r' || manager->_type=='s') && cache->isMapped() )
+        return; // raw chunks are used directly from mapped file, restoring is cheap
+    cache->enableConcurrentReads();
+    if ( !_executor ) {
+        _monitor = concurrencyProvider->createMonitor();
+        _executor = new CRThreadExecutor();
+    }
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        if ( find( manager, index, NULL ) || _items.length()>=PREFETCH_MAX_CHUNKS )
+            return;
+        _items.add( new ldomPrefetchItem( manager, index ) );
+    }
+    _executor->execute( new ldomPrefetchTask( this, manager, index ) );
+}
+
+/// reads and unpacks chunk, called from background thread
+void ldomChunkPrefetcher::load( ldomDataStorageManager * manager, int index )
+{
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        ldomPrefetchItem * item = find( manager, index, NULL );
+        if ( !item || item->state!=PREFETCH_QUEUED )
+            return; // cancelled
+        item->state = PREFETCH_LOADING;
+    }
+    lUInt8 * buf = NULL;
+    int size = 0;
+    bool res = manager->_cache->readUnmapped( manager->cacheType(), index, buf, size );
+    CRGuard guard(_monitor);
+    CR_UNUSED(guard);
+    // item cannot be removed while loading
+    ldomPrefetchItem * item = find( manager, index, NULL );
+    item->buf = res ? buf : NULL;
+    item->size = res ? size : 0;
+    item->state = res ? PREFETCH_READY : PREFETCH_FAILED;
+    _monitor->notifyAll();
+}
+
+/// takes prefetched data of swapped out chunk; returns false if chunk is not prefetched
+bool ldomChunkPrefetcher::adopt( ldomTextStorageChunk * chunk )
+{
+    if ( !_executor )
+        return false;
+    lUInt8 * buf = NULL;
+    int size = 0;
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        int pos;
+        ldomPrefetchItem * item = find( chunk->_manager, chunk->_index, &pos );
+        if ( !item )
+            return false;
+        while ( item->state==PREFETCH_LOADING )
+            _monitor->wait();
+        if ( item->state==PREFETCH_READY ) {
+            buf = item->buf;
+            size = item->size;
+            item->buf = NULL;
+        }
+        // queued item is cancelled: chunk is restored synchronously
+        _items.remove( pos );
+        delete item;
+    }
+    if ( !buf )
+        return false;
+    chunk->_buf = buf;
+    chunk->_bufsize = size;
+    chunk->_manager->_uncompressedSize += size;
+    return true;
+}
+
+/// puts all restored chunks to storage, as recently used ones
+void ldomChunkPrefetcher::adoptReady()
+{
+    if ( !_executor )
+        return;
+    LVPtrVector<ldomPrefetchItem> ready;
+    {
+        CRGuard guard(_monitor);
+        CR_UNUSED(guard);
+        for ( int i=_items.length()-1; i>=0; i-- ) {
+            if ( _items[i]->state==PREFETCH_READY || _items[i]->state==PREFETCH_FAILED )
+                ready.add( _items.remove(i) );
+        }
+    }
+    bool changed = false;
+    for ( int i=0; i<ready.length(); i++ ) {
+        ldomPrefetchItem * item = ready[i];
+        ldomTextStorageChunk * chunk = item->manager->_chunks[item->index];
+        if ( !item->buf || chunk->_buf )
+            continue;
+        chunk->_buf = item->buf;
+        chunk->_bufsize = item->size;
+        item->buf = NULL;
+        item->manager->_uncompressedSize += chunk->_bufsize;
+        _storageBudget.touch( chunk );
+        changed = true;
+    }
+    if ( changed ) {
+        for ( int i=0; i<4; i++ )
+            _managers[i]->compact( 0 );
+    }
+}
+#endif
+
 
 
 
@@ -2710,7 +5072,7 @@ public:
     {
         return _len;
     }
-    lUInt16 get( lUInt16 nsId, lUInt16 attrId ) const
+    lUInt32 get( lUInt16 nsId, lUInt16 attrId ) const
     {
         for (lUInt16 i=0; i<_len; i++)
         {
@@ -2719,7 +5081,7 @@ public:
         }
         return LXML_ATTR_VALUE_NONE;
     }
-    void set( lUInt16 nsId, lUInt16 attrId, lUInt16 valueIndex )
+    void set( lUInt16 nsId, lUInt16 attrId, lUInt32 valueIndex )
     {
         // find existing
         for (lUInt16 i=0; i<_len; i++)
@@ -2738,7 +5100,7 @@ public:
         }
         _list[ _len++ ].setData(nsId, attrId, valueIndex);
     }
-    void add( lUInt16 nsId, lUInt16 attrId, lUInt16 valueIndex )
+    void add( lUInt16 nsId, lUInt16 attrId, lUInt32 valueIndex )
     {
         // find existing
         if (_len>=_size)
@@ -2793,37 +5155,185 @@ simpleLogFile logfile("logfile.log");
 /// lxmlDocument
 
 
-lxmlDocBase::lxmlDocBase( int /*dataBufSize*/ )
-: _elementNameTable(MAX_ELEMENT_TYPE_ID)
-, _attrNameTable(MAX_ATTRIBUTE_TYPE_ID)
-, _nsNameTable(MAX_NAMESPACE_TYPE_ID)
-, _nextUnknownElementId(UNKNOWN_ELEMENT_TYPE_ID)
-, _nextUnknownAttrId(UNKNOWN_ATTRIBUTE_TYPE_ID)
-, _nextUnknownNsId(UNKNOWN_NAMESPACE_TYPE_ID)
-, _attrValueTable( DOC_STRING_HASH_SIZE )
-,_idNodeMap(8192)
-,_urlImageMap(1024)
-,_idAttrId(0)
-,_nameAttrId(0)
+lxmlDocBase::lxmlDocBase( int /*dataBufSize*/ )
+: _elementNameTable(MAX_ELEMENT_TYPE_ID)
+, _attrNameTable(MAX_ATTRIBUTE_TYPE_ID)
+, _nsNameTable(MAX_NAMESPACE_TYPE_ID)
+, _nextUnknownElementId(UNKNOWN_ELEMENT_TYPE_ID)
+, _nextUnknownAttrId(UNKNOWN_ATTRIBUTE_TYPE_ID)
+, _nextUnknownNsId(UNKNOWN_NAMESPACE_TYPE_ID)
+, _attrValueTable( DOC_STRING_HASH_SIZE )
+, _cssNameTable( CSS_NAME_HASH_SIZE )
+, _compiledStyleSheets( 16 )
+, _compiledStyleSheetsChanged( false )
+,_idNodeMap(8192)
+,_urlImageMap(1024)
+,_idAttrId(0)
+,_nameAttrId(0)
+#if BUILD_LITE!=1
+//,_keepData(false)
+//,_mapped(false)
+#endif
+#if BUILD_LITE!=1
+,_pagesData(8192)
+#endif
+{
+    // create and add one data buffer
+    _stylesheet.setDocument( this );
+}
+
+/// Destructor
+lxmlDocBase::~lxmlDocBase()
+{
+    LVHashTable<lUInt64, LVArray<lUInt8> *>::iterator i = _compiledStyleSheets.forwardIterator();
+    for ( LVHashTable<lUInt64, LVArray<lUInt8> *>::pair * p = i.next(); p; p = i.next() )
+        delete p->value;
+}
+
+/// returns interned id of CSS selector name (class name, id or attribute value), allocates new id if not found
+lUInt16 lxmlDocBase::getCssNameId( const lString16 & name )
+{
+    int count = _cssNameTable.length();
+    lUInt16 id = (lUInt16)_cssNameTable.add( name.c_str() );
+    if ( _cssNameTable.length()!=count ) {
+        // attribute values which didn't match any name may match new one
+        _attrValueCssNameIds.clear();
+        _classNameListOffsets.clear();
+        _classNameLists.clear();
+    }
+    return id;
+}
+
+/// returns interned CSS name id of whole attribute value, to compare with getCssNameId() of selector value
+lUInt16 lxmlDocBase::getAttrValueCssNameId( lUInt32 valueIndex )
+{
+    while ( _attrValueCssNameIds.length()<=(int)valueIndex )
+        _attrValueCssNameIds.add( 0xFFFF );
+    lUInt16 & id = _attrValueCssNameIds[valueIndex];
+    if ( id==0xFFFF ) {
+        int index = _cssNameTable.find( getAttrValue( valueIndex ).c_str() );
+        id = index>=0 ? (lUInt16)index : CSS_NAME_ID_NONE;
+    }
+    return id;
+}
+
+/// returns lowercase class name ids of class attribute value: number of ids followed by ids
+const lUInt16 * lxmlDocBase::getClassNameIds( lUInt32 valueIndex )
+{
+    while ( _classNameListOffsets.length()<=(int)valueIndex )
+        _classNameListOffsets.add( -1 );
+    if ( _classNameListOffsets[valueIndex]<0 ) {
+        // split by spaces, lowercase and intern each class name
+        lString16 value = getAttrValue( valueIndex );
+        value.lowercase();
+        int start = _classNameLists.length();
+        _classNameLists.add( 0 );
+        int len = value.length();
+        for ( int i=0; i<len; ) {
+            while ( i<len && value[i]<=' ' )
+                i++;
+            int j = i;
+            while ( j<len && value[j]>' ' )
+                j++;
+            if ( j>i ) {
+                int index = _cssNameTable.find( value.substr( i, j-i ).c_str() );
+                if ( index>=0 ) {
+                    _classNameLists.add( (lUInt16)index );
+                    _classNameLists[start]++;
+                }
+            }
+            i = j;
+        }
+        _classNameListOffsets[valueIndex] = start;
+    }
+    return _classNameLists.get() + _classNameListOffsets[valueIndex];
+}
+
+/// resolves CSS name ids of all attribute values, so that following getAttrValueCssNameId() and getClassNameIds() calls only read tables
+void lxmlDocBase::resolveCssNameIds()
+{
+    int count = _attrValueTable.length();
+    for ( int i=0; i<count; i++ ) {
+        getAttrValueCssNameId( (lUInt32)i );
+        getClassNameIds( (lUInt32)i );
+    }
+}
+
+/// returns compiled rules of CSS text with specified key, parsed before by this or another document
+bool lxmlDocBase::getCompiledStyleSheet( lUInt64 key, LVArray<lUInt8> & data )
+{
+    LVArray<lUInt8> * item = NULL;
+    if ( _compiledStyleSheets.get( key, item ) ) {
+        data = *item;
+        return true;
+    }
 #if BUILD_LITE!=1
-//,_keepData(false)
-//,_mapped(false)
+    if ( ldomDocCache::getCompiledStyleSheet( key, data ) ) {
+        // keep in document cache file as well
+        _compiledStyleSheets.set( key, new LVArray<lUInt8>( data ) );
+        _compiledStyleSheetsChanged = true;
+        return true;
+    }
 #endif
+    return false;
+}
+
+/// remembers compiled rules of CSS text for this document cache file and other documents
+void lxmlDocBase::setCompiledStyleSheet( lUInt64 key, SerialBuf & data )
+{
+    LVArray<lUInt8> * item = NULL;
+    if ( !_compiledStyleSheets.get( key, item ) ) {
+        item = new LVArray<lUInt8>();
+        _compiledStyleSheets.set( key, item );
+    }
+    item->clear();
+    item->add( data.buf(), data.pos() );
+    _compiledStyleSheetsChanged = true;
 #if BUILD_LITE!=1
-,_pagesData(8192)
+    ldomDocCache::putCompiledStyleSheet( key, data.buf(), data.pos() );
 #endif
+}
+
+/// writes all compiled rules remembered by document
+void lxmlDocBase::serializeCompiledStyleSheets( SerialBuf & buf )
 {
-    // create and add one data buffer
-    _stylesheet.setDocument( this );
+    buf << (lUInt32)_compiledStyleSheets.length();
+    LVHashTable<lUInt64, LVArray<lUInt8> *>::iterator i = _compiledStyleSheets.forwardIterator();
+    for ( LVHashTable<lUInt64, LVArray<lUInt8> *>::pair * p = i.next(); p; p = i.next() ) {
+        buf << (lUInt32)(p->key >> 32) << (lUInt32)p->key << (lUInt32)p->value->length();
+        SerialBuf data( p->value->get(), p->value->length() );
+        data.setPos( p->value->length() );
+        buf << data;
+    }
 }
 
-/// Destructor
-lxmlDocBase::~lxmlDocBase()
+/// reads compiled rules written by serializeCompiledStyleSheets()
+bool lxmlDocBase::deserializeCompiledStyleSheets( SerialBuf & buf )
 {
+    lUInt32 count = 0;
+    buf >> count;
+    for ( lUInt32 i = 0; i < count && !buf.error(); i++ ) {
+        lUInt32 hi = 0, lo = 0, size = 0;
+        buf >> hi >> lo >> size;
+        if ( buf.error() || buf.check( size ) )
+            return false;
+        LVArray<lUInt8> * item = NULL;
+        lUInt64 key = ((lUInt64)hi << 32) | lo;
+        if ( !_compiledStyleSheets.get( key, item ) ) {
+            item = new LVArray<lUInt8>();
+            _compiledStyleSheets.set( key, item );
+        }
+        item->clear();
+        item->add( buf.buf() + buf.pos(), size );
+        buf.setPos( buf.pos() + size );
+    }
+    return !buf.error();
 }
 
-void lxmlDocBase::onAttributeSet( lUInt16 attrId, lUInt16 valueId, ldomNode * node )
+void lxmlDocBase::onAttributeSet( lUInt16 attrId, lUInt32 valueId, ldomNode * node )
 {
+    if ( attrId==attr_class )
+        getClassNameIds( valueId ); // tokenize while loading
     if ( _idAttrId==0 )
         _idAttrId = _attrNameTable.idByName("id");
     if ( _nameAttrId==0 )
@@ -2941,6 +5451,9 @@ lxmlDocBase::lxmlDocBase( lxmlDocBase & doc )
 ,   _nextUnknownNsId(doc._nextUnknownNsId)      // Next Id for unknown namespace
     //lvdomStyleCache _styleCache;         // Style cache
 ,   _attrValueTable(doc._attrValueTable)
+,   _cssNameTable(doc._cssNameTable)
+,   _compiledStyleSheets(16)
+,   _compiledStyleSheetsChanged(false)
 ,   _idNodeMap(doc._idNodeMap)
 ,   _urlImageMap(1024)
 ,   _idAttrId(doc._idAttrId) // Id for "id" attribute name
@@ -2977,8 +5490,8 @@ static void writeNode( LVStream * stream, ldomNode * node, bool treeLayout )
     }
     if ( node->isText() )
     {
-        lString8 txt = node->getText8();
-        *stream << txt;
+        ldomTextView txt( node );
+        stream->Write( txt.text(), txt.length(), NULL );
         if ( treeLayout )
             *stream << "\n";
     }
@@ -3224,6 +5737,7 @@ bool ldomDocument::setRenderProps( int width, int dy, bool /*showCover*/, int /*
 
 void tinyNodeCollection::dropStyles()
 {
+    resetStyleSharing();
     _styles.clear(-1);
     _fonts.clear(-1);
     resetNodeNumberingProps();
@@ -3311,6 +5825,7 @@ bool ldomDocument::parseStyleSheet(lString16 cssFile)
 int ldomDocument::render( LVRendPageList * pages, LVDocViewCallback * callback, int width, int dy, bool showCover, int y0, font_ref_t def_font, int def_interline_space, CRPropRef props )
 {
     CRLog::info("Render is called for width %d, pageHeight=%d, fontFace=%s, docFlags=%d", width, dy, def_font->getTypeFace().c_str(), getDocFlags() );
+    clearChunkAccessHistory();
     CRLog::trace("initializing default style...");
     //persist();
 //    {
@@ -3482,7 +5997,7 @@ static const char * ns_id_map_magic =   "NMSP";
 static const char * node_by_id_map_magic = "NIDM";
 
 typedef struct {
-    lUInt16 key;
+    lUInt32 key;
     lUInt32 value;
 } id_node_map_item;
 
@@ -3519,8 +6034,8 @@ void lxmlDocBase::serializeMaps( SerialBuf & buf )
     buf.putMagic( node_by_id_map_magic );
     lUInt32 cnt = 0;
     {
-        LVHashTable<lUInt16,lInt32>::iterator ii = _idNodeMap.forwardIterator();
-        for ( LVHashTable<lUInt16,lInt32>::pair * p = ii.next(); p!=NULL; p = ii.next() ) {
+        LVHashTable<lUInt32,lInt32>::iterator ii = _idNodeMap.forwardIterator();
+        for ( LVHashTable<lUInt32,lInt32>::pair * p = ii.next(); p!=NULL; p = ii.next() ) {
             cnt++;
         }
     }
@@ -3533,15 +6048,24 @@ void lxmlDocBase::serializeMaps( SerialBuf & buf )
         // sort items before serializing!
         id_node_map_item * array = new id_node_map_item[cnt];
         int i = 0;
-        LVHashTable<lUInt16,lInt32>::iterator ii = _idNodeMap.forwardIterator();
-        for ( LVHashTable<lUInt16,lInt32>::pair * p = ii.next(); p!=NULL; p = ii.next() ) {
-            array[i].key = (lUInt16)p->key;
+        LVHashTable<lUInt32,lInt32>::iterator ii = _idNodeMap.forwardIterator();
+        for ( LVHashTable<lUInt32,lInt32>::pair * p = ii.next(); p!=NULL; p = ii.next() ) {
+            array[i].key = p->key;
             array[i].value = (lUInt32)p->value;
             i++;
         }
         qsort(array, cnt, sizeof(id_node_map_item), &compare_id_node_map_items);
-        for (i = 0; i < (int)cnt; i++)
-            buf << array[i].key << array[i].value;
+        // keys are sorted, and nodes of subsequent ids usually follow each other:
+        // store key deltas and zigzag encoded node index deltas, mostly 1-2 bytes each
+        lUInt32 prevKey = 0;
+        lUInt32 prevValue = 0;
+        for (i = 0; i < (int)cnt; i++) {
+            lInt32 delta = (lInt32)(array[i].value - prevValue);
+            buf.putVarUInt( array[i].key - prevKey );
+            buf.putVarUInt( ((lUInt32)delta << 1) ^ (lUInt32)(delta >> 31) );
+            prevKey = array[i].key;
+            prevValue = array[i].value;
+        }
         delete[] array;
     }
     buf.putMagic( node_by_id_map_magic );
@@ -3587,6 +6111,10 @@ bool lxmlDocBase::deserializeMaps( SerialBuf & buf )
 
     buf.checkMagic( attr_value_map_magic );
     _attrValueTable.deserialize( buf );
+    // value indexes are changed: CSS names will be interned again
+    _attrValueCssNameIds.clear();
+    _classNameListOffsets.clear();
+    _classNameLists.clear();
 
     if ( buf.error() ) {
         CRLog::error("Error while deserialization of AttrValue map");
@@ -3600,11 +6128,12 @@ bool lxmlDocBase::deserializeMaps( SerialBuf & buf )
     _idNodeMap.clear();
     if ( idmsize < 20000 )
         _idNodeMap.resize( idmsize*2 );
+    lUInt32 key = 0;
+    lUInt32 value = 0;
     for ( unsigned i=0; i<idmsize; i++ ) {
-        lUInt16 key;
-        lUInt32 value;
-        buf >> key;
-        buf >> value;
+        key += buf.getVarUInt();
+        lUInt32 delta = buf.getVarUInt();
+        value += (delta >> 1) ^ (0 - (delta & 1));
         _idNodeMap.set( key, value );
         if ( buf.error() )
             return false;
@@ -4851,7 +7380,7 @@ ldomXPointer ldomDocument::createXPointer( const lString16 & xPointerStr )
 {
     if ( xPointerStr[0]=='#' ) {
         lString16 id = xPointerStr.substr(1);
-        lUInt16 idid = getAttrValueIndex(id.c_str());
+        lUInt32 idid = getAttrValueIndex(id.c_str());
         lInt32 nodeIndex;
         if ( _idNodeMap.get(idid, nodeIndex) ) {
             ldomNode * node = getTinyNode(nodeIndex);
@@ -5548,31 +8077,49 @@ int ldomXPointerEx::compare( const ldomXPointerEx& v ) const
     return 0;
 }
 
-/// calls specified function recursively for all elements of DOM tree
+/// calls specified function for all elements of DOM tree
 void ldomXPointerEx::recurseElements( void (*pFun)( ldomXPointerEx & node ) )
 {
     if ( !isElement() )
         return;
-    pFun( *this );
-    if ( child( 0 ) ) {
-        do {
-            recurseElements( pFun );
-        } while ( nextSibling() );
-        parent();
+    int level = 0;
+    for ( ;; ) {
+        if ( isElement() ) {
+            pFun( *this );
+            if ( child( 0 ) ) {
+                level++;
+                continue;
+            }
+        }
+        // move to next sibling, going up when there are no more siblings
+        while ( level>0 && !nextSibling() ) {
+            parent();
+            level--;
+        }
+        if ( level==0 )
+            break;
     }
 }
 
-/// calls specified function recursively for all nodes of DOM tree
+/// calls specified function for all nodes of DOM tree
 void ldomXPointerEx::recurseNodes( void (*pFun)( ldomXPointerEx & node ) )
 {
     if ( !isElement() )
         return;
-    pFun( *this );
-    if ( child( 0 ) ) {
-        do {
-            recurseElements( pFun );
-        } while ( nextSibling() );
-        parent();
+    int level = 0;
+    for ( ;; ) {
+        pFun( *this );
+        if ( isElement() && child( 0 ) ) {
+            level++;
+            continue;
+        }
+        // move to next sibling, going up when there are no more siblings
+        while ( level>0 && !nextSibling() ) {
+            parent();
+            level--;
+        }
+        if ( level==0 )
+            break;
     }
 }
 
@@ -8101,6 +10648,12 @@ bool ldomDocument::loadCacheFileContent(CacheLoadingCallback * formatCallback)
 {
 
     CRLog::trace("ldomDocument::loadCacheFileContent()");
+    // storage chunks are read on demand, after document is opened: check them now,
+    // to parse document again instead of reading corrupted chunk while it's in use
+    if ( _enableCacheFileContentsValidation && !_cacheFile->validateBlocks() ) {
+        CRLog::error("Corrupted blocks are found in cache file");
+        return false;
+    }
     {
         SerialBuf propsbuf(0, true);
         if ( !_cacheFile->read( CBT_PROP_DATA, propsbuf ) ) {
@@ -8156,6 +10709,15 @@ bool ldomDocument::loadCacheFileContent(CacheLoadingCallback * formatCallback)
             registerEmbeddedFonts();
         }
 
+        CRLog::trace("ldomDocument::loadCacheFileContent() - compiled stylesheets");
+        {
+            // optional: absent in files written before compiled stylesheets were cached
+            SerialBuf buf(0, true);
+            if ( _cacheFile->hasBlock(CBT_STYLESHEET_DATA, 0) && _cacheFile->read(CBT_STYLESHEET_DATA, buf) && !deserializeCompiledStyleSheets(buf) )
+                CRLog::error("Error while parsing compiled stylesheet data, ignored");
+            _compiledStyleSheetsChanged = false;
+        }
+
         DocFileHeader h;
         memset(&h, 0, sizeof(h));
         SerialBuf hdrbuf(0,true);
@@ -8199,6 +10761,12 @@ bool ldomDocument::loadCacheFileContent(CacheLoadingCallback * formatCallback)
         return false;
     }
 
+    CRLog::trace("ldomDocument::loadCacheFileContent() - node topology");
+    if ( !loadNodeTopology() ) {
+        CRLog::info("Node topology is not found in cache file, building it from element storage");
+        buildNodeTopology();
+    }
+
     CRLog::trace("ldomDocument::loadCacheFileContent() - TOC");
     {
         SerialBuf tocbuf(0,true);
@@ -8233,6 +10801,11 @@ bool ldomDocument::loadCacheFileContent(CacheLoadingCallback * formatCallback)
         updateLoadedStyles( false );
     }
 
+    if ( _cacheFile->isInvalid() ) {
+        CRLog::error("Corrupted blocks are found while loading cache file content");
+        return false;
+    }
+
     CRLog::trace("ldomDocument::loadCacheFileContent() - completed successfully");
 
     return true;
@@ -8434,10 +11007,24 @@ ContinuousOperationResult ldomDocument::saveChanges( CRTimerUtil & maxTime )
             }
             CHECK_EXPIRATION("saving embedded fonts")
         }
+        if ( _compiledStyleSheetsChanged ) {
+            CRLog::trace("ldomDocument::saveChanges() - compiled stylesheets");
+            SerialBuf buf(4096);
+            serializeCompiledStyleSheets(buf);
+            if (!_cacheFile->write(CBT_STYLESHEET_DATA, buf, COMPRESS_MISC_DATA) ) {
+                CRLog::error("Error while saving compiled stylesheet data");
+                return CR_ERROR;
+            }
+            _compiledStyleSheetsChanged = false;
+        }
         // fall through
     case 12:
         _mapSavingStage = 12;
         CRLog::trace("ldomDocument::saveChanges() - flush");
+        if ( !maxTime.infinite() && _cacheFile->hasPendingWrites() ) {
+            // don't wait for background writer here, continue on next call
+            return CR_TIMEOUT;
+        }
         {
             CRTimerUtil infinite;
             if ( !_cacheFile->flush(true, infinite) ) {
@@ -8449,6 +11036,21 @@ ContinuousOperationResult ldomDocument::saveChanges( CRTimerUtil & maxTime )
         // fall through
     case 13:
         _mapSavingStage = 13;
+        if ( _cacheFile->needsCompaction() ) {
+            CRLog::trace("ldomDocument::saveChanges() - compaction");
+            ContinuousOperationResult res = compactCacheFile(maxTime);
+            if ( res==CR_ERROR ) {
+                CRLog::error("Error while compacting cache file");
+                return CR_ERROR;
+            }
+            if ( res==CR_TIMEOUT ) {
+                CRLog::info("timer expired while compacting cache file");
+                return CR_TIMEOUT;
+            }
+        }
+        // fall through
+    case 14:
+        _mapSavingStage = 14;
     }
     CRLog::trace("ldomDocument::saveChanges() - done");
     return CR_DONE;
@@ -8753,7 +11355,40 @@ ContinuousOperationResult ldomDocument::updateMap(CRTimerUtil & maxTime)
 
 #endif
 
-static const char * doccache_magic = "CoolReader3 Document Cache Directory Index\nV1.00\n";
+static const char * doccache_magic = "CoolReader3 Document Cache Directory Index\nV1.02\n";
+/// index format without access times and hit counters
+static const char * doccache_magic_v101 = "CoolReader3 Document Cache Directory Index\nV1.01\n";
+/// index format without stream fingerprints
+static const char * doccache_magic_v100 = "CoolReader3 Document Cache Directory Index\nV1.00\n";
+
+/// max number of stream fingerprint to crc32 pairs kept in cache index
+#define DOC_CACHE_MAX_FINGERPRINTS 1000
+
+#ifndef DOC_CACHE_MAX_JOURNAL_RECORDS
+/// index is rewritten and journal is truncated when journal grows longer than this number of records
+#define DOC_CACHE_MAX_JOURNAL_RECORDS 64
+#endif
+
+#ifndef DOC_CACHE_MAX_STYLESHEET_SIZE
+/// shared compiled stylesheet file is dropped and started again when it grows larger than this size
+#define DOC_CACHE_MAX_STYLESHEET_SIZE 0x200000
+#endif
+
+/// shared compiled stylesheet file header
+static const char * doccache_stylesheet_magic = "CoolReader3 Compiled Stylesheets\nV1.00\n";
+
+/// cache index journal record: file is added or accessed
+#define DOC_CACHE_JOURNAL_UPDATE 1
+/// cache index journal record: file is removed
+#define DOC_CACHE_JOURNAL_REMOVE 2
+/// cache index journal record: crc32 of stream with new fingerprint is calculated
+#define DOC_CACHE_JOURNAL_FINGERPRINT 3
+
+/// returns current time in seconds, used for cache file access times
+static lUInt32 getDocCacheTime()
+{
+    return (lUInt32)(GetCurrentTimeMillis() / 1000);
+}
 
 /// document cache
 class ldomDocCacheImpl : public ldomDocCache
@@ -8766,16 +11401,42 @@ class ldomDocCacheImpl : public ldomDocCache
     struct FileItem {
         lString16 filename;
         lUInt32 size;
+        lUInt32 lastAccess; // time of last open, seconds
+        lUInt32 hits;       // number of times file has been reused
+        FileItem() : size(0), lastAccess(0), hits(0) { }
     };
     LVPtrVector<FileItem> _files;
+    LVHashTable<lString16, FileItem*> _fileMap; // filename -> item of _files
+    int _journalRecords;
+    ldomDocCacheStats _stats;
+    struct FingerprintItem {
+        lUInt64 fingerprint;
+        lUInt32 crc;
+    };
+    LVPtrVector<FingerprintItem> _fingerprints; // most recently used first
+    LVHashTable<lUInt64, LVArray<lUInt8> *> _styleSheets; // CSS text key -> compiled stylesheet, shared by documents
+    bool _styleSheetsLoaded;      // cr3css.dat is read into _styleSheets
+    lUInt32 _styleSheetsSize;     // current size of cr3css.dat
+#if BUILD_LITE!=1
+    CacheFile * _compactFile;     // file which is being compacted
+    lString16 _compactFileName;
+    lString16Collection _checked; // files checked during current compaction pass
+#endif
 public:
     ldomDocCacheImpl( lString16 cacheDir, lvsize_t maxSize )
         : _cacheDir( cacheDir ), _maxSize( maxSize ), _oldStreamSize(0), _oldStreamCRC(0)
+        , _fileMap(1024), _journalRecords(0)
+        , _styleSheets(64), _styleSheetsLoaded(false), _styleSheetsSize(0)
+#if BUILD_LITE!=1
+        , _compactFile(NULL)
+#endif
     {
         LVAppendPathDelimiter( _cacheDir );
+        memset( &_stats, 0, sizeof(_stats) );
         CRLog::trace("ldomDocCacheImpl(%s maxSize=%d)", LCSTR(_cacheDir), (int)maxSize);
     }
 
+    /// rewrites whole index file and truncates journal
     bool writeIndex()
     {
         lString16 filename = _cacheDir + "cr3cache.inx";
@@ -8797,9 +11458,15 @@ public:
         for ( int i=0; i<count && !buf.error(); i++ ) {
             FileItem * item = _files[i];
             buf << item->filename;
-            buf << item->size;
+            buf << item->size << item->lastAccess << item->hits;
             CRLog::trace("cache item: %s %d", LCSTR(item->filename), (int)item->size);
         }
+        count = _fingerprints.length();
+        buf << (lUInt32)count;
+        for ( int i=0; i<count && !buf.error(); i++ ) {
+            FingerprintItem * item = _fingerprints[i];
+            buf << (lUInt32)(item->fingerprint >> 32) << (lUInt32)item->fingerprint << item->crc;
+        }
         buf.putCRC( buf.pos() - start );
         if ( buf.error() )
             return false;
@@ -8818,9 +11485,98 @@ public:
             _oldStreamCRC = newCRC;
             _oldStreamSize = newSize;
         }
+        // all journal records are now in index
+        if ( _journalRecords || LVFileExists( _cacheDir + "cr3cache.jnl" ) )
+            LVDeleteFile( _cacheDir + "cr3cache.jnl" );
+        _journalRecords = 0;
+        return true;
+    }
+
+    /// appends record about changed file to index journal; rewrites index instead when journal is too long
+    bool writeJournal( int op, FileItem * item )
+    {
+        if ( _journalRecords >= DOC_CACHE_MAX_JOURNAL_RECORDS )
+            return writeIndex();
+        SerialBuf buf( 512, true );
+        lUInt32 start = buf.pos();
+        buf << (lUInt8)op << item->filename << item->size << item->lastAccess << item->hits;
+        buf.putCRC( buf.pos() - start );
+        return writeJournal( buf );
+    }
+
+    /// appends record about new stream fingerprint to index journal; rewrites index instead when journal is too long
+    bool writeJournal( FingerprintItem * item )
+    {
+        if ( _journalRecords >= DOC_CACHE_MAX_JOURNAL_RECORDS )
+            return writeIndex();
+        SerialBuf buf( 64, true );
+        lUInt32 start = buf.pos();
+        buf << (lUInt8)DOC_CACHE_JOURNAL_FINGERPRINT << (lUInt32)(item->fingerprint >> 32) << (lUInt32)item->fingerprint << item->crc;
+        buf.putCRC( buf.pos() - start );
+        return writeJournal( buf );
+    }
+
+    /// appends serialized record to index journal
+    bool writeJournal( SerialBuf & buf )
+    {
+        if ( buf.error() )
+            return writeIndex();
+        LVStreamRef stream = LVOpenFileStream( (_cacheDir + "cr3cache.jnl").c_str(), LVOM_APPEND );
+        if ( stream.isNull() )
+            return writeIndex();
+        stream->SetPos( stream->GetSize() );
+        if ( stream->Write( buf.buf(), buf.pos(), NULL )!=LVERR_OK )
+            return writeIndex();
+        _journalRecords++;
         return true;
     }
 
+    /// applies records of index journal written after last index rewrite
+    void readJournal()
+    {
+        LVStreamRef instream = LVOpenFileStream( (_cacheDir + "cr3cache.jnl").c_str(), LVOM_READ );
+        if ( instream.isNull() || instream->GetSize()==0 )
+            return;
+        LVStreamBufferRef sb = instream->GetReadBuffer(0, instream->GetSize() );
+        if ( !sb )
+            return;
+        SerialBuf buf( sb->getReadOnly(), sb->getSize() );
+        int count = 0;
+        while ( buf.pos() < (int)sb->getSize() ) {
+            lUInt32 start = buf.pos();
+            lUInt8 op;
+            FileItem record;
+            FingerprintItem fingerprint;
+            buf >> op;
+            if ( op==DOC_CACHE_JOURNAL_FINGERPRINT ) {
+                lUInt32 hi, lo;
+                buf >> hi >> lo >> fingerprint.crc;
+                fingerprint.fingerprint = ((lUInt64)hi << 32) | lo;
+            } else {
+                buf >> record.filename >> record.size >> record.lastAccess >> record.hits;
+            }
+            if ( buf.error() || !buf.checkCRC( buf.pos() - start ) ) {
+                // last record is incomplete: ignore it
+                CRLog::error("Broken record in document cache index journal");
+                break;
+            }
+            if ( op==DOC_CACHE_JOURNAL_FINGERPRINT ) {
+                addFingerprint( fingerprint.fingerprint, fingerprint.crc );
+            } else if ( op==DOC_CACHE_JOURNAL_REMOVE ) {
+                removeFileItem( record.filename );
+            } else {
+                FileItem * item = findFile( record.filename );
+                if ( !item )
+                    item = addFileItem( record.filename );
+                item->size = record.size;
+                item->lastAccess = record.lastAccess;
+                item->hits = record.hits;
+            }
+            count++;
+        }
+        CRLog::info("Document cache index journal read, %d records applied", count);
+    }
+
     bool readIndex(  )
     {
         lString16 filename = _cacheDir + "cr3cache.inx";
@@ -8832,7 +11588,15 @@ public:
             if ( !sb )
                 return false;
             SerialBuf buf( sb->getReadOnly(), sb->getSize() );
-            if ( !buf.checkMagic( doccache_magic ) ) {
+            int oldMagicSize = strlen( doccache_magic_v100 );
+            const char * magic = doccache_magic;
+            if ( (int)sb->getSize()>=oldMagicSize && !memcmp( sb->getReadOnly(), doccache_magic_v100, oldMagicSize ) )
+                magic = doccache_magic_v100;
+            else if ( (int)sb->getSize()>=oldMagicSize && !memcmp( sb->getReadOnly(), doccache_magic_v101, oldMagicSize ) )
+                magic = doccache_magic_v101;
+            bool hasFingerprints = magic!=doccache_magic_v100;
+            bool hasAccessTimes = magic==doccache_magic;
+            if ( !buf.checkMagic( magic ) ) {
                 CRLog::error("wrong cache index file format");
                 return false;
             }
@@ -8840,14 +11604,31 @@ public:
             lUInt32 start = buf.pos();
             lUInt32 count;
             buf >> count;
+            lUInt32 now = getDocCacheTime();
             for (lUInt32 i=0; i < count && !buf.error(); i++) {
-                FileItem * item = new FileItem();
-                _files.add( item );
-                buf >> item->filename;
+                lString16 fn;
+                buf >> fn;
+                FileItem * item = addFileItem( fn );
                 buf >> item->size;
+                if ( hasAccessTimes ) {
+                    buf >> item->lastAccess >> item->hits;
+                } else {
+                    // old index is ordered by last access
+                    item->lastAccess = now - i;
+                }
                 CRLog::trace("cache %d: %s [%d]", i, UnicodeToUtf8(item->filename).c_str(), (int)item->size );
                 totalSize += item->size;
             }
+            if ( hasFingerprints ) {
+                buf >> count;
+                for (lUInt32 i=0; i < count && !buf.error(); i++) {
+                    FingerprintItem * item = new FingerprintItem();
+                    _fingerprints.add( item );
+                    lUInt32 hi, lo;
+                    buf >> hi >> lo >> item->crc;
+                    item->fingerprint = ((lUInt64)hi << 32) | lo;
+                }
+            }
             if ( !buf.checkCRC( buf.pos() - start ) ) {
                 CRLog::error("CRC32 doesn't match in cache index file");
                 return false;
@@ -8886,7 +11667,7 @@ public:
                 lString16 fn = item->GetName();
                 if ( !fn.endsWith(".cr3") )
                     continue;
-                if ( findFileIndex(fn)<0 ) {
+                if ( !findFile(fn) ) {
                     // delete file
                     CRLog::info("Removing cache file not specified in index: %s", UnicodeToUtf8(fn).c_str() );
                     if ( !LVDeleteFile( _cacheDir + fn ) ) {
@@ -8898,57 +11679,258 @@ public:
         return true;
     }
 
+    /// eviction score: large files which were not used for long time and have few hits go first
+    static double evictionScore( FileItem * item, lUInt32 now )
+    {
+        lUInt32 age = now > item->lastAccess ? now - item->lastAccess : 0;
+        return (double)item->size * ((double)age + 1) / ((double)item->hits + 1);
+    }
+
+    /// returns true if file cannot be evicted now
+    bool isFileInUse( FileItem * item )
+    {
+#if BUILD_LITE!=1
+        if ( tinyNodeCollection::isCacheFileOpen( _cacheDir + item->filename ) )
+            return true;
+#endif
+        return false;
+    }
+
     // remove all extra files to add new one of specified size
     bool reserve( lvsize_t allocSize )
     {
         bool res = true;
-        // remove extra files specified in list
         lvsize_t dirsize = allocSize;
+        FileItem * newest = NULL;
         for ( int i=0; i<_files.length(); ) {
             if ( LVFileExists( _cacheDir + _files[i]->filename ) ) {
-                if ( (i>0 || allocSize>0) && dirsize+_files[i]->size > _maxSize ) {
-                    if ( LVDeleteFile( _cacheDir + _files[i]->filename ) ) {
-                        _files.erase(i, 1);
-                    } else {
-                        CRLog::error("Cannot delete cache file %s", UnicodeToUtf8(_files[i]->filename).c_str() );
-                        dirsize += _files[i]->size;
-                        res = false;
-                        i++;
-                    }
-                } else {
-                    dirsize += _files[i]->size;
-                    i++;
-                }
+                dirsize += _files[i]->size;
+                if ( !newest || _files[i]->lastAccess > newest->lastAccess )
+                    newest = _files[i];
+                i++;
             } else {
                 CRLog::error("File %s is found in cache index, but does not exist", UnicodeToUtf8(_files[i]->filename).c_str() );
-                _files.erase(i, 1);
+                removeFileItem( _files[i]->filename );
+            }
+        }
+        if ( dirsize <= _maxSize )
+            return res;
+        // evict files in order of decreasing score until there is enough space
+        LVArray<FileItem*> candidates;
+        for ( int i=0; i<_files.length(); i++ ) {
+            // most recently used file is kept when there is no new file
+            if ( allocSize==0 && _files[i]==newest )
+                continue;
+            if ( isFileInUse( _files[i] ) )
+                continue;
+            candidates.add( _files[i] );
+        }
+        lUInt32 now = getDocCacheTime();
+        while ( dirsize > _maxSize && candidates.length() ) {
+            int best = 0;
+            double bestScore = evictionScore( candidates[0], now );
+            for ( int i=1; i<candidates.length(); i++ ) {
+                double score = evictionScore( candidates[i], now );
+                if ( score > bestScore ) {
+                    best = i;
+                    bestScore = score;
+                }
+            }
+            FileItem * item = candidates[best];
+            candidates.erase( best, 1 );
+            lString16 fn = item->filename;
+#if BUILD_LITE!=1
+            if ( _compactFile && _compactFileName==fn )
+                closeCompactedFile( false );
+#endif
+            lUInt32 size = item->size;
+            if ( LVDeleteFile( _cacheDir + fn ) ) {
+                CRLog::info("Evicting cache file %s (%d bytes, %d hits)", LCSTR(fn), (int)size, (int)item->hits);
+                dirsize -= size;
+                _stats.evictions++;
+                _stats.evictedBytes += size;
+                removeFileItem( fn );
+                FileItem record;
+                record.filename = fn;
+                writeJournal( DOC_CACHE_JOURNAL_REMOVE, &record );
+            } else {
+                CRLog::error("Cannot delete cache file %s", UnicodeToUtf8(fn).c_str() );
+                res = false;
             }
         }
         return res;
     }
 
-    int findFileIndex( lString16 filename )
+    /// returns index item for file name, NULL if not found
+    FileItem * findFile( const lString16 & filename )
+    {
+        return _fileMap.get( filename );
+    }
+
+    /// adds new empty item to index
+    FileItem * addFileItem( const lString16 & filename )
+    {
+        FileItem * item = new FileItem();
+        item->filename = filename;
+        _files.add( item );
+        _fileMap.set( filename, item );
+        return item;
+    }
+
+    /// removes item from index, if found
+    void removeFileItem( const lString16 & filename )
     {
+        FileItem * item = findFile( filename );
+        if ( !item )
+            return;
+        _fileMap.remove( filename );
         for ( int i=0; i<_files.length(); i++ ) {
-            if ( _files[i]->filename == filename )
-                return i;
+            if ( _files[i]==item ) {
+                _files.erase( i, 1 );
+                break;
+            }
         }
-        return -1;
     }
 
-    bool moveFileToTop( lString16 filename, lUInt32 size )
+    /// updates size and access time of file, adding it to index if necessary
+    bool touchFile( lString16 filename, lUInt32 size, bool hit )
     {
-        int index = findFileIndex( filename );
-        if ( index<0 ) {
-            FileItem * item = new FileItem();
-            item->filename = filename;
-            item->size = size;
-            _files.insert( 0, item );
-        } else {
-            _files.move( 0, index );
-            _files[0]->size = size;
+        FileItem * item = findFile( filename );
+        if ( !item )
+            item = addFileItem( filename );
+        item->size = size;
+        item->lastAccess = getDocCacheTime();
+        if ( hit )
+            item->hits++;
+        else
+            item->hits = 0; // file is created again
+        return writeJournal( DOC_CACHE_JOURNAL_UPDATE, item );
+    }
+
+    /// drops all compiled stylesheets from memory
+    void clearStyleSheets()
+    {
+        LVHashTable<lUInt64, LVArray<lUInt8> *>::iterator i = _styleSheets.forwardIterator();
+        for ( LVHashTable<lUInt64, LVArray<lUInt8> *>::pair * p = i.next(); p; p = i.next() )
+            delete p->value;
+        _styleSheets.clear();
+        _styleSheetsSize = 0;
+    }
+
+    /// reads shared compiled stylesheet file on first access: header, then key, size, data, crc32 records
+    void readStyleSheets()
+    {
+        if ( _styleSheetsLoaded )
+            return;
+        _styleSheetsLoaded = true;
+        if ( !LVFileExists( _cacheDir + "cr3css.dat" ) )
+            return;
+        LVStreamRef instream = LVOpenFileStream( (_cacheDir + "cr3css.dat").c_str(), LVOM_READ );
+        if ( instream.isNull() || instream->GetSize()==0 )
+            return;
+        LVStreamBufferRef sb = instream->GetReadBuffer( 0, instream->GetSize() );
+        if ( !sb )
+            return;
+        SerialBuf buf( sb->getReadOnly(), sb->getSize() );
+        if ( !buf.checkMagic( doccache_stylesheet_magic ) ) {
+            CRLog::error("wrong compiled stylesheet file format");
+            return;
         }
-        return writeIndex();
+        int count = 0;
+        while ( buf.pos() < (int)sb->getSize() ) {
+            lUInt32 start = buf.pos();
+            lUInt32 hi, lo, size;
+            buf >> hi >> lo >> size;
+            if ( buf.error() || buf.check( size ) )
+                break;
+            const lUInt8 * data = buf.buf() + buf.pos();
+            buf.setPos( buf.pos() + size );
+            if ( !buf.checkCRC( buf.pos() - start ) )
+                break;
+            lUInt64 key = ((lUInt64)hi << 32) | lo;
+            LVArray<lUInt8> * item = NULL;
+            if ( !_styleSheets.get( key, item ) ) {
+                item = new LVArray<lUInt8>();
+                _styleSheets.set( key, item );
+            }
+            item->clear();
+            item->add( data, size );
+            count++;
+        }
+        if ( buf.error() ) {
+            // last record is incomplete: ignore it, it's overwritten by next append
+            CRLog::error("Broken record in compiled stylesheet file");
+        }
+        _styleSheetsSize = buf.error() ? 0 : buf.pos();
+        CRLog::info("%d compiled stylesheets read from cache", count);
+    }
+
+    /// returns compiled stylesheet for CSS text key
+    bool getCompiledStyleSheet( lUInt64 key, LVArray<lUInt8> & data )
+    {
+        readStyleSheets();
+        LVArray<lUInt8> * item = NULL;
+        if ( !_styleSheets.get( key, item ) )
+            return false;
+        data = *item;
+        return true;
+    }
+
+    /// adds compiled stylesheet to memory table and appends it to cr3css.dat
+    void putCompiledStyleSheet( lUInt64 key, const lUInt8 * data, int size )
+    {
+        readStyleSheets();
+        LVArray<lUInt8> * item = NULL;
+        if ( _styleSheets.get( key, item ) )
+            return;
+        lString16 filename = _cacheDir + "cr3css.dat";
+        if ( _styleSheetsSize==0 || _styleSheetsSize + size > DOC_CACHE_MAX_STYLESHEET_SIZE ) {
+            // start new file
+            clearStyleSheets();
+            LVStreamRef stream = LVOpenFileStream( filename.c_str(), LVOM_WRITE );
+            if ( stream.isNull() )
+                return;
+            SerialBuf hdr( 64, true );
+            hdr.putMagic( doccache_stylesheet_magic );
+            if ( stream->Write( hdr.buf(), hdr.pos(), NULL )!=LVERR_OK )
+                return;
+            _styleSheetsSize = hdr.pos();
+        }
+        item = new LVArray<lUInt8>();
+        item->add( data, size );
+        _styleSheets.set( key, item );
+        SerialBuf buf( size + 32, true );
+        buf << (lUInt32)(key >> 32) << (lUInt32)key << (lUInt32)size;
+        SerialBuf body( data, size );
+        body.setPos( size );
+        buf << body;
+        buf.putCRC( buf.pos() );
+        LVStreamRef stream = LVOpenFileStream( filename.c_str(), LVOM_APPEND );
+        if ( stream.isNull() )
+            return;
+        stream->SetPos( stream->GetSize() );
+        if ( buf.error() || stream->Write( buf.buf(), buf.pos(), NULL )!=LVERR_OK ) {
+            CRLog::error("Error while writing compiled stylesheet to cache");
+            _styleSheetsSize = 0;
+            return;
+        }
+        _styleSheetsSize += buf.pos();
+    }
+
+    /// returns cache usage statistics
+    void getStats( ldomDocCacheStats & stats )
+    {
+        stats = _stats;
+        stats.files = _files.length();
+        stats.totalSize = 0;
+        for ( int i=0; i<_files.length(); i++ )
+            stats.totalSize += _files[i]->size;
+    }
+
+    /// resets hit, miss and eviction counters
+    void resetStats()
+    {
+        memset( &_stats, 0, sizeof(_stats) );
     }
 
     bool init()
@@ -8957,6 +11939,7 @@ public:
         // read index
         if ( readIndex(  ) ) {
             // read successfully
+            readJournal();
             // remove files not specified in list
             removeExtraFiles( );
         } else {
@@ -8965,7 +11948,8 @@ public:
                 return false;
             }
             _files.clear();
-
+            _fileMap.clear();
+            _fingerprints.clear();
         }
         reserve(0);
         if ( !writeIndex() )
@@ -8973,15 +11957,135 @@ public:
         return true;
     }
 
+#if BUILD_LITE!=1
+    /// completes compaction of file, closes it and updates its size in index
+    void closeCompactedFile( bool finish )
+    {
+        if ( !_compactFile )
+            return;
+        if ( finish && _compactFile->needsCompaction() ) {
+            CRTimerUtil infinite;
+            _compactFile->compact( infinite );
+        }
+        delete _compactFile;
+        _compactFile = NULL;
+        FileItem * item = findFile( _compactFileName );
+        if ( item ) {
+            LVStreamRef stream = LVOpenFileStream( (_cacheDir+_compactFileName).c_str(), LVOM_READ );
+            if ( !stream.isNull() ) {
+                item->size = (lUInt32)stream->GetSize();
+                writeJournal( DOC_CACHE_JOURNAL_UPDATE, item );
+            }
+        }
+        _compactFileName.clear();
+    }
+
+    /// opens next file which needs compaction, returns false if there are no such files
+    bool openFileForCompaction()
+    {
+        for ( int i=0; i<_files.length(); i++ ) {
+            lString16 fn = _files[i]->filename;
+            if ( _checked.contains( fn ) )
+                continue;
+            _checked.add( fn );
+            lString16 pathname = _cacheDir + fn;
+            if ( tinyNodeCollection::isCacheFileOpen( pathname ) )
+                continue;
+            LVStreamRef stream = LVOpenFileStream( pathname.c_str(), LVOM_APPEND );
+            if ( stream.isNull() )
+                continue;
+#if ENABLED_BLOCK_WRITE_CACHE
+            stream = LVCreateBlockWriteStream( stream, WRITE_CACHE_BLOCK_SIZE, WRITE_CACHE_BLOCK_COUNT );
+#endif
+            CacheFile * file = new CacheFile();
+            if ( !file->open( stream ) || !file->needsCompaction() ) {
+                delete file;
+                continue;
+            }
+            CRLog::info("ldomDocCache::compact - compacting %s", LCSTR(fn));
+            _compactFile = file;
+            _compactFileName = fn;
+            return true;
+        }
+        return false;
+    }
+
+    /// compacts fragmented cache files not used by open documents, limited by time interval
+    ContinuousOperationResult compact( CRTimerUtil & maxTime )
+    {
+        for (;;) {
+            if ( !_compactFile && !openFileForCompaction() ) {
+                // all files are checked: next pass starts from the beginning
+                _checked.clear();
+                return CR_DONE;
+            }
+            ContinuousOperationResult res = _compactFile->compact( maxTime );
+            if ( res==CR_TIMEOUT )
+                return CR_TIMEOUT;
+            if ( res==CR_ERROR )
+                CRLog::error("ldomDocCache::compact - error while compacting %s", LCSTR(_compactFileName));
+            closeCompactedFile( false );
+            if ( maxTime.expired() )
+                return CR_TIMEOUT;
+        }
+    }
+#endif
+
     /// remove all files
     bool clear()
     {
+#if BUILD_LITE!=1
+        closeCompactedFile( false );
+#endif
         for ( int i=0; i<_files.length(); i++ )
-            LVDeleteFile( _files[i]->filename );
+            LVDeleteFile( _cacheDir + _files[i]->filename );
         _files.clear();
+        _fileMap.clear();
+        clearStyleSheets();
+        if ( LVFileExists( _cacheDir + "cr3css.dat" ) )
+            LVDeleteFile( _cacheDir + "cr3css.dat" );
         return writeIndex();
     }
 
+    /// returns crc32 of stream, looked up by stream fingerprint to avoid reading of whole stream
+    lUInt32 getStreamCRC32( LVStreamRef stream )
+    {
+        lUInt64 fingerprint = 0;
+        if ( stream->getFingerprint( fingerprint )!=LVERR_OK )
+            return stream->getcrc32();
+        for ( int i=0; i<_fingerprints.length(); i++ ) {
+            if ( _fingerprints[i]->fingerprint==fingerprint ) {
+                _fingerprints.move( 0, i );
+                return _fingerprints[0]->crc;
+            }
+        }
+        // first time this stream is seen
+        lUInt32 crc = stream->getcrc32();
+        if ( !crc )
+            return crc;
+        writeJournal( addFingerprint( fingerprint, crc ) );
+        return crc;
+    }
+
+    /// adds fingerprint as most recently used one, or updates crc32 of existing one
+    FingerprintItem * addFingerprint( lUInt64 fingerprint, lUInt32 crc )
+    {
+        for ( int i=0; i<_fingerprints.length(); i++ ) {
+            if ( _fingerprints[i]->fingerprint==fingerprint ) {
+                _fingerprints.move( 0, i );
+                _fingerprints[0]->crc = crc;
+                return _fingerprints[0];
+            }
+        }
+        FingerprintItem * item = new FingerprintItem();
+        item->fingerprint = fingerprint;
+        item->crc = crc;
+        _fingerprints.insert( 0, item );
+        if ( _fingerprints.length() > DOC_CACHE_MAX_FINGERPRINTS )
+            _fingerprints.erase( DOC_CACHE_MAX_FINGERPRINTS, _fingerprints.length() - DOC_CACHE_MAX_FINGERPRINTS );
+        return item;
+    }
+
     // dir/filename.{crc32}.cr3
     lString16 makeFileName( lString16 filename, lUInt32 crc, lUInt32 docFlags )
     {
@@ -9019,14 +12123,20 @@ public:
     {
         lString16 fn = makeFileName( filename, crc, docFlags );
         CRLog::debug("ldomDocCache::openExisting(%s)", LCSTR(fn));
+#if BUILD_LITE!=1
+        if ( _compactFile && _compactFileName==fn )
+            closeCompactedFile( true );
+#endif
         LVStreamRef res;
-        if ( findFileIndex( fn ) < 0 ) {
+        if ( !findFile( fn ) ) {
             CRLog::error( "ldomDocCache::openExisting - File %s is not found in cache index", UnicodeToUtf8(fn).c_str() );
+            _stats.misses++;
             return res;
         }
         res = LVOpenFileStream( (_cacheDir+fn).c_str(), LVOM_APPEND|LVOM_FLAG_SYNC );
         if ( !res ) {
             CRLog::error( "ldomDocCache::openExisting - File %s is listed in cache index, but cannot be opened", UnicodeToUtf8(fn).c_str() );
+            _stats.misses++;
             return res;
         }
 
@@ -9044,7 +12154,9 @@ public:
 #endif
 
         lUInt32 fileSize = (lUInt32) res->GetSize();
-        moveFileToTop( fn, fileSize );
+        _stats.hits++;
+        _stats.bytesSaved += fileSize;
+        touchFile( fn, fileSize, true );
         return res;
     }
 
@@ -9052,9 +12164,13 @@ public:
     LVStreamRef createNew( lString16 filename, lUInt32 crc, lUInt32 docFlags, lUInt32 fileSize )
     {
         lString16 fn = makeFileName( filename, crc, docFlags );
+#if BUILD_LITE!=1
+        if ( _compactFile && _compactFileName==fn )
+            closeCompactedFile( false );
+#endif
         LVStreamRef res;
         lString16 pathname( _cacheDir+fn );
-        if ( findFileIndex( pathname ) >= 0 )
+        if ( findFile( fn ) )
             LVDeleteFile( pathname );
         reserve( fileSize/10 );
         //res = LVMapFileStream( (_cacheDir+fn).c_str(), LVOM_APPEND, fileSize );
@@ -9075,12 +12191,37 @@ public:
         res = LVCreateCompareTestStream(res, stream2);
 #endif
 #endif
-        moveFileToTop( fn, fileSize );
-        return res;
+        touchFile( fn, fileSize, false );
+        return res;
+    }
+
+    /// delete cache file, e.g. found to be corrupted
+    bool remove( lString16 filename, lUInt32 crc, lUInt32 docFlags )
+    {
+        lString16 fn = makeFileName( filename, crc, docFlags );
+#if BUILD_LITE!=1
+        if ( _compactFile && _compactFileName==fn )
+            closeCompactedFile( false );
+#endif
+        if ( !findFile( fn ) )
+            return false;
+        CRLog::info("Removing cache file %s", LCSTR(fn));
+        if ( !LVDeleteFile( _cacheDir + fn ) )
+            CRLog::error("Cannot delete cache file %s", LCSTR(fn));
+        removeFileItem( fn );
+        FileItem record;
+        record.filename = fn;
+        return writeJournal( DOC_CACHE_JOURNAL_REMOVE, &record );
     }
 
     virtual ~ldomDocCacheImpl()
     {
+#if BUILD_LITE!=1
+        closeCompactedFile( true );
+#endif
+        if ( _journalRecords )
+            writeIndex();
+        clearStyleSheets();
     }
 };
 
@@ -9125,6 +12266,14 @@ LVStreamRef ldomDocCache::createNew( lString16 filename, lUInt32 crc, lUInt32 do
     return _cacheInstance->createNew( filename, crc, docFlags, fileSize );
 }
 
+/// delete cache file, e.g. found to be corrupted
+bool ldomDocCache::remove( lString16 filename, lUInt32 crc, lUInt32 docFlags )
+{
+    if ( !_cacheInstance )
+        return false;
+    return _cacheInstance->remove( filename, crc, docFlags );
+}
+
 /// delete all cache files
 bool ldomDocCache::clear()
 {
@@ -9139,6 +12288,58 @@ bool ldomDocCache::enabled()
     return _cacheInstance!=NULL;
 }
 
+/// returns crc32 of stream, looked up by stream fingerprint to avoid reading of whole stream
+lUInt32 ldomDocCache::getStreamCRC32( LVStreamRef stream )
+{
+    if ( stream.isNull() )
+        return 0;
+    if ( !_cacheInstance )
+        return stream->getcrc32();
+    return _cacheInstance->getStreamCRC32( stream );
+}
+
+/// returns cache usage statistics for current session, false if cache is disabled
+bool ldomDocCache::getStats( ldomDocCacheStats & stats )
+{
+    memset( &stats, 0, sizeof(stats) );
+    if ( !_cacheInstance )
+        return false;
+    _cacheInstance->getStats( stats );
+    return true;
+}
+
+/// resets hit, miss and eviction counters
+void ldomDocCache::resetStats()
+{
+    if ( _cacheInstance )
+        _cacheInstance->resetStats();
+}
+
+/// returns compiled stylesheet saved by any document for CSS text key, false if not found
+bool ldomDocCache::getCompiledStyleSheet( lUInt64 key, LVArray<lUInt8> & data )
+{
+    if ( !_cacheInstance )
+        return false;
+    return _cacheInstance->getCompiledStyleSheet( key, data );
+}
+
+/// saves compiled stylesheet for CSS text key, to be reused by documents with the same CSS
+void ldomDocCache::putCompiledStyleSheet( lUInt64 key, const lUInt8 * data, int size )
+{
+    if ( _cacheInstance )
+        _cacheInstance->putCompiledStyleSheet( key, data, size );
+}
+
+/// compacts fragmented cache files not used by open documents, limited by time interval
+ContinuousOperationResult ldomDocCache::compact( CRTimerUtil & maxTime )
+{
+#if BUILD_LITE!=1
+    if ( _cacheInstance )
+        return _cacheInstance->compact( maxTime );
+#endif
+    return CR_DONE;
+}
+
 //void calcStyleHash( ldomNode * node, lUInt32 & value )
 //{
 //    if ( !node )
@@ -9394,6 +12595,7 @@ void ldomNode::destroy()
             ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
             for ( int i=0; i<me->childCount; i++ )
                 getDocument()->getTinyNode( me->children[i] )->destroy();
+            getDocument()->_topology.clearElem( _handle._dataIndex );
             getDocument()->clearNodeStyle( _handle._dataIndex );
 //            getDocument()->_styles.release( _data._pelem._styleIndex );
 //            getDocument()->_fonts.release( _data._pelem._fontIndex );
@@ -9429,9 +12631,10 @@ int ldomNode::getChildIndex( lUInt32 dataIndex ) const
 #if BUILD_LITE!=1
     case NT_PELEMENT:
         {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            for ( int i=0; i<me->childCount; i++ ) {
-                if ( (me->children[i] & 0xFFFFFFF0) == dataIndex ) {
+            int childCount = getDocument()->_topology.getElemChildCount( _handle._dataIndex );
+            const lUInt32 * children = getDocument()->_topology.getElemChildren( _handle._dataIndex );
+            for ( int i=0; i<childCount; i++ ) {
+                if ( (children[i] & 0xFFFFFFF0) == dataIndex ) {
                     // found
                     parentIndex = i;
                     break;
@@ -9466,15 +12669,9 @@ bool ldomNode::isRoot() const
         return !NPELEM->_parentNode;
 #if BUILD_LITE!=1
     case NT_PELEMENT:   // immutable (persistent) element node
-        {
-             ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-             return me->parentIndex==0;
-        }
-        break;
+        return getDocument()->_topology.getElemParent( _handle._dataIndex )==0;
     case NT_PTEXT:      // immutable (persistent) text node
-        {
-            return getDocument()->_textStorage.getParent( _data._ptext_addr )==0;
-        }
+        return getDocument()->_topology.getTextParent( _handle._dataIndex )==0;
 #endif
     case NT_TEXT:
         return _data._text_ptr->getParentIndex()==0;
@@ -9516,12 +12713,14 @@ void ldomNode::setParentNode( ldomNode * parent )
                 me->parentIndex = parentIndex;
                 modified();
             }
+            getDocument()->_topology.setElemParent( _handle._dataIndex, parentIndex );
         }
         break;
     case NT_PTEXT:      // immutable (persistent) text node
         {
             lUInt32 parentIndex = parent->_handle._dataIndex;
             getDocument()->_textStorage.setParent(_data._ptext_addr, parentIndex);
+            getDocument()->_topology.setTextParent( _handle._dataIndex, parentIndex );
             //_data._ptext_addr._parentIndex = parentIndex;
             //_document->_textStorage.setTextParent( _data._ptext_addr._addr, parentIndex );
         }
@@ -9546,13 +12745,9 @@ int ldomNode::getParentIndex() const
         return NPELEM->_parentNode ? NPELEM->_parentNode->getDataIndex() : 0;
 #if BUILD_LITE!=1
     case NT_PELEMENT:   // immutable (persistent) element node
-        {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            return me->parentIndex;
-        }
-        break;
+        return getDocument()->_topology.getElemParent( _handle._dataIndex );
     case NT_PTEXT:      // immutable (persistent) text node
-        return getDocument()->_textStorage.getParent(_data._ptext_addr);
+        return getDocument()->_topology.getTextParent( _handle._dataIndex );
 #endif
     case NT_TEXT:
         return _data._text_ptr->getParentIndex();
@@ -9570,13 +12765,10 @@ ldomNode * ldomNode::getParentNode() const
         return NPELEM->_parentNode;
 #if BUILD_LITE!=1
     case NT_PELEMENT:   // immutable (persistent) element node
-        {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            parentIndex = me->parentIndex;
-        }
+        parentIndex = getDocument()->_topology.getElemParent( _handle._dataIndex );
         break;
     case NT_PTEXT:      // immutable (persistent) text node
-        parentIndex = getDocument()->_textStorage.getParent(_data._ptext_addr);
+        parentIndex = getDocument()->_topology.getTextParent( _handle._dataIndex );
         break;
 #endif
     case NT_TEXT:
@@ -9600,8 +12792,7 @@ bool ldomNode::isChildNodeElement( lUInt32 index ) const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        int n = me->children[index];
+        int n = getDocument()->_topology.getElemChildren( _handle._dataIndex )[index];
         return ( (n & 1)==1 );
     }
 #endif
@@ -9621,8 +12812,7 @@ bool ldomNode::isChildNodeText( lUInt32 index ) const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        int n = me->children[index];
+        int n = getDocument()->_topology.getElemChildren( _handle._dataIndex )[index];
         return ( (n & 1)==0 );
     }
 #endif
@@ -9652,8 +12842,7 @@ ldomNode * ldomNode::getChildElementNode( lUInt32 index, lUInt16 nodeId ) const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        int n = me->children[index];
+        int n = getDocument()->_topology.getElemChildren( _handle._dataIndex )[index];
         if ( (n & 1)==0 ) // not element
             return NULL;
         res = getTinyNode( n );
@@ -9677,8 +12866,7 @@ ldomNode * ldomNode::getChildNode( lUInt32 index ) const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        return getTinyNode( me->children[index] );
+        return getTinyNode( getDocument()->_topology.getElemChildren( _handle._dataIndex )[index] );
     }
 #endif
 }
@@ -9698,14 +12886,7 @@ int ldomNode::getChildCount() const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        // persistent element
-        {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-//            if ( me==NULL ) { // DEBUG
-//                me = _document->_elemStorage.getElem( _data._pelem_addr );
-//            }
-            return me->childCount;
-        }
+        return getDocument()->_topology.getElemChildCount( _handle._dataIndex );
     }
 #endif
 }
@@ -9744,7 +12925,7 @@ const lString16 & ldomNode::getAttributeValue( lUInt16 nsid, lUInt16 id ) const
 #endif
         // element
         tinyElement * me = NPELEM;
-        lUInt16 valueId = me->_attrs.get( nsid, id );
+        lUInt32 valueId = me->_attrs.get( nsid, id );
         if ( valueId==LXML_ATTR_VALUE_NONE )
             return lString16::empty_str;
         return getDocument()->getAttrValue(valueId);
@@ -9752,7 +12933,7 @@ const lString16 & ldomNode::getAttributeValue( lUInt16 nsid, lUInt16 id ) const
     } else {
         // persistent element
         ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        lUInt16 valueId = me->getAttrValueId( nsid, id );
+        lUInt32 valueId = me->getAttrValueId( nsid, id );
         if ( valueId==LXML_ATTR_VALUE_NONE )
             return lString16::empty_str;
         return getDocument()->getAttrValue(valueId);
@@ -9760,6 +12941,27 @@ const lString16 & ldomNode::getAttributeValue( lUInt16 nsid, lUInt16 id ) const
 #endif
 }
 
+/// returns attribute value index by attribute name id and namespace id, LXML_ATTR_VALUE_NONE if not set
+lUInt32 ldomNode::getAttributeValueIndex( lUInt16 nsid, lUInt16 id ) const
+{
+    ASSERT_NODE_NOT_NULL;
+    if ( !isElement() )
+        return LXML_ATTR_VALUE_NONE;
+#if BUILD_LITE!=1
+    if ( !isPersistent() ) {
+#endif
+        // element
+        tinyElement * me = NPELEM;
+        return me->_attrs.get( nsid, id );
+#if BUILD_LITE!=1
+    } else {
+        // persistent element
+        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
+        return me->getAttrValueId( nsid, id );
+    }
+#endif
+}
+
 /// returns attribute value by attribute name and namespace
 const lString16 & ldomNode::getAttributeValue( const lChar16 * nsName, const lChar16 * attrName ) const
 {
@@ -9810,7 +13012,7 @@ bool ldomNode::hasAttribute( lUInt16 nsid, lUInt16 id ) const
 #endif
         // element
         tinyElement * me = NPELEM;
-        lUInt16 valueId = me->_attrs.get( nsid, id );
+        lUInt32 valueId = me->_attrs.get( nsid, id );
         return ( valueId!=LXML_ATTR_VALUE_NONE );
 #if BUILD_LITE!=1
     } else {
@@ -9837,7 +13039,7 @@ void ldomNode::setAttributeValue( lUInt16 nsid, lUInt16 id, const lChar16 * valu
     ASSERT_NODE_NOT_NULL;
     if ( !isElement() )
         return;
-    lUInt16 valueIndex = getDocument()->getAttrValueIndex(value);
+    lUInt32 valueIndex = getDocument()->getAttrValueIndex(value);
 #if BUILD_LITE!=1
     if ( isPersistent() ) {
         // persistent element
@@ -9901,8 +13103,7 @@ lUInt16 ldomNode::getNodeId() const
 #if BUILD_LITE!=1
     } else {
         // persistent element
-        ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-        return me->id;
+        return getDocument()->_topology.getElemId( _handle._dataIndex );
     }
 #endif
 }
@@ -9944,6 +13145,7 @@ void ldomNode::setNodeId( lUInt16 id )
         ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
         me->id = id;
         modified();
+        getDocument()->_topology.setElemId( _handle._dataIndex, id );
     }
 #endif
 }
@@ -10044,7 +13246,14 @@ lString16 ldomNode::getText( lChar16 blockDelimiter, int maxSize ) const
         break;
 #if BUILD_LITE!=1
     case NT_PTEXT:
-        return Utf8ToUnicode(getDocument()->_textStorage.getText( _data._ptext_addr ));
+        {
+            lString16 txt;
+            if ( !getDocument()->_textCache->get( _handle._dataIndex, txt ) ) {
+                txt = ldomTextView( this ).getText16();
+                getDocument()->_textCache->put( _handle._dataIndex, txt );
+            }
+            return txt;
+        }
 #endif
     case NT_TEXT:
         return _data._text_ptr->getText16();
@@ -10087,6 +13296,37 @@ lString8 ldomNode::getText8( lChar8 blockDelimiter, int maxSize ) const
     return lString8::empty_str;
 }
 
+ldomTextView::ldomTextView( const ldomNode * node )
+: _node(NULL), _addr(0), _text(""), _length(0)
+{
+    if ( !node || node->isNull() )
+        return;
+    switch ( node->_handle._dataIndex & 0x0F ) {
+#if BUILD_LITE!=1
+    case ldomNode::NT_PTEXT:
+        _node = node;
+        _addr = node->_data._ptext_addr;
+        _text = node->getDocument()->_textStorage.pinText( _addr, _length );
+        break;
+#endif
+    case ldomNode::NT_TEXT:
+        {
+            const lString8 & txt = node->_data._text_ptr->getTextRef();
+            _text = txt.c_str();
+            _length = txt.length();
+        }
+        break;
+    }
+}
+
+ldomTextView::~ldomTextView()
+{
+#if BUILD_LITE!=1
+    if ( _node )
+        _node->getDocument()->_textStorage.unpinText( _addr );
+#endif
+}
+
 /// sets text node text as wide string
 void ldomNode::setText( lString16 str )
 {
@@ -10102,6 +13342,7 @@ void ldomNode::setText( lString16 str )
     case NT_PTEXT:
         {
             // convert persistent text to mutable
+            getDocument()->_textCache->remove( _handle._dataIndex );
             lUInt32 parentIndex = getDocument()->_textStorage.getParent(_data._ptext_addr);
             getDocument()->_textStorage.freeNode( _data._ptext_addr );
             _data._text_ptr = new ldomTextNode( parentIndex, UnicodeToUtf8(str) );
@@ -10133,6 +13374,7 @@ void ldomNode::setText8( lString8 utf8 )
     case NT_PTEXT:
         {
             // convert persistent text to mutable
+            getDocument()->_textCache->remove( _handle._dataIndex );
             lUInt32 parentIndex = getDocument()->_textStorage.getParent(_data._ptext_addr);
             getDocument()->_textStorage.freeNode( _data._ptext_addr );
             _data._text_ptr = new ldomTextNode( parentIndex, utf8 );
@@ -10202,22 +13444,198 @@ void ldomNode::clearRenderData()
 }
 #endif
 
-/// calls specified function recursively for all elements of DOM tree, children before parent
+ldomNodeCursor::ldomNodeCursor( ldomNode * root, int flags, lUInt16 nodeId )
+: _document( root->getDocument() ), _rootIndex( root->getDataIndex() ), _current( 0 )
+, _nodeId( nodeId ), _flags( (lUInt8)flags ), _started( false ), _leaving( false )
+{
+}
+
+ldomNodeCursor::ldomNodeCursor( ldomNode * parent, int startChild, int endChild, int flags, lUInt16 nodeId )
+: _document( parent->getDocument() ), _rootIndex( 0 ), _current( 0 )
+, _nodeId( nodeId ), _flags( (lUInt8)flags ), _started( true ), _leaving( false )
+{
+    push( parent->getDataIndex(), startChild, endChild );
+}
+
+ldomNodeCursor::ldomNodeCursor( ldomDocument * document )
+: _document( document ), _rootIndex( 0 ), _current( 0 )
+, _nodeId( 0 ), _flags( LDOM_CURSOR_ALL_NODES ), _started( true ), _leaving( false )
+{
+}
+
+inline void ldomNodeCursor::push( lUInt32 dataIndex, int nextChild, int endChild )
+{
+    Frame f;
+    f.dataIndex = dataIndex;
+    f.nextChild = nextChild;
+    f.endChild = endChild;
+    _stack.add( f );
+}
+
+inline bool ldomNodeCursor::matches( lUInt32 dataIndex, bool isElement )
+{
+    if ( !isElement )
+        return (_flags & LDOM_CURSOR_TEXT) && !_nodeId;
+    if ( !(_flags & LDOM_CURSOR_ELEMENTS) )
+        return false;
+    return !_nodeId || _document->getTinyNode( dataIndex )->getNodeId()==_nodeId;
+}
+
+/// moves to next node, returns false if walk is finished
+bool ldomNodeCursor::next()
+{
+    _leaving = false;
+    if ( !_started ) {
+        _started = true;
+        ldomNode * root = _document->getTinyNode( _rootIndex );
+        bool isElement = root->isElement();
+        if ( isElement )
+            push( _rootIndex, 0, -1 );
+        if ( (!isElement || (_flags & LDOM_CURSOR_ENTER)) && matches( _rootIndex, isElement ) ) {
+            _current = _rootIndex;
+            return true;
+        }
+    }
+    while ( _stack.length() ) {
+        Frame & f = _stack[_stack.length()-1];
+        ldomNode * node = _document->getTinyNode( f.dataIndex );
+        if ( f.endChild<0 )
+            f.endChild = node->getChildCount();
+        if ( f.nextChild < f.endChild ) {
+            ldomNode * child = node->getChildNode( f.nextChild++ );
+            lUInt32 childIndex = child->getDataIndex();
+            if ( child->isElement() ) {
+                push( childIndex, 0, -1 );
+                if ( (_flags & LDOM_CURSOR_ENTER) && matches( childIndex, true ) ) {
+                    _current = childIndex;
+                    return true;
+                }
+            } else if ( matches( childIndex, false ) ) {
+                _current = childIndex;
+                return true;
+            }
+        } else {
+            lUInt32 index = f.dataIndex;
+            _stack.erase( _stack.length()-1, 1 );
+            // bottom element of children range cursor is not reported
+            if ( (_flags & LDOM_CURSOR_LEAVE) && (_rootIndex || _stack.length()) && matches( index, true ) ) {
+                _current = index;
+                _leaving = true;
+                return true;
+            }
+        }
+    }
+    _current = 0;
+    return false;
+}
+
+/// returns current node
+ldomNode * ldomNodeCursor::getNode() const
+{
+    return _current ? _document->getTinyNode( _current ) : NULL;
+}
+
+/// returns level of current node relative to cursor root (0 for root)
+int ldomNodeCursor::getLevel() const
+{
+    int level = _stack.length();
+    if ( _stack.length() && !_leaving && _stack[_stack.length()-1].dataIndex==_current )
+        level--; // entered element is on top of stack
+    return level;
+}
+
+/// don't visit children of current element (when reported on enter)
+void ldomNodeCursor::skipChildren()
+{
+    if ( _current && !_leaving && _stack.length() && _stack[_stack.length()-1].dataIndex==_current )
+        _stack[_stack.length()-1].endChild = 0;
+}
+
+/// moves second half of unvisited subtrees of the shallowest possible level to new cursor, returns NULL if there is nothing to split
+ldomNodeCursor * ldomNodeCursor::split()
+{
+    if ( !_started )
+        return NULL;
+    for ( int i=0; i<_stack.length(); i++ ) {
+        Frame & f = _stack[i];
+        if ( f.endChild<0 )
+            f.endChild = _document->getTinyNode( f.dataIndex )->getChildCount();
+        int remaining = f.endChild - f.nextChild;
+        if ( remaining<2 )
+            continue;
+        int middle = f.nextChild + remaining / 2;
+        ldomNodeCursor * res = new ldomNodeCursor( _document->getTinyNode( f.dataIndex ), middle, f.endChild, _flags, _nodeId );
+        f.endChild = middle;
+        return res;
+    }
+    return NULL;
+}
+
+/// splits remaining walk into up to maxParts cursors with disjoint subtrees: this cursor and new cursors added to parts
+void ldomNodeCursor::split( int maxParts, LVPtrVector<ldomNodeCursor> & parts )
+{
+    // split cursors in round robin order, to get parts of similar size
+    LVArray<ldomNodeCursor*> all;
+    all.add( this );
+    int failed = 0;
+    for ( int i=0; all.length()<maxParts && failed<all.length(); i = (i+1) % all.length() ) {
+        ldomNodeCursor * part = all[i]->split();
+        if ( !part ) {
+            failed++;
+            continue;
+        }
+        failed = 0;
+        all.add( part );
+        parts.add( part );
+    }
+}
+
+/// saves cursor state
+void ldomNodeCursor::serialize( SerialBuf & buf )
+{
+    buf << _rootIndex << _current << _nodeId << _flags << _started << _leaving;
+    buf << (lUInt32)_stack.length();
+    for ( int i=0; i<_stack.length(); i++ )
+        buf << _stack[i].dataIndex << (lInt32)_stack[i].nextChild << (lInt32)_stack[i].endChild;
+}
+
+/// restores cursor state saved by serialize()
+bool ldomNodeCursor::deserialize( SerialBuf & buf )
+{
+    lUInt32 count;
+    buf >> _rootIndex >> _current >> _nodeId >> _flags >> _started >> _leaving;
+    buf >> count;
+    _stack.clear();
+    for ( lUInt32 i=0; i<count && !buf.error(); i++ ) {
+        Frame f;
+        lInt32 nextChild, endChild;
+        buf >> f.dataIndex >> nextChild >> endChild;
+        f.nextChild = nextChild;
+        f.endChild = endChild;
+        if ( !(f.dataIndex & 1) || !_document->getTinyNode( f.dataIndex ) ) {
+            buf.seterror();
+            break;
+        }
+        _stack.add( f );
+    }
+    if ( buf.error() ) {
+        _stack.clear();
+        _current = 0;
+        _started = true;
+        return false;
+    }
+    return true;
+}
+
+/// calls specified function for all elements of DOM tree, children before parent
 void ldomNode::recurseElementsDeepFirst( void (*pFun)( ldomNode * node ) )
 {
     ASSERT_NODE_NOT_NULL;
     if ( !isElement() )
         return;
-    int cnt = getChildCount();
-    for (int i=0; i<cnt; i++)
-    {
-        ldomNode * child = getChildNode( i );
-        if ( child->isElement() )
-        {
-            child->recurseElementsDeepFirst( pFun );
-        }
-    }
-    pFun( this );
+    ldomNodeCursor cursor( this, LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_LEAVE );
+    while ( cursor.next() )
+        pFun( cursor.getNode() );
 }
 
 #if BUILD_LITE!=1
@@ -10243,65 +13661,277 @@ static void updateStyleData( ldomNode * node )
 #endif
 
 #if BUILD_LITE!=1
-static void updateStyleDataRecursive( ldomNode * node )
+/// init styles of the whole subtree, applying stylesheets of DocFragment elements to their subtrees
+static void updateStyleDataRecursive( ldomNode * root )
+{
+    LVArray<lUInt32> stylesheetOwners; // elements which pushed stylesheet
+    ldomNodeCursor cursor( root, LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER | LDOM_CURSOR_LEAVE );
+    while ( cursor.next() ) {
+        ldomNode * node = cursor.getNode();
+        if ( cursor.isLeaving() ) {
+            if ( stylesheetOwners.length() && stylesheetOwners[stylesheetOwners.length()-1]==cursor.getDataIndex() ) {
+                stylesheetOwners.erase( stylesheetOwners.length()-1, 1 );
+                node->getDocument()->getStyleSheet()->pop();
+            }
+            continue;
+        }
+        if ( node->getNodeId()==el_DocFragment && node->applyNodeStylesheet() )
+            stylesheetOwners.add( cursor.getDataIndex() );
+        node->initNodeStyle();
+    }
+}
+
+/// subtree to be styled by worker thread
+struct ldomStyleInitTask {
+    lUInt32 rootIndex;           // subtree root, its parent is styled by main thread
+    LVStyleSheet * stylesheet;   // copy of document stylesheet with rules applied to subtree
+    css_style_ref_t parentStyle; // private copy of style of root's parent
+    ldomStyleInitTask( lUInt32 root, LVStyleSheet & sheet, const css_style_ref_t & parent )
+    : rootIndex(root), stylesheet( new LVStyleSheet( sheet ) )
+    {
+        // font name string is not shared with document style, which is used by main thread
+        css_style_rec_t * style = new css_style_rec_t( *parent.get() );
+        style->refCount = 0;
+        style->font_name = lString8( parent->font_name.c_str() );
+        parentStyle = style;
+    }
+    ~ldomStyleInitTask() { delete stylesheet; }
+};
+
+/// queue of subtrees to be styled, shared by worker threads
+class ldomStyleInitQueue
 {
-    if ( !node->isElement() )
-        return;
-    bool styleSheetChanged = false;
-    if ( node->getNodeId()==el_DocFragment )
-        styleSheetChanged = node->applyNodeStylesheet();
-    node->initNodeStyle();
-    int n = node->getChildCount();
-    for ( int i=0; i<n; i++ ) {
-        ldomNode * child = node->getChildNode(i);
-        if ( child->isElement() )
-            updateStyleDataRecursive( child );
+    LVPtrVector<ldomStyleInitTask> & _tasks;
+    CRMutexRef _mutex;
+    int _next;
+public:
+    ldomStyleInitQueue( LVPtrVector<ldomStyleInitTask> & tasks, bool threaded )
+    : _tasks(tasks), _next(0)
+    {
+        if ( threaded )
+            _mutex = concurrencyProvider->createMutex();
+    }
+    /// returns next subtree to style, NULL if there are no more subtrees
+    ldomStyleInitTask * next()
+    {
+        CRGuard guard(_mutex);
+        CR_UNUSED(guard);
+        return _next < _tasks.length() ? _tasks[_next++] : NULL;
+    }
+};
+
+/// calculates styles of subtrees taken from queue, without access to style and font caches of document
+/**
+    Calculated styles are deduplicated by worker, and are put to document caches by main thread after all workers finish.
+*/
+class ldomStyleInitWorker : public CRRunnable
+{
+    ldomDocument * _document;
+    ldomStyleInitQueue * _queue;
+    int _baseFontSize;
+    bool _internalStyles;
+
+    /// styles elements of subtree, returns false if subtree should be styled by main thread
+    bool styleSubtree( ldomStyleInitTask * task )
+    {
+        LVArray<int> path;                // styles of entered elements
+        LVArray<ldomNode *> lastChild;    // last child of entered element with calculated style
+        LVArray<int> lastChildStyle;
+        ldomNodeCursor cursor( _document->getTinyNode( task->rootIndex ), LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER | LDOM_CURSOR_LEAVE );
+        while ( cursor.next() ) {
+            int level = path.length();
+            if ( cursor.isLeaving() ) {
+                path.erase( level-1, 1 );
+                lastChild.erase( level-1, 1 );
+                lastChildStyle.erase( level-1, 1 );
+                continue;
+            }
+            ldomNode * node = cursor.getNode();
+            if ( node->getNodeId()==el_DocFragment )
+                return false; // fragment stylesheet is applied by main thread
+            int index = 0;
+            // reuse style of sibling with the same matching rules and attributes
+            ldomNode * sibling = level ? lastChild[level-1] : NULL;
+            if ( sibling && ( !_internalStyles || node->getAttributeValueIndex( attr_style )==sibling->getAttributeValueIndex( attr_style ) )
+                    && task->stylesheet->canShareStyle( node, sibling ) )
+                index = lastChildStyle[level-1];
+            if ( !index ) {
+                css_style_ref_t style( new css_style_rec_t );
+                calcNodeStyle( node, task->stylesheet, level ? styles.get( path[level-1] ) : task->parentStyle, _baseFontSize, style.get() );
+                index = styles.cache( style );
+                if ( level ) {
+                    lastChild[level-1] = node;
+                    lastChildStyle[level-1] = index;
+                }
+            }
+            nodes.add( cursor.getDataIndex() );
+            nodeStyles.add( index );
+            if ( maxStyle < index )
+                maxStyle = index;
+            path.add( index );
+            lastChild.add( NULL );
+            lastChildStyle.add( 0 );
+        }
+        return true;
+    }
+public:
+    LVIndexedRefCache<css_style_ref_t> styles; // distinct calculated styles
+    LVArray<lUInt32> nodes;    // styled elements
+    LVArray<int> nodeStyles;   // index in styles for each of nodes
+    int maxStyle;              // max index in styles
+    bool failed;               // found subtree which should be styled by main thread
+
+    ldomStyleInitWorker( ldomDocument * document, ldomStyleInitQueue * queue, int baseFontSize )
+    : _document(document), _queue(queue), _baseFontSize(baseFontSize)
+    , _internalStyles( document->getDocFlag( DOC_FLAG_ENABLE_INTERNAL_STYLES ) )
+    , styles(STYLE_HASH_TABLE_SIZE), maxStyle(0), failed(false)
+    {
+    }
+    virtual void run()
+    {
+        ldomStyleInitTask * task;
+        while ( !failed && (task = _queue->next())!=NULL )
+            failed = !styleSubtree( task );
+    }
+};
+
+/// init styles of subtree: elements of lower levels are styled by main thread, deeper subtrees by several threads
+bool ldomDocument::initNodeStylesInThreads( ldomNode * root )
+{
+    int threadCount = concurrencyProvider ? _styleInitThreads : 1;
+    if ( threadCount<2 || !isDefStyleSet() || _def_font.isNull() )
+        return false;
+    // style elements of lower levels, collect subtrees of split level
+    LVPtrVector<ldomStyleInitTask> tasks;
+    LVArray<lUInt32> stylesheetOwners; // elements which pushed stylesheet
+    ldomNodeCursor cursor( root, LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER | LDOM_CURSOR_LEAVE );
+    while ( cursor.next() ) {
+        ldomNode * node = cursor.getNode();
+        if ( cursor.isLeaving() ) {
+            if ( stylesheetOwners.length() && stylesheetOwners[stylesheetOwners.length()-1]==cursor.getDataIndex() ) {
+                stylesheetOwners.erase( stylesheetOwners.length()-1, 1 );
+                _stylesheet.pop();
+            }
+            continue;
+        }
+        if ( node->getNodeId()==el_DocFragment ) {
+            if ( node->applyNodeStylesheet() )
+                stylesheetOwners.add( cursor.getDataIndex() );
+        } else if ( cursor.getLevel()>=_styleInitSplitLevel ) {
+            ldomNode * parent = node->getParentNode();
+            tasks.add( new ldomStyleInitTask( cursor.getDataIndex(), _stylesheet,
+                                              parent->isRoot() ? _def_style : parent->getStyle() ) );
+            cursor.skipChildren();
+            continue;
+        }
+        node->initNodeStyle();
+    }
+    if ( threadCount>tasks.length() )
+        threadCount = tasks.length();
+    if ( threadCount<1 )
+        return true;
+
+    // make data read by workers immutable
+    resolveCssNameIds();
+    for ( int i=0; i<tasks.length(); i++ )
+        tasks[i]->stylesheet->prepareMatching( threadCount>1 );
+    _elemStorage.pinAll();
+    // strings are shared by workers: reference counters and string pool are made thread safe
+    CRMutexRef stringsMutex( threadCount>1 ? concurrencyProvider->createMutex() : NULL );
+    if ( threadCount>1 )
+        enable_ls_storage_threading( stringsMutex.get() );
+
+    ldomStyleInitQueue queue( tasks, threadCount>1 );
+    LVPtrVector<ldomStyleInitWorker> workers;
+    LVPtrVector<CRThread> threads;
+    for ( int i=0; i<threadCount; i++ )
+        workers.add( new ldomStyleInitWorker( this, &queue, _def_font->getSize() ) );
+    for ( int i=1; i<threadCount; i++ ) {
+        CRThread * thread = concurrencyProvider->createThread( workers[i] );
+        threads.add( thread );
+        thread->start();
+    }
+    // current thread styles subtrees as well
+    workers[0]->run();
+    for ( int i=0; i<threads.length(); i++ )
+        threads[i]->join();
+
+    if ( threadCount>1 )
+        enable_ls_storage_threading( NULL );
+    _elemStorage.unpinAll();
+    for ( int i=0; i<tasks.length(); i++ )
+        tasks[i]->stylesheet->prepareMatching( false );
+    for ( int i=0; i<workers.length(); i++ )
+        if ( workers[i]->failed )
+            return false;
+
+    // merge: each distinct style is cached once, then style and font indexes are set for elements
+    for ( int i=0; i<workers.length(); i++ ) {
+        ldomStyleInitWorker * worker = workers[i];
+        LVArray<lUInt16> styleIndex( worker->maxStyle + 1, 0 );
+        LVArray<lUInt16> fontIndex( worker->maxStyle + 1, 0 );
+        for ( int j=1; j<=worker->maxStyle; j++ ) {
+            css_style_ref_t style = worker->styles.get( j );
+            if ( style.isNull() )
+                continue;
+            lUInt16 s = (lUInt16)_styles.cache( style );
+            lUInt16 f = _fontMap.get( s );
+            if ( f ) {
+                _fonts.addIndexRef( f );
+            } else {
+                LVFontRef font = ::getFont( style.get(), getFontContextDocIndex() );
+                if ( !font.isNull() ) {
+                    f = (lUInt16)_fonts.cache( font );
+                    _fontMap.set( s, f );
+                } else {
+                    CRLog::error("font not found for style!");
+                }
+            }
+            styleIndex[j] = s;
+            fontIndex[j] = f;
+        }
+        for ( int j=0; j<worker->nodes.length(); j++ ) {
+            int k = worker->nodeStyles[j];
+            setNodeStyleInfo( worker->nodes[j], styleIndex[k], fontIndex[k] );
+        }
+        // references of elements are kept only
+        for ( int j=1; j<=worker->maxStyle; j++ ) {
+            _styles.release( styleIndex[j] );
+            _fonts.release( fontIndex[j] );
+        }
     }
-    if ( styleSheetChanged )
-        node->getDocument()->getStyleSheet()->pop();
+    return true;
 }
 
 /// init render method for the whole subtree
 void ldomNode::initNodeStyleRecursive()
 {
     getDocument()->_fontMap.clear();
-    updateStyleDataRecursive( this );
+    getDocument()->resetStyleSharing();
+    if ( !getDocument()->initNodeStylesInThreads( this ) )
+        updateStyleDataRecursive( this );
     //recurseElements( updateStyleData );
 }
 #endif
 
-/// calls specified function recursively for all elements of DOM tree
+/// calls specified function for all elements of DOM tree
 void ldomNode::recurseElements( void (*pFun)( ldomNode * node ) )
 {
     ASSERT_NODE_NOT_NULL;
     if ( !isElement() )
         return;
-    pFun( this );
-    int cnt = getChildCount();
-    for (int i=0; i<cnt; i++)
-    {
-        ldomNode * child = getChildNode( i );
-        if ( child->isElement() )
-        {
-            child->recurseElements( pFun );
-        }
-    }
+    ldomNodeCursor cursor( this, LDOM_CURSOR_ELEMENTS | LDOM_CURSOR_ENTER );
+    while ( cursor.next() )
+        pFun( cursor.getNode() );
 }
 
-/// calls specified function recursively for all nodes of DOM tree
+/// calls specified function for all nodes of DOM tree
 void ldomNode::recurseNodes( void (*pFun)( ldomNode * node ) )
 {
     ASSERT_NODE_NOT_NULL;
-    pFun( this );
-    if ( isElement() )
-    {
-        int cnt = getChildCount();
-        for (int i=0; i<cnt; i++)
-        {
-            ldomNode * child = getChildNode( i );
-            child->recurseNodes( pFun );
-        }
-    }
+    ldomNodeCursor cursor( this, LDOM_CURSOR_ALL_NODES );
+    while ( cursor.next() )
+        pFun( cursor.getNode() );
 }
 
 /// returns first text child element
@@ -10416,8 +14046,7 @@ lvdom_element_render_method ldomNode::getRendMethod()
             return NPELEM->_rendMethod;
 #if BUILD_LITE!=1
         } else {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            return (lvdom_element_render_method)me->rendMethod;
+            return (lvdom_element_render_method)getDocument()->_topology.getElemRendMethod( _handle._dataIndex );
         }
 #endif
     }
@@ -10434,12 +14063,11 @@ void ldomNode::setRendMethod( lvdom_element_render_method method )
 #endif
             NPELEM->_rendMethod = method;
 #if BUILD_LITE!=1
-        } else {
+        } else if ( getDocument()->_topology.getElemRendMethod( _handle._dataIndex ) != method ) {
             ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            if ( me->rendMethod != method ) {
-                me->rendMethod = (lUInt8)method;
-                modified();
-            }
+            me->rendMethod = (lUInt8)method;
+            modified();
+            getDocument()->_topology.setElemRendMethod( _handle._dataIndex, (lUInt8)method );
         }
 #endif
     }
@@ -10705,9 +14333,8 @@ ldomNode * ldomNode::getFirstChild() const
                 return getDocument()->getTinyNode(me->_children[0]);
 #if BUILD_LITE!=1
         } else {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            if ( me->childCount )
-                return getDocument()->getTinyNode(me->children[0]);
+            if ( getDocument()->_topology.getElemChildCount( _handle._dataIndex ) )
+                return getDocument()->getTinyNode( getDocument()->_topology.getElemChildren( _handle._dataIndex )[0] );
         }
 #endif
     }
@@ -10727,9 +14354,9 @@ ldomNode * ldomNode::getLastChild() const
                 return getDocument()->getTinyNode(me->_children[me->_children.length()-1]);
 #if BUILD_LITE!=1
         } else {
-            ElementDataStorageItem * me = getDocument()->_elemStorage.getElem( _data._pelem_addr );
-            if ( me->childCount )
-                return getDocument()->getTinyNode(me->children[me->childCount-1]);
+            int childCount = getDocument()->_topology.getElemChildCount( _handle._dataIndex );
+            if ( childCount )
+                return getDocument()->getTinyNode( getDocument()->_topology.getElemChildren( _handle._dataIndex )[childCount-1] );
         }
 #endif
     }
@@ -10891,6 +14518,7 @@ ldomNode * ldomNode::insertChildText( lUInt32 index, const lString16 & value )
         //node->_data._ptext_addr._parentIndex = _handle._dataIndex;
         lString8 s8 = UnicodeToUtf8(value);
         node->_data._ptext_addr = getDocument()->_textStorage.allocText( node->_handle._dataIndex, _handle._dataIndex, s8 );
+        getDocument()->_topology.setTextParent( node->_handle._dataIndex, _handle._dataIndex );
 #endif
         me->_children.insert( index, node->getDataIndex() );
         return node;
@@ -10915,6 +14543,7 @@ ldomNode * ldomNode::insertChildText( const lString16 & value )
         ldomNode * node = getDocument()->allocTinyNode( NT_PTEXT );
         lString8 s8 = UnicodeToUtf8(value);
         node->_data._ptext_addr = getDocument()->_textStorage.allocText( node->_handle._dataIndex, _handle._dataIndex, s8 );
+        getDocument()->_topology.setTextParent( node->_handle._dataIndex, _handle._dataIndex );
 #endif
         me->_children.insert( me->_children.length(), node->getDataIndex() );
         return node;
@@ -10937,6 +14566,7 @@ ldomNode * ldomNode::insertChildText(const lString8 & s8)
 #else
         ldomNode * node = getDocument()->allocTinyNode( NT_PTEXT );
         node->_data._ptext_addr = getDocument()->_textStorage.allocText( node->_handle._dataIndex, _handle._dataIndex, s8 );
+        getDocument()->_topology.setTextParent( node->_handle._dataIndex, _handle._dataIndex );
 #endif
         me->_children.insert( me->_children.length(), node->getDataIndex() );
         return node;
@@ -11179,7 +14809,7 @@ LVStreamRef ldomDocument::getObjectImageStream( lString16 refName )
         }
         return ref;
     }
-    lUInt16 refValueId = findAttrValueIndex( refName.c_str() + 1 );
+    lUInt32 refValueId = findAttrValueIndex( refName.c_str() + 1 );
     if ( refValueId == (lUInt16)-1 ) {
         return ref;
     }
@@ -11287,18 +14917,15 @@ ldomNode * ldomNode::persist()
             ElementDataStorageItem * data = getDocument()->_elemStorage.getElem(_data._pelem_addr);
             data->nsid = elem->_nsid;
             data->id = elem->_id;
-            lUInt16 * attrs = data->attrs();
+            lxmlAttribute * attrs = data->attrs();
             int i;
-            for ( i=0; i<attrCount; i++ ) {
-                const lxmlAttribute * attr = elem->_attrs[i];
-                attrs[i * 3] = attr->nsid;     // namespace
-                attrs[i * 3 + 1] = attr->id;   // id
-                attrs[i * 3 + 2] = attr->index;// value
-            }
+            for ( i=0; i<attrCount; i++ )
+                attrs[i] = *elem->_attrs[i];
             for ( i=0; i<childCount; i++ ) {
                 data->children[i] = elem->_children[i];
             }
             data->rendMethod = (lUInt8)elem->_rendMethod;
+            getDocument()->_topology.setElem( _handle._dataIndex, data->parentIndex, data->id, data->rendMethod, data->children, childCount );
             delete elem;
         } else {
             // TEXT->PTEXT
@@ -11307,6 +14934,7 @@ ldomNode * ldomNode::persist()
             lUInt32 parentIndex = _data._text_ptr->getParentIndex();
             _handle._dataIndex = (_handle._dataIndex & ~0xF) | NT_PTEXT;
             _data._ptext_addr = getDocument()->_textStorage.allocText(_handle._dataIndex, parentIndex, utf8 );
+            getDocument()->_topology.setTextParent( _handle._dataIndex, parentIndex );
             // change type
         }
     }
@@ -11331,10 +14959,12 @@ ldomNode * ldomNode::modify()
             _handle._dataIndex = (_handle._dataIndex & ~0xF) | NT_ELEMENT;
             elem->_rendMethod = (lvdom_element_render_method)data->rendMethod;
             getDocument()->_elemStorage.freeNode( _data._pelem_addr );
+            getDocument()->_topology.clearElem( _handle._dataIndex );
             NPELEM = elem;
         } else {
             // PTEXT->TEXT
             // convert persistent text to mutable
+            getDocument()->_textCache->remove( _handle._dataIndex );
             lString8 utf8 = getDocument()->_textStorage.getText(_data._ptext_addr);
             lUInt32 parentIndex = getDocument()->_textStorage.getParent(_data._ptext_addr);
             getDocument()->_textStorage.freeNode( _data._ptext_addr );
@@ -11376,6 +15006,10 @@ void tinyNodeCollection::dumpStatistics()
 #endif
                 _itemCount, _itemCount*16/1024,
                 _tinyElementCount, _tinyElementCount*(sizeof(tinyElement)+8*4)/1024 );
+#if BUILD_LITE!=1
+    CRLog::info("*** Node topology table: %dKb", _topology.getMemoryUsage()/1024);
+#endif
+    dumpCacheFileUnpackStats();
 }
 
 